@@ -153,6 +153,7 @@ static void CRASH_hdl(int sig, siginfo_t* info, ucontext_t* uc) {
         }
     }
     free(strs);
+    log_flush_crash();
     abort();
 }
 
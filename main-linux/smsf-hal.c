@@ -21,12 +21,17 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <termios.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "smsf-hal.h"
 
 #define BAUDRATE B115200
-#define READ_USLEEP 1000
-#define READ_SIZE 1
+
+static long _syscalls = 0;
+
+#define COUNT_SYSCALL() __atomic_add_fetch(&_syscalls, 1, __ATOMIC_RELAXED)
 
 static int set_com_parameters(int fd) {
     struct termios options;
@@ -48,6 +53,10 @@ static int set_com_parameters(int fd) {
     options.c_iflag &= ~(ICRNL | INLCR);
     options.c_oflag &= ~OPOST;
 
+    // Non-blocking reads, poll() is used for waiting
+    options.c_cc[VMIN] = 0;
+    options.c_cc[VTIME] = 0;
+
     tcsetattr(fd, TCSANOW, &options);
     return 0;
 }
@@ -72,6 +81,7 @@ void com_close(int fd) {
 }
 
 int com_write(int fd, const char *data, int data_size, int* bytes_written) {
+    COUNT_SYSCALL();
     int bw = write(fd, data, data_size);
     if (bw == -1) {
         *bytes_written = 0;
@@ -82,41 +92,35 @@ int com_write(int fd, const char *data, int data_size, int* bytes_written) {
 }
 
 static int com_read_impl(int fd, char *data, int data_size, int timeout, int* bytes_read) {
-    int br = 0;
     *bytes_read = 0;
-    memset(data, 0, data_size);
-    data_size -= 1; // make a room for \0, decreasing local var - changes will not be saved.
-
-    while(1) {
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(fd, &read_fds);
-
-        // Set timeout
-        struct timeval timeout_tv;
-        timeout_tv.tv_sec = timeout;
-        timeout_tv.tv_usec = 0;
-
-        int ready = select(fd + 1, &read_fds, NULL, NULL, &timeout_tv);
-        if (ready == -1 || ready == 0) { // select error or timeout
-            return ready;
-        }
-
-        if (FD_ISSET(fd, &read_fds)) {
-            // br = read(fd, data + (*bytes_read), data_size - (*bytes_read));
-            int ask_size = ((data_size - *bytes_read) < READ_SIZE) ? data_size - *bytes_read : READ_SIZE;
-            br = read(fd, data + (*bytes_read), ask_size);
-            if (br == -1 || br == 0) { // read error or EOF, bail out
-                return br;
-            }
-            *bytes_read += br;
-        }
-
-        if (*bytes_read == data_size) { // All done
-            return 0;
-        }
-        usleep(READ_USLEEP);
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    COUNT_SYSCALL();
+    int ready = poll(&pfd, 1, timeout);
+    if (ready == -1 && errno == EINTR) { // interrupted by signal, let the caller retry
+        return 0;
     }
+    if (ready == -1 || ready == 0) { // poll error or timeout
+        return ready;
+    }
+
+    // VMIN and VTIME are zero, so read returns everything the driver has buffered
+    // in one call and the caller (read_response) decides whether to wait for more.
+    COUNT_SYSCALL();
+    int br = read(fd, data, data_size);
+    if (br == -1) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    if (br == 0 && (pfd.revents & (POLLHUP | POLLERR)) != 0) { // device is gone
+        return -1;
+    }
+
+    *bytes_read = br;
+    return 0;
 }
 
 int com_read(int fd, char *data, int data_size, int timeout, int* bytes_read) {
@@ -129,3 +133,43 @@ int com_read(int fd, char *data, int data_size, int timeout, int* bytes_read) {
     return res;
 }
 
+long com_syscalls() {
+    return __atomic_load_n(&_syscalls, __ATOMIC_RELAXED);
+}
+
+int store_open(const char *name, int size, char **image, int *handle) {
+    int fd = open(name, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+
+    // New or truncated file is extended with zeroes
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (st.st_size < size && ftruncate(fd, size) == -1)) {
+        close(fd);
+        return -1;
+    }
+
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    *image = addr;
+    *handle = fd;
+    return 0;
+}
+
+int store_sync(int handle, char *image, int offs, int len) {
+    (void) handle; // mapping is enough
+    // Writes to the shared mapping survive process crash, msync protects from power loss
+    long page = sysconf(_SC_PAGESIZE);
+    int start = offs - (offs % page);
+    return msync(image + start, len + (offs - start), MS_SYNC);
+}
+
+void store_close(int handle, char *image, int size) {
+    munmap(image, size);
+    close(handle);
+}
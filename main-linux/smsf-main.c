@@ -19,6 +19,9 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <string.h>
+#include <pthread.h>
+#include <limits.h>
 
 #include "smsf-logging.h"
 #include "smsf-daemon.h"
@@ -26,19 +29,117 @@
 #include "smsf-ata.h"
 #include "smsf-pdu.h"
 #include "smsf-flow.h"
+#include "smsf-metrics.h"
 
 #define PROG_NAME "s3smsf"
 #define COM_DEVICE "/dev/ttyUSB0"
+#define JOURNAL_DIR "/var/tmp"
+#define METRICS_FILE "/run/s3smsf.metrics"
+#define EXPORT_INTERVAL 15 // Seconds between rewrites of Prometheus textfile
 
 extern struct smsf_options _opts;
 extern FILE *_log_stream;
-int _fd = 0;
+
+/**
+ * @brief Every modem is driven by its own thread
+ */
+struct modem_worker {
+    char *port;
+    int fd;
+    pthread_t thread;
+    char *send_port;    //! Separate port to send messages, NULL - messages are sent through the read port
+    int send_fd;
+    pthread_t send_thread;
+};
+
+struct modem_worker _workers[SMSF_MAX_MODEMS];
+int _n_workers = 0;
+char *_destaddr = NULL;
 
 // TODO
 static void send_to_display(const char *format, ...) {
     // PASS
 }
 
+// Port list is comma separated, -p could be used several times.
+// Modem with several AT ports is given as <read port>:<send port>
+static void add_ports(const char *ports) {
+    char *list = strdup(ports); // Expected memory leaks.
+    for (char *port = strtok(list, ","); port != NULL; port = strtok(NULL, ",")) {
+        if (_n_workers == SMSF_MAX_MODEMS) {
+            fprintf(stderr, "Too many modems, %d is the limit\n", SMSF_MAX_MODEMS);
+            exit(7);
+        }
+        char *send_port = strchr(port, ':');
+        if (send_port != NULL) {
+            *send_port++ = 0;
+        }
+        _workers[_n_workers].port = port;
+        _workers[_n_workers].send_port = send_port;
+        _n_workers += 1;
+    }
+}
+
+static void *modem_loop(void *arg) {
+    struct modem_worker *w = (struct modem_worker *) arg;
+
+    if (_n_workers > 1) {
+        log_set_tag(w->port);
+    }
+
+    while(1) {
+        if (flow_setup(w->fd, (notify_func_t *) send_to_display, _destaddr) == 0) {
+            while(1) {
+                if (flow(w->fd, (notify_func_t *) send_to_display) != 0) {
+                    break;
+                }
+                if (flow_wait(w->fd, (notify_func_t *) send_to_display) != 0) {
+                    break;
+                }
+            }
+        }
+
+        usleep(1000);
+    }
+
+    return NULL;
+}
+
+static void *send_loop(void *arg) {
+    struct modem_worker *w = (struct modem_worker *) arg;
+
+    log_set_tag(w->send_port);
+    while(1) {
+        flow_send_loop(w->fd, (notify_func_t *) send_to_display);
+        sleep(1);
+    }
+
+    return NULL;
+}
+
+// Rewrite Prometheus textfile, node_exporter picks it up on its own schedule
+static void *export_loop(void *arg) {
+    const char *name = (const char *) arg;
+    int failed = 0;
+
+    while(1) {
+        if (metrics_export(name) != 0) {
+            // Report once, not every interval
+            if (!failed) {
+                log_errno("Can't write metrics to %s", name);
+            }
+            failed = 1;
+        }
+        else if (failed) {
+            log_noise("Metrics are written to %s again", name);
+            failed = 0;
+        }
+        sleep(EXPORT_INTERVAL);
+    }
+
+    return NULL;
+}
+
 static void usage(const char *msg) {
     if (msg != NULL) {
         fprintf(stderr, "Bad command line: %s\n", msg);
@@ -46,7 +147,13 @@ static void usage(const char *msg) {
     const char help[] = "\n" \
         "s3smsf -a <destination address> - override destination address, default read contact \"PRIMARY NUMBER\"\n" \
         "s3smsf -c <command> - execute one of management commands and exit, e.g. \"++CLEAR\" see documentation\n" \
-        "s3smsf -p <port> - modem port device, default /dev/ttyUSB0\n" \
+        "s3smsf -j <directory> - keep journal of forwarded messages and outbox there, \"none\" to disable, default /var/tmp\n" \
+        "s3smsf -m <filename> - publish counters for s3smsf-stat there, \"none\" to disable, default " METRICS_FILE "\n" \
+        "s3smsf -t <filename> - write metrics for Prometheus textfile collector there every 15 s, e.g. /var/lib/node_exporter/textfile/s3smsf.prom\n" \
+        "s3smsf -e <mode> - outgoing text encoding 0 - GSM 7-bit if possible, otherwise UCS2 (default), 1 - transliterate Cyrillic to Latin if it takes fewer messages, 2 - always UCS2\n" \
+        "s3smsf -i <mode> - new message indication 0 - poll SIM (default), 1 - sleep until modem reports new message, 2 - route messages directly, bypass SIM\n" \
+        "s3smsf -p <port>[,<port>...] - modem port devices, could be repeated, default /dev/ttyUSB0\n" \
+        "s3smsf -p <read port>:<send port> - send messages through the second AT port of the modem, so sending doesn't delay reading\n" \
         "s3smsf -v - set verbosity level 3 (ERROR), 7 (DEBUG), default - NOISE\n" \
         "s3smsf -D - daemonize\n" \
         "s3smsf -K - kill running daemon\n" \
@@ -65,13 +172,15 @@ int main(int argc, char* argv[]) {
 
     char * o_destaddr = NULL;
     char * o_command = NULL;
-    char * o_port = NULL;
     int o_daemonize = 0;
     int o_killrunning = 0;
     char *o_log_file = NULL;
+    char *o_journal_dir = JOURNAL_DIR;
+    char *o_metrics_file = METRICS_FILE;
+    char *o_prom_file = NULL;
 
     int c;
-    while ((c = getopt(argc, argv, "a:c:p:v:Kl:LD")) != -1) {
+    while ((c = getopt(argc, argv, "a:c:e:i:j:m:p:t:v:Kl:LD")) != -1) {
         switch (c) {
             case 'a':
                 o_destaddr = strdup(optarg); // Expected memory leaks.
@@ -79,8 +188,29 @@ int main(int argc, char* argv[]) {
             case 'c':
                 o_command = strdup(optarg);
                 break;
+            case 'e':
+                _opts.encoding = atoi(optarg);
+                if (_opts.encoding < ENCODING_EXACT || _opts.encoding > ENCODING_UCS2) {
+                    usage("Bad encoding mode");
+                }
+                break;
+            case 'i':
+                _opts.cnmi = atoi(optarg);
+                if (_opts.cnmi < 0 || _opts.cnmi > 2) {
+                    usage("Bad new message indication mode");
+                }
+                break;
+            case 'j':
+                o_journal_dir = strdup(optarg);
+                break;
+            case 'm':
+                o_metrics_file = strdup(optarg);
+                break;
+            case 't':
+                o_prom_file = strdup(optarg);
+                break;
             case 'p':
-                o_port = strdup(optarg);
+                add_ports(optarg);
                 break;
             case 'v':
                 _opts.verbosity = atoi(optarg);
@@ -110,9 +240,10 @@ int main(int argc, char* argv[]) {
         usage("Can't go background if command execution is requested");
     }
 
-    if (o_port == NULL) {
-        o_port = strdup(COM_DEVICE);
+    if (_n_workers == 0) {
+        add_ports(COM_DEVICE);
     }
+    _destaddr = o_destaddr;
 
     // if (optind == argc) {
     //  usage("filename is required");
@@ -140,39 +271,101 @@ int main(int argc, char* argv[]) {
 #endif
     }
 
-    int res = com_open(o_port, &_fd);
-    if (res < 0) {
-        log_errno("Error open device %s", COM_DEVICE);
-        exit(-1);
+    // After daemonize, the flusher thread doesn't survive fork
+    log_start();
+
+    for (int i = 0; i < _n_workers; ++i) {
+        struct modem_worker *w = &_workers[i];
+        if (com_open(w->port, &w->fd) < 0) {
+            log_errno("Error open device %s", w->port);
+            exit(-1);
+        }
+        if (ata_attach(w->fd) != 0) {
+            exit(-1);
+        }
+        if (w->send_port != NULL) {
+            if (com_open(w->send_port, &w->send_fd) < 0) {
+                log_errno("Error open device %s", w->send_port);
+                exit(-1);
+            }
+            if (ata_attach(w->send_fd) != 0) {
+                exit(-1);
+            }
+        }
     }
 
     if (o_command != NULL) {
-        // Execute command and exit
+        // Execute command on every modem and exit
         // if (flow_setup(_fd, (notify_func_t *) send_to_display, o_destaddr) != 0) {
         //   log_err("Flow  {%s}", o_command);
         //    exit(-1);
         // }
 
-        if (process_command_message(_fd, o_command) != 1) {
-            log_err("Invalid command {%s}", o_command);
-            usage(NULL);
+        for (int i = 0; i < _n_workers; ++i) {
+            if (process_command_message(_workers[i].fd, o_command) != 1) {
+                log_err("Invalid command {%s}", o_command);
+                usage(NULL);
+            }
         }
 
         exit(0);
     }
 
-    // Main loop
-    while(1) {
-        if (flow_setup(_fd, (notify_func_t *) send_to_display, o_destaddr) == 0) {
-            while(1) {
-                if (flow(_fd, (notify_func_t *) send_to_display) != 0) {
-                    break;
-                }
-            }
+    // Journal and outbox per port, e.g. /var/tmp/s3smsf-ttyUSB0.journal
+    if (strcmp(o_journal_dir, "none") != 0) {
+        for (int i = 0; i < _n_workers; ++i) {
+            char path[PATH_MAX];
+            const char *base = strrchr(_workers[i].port, '/');
+            snprintf(path, sizeof(path), "%s/%s-%s", o_journal_dir, PROG_NAME, (base != NULL) ? base + 1 : _workers[i].port);
+            flow_storage(_workers[i].fd, path);
         }
+    }
 
-        usleep(1000);
+    // Counters are published to shared memory, monitoring never touches the modem ports.
+    // Prometheus export alone keeps them in memory, so does export when the file can't be opened, e.g. by non-root user
+    int metrics = -1;
+    if (strcmp(o_metrics_file, "none") != 0) {
+        metrics = metrics_open(o_metrics_file);
+    }
+    if (metrics != 0 && o_prom_file != NULL) {
+        if (strcmp(o_metrics_file, "none") != 0) {
+            log_warn("Metrics are not published to %s, keeping them in memory for export to %s", o_metrics_file, o_prom_file);
+        }
+        metrics = metrics_open(NULL);
+    }
+    if (metrics == 0) {
+        for (int i = 0; i < _n_workers; ++i) {
+            flow_metrics(_workers[i].fd, _workers[i].port, _workers[i].send_port);
+        }
     }
 
-    com_close(_fd);
+    pthread_t export_thread;
+    if (metrics == 0 && o_prom_file != NULL && pthread_create(&export_thread, NULL, export_loop, o_prom_file) != 0) {
+        log_errno("Can't start metrics export thread");
+    }
+
+    // Send stage of the modem with separate send port
+    for (int i = 0; i < _n_workers; ++i) {
+        struct modem_worker *w = &_workers[i];
+        if (w->send_port == NULL) {
+            continue;
+        }
+        if (flow_send_port(w->fd, w->send_fd) != 0 || pthread_create(&w->send_thread, NULL, send_loop, w) != 0) {
+            log_errno("Can't start send thread for %s", w->send_port);
+            exit(-1);
+        }
+    }
+
+    // Main loop, main thread drives the first modem, every other modem gets its own thread
+    for (int i = 1; i < _n_workers; ++i) {
+        if (pthread_create(&_workers[i].thread, NULL, modem_loop, &_workers[i]) != 0) {
+            log_errno("Can't start thread for %s", _workers[i].port);
+            exit(-1);
+        }
+    }
+    modem_loop(&_workers[0]);
+
+    for (int i = 0; i < _n_workers; ++i) {
+        com_close(_workers[i].fd);
+    }
 }
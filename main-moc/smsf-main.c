@@ -25,6 +25,18 @@
 #include "smsf-ata.h"
 #include "smsf-pdu.h"
 #include "smsf-flow.h"
+#include "smsf-hash.h"
+#include "smsf-reasm.h"
+#include "smsf-pool.h"
+#include "smsf-journal.h"
+#include "smsf-outbox.h"
+#include "smsf-queue.h"
+#include "smsf-stats.h"
+#include "smsf-trace.h"
+#include "smsf-metrics.h"
+#include "smsf-hex.h"
+#include "smsf-crc.h"
+#include "smsf-gsm.h"
 
 #define PROG_NAME "s3smsf"
 #define COM_DEVICE "/dev/ttyUSB0"
@@ -130,12 +142,67 @@ int main(int argc, char* argv[]) {
 
     test_date_conversion();
 
+    if (test_hex() > 0) {
+        printf("Hex codec self-test error\n");
+    }
+
+    if (test_crc() > 0) {
+        printf("CRC self-test error\n");
+    }
+
+    if (test_gsm() > 0) {
+        printf("GSM alphabet self-test error\n");
+    }
 
     int errs = test_pdu();
     if (errs > 0) {
         printf("PDU Parser self-test error\n");
 //        exit(0);
     }
+
+    if (test_msg_table() > 0) {
+        printf("Message table self-test error\n");
+    }
+
+    if (test_reasm() > 0) {
+        printf("Reassembly self-test error\n");
+    }
+
+    if (test_pool() > 0) {
+        printf("Message pool self-test error\n");
+    }
+
+    if (test_journal() > 0) {
+        printf("Journal self-test error\n");
+    }
+
+    if (test_outbox() > 0) {
+        printf("Outbox self-test error\n");
+    }
+
+    if (test_queue() > 0) {
+        printf("Queue self-test error\n");
+    }
+
+    if (test_log() > 0) {
+        printf("Logger self-test error\n");
+    }
+
+    if (test_stats() > 0) {
+        printf("Histogram self-test error\n");
+    }
+
+    if (test_trace() > 0) {
+        printf("Trace self-test error\n");
+    }
+
+    if (test_metrics() > 0) {
+        printf("Metrics self-test error\n");
+    }
+
+    if (test_flow() > 0) {
+        printf("Flow self-test error\n");
+    }
 #endif
 
     if (o_killrunning) {
@@ -24,6 +24,8 @@
 #include "driver/uart_vfs.h"
 #include "driver/uart.h"
 #include "driver/gpio.h"
+#include "nvs_flash.h"
+#include "nvs.h"
 
 #include "smsf-logging.h"
 #include "smsf-hal.h"
@@ -31,7 +33,7 @@
 extern struct smsf_options _opts;
 
 #define BAUDRATE 115200
-#define READ_TIMEOUT 1000
+#define READ_GAP_MS 20   // modem is considered idle if nothing arrives within this time
 #define READ_SIZE 1
 #define RX_BUF_SIZE 1024
 
@@ -97,7 +99,10 @@ void com_close(int uart_no) {
     // close(fd);
 }
 
+static long _syscalls = 0;
+
 int com_write(int uart_no, const char *data, int data_size, int* bytes_written) {
+    _syscalls += 1;
     int bw = uart_write_bytes(uart_no, data, data_size);
     if (bw == -1) {
         *bytes_written = 0;
@@ -114,10 +119,13 @@ static int com_read_impl(int uart_no, char *data, int data_size, int timeout, in
     data_size -= 1; // make a room for \0, decreasing local var - changes will not be saved.
 
     while(1) {
+        // Wait for the first byte up to timeout, after that only while the modem keeps sending
+        int wait_ms = (*bytes_read == 0) ? timeout : READ_GAP_MS;
         int ask_size = ((data_size - *bytes_read) < READ_SIZE) ? data_size - *bytes_read : READ_SIZE;
-        br = uart_read_bytes(uart_no, data + (*bytes_read), ask_size, READ_TIMEOUT);
-        if (br == -1 || br == 0) { // read error or EOF, bail out
-            return br;
+        _syscalls += 1;
+        br = uart_read_bytes(uart_no, data + (*bytes_read), ask_size, wait_ms / portTICK_PERIOD_MS);
+        if (br == -1 || br == 0) { // read error, timeout or the modem is idle
+            return (br == -1) ? -1 : 0;
         }
         *bytes_read += br;
         if (*bytes_read == data_size) { // All done
@@ -136,3 +144,74 @@ int com_read(int uart_no, char *data, int data_size, int timeout, int* bytes_rea
     return res;
 }
 
+long com_syscalls() {
+    return _syscalls;
+}
+
+// The image is kept in RAM and written to NVS as a single blob,
+// NVS takes care of flash wear, so the whole blob is rewritten on every sync
+#define STORE_NAMESPACE "smsf"
+#define STORE_MAX 4
+
+struct store {
+    nvs_handle_t nvs;
+    char key[16];
+    int size;
+};
+
+static struct store _stores[STORE_MAX];
+static int _n_stores = 0;
+
+int store_open(const char *name, int size, char **image, int *handle) {
+    if (_n_stores == STORE_MAX) {
+        log_err("Too many stores, %d is the limit", STORE_MAX);
+        return -1;
+    }
+
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        nvs_flash_erase();
+        err = nvs_flash_init();
+    }
+    if (err != ESP_OK) {
+        log_err("Can't init NVS (%d)", err);
+        return -1;
+    }
+
+    struct store *st = &_stores[_n_stores];
+    if (nvs_open(STORE_NAMESPACE, NVS_READWRITE, &st->nvs) != ESP_OK) {
+        return -1;
+    }
+
+    char *buf = calloc(1, size);
+    if (buf == NULL) {
+        nvs_close(st->nvs);
+        return -1;
+    }
+
+    // Missing or resized blob is not an error, storage starts empty
+    size_t blob_size = size;
+    if (nvs_get_blob(st->nvs, name, buf, &blob_size) != ESP_OK || blob_size != size) {
+        memset(buf, 0, size);
+    }
+
+    strncpy(st->key, name, sizeof(st->key) - 1);
+    st->size = size;
+    *image = buf;
+    *handle = _n_stores++;
+    return 0;
+}
+
+int store_sync(int handle, char *image, int offs, int len) {
+    (void) offs; (void) len; // blob is written as a whole
+    struct store *st = &_stores[handle];
+    if (nvs_set_blob(st->nvs, st->key, image, st->size) != ESP_OK || nvs_commit(st->nvs) != ESP_OK) {
+        return -1;
+    }
+    return 0;
+}
+
+void store_close(int handle, char *image, int size) {
+    nvs_close(_stores[handle].nvs);
+    free(image);
+}
@@ -36,14 +36,20 @@
 #include "smsf-logging.h"
 #include "smsf-hal.h"
 #include "smsf-flow.h"
+#include "smsf-queue.h"
+#include "smsf-hex.h"
 
 #define COM_DEVICE "/dev/uart/2"
+#define DISPLAY_QUEUE 16    // Lines waiting to be displayed, extra lines are dropped
+#define DISPLAY_TEXT 32     // Display line is 16 characters, UTF-8 contact names are longer
+#define DISPLAY_PAUSE 3000  // Keep line on the screen before scrolling it, ms
 
 extern struct smsf_options _opts;
 int _uartno; // UART no
 
-// Queue
-QueueHandle_t _queue;
+// Lines to display, uart task is the only producer
+struct spsc_queue _display_queue;
+TaskHandle_t _display_task;
 
 // static char _disp_buf[256];
 
@@ -73,53 +79,61 @@ static void display_banner() {
  */
 
 static void display_task(void *arg) {
-    char *recv_message;
+    char recv_message[DISPLAY_TEXT];
 
     while(1) {
-        if (xQueueReceive(_queue, &recv_message, 0) == pdTRUE) {
-            switch ( _current_line) {
-                case 1:
-                  // Empty screen, clear and print the banner
-                    display_banner();
-                    break;
-                case 3:
-                    // First message in the scroll area, enable scroll before displaying message and leave empty line
-                    ssd1306_software_scroll(&_disp, 4, 7);
-                    _current_line += 1;
-                    break;
-                default:
-                    break;
-            }
+        if (spsc_pop(&_display_queue, recv_message) != 0) {
+            // Sleep until the next line is queued
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
 
-            if (_current_line < 4) {
-                // Header text
-	            ssd1306_display_text(&_disp, _current_line, recv_message, strlen(recv_message), false);
-            }
-            else {
-                // Message text
-                ssd1306_scroll_text(&_disp, recv_message, strlen(recv_message), false);
-            }
+        switch ( _current_line) {
+            case 1:
+              // Empty screen, clear and print the banner
+                display_banner();
+                break;
+            case 3:
+                // First message in the scroll area, enable scroll before displaying message and leave empty line
+                ssd1306_software_scroll(&_disp, 4, 7);
+                _current_line += 1;
+                break;
+            default:
+                break;
+        }
 
-            _current_line += 1;
-            free(recv_message);
+        if (_current_line < 4) {
+            // Header text
+	            ssd1306_display_text(&_disp, _current_line, recv_message, strlen(recv_message), false);
         }
-	    vTaskDelay(3000 / portTICK_PERIOD_MS);
+        else {
+            // Message text
+            ssd1306_scroll_text(&_disp, recv_message, strlen(recv_message), false);
+        }
+
+        _current_line += 1;
+	    vTaskDelay(DISPLAY_PAUSE / portTICK_PERIOD_MS);
     }
     vTaskDelete( NULL );
 }
 
 
 static void send_to_display(const char *format, ...) {
+    char buf[DISPLAY_TEXT];
     va_list args;
     va_start(args, format);
-    int size = vsnprintf(NULL, 0, format, args);
-    char *buf = malloc(size+1);
-    vsnprintf(buf, size+1, format, args);
+    vsnprintf(buf, sizeof(buf), format, args);
     va_end(args);
-    xQueueSend(_queue, &buf, 0);
+    // Display is best effort, the line is dropped if the display is behind
+    if (spsc_push(&_display_queue, buf) == 0 && _display_task != NULL) {
+        xTaskNotifyGive(_display_task);
+    }
 }
 
 static void uart_task(void *arg) {
+    // Forwarded messages and outbox are kept in NVS, so reboot doesn't forward messages again or lose them
+    flow_storage(_uartno, "smsf");
+
     while(1) {
         _current_line = 1; // Not care about race
 
@@ -129,6 +143,9 @@ static void uart_task(void *arg) {
                     // Repeat full cycle in case of errors
                     break;
                 }
+                if (flow_wait(_uartno, (notify_func_t *) send_to_display) != 0) {
+                    break;
+                }
             }
         }
         vTaskDelay(5000 / portTICK_PERIOD_MS); // Let modem too bootstrap
@@ -138,7 +155,17 @@ static void uart_task(void *arg) {
 }
 
 void app_main(void) {
-    _queue = xQueueCreate(5, sizeof(char **));
+#ifdef SMSF_QUEUE_BENCH
+    queue_bench(100000);
+    hex_bench(10000);
+#endif
+
+    // Serial task doesn't wait for console output
+    log_start();
+
+    if (spsc_init(&_display_queue, DISPLAY_QUEUE, DISPLAY_TEXT) != 0) {
+        abort();
+    }
 
     i2c_master_init(&_disp, SDA_PIN, SCL_PIN, RESET_PIN);
 	ssd1306_init(&_disp, 128, 64);
@@ -153,6 +180,6 @@ void app_main(void) {
     }
 
     // Display task has lower priority then uart task
-    xTaskCreate(display_task, "display_task", 2*1024, NULL, configMAX_PRIORITIES - 2, NULL);
+    xTaskCreate(display_task, "display_task", 2*1024, NULL, configMAX_PRIORITIES - 2, &_display_task);
     xTaskCreate(uart_task, "uart_task", 6 * 1024, NULL, configMAX_PRIORITIES - 1, NULL);
 }
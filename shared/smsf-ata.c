@@ -24,16 +24,150 @@
 #include "smsf-hal.h"
 #include "smsf-pdu.h"
 #include "smsf-util.h"
+#include "smsf-pool.h"
 #include "smsf-ata.h"
 
 #define TIMEOUT 10
 #define CRLF "\r\n"
 #define RD_BUF_SIZE 4096
+#define ROUTED_QUEUE 8
+#define ROUTED_PDU_SIZE 512
 
-char _rd_buf[RD_BUF_SIZE];
+/**
+ * @brief Per-modem state, the modem is addressed by its device handle
+ */
+struct ata_modem {
+    int in_use;
+    int fd;
+    char rd_buf[RD_BUF_SIZE];
+
+    char rx_left[RD_BUF_SIZE]; //! Bytes received after the end of the previous response
+    int rx_left_len;
+    int urc_pending;           //! Number of new message indications not handled yet
+    int sim_capacity;          //! Message slots of SIM from the last +CPMS, -1 - unknown
+
+    char routed_pdus[ROUTED_QUEUE][ROUTED_PDU_SIZE]; //! Messages routed to TE (+CMT), not processed yet
+    uint32_t routed_seen[ROUTED_QUEUE];              //! trace_now() of +CMT
+    int routed_head;
+    int routed_count;
+
+    struct at_stats stats[AT_VERBS];
+    int n_stats;
+    struct at_stats *exchange; //! Command sent, final result code is not received yet
+    int64_t exchange_start;    //! Monotonic us
+};
+
+enum at_outcome { AT_OK, AT_ERROR, AT_TIMEOUT, AT_PROMPT };
+
+struct ata_modem _modems[SMSF_MAX_MODEMS];
 
 extern struct smsf_options _opts;
 
+/**
+ * @brief Find modem state by device handle, the state is attached on the first use
+ *
+ * @param fd - device handle
+ * @return struct ata_modem* - modem state, NULL if too many modems are in use
+ */
+static struct ata_modem *get_modem(int fd) {
+    for (int i = 0; i < SMSF_MAX_MODEMS; ++i) {
+        if (__atomic_load_n(&_modems[i].in_use, __ATOMIC_ACQUIRE) && _modems[i].fd == fd) {
+            return &_modems[i];
+        }
+    }
+    return ata_attach(fd) == 0 ? get_modem(fd) : NULL;
+}
+
+int ata_attach(int fd) {
+    for (int i = 0; i < SMSF_MAX_MODEMS; ++i) {
+        int expected = 0;
+        // Claim free slot, modems could be attached from different threads
+        if (__atomic_compare_exchange_n(&_modems[i].in_use, &expected, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            struct ata_modem *m = &_modems[i];
+            m->fd = fd;
+            m->rx_left_len = 0;
+            m->urc_pending = 0;
+            m->sim_capacity = -1;
+            m->routed_head = 0;
+            m->routed_count = 0;
+            memset(m->stats, 0, sizeof(m->stats));
+            m->n_stats = 0;
+            m->exchange = NULL;
+            __atomic_store_n(&m->in_use, 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+    log_err("Too many modems, %d is the limit", SMSF_MAX_MODEMS);
+    return -1;
+}
+
+void ata_detach(int fd) {
+    for (int i = 0; i < SMSF_MAX_MODEMS; ++i) {
+        if (__atomic_load_n(&_modems[i].in_use, __ATOMIC_ACQUIRE) && _modems[i].fd == fd) {
+            __atomic_store_n(&_modems[i].in_use, 0, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Find or add counters of the command, AT+CMGR=1 is counted as CMGR, ATE0 as ATE
+ *
+ * @param cmd - command, starts with AT
+ * @return struct at_stats* - counters, shared "OTHER" slot if the table is full
+ */
+static struct at_stats *verb_stats(struct ata_modem *m, const char *cmd) {
+    char verb[AT_VERB_SIZE] = {0};
+    const char *p = cmd + 2;
+    int n = 0;
+
+    if (*p == '+') {
+        p += 1;
+    }
+    else {
+        verb[n++] = 'A';
+        verb[n++] = 'T';
+    }
+    while (n < AT_VERB_SIZE - 1 && *p >= 'A' && *p <= 'Z') {
+        verb[n++] = *p++;
+    }
+
+    for (int i = 0; i < m->n_stats; ++i) {
+        if (strcmp(m->stats[i].verb, verb) == 0) {
+            return &m->stats[i];
+        }
+    }
+
+    if (m->n_stats == AT_VERBS) {
+        return &m->stats[AT_VERBS - 1];
+    }
+    struct at_stats *s = &m->stats[m->n_stats++];
+    strcpy(s->verb, (m->n_stats == AT_VERBS) ? "OTHER" : verb);
+    return s;
+}
+
+/**
+ * @brief Account the response and close the exchange unless it's AT+CMGS prompt
+ */
+static void exchange_done(struct ata_modem *m, enum at_outcome outcome, int bytes_in) {
+    struct at_stats *s = m->exchange;
+    if (s == NULL) {
+        return;
+    }
+
+    s->bytes_in += bytes_in;
+    if (outcome == AT_PROMPT) {
+        return;
+    }
+
+    int64_t elapsed = monotonic_us() - m->exchange_start;
+    s->calls += 1;
+    s->errors += (outcome == AT_ERROR);
+    s->timeouts += (outcome == AT_TIMEOUT);
+    hist_add(&s->latency_us, (elapsed < UINT32_MAX) ? (uint32_t) elapsed : UINT32_MAX);
+    m->exchange = NULL;
+}
+
 /**
  * @brief send AT command to modem, CRLF is added
  *
@@ -46,6 +180,14 @@ static int send_command(int fd, const char *str, ... ) {
     va_list(args);
     int ds = strlen(str);
     int bw = 0, res = 0;
+    struct ata_modem *m = get_modem(fd);
+
+    // Command starts new exchange, anything else (e.g. PDU after prompt) continues it
+    if (m != NULL && str[0] == 'A' && str[1] == 'T') {
+        m->exchange = verb_stats(m, str);
+        m->exchange_start = monotonic_us();
+    }
+    struct at_stats *s = (m != NULL) ? m->exchange : NULL;
 
     log_debug("SENDING C (%d): {{%s}}", ds, str);
 
@@ -53,6 +195,9 @@ static int send_command(int fd, const char *str, ... ) {
     if (res == -1 || bw != ds) {
         log_errno("Error sending comand {{%s}}", str);
     }
+    if (s != NULL) {
+        s->bytes_out += bw;
+    }
 
     va_start(args, str);
     while(1) {
@@ -67,9 +212,15 @@ static int send_command(int fd, const char *str, ... ) {
         if (res == -1) {
             log_errno("Error sending comand {{%s}}", ending);
         }
+        if (s != NULL) {
+            s->bytes_out += bw;
+        }
     }
 
     va_end(args);
+    if (res == -1 && m != NULL) {
+        exchange_done(m, AT_ERROR, 0);
+    }
     return res;
 }
 
@@ -91,30 +242,190 @@ static int send_command_dig_cr(int fd, const char *str, int dig) {
 }
 
 /**
- * @brief Read response from modem
+ * @brief Check whether the line is a final result code or an error report
  *
- * @param fd - descriptor to read from
+ * @param line - line to check, might be not null-terminated
+ * @param line_len - len of line, without \n
+ * @return int - 1 if the line terminates the response, 0 otherwise
+ */
+static int is_final_result(const char *line, int line_len) {
+    if (line_len > 0 && line[line_len - 1] == '\r') {
+        line_len -= 1;
+    }
+
+    if ((line_len == 2 && memcmp(line, "OK", 2) == 0) ||
+        (line_len == 5 && memcmp(line, "ERROR", 5) == 0) ||
+        (line_len >= 11 && memcmp(line, "+CMS ERROR:", 11) == 0) ||
+        (line_len >= 11 && memcmp(line, "+CME ERROR:", 11) == 0)) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Find the end of the response, i.e. the position right after the final
+ *        result code line or the AT+CMGS prompt
+ *
+ * @param buf - buffer to check
+ * @param len - number of bytes in buffer
+ * @param line_start - start of the first line that is not checked yet, updated
+ * @return int - end of the response or -1 if the response is not complete yet
+ */
+static int find_response_end(const char *buf, int len, int *line_start) {
+    const char *s;
+    while((s = memchr(buf + *line_start, '\n', len - *line_start)) != NULL) {
+        if (is_final_result(buf + *line_start, s - (buf + *line_start))) {
+            return (s - buf) + 1;
+        }
+        *line_start = (s - buf) + 1;
+    }
+
+    // AT+CMGS prompt is not followed by CRLF
+    if (len - *line_start == 2 && memcmp(buf + *line_start, "> ", 2) == 0) {
+        return len;
+    }
+    return -1;
+}
+
+// Queue message routed directly to TE, it's decoded later by ata_read_routed_message
+static void queue_routed_pdu(struct ata_modem *m, const char *pdu, int pdu_len) {
+    if (pdu_len > 0 && pdu[pdu_len - 1] == '\r') {
+        pdu_len -= 1;
+    }
+
+    if (m->routed_count == ROUTED_QUEUE || pdu_len >= ROUTED_PDU_SIZE) {
+        log_err("Routed message dropped, queue %d, pdu len %d", m->routed_count, pdu_len);
+        return;
+    }
+
+    int idx = (m->routed_head + m->routed_count) % ROUTED_QUEUE;
+    char *slot = m->routed_pdus[idx];
+    memcpy(slot, pdu, pdu_len);
+    slot[pdu_len] = 0;
+    m->routed_seen[idx] = trace_now();
+    m->routed_count += 1;
+}
+
+/**
+ * @brief Check complete lines for unsolicited new message indications,
+ *        +CMT: is followed by PDU line that is queued for processing
+ *
+ * @param buf - buffer to check
+ * @param len - number of bytes in buffer, last line is expected to be complete
+ * @return int - number of bytes consumed, +CMT: without PDU line is left unconsumed
+ */
+static int scan_urc(struct ata_modem *m, const char *buf, int len) {
+    const char *p = buf;
+    const char *s;
+    while((s = memchr(p, '\n', len - (p - buf))) != NULL) {
+        if (s - p > 6 && memcmp(p, "+CMTI:", 6) == 0) {
+            log_noise("New message indication: {%.*s}", (int)(s - p - 1), p);
+            m->urc_pending += 1;
+        }
+        else if (s - p > 5 && memcmp(p, "+CMT:", 5) == 0) {
+            const char *pdu = s + 1;
+            const char *pdu_e = memchr(pdu, '\n', len - (pdu - buf));
+            if (pdu_e == NULL) { // PDU line is not received yet
+                break;
+            }
+            log_noise("New message routed: {%.*s}", (int)(s - p - 1), p);
+            queue_routed_pdu(m, pdu, pdu_e - pdu);
+            m->urc_pending += 1;
+            s = pdu_e;
+        }
+        p = s + 1;
+    }
+    return p - buf;
+}
+
+// Keep bytes received after the end of response, e.g. URC, for the next read
+static void save_leftover(struct ata_modem *m, const char *buf, int len) {
+    if (len > (int) sizeof(m->rx_left)) {
+        log_err("Leftover is too large %d, dropped", len);
+        len = 0;
+    }
+    memcpy(m->rx_left, buf, len);
+    m->rx_left_len = len;
+}
+
+static int take_leftover(struct ata_modem *m, char *buf, int buf_size) {
+    int len = MIN(m->rx_left_len, buf_size - 1);
+    memcpy(buf, m->rx_left, len);
+    buf[len] = 0;
+    m->rx_left_len = 0;
+    return len;
+}
+
+/**
+ * @brief Read response from modem, return as soon as a final result code
+ *        or AT+CMGS prompt is received. TIMEOUT is used as a fallback only.
+ *
+ * @param m - modem to read from
  * @param buf - destination buffer
  * @param buf_size - size of destination buffer
  * @return int - 0 if success, -1 if error occur
  */
-static int read_response(int fd, char *buf, int buf_size) {
-    int br;
-    int res = com_read(fd, buf, buf_size, TIMEOUT, &br);
-    if (res == -1) {
-        log_errno("Error reading response");
-        return -1;
+static int read_response(struct ata_modem *m, char *buf, int buf_size) {
+    int br = take_leftover(m, buf, buf_size);
+    int line_start = 0; // start of the first line that is not checked yet
+    int end = -1;
+    int64_t deadline = monotonic_ms() + TIMEOUT * 1000;
+
+    while((end = find_response_end(buf, br, &line_start)) == -1) {
+        if (br >= buf_size - 2) { // com_read keeps room for null termination
+            log_debug("Response buffer is full %d", br);
+            break;
+        }
+
+        int64_t wait_ms = deadline - monotonic_ms();
+        if (wait_ms <= 0) {
+            log_debug("Response timeout after %d bytes", br);
+            break;
+        }
+
+        int chunk = 0;
+        int res = com_read(m->fd, buf + br, buf_size - br, (int) wait_ms, &chunk);
+        if (res == -1) {
+            log_errno("Error reading response");
+            exchange_done(m, AT_ERROR, br);
+            return -1;
+        }
+        br += chunk;
+    }
+
+    if (end != -1 && end < br) {
+        save_leftover(m, buf + end, br - end);
+        br = end;
+        buf[br] = 0;
     }
 
+    // Final result code or prompt starts at line_start
+    const char *last = buf + line_start;
+    if (end == -1) {
+        exchange_done(m, AT_TIMEOUT, br);
+    }
+    else if (end - line_start == 2 && memcmp(last, "> ", 2) == 0) {
+        exchange_done(m, AT_PROMPT, br);
+    }
+    else {
+        exchange_done(m, (last[0] == 'O' && last[1] == 'K') ? AT_OK : AT_ERROR, br);
+    }
+
+    scan_urc(m, buf, br);
+
     log_debug("RESPONSE BEGIN (%d):", br);
-    dump(_rd_buf, br);
+    dump(buf, br);
     log_debug("RESPONSE END");
 
-    return res; // ATA error or noise
+    return 0; // ATA error or noise is handled by caller
 }
 
 static int read_response_gb(int fd) {
-    return read_response(fd, _rd_buf, RD_BUF_SIZE);
+    struct ata_modem *m = get_modem(fd);
+    if (m == NULL) {
+        return -1;
+    }
+    return read_response(m, m->rd_buf, RD_BUF_SIZE);
 }
 
 /**
@@ -124,12 +435,13 @@ static int read_response_gb(int fd) {
  * @return int - OK found, -1 noise or ERROR
  */
 static int read_ok(int fd) {
+    struct ata_modem *m = get_modem(fd);
     CHECK(read_response_gb(fd));
     int pos = 0;
     const char *line;
     int line_len;
     while(pos != -1) {
-        read_line(_rd_buf, &pos, &line, &line_len);
+        read_line(m->rd_buf, &pos, &line, &line_len);
         // Check for OK, safe because last char of line is either 0 or \r
         if (*line == 'O' && *(line+1) == 'K') {
             return 0;
@@ -182,6 +494,7 @@ int ata_sync_clock(int fd) {
 
 // AT+CCLK?
 int ata_get_clock(int fd, char *info, int info_size) {
+    struct ata_modem *m = get_modem(fd);
     CHECK(send_command_cr(fd, "AT+CCLK?"));
     CHECK(read_response_gb(fd));
 
@@ -189,7 +502,7 @@ int ata_get_clock(int fd, char *info, int info_size) {
     const char *line;
     int line_len;
     while(pos != -1) {
-        read_line(_rd_buf, &pos, &line, &line_len);
+        read_line(m->rd_buf, &pos, &line, &line_len);
         if (line_len > 6 && (memcmp(line, "+CCLK:", 6) == 0)) {
             copy_quoted(info, info_size, line, line_len);
             return 0;
@@ -221,6 +534,7 @@ int ata_power_status(int fd) {
  // Send AT+COPS?
  // +COPS: 0,0,"Bee Line GSM"
  int ata_op_info(int fd, char *info, int info_size) {
+    struct ata_modem *m = get_modem(fd);
     CHECK(send_command_cr(fd, "AT+COPS?"));
     CHECK(read_response_gb(fd));
 
@@ -228,7 +542,7 @@ int ata_power_status(int fd) {
     const char *line;
     int line_len;
     while(pos != -1) {
-        read_line(_rd_buf, &pos, &line, &line_len);
+        read_line(m->rd_buf, &pos, &line, &line_len);
         if (line_len > 7 && (memcmp(line, "+COPS:", 6) == 0)) {
             copy_quoted(info, info_size, line, line_len);
             return 0;
@@ -255,6 +569,7 @@ int ata_set_cset_UCS2(int fd) {
 }
 
 static int ata_send_message_impl(int fd, struct sms_pdu *spdu) {
+    struct ata_modem *m = get_modem(fd);
     CHECK(send_command_dig_cr(fd, "AT+CMGS=", spdu->len/2)); // Max size here is 255
     // Modem should return > but we don't care. Try to send and check modem error later
     // So only os error is checked here
@@ -266,52 +581,61 @@ static int ata_send_message_impl(int fd, struct sms_pdu *spdu) {
     const char *line;
     int line_len;
     while(pos != -1) {
-        read_line(_rd_buf, &pos, &line, &line_len);
+        read_line(m->rd_buf, &pos, &line, &line_len);
         if ((line_len > 10 && memcmp(line, "+CMS ERROR", 10) == 0) ||
             (line_len > 5 && memcmp(line, "ERROR", 5) == 0)) {
 
             log_err("Not able to send message %d {%s}", spdu->len, spdu->pdu);
-            dump_by_line(_rd_buf);
+            dump_by_line(m->rd_buf);
             return -1;
         }
     }
     return 0;
 }
 
-int ata_send_message(int fd, const char *number, struct sms_message *msg) {
+int ata_send_message(int fd, const char *number, struct sms_message *msg, struct arena *scratch) {
     int res = 0;
+    int mark = arena_mark(scratch);
     struct sms_pdu *spdu = NULL;
-    CHECK(create_pdu(number, msg, &spdu))
+    if (create_pdu(number, msg, &spdu, scratch) != 0) {
+        arena_rewind(scratch, mark);
+        return -1;
+    }
     if (spdu->len > 255*2) {
         log_err("PDU length error %d for {%s} {%s}", spdu->len, number, msg->text);
-        free(spdu);
+        arena_rewind(scratch, mark);
         return -1;
     }
     res = ata_send_message_impl(fd, spdu);
-    free(spdu);
+    arena_rewind(scratch, mark);
     return res;
 }
 
-int ata_send_message_multipart(int fd, const char *number, struct sms_message *msg) {
+int ata_send_message_multipart(int fd, const char *number, struct sms_message *msg, struct arena *scratch) {
     int res = 0;
+    int mark = arena_mark(scratch);
     struct sms_pdu *spdu = NULL;
     int split_parts = 0;
-    CHECK(create_pdu_multipart(number, msg, &spdu, &split_parts))
+    if (create_pdu_multipart(number, msg, &spdu, &split_parts, scratch) != 0) {
+        arena_rewind(scratch, mark);
+        return -1;
+    }
     for(int i = 0; i < split_parts; ++i) {
         if (spdu[i].len > 255*2) {
             log_err("PDU length error %d for {%s} {%s}", spdu[i].len, number, msg->text);
-            free(spdu);
+            arena_rewind(scratch, mark);
             return -1;
         }
         log_noise("Sending PDU %d {%s}", spdu[i].len, spdu[i].pdu);
         res = ata_send_message_impl(fd, &(spdu[i]));
     }
-    free(spdu);
+    arena_rewind(scratch, mark);
     return res;
 }
 
 // Get memory source and number of messages
 int ata_msg_count(int fd, int *msgs_to_read) {
+    struct ata_modem *m = get_modem(fd);
     CHECK(send_command_cr(fd, "AT+CPMS?"));
     CHECK(read_response_gb(fd));
     // +CPMS: "SM",3,10,"SM",3,0,"SM",3,10
@@ -322,11 +646,14 @@ int ata_msg_count(int fd, int *msgs_to_read) {
     int res = -1;
     int messages = 0;
     while(pos != -1) {
-        read_line(_rd_buf, &pos, &line, &line_len);
+        read_line(m->rd_buf, &pos, &line, &line_len);
         if (line_len > 6 && memcmp(line, "+CPMS:", 6) == 0) {
             const char *s = line;
             while(*s != ',' && s - line < line_len) ++s;
             messages = atoi(s+1);
+            ++s;
+            while(*s != ',' && s - line < line_len) ++s;
+            m->sim_capacity = (s - line < line_len) ? atoi(s+1) : -1;
         }
         if (line_len > 2 && memcmp(line, "OK", 2) == 0) {
             res = 0;
@@ -337,13 +664,20 @@ int ata_msg_count(int fd, int *msgs_to_read) {
         *msgs_to_read = messages;
     }
     else {
-        dump_by_line(_rd_buf);
+        dump_by_line(m->rd_buf);
     }
     return res;
 }
 
+int ata_sim_capacity(int fd) {
+    struct ata_modem *m = get_modem(fd);
+    return (m != NULL) ? m->sim_capacity : -1;
+}
+
 int ata_read_message(int fd, int msg_no, struct sms_message *msg) {
+    struct ata_modem *m = get_modem(fd);
     int res;
+    uint32_t seen = trace_now();
     CHECK(send_command_dig_cr(fd, "AT+CMGR=", msg_no)); // Read the message
     CHECK(read_response_gb(fd));
 
@@ -352,22 +686,26 @@ int ata_read_message(int fd, int msg_no, struct sms_message *msg) {
     int line_len;
     res = -1;
     while(pos != -1) {
-        read_line(_rd_buf, &pos, &line, &line_len);
+        read_line(m->rd_buf, &pos, &line, &line_len);
         if (line_len > 6 && memcmp(line, "+CMGR:", 6) == 0) {
-            read_line(_rd_buf, &pos, &line, &line_len);
+            read_line(m->rd_buf, &pos, &line, &line_len);
             res = decode_pdu(line, line_len, msg);
+            msg->trace[TRACE_SEEN] = seen;
+            trace_mark(msg, TRACE_DECODED);
             break;
         }
     }
 
     if (res == -1) {
-        dump_by_line(_rd_buf);
+        dump_by_line(m->rd_buf);
     }
 
     return res;
 }
 
 int ata_read_all_messages_fast(int fd, struct sms_message *msgs, int max_messages, int *msg_count) {
+    struct ata_modem *m = get_modem(fd);
+    uint32_t seen = trace_now();
     CHECK(send_command_cr(fd, "AT+CMGL=4")); // Read all messages \"ALL\" in text mode
     CHECK(read_response_gb(fd));
 
@@ -377,9 +715,9 @@ int ata_read_all_messages_fast(int fd, struct sms_message *msgs, int max_message
     int res = 0;
     int i = 0;
     while(pos != -1) {
-        read_line(_rd_buf, &pos, &line, &line_len);
+        read_line(m->rd_buf, &pos, &line, &line_len);
         if (line_len > 6 && memcmp(line, "+CMGL:", 6) == 0) {
-            read_line(_rd_buf, &pos, &line, &line_len);
+            read_line(m->rd_buf, &pos, &line, &line_len);
             res = decode_pdu(line, line_len, &(msgs[i++]));
             if (res != 0) {
                 i -= 1;
@@ -387,6 +725,8 @@ int ata_read_all_messages_fast(int fd, struct sms_message *msgs, int max_message
                 dump(line, line_len);
                 continue;
             }
+            msgs[i - 1].trace[TRACE_SEEN] = seen;
+            trace_mark(&msgs[i - 1], TRACE_DECODED);
             if (i == max_messages) {
                 res = -1;
                 break;
@@ -439,19 +779,24 @@ int ata_delete_all_messages(int fd) {
 }
 
 // AT+CPBW=,”6187759088",129,”Adam”
-// ATT! Used global buffer _rd_buf
+// ATT! Uses modem read buffer to build the command
 int ata_write_contact(int fd, int num, const char *name, const char *phone) {
+    struct ata_modem *m = get_modem(fd);
+    if (m == NULL) {
+        return -1;
+    }
     if (num == -1) {
-       snprintf(_rd_buf, RD_BUF_SIZE, "AT+CPBW=,\"%s\",129,\"%s\"", phone, name);
+       snprintf(m->rd_buf, RD_BUF_SIZE, "AT+CPBW=,\"%s\",129,\"%s\"", phone, name);
     }
     else {
-       snprintf(_rd_buf, RD_BUF_SIZE, "AT+CPBW=%d,\"%s\",129,\"%s\"", num, phone, name);
+       snprintf(m->rd_buf, RD_BUF_SIZE, "AT+CPBW=%d,\"%s\",129,\"%s\"", num, phone, name);
     }
-    CHECK(send_command_cr(fd, _rd_buf));
+    CHECK(send_command_cr(fd, m->rd_buf));
     return read_ok(fd);
 }
 
 int ata_read_contact(int fd, int num, char *name, int name_size, char *phone, int phone_size) {
+    struct ata_modem *m = get_modem(fd);
     CHECK(send_command_dig_cr(fd, "AT+CPBR=", num)); // Read the message
     CHECK(read_response_gb(fd));
 
@@ -459,7 +804,7 @@ int ata_read_contact(int fd, int num, char *name, int name_size, char *phone, in
     const char *line;
     int line_len;
     while(pos != -1) {
-        read_line(_rd_buf, &pos, &line, &line_len);
+        read_line(m->rd_buf, &pos, &line, &line_len);
         if (line_len > 7 && (memcmp(line, "+CPBR:", 6) == 0)) {
             int end = copy_quoted(phone, phone_size, line, line_len);
             copy_quoted(name, name_size, line + end + 1, line_len - end - 1);
@@ -468,4 +813,132 @@ int ata_read_contact(int fd, int num, char *name, int name_size, char *phone, in
     }
 
     return -1;
-}
\ No newline at end of file
+}
+
+// AT+CNMI=<mode>,<mt>,<bm>,<ds>,<bfr>
+// mt: 0 - no indication, 1 - +CMTI: "SM",<index>, 2 - +CMT: ,<length><CR><LF><pdu>
+int ata_set_msg_indication(int fd, int mt) {
+    CHECK(send_command_dig_cr(fd, "AT+CNMI=2,", mt));
+    return read_ok(fd);
+}
+
+int ata_wait_event(int fd, int timeout) {
+    struct ata_modem *m = get_modem(fd);
+    if (m == NULL) {
+        return -1;
+    }
+
+    int64_t deadline = monotonic_ms() + timeout;
+    int br = take_leftover(m, m->rd_buf, RD_BUF_SIZE);
+
+    while(1) {
+        // Check complete lines only, incomplete tail is kept for the next read
+        int complete = br;
+        while(complete > 0 && m->rd_buf[complete - 1] != '\n') {
+            complete -= 1;
+        }
+        complete = scan_urc(m, m->rd_buf, complete);
+        memmove(m->rd_buf, m->rd_buf + complete, br - complete);
+        br -= complete;
+
+        if (br >= RD_BUF_SIZE - 2) { // noise without line ending
+            log_debug("Dropping %d bytes of noise", br);
+            br = 0;
+        }
+
+        int64_t wait_ms = deadline - monotonic_ms();
+        if (m->urc_pending > 0 || wait_ms <= 0) {
+            break;
+        }
+
+        int chunk = 0;
+        if (com_read(fd, m->rd_buf + br, RD_BUF_SIZE - br, (int) wait_ms, &chunk) == -1) {
+            log_errno("Error waiting for events");
+            return -1;
+        }
+        br += chunk;
+    }
+
+    save_leftover(m, m->rd_buf, br);
+
+    int res = (m->urc_pending > 0) ? 1 : 0;
+    m->urc_pending = 0;
+    return res;
+}
+
+int ata_read_routed_message(int fd, struct sms_message *msg) {
+    // PDU is already received with +CMT
+    struct ata_modem *m = get_modem(fd);
+    if (m == NULL || m->routed_count == 0) {
+        return 0;
+    }
+
+    const char *pdu = m->routed_pdus[m->routed_head];
+    uint32_t seen = m->routed_seen[m->routed_head];
+    m->routed_head = (m->routed_head + 1) % ROUTED_QUEUE;
+    m->routed_count -= 1;
+
+    if (decode_pdu(pdu, strlen(pdu), msg) != 0) {
+        log_err("Can't decode routed message {%s}", pdu);
+        return -1;
+    }
+    msg->trace[TRACE_SEEN] = seen;
+    trace_mark(msg, TRACE_DECODED);
+    return 1;
+}
+
+int ata_ack_message(int fd) {
+    CHECK(send_command_cr(fd, "AT+CNMA"));
+    return read_ok(fd);
+}
+
+int ata_reject_message(int fd) {
+    CHECK(send_command_cr(fd, "AT+CNMA=2"));
+    return read_ok(fd);
+}
+
+// +CSMS: <service>,<mt>,<mo>,<bm>
+int ata_sms_service(int fd, int *service) {
+    struct ata_modem *m = get_modem(fd);
+    CHECK(send_command_cr(fd, "AT+CSMS?"));
+    CHECK(read_response_gb(fd));
+
+    int pos = 0;
+    const char *line;
+    int line_len;
+    while(pos != -1) {
+        read_line(m->rd_buf, &pos, &line, &line_len);
+        if (line_len > 6 && memcmp(line, "+CSMS:", 6) == 0) {
+            *service = atoi(line + 6);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int ata_stats(int fd, const struct at_stats **stats) {
+    struct ata_modem *m = get_modem(fd);
+    if (m == NULL) {
+        return -1;
+    }
+    *stats = m->stats;
+    return m->n_stats;
+}
+
+void ata_log_stats(int fd, const char *title) {
+    const struct at_stats *stats;
+    int count = ata_stats(fd, &stats);
+    if (count < 0) {
+        return;
+    }
+
+    log_write("AT statistics of %s, latency in us", title);
+    for (int i = 0; i < count; ++i) {
+        const struct at_stats *s = &stats[i];
+        const struct histogram *h = &s->latency_us;
+        log_write("%-6s calls %u errors %u timeouts %u out %u in %u; avg %u p50 %u p90 %u p99 %u max %u",
+                  s->verb, s->calls, s->errors, s->timeouts, s->bytes_out, s->bytes_in,
+                  (h->count > 0) ? (uint32_t) (h->sum / h->count) : 0, hist_percentile(h, 50),
+                  hist_percentile(h, 90), hist_percentile(h, 99), h->max);
+    }
+}
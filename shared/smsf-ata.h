@@ -18,9 +18,45 @@
 #define _SMSF_ATA_H
 
 #include "smsf-pdu.h"
+#include "smsf-stats.h"
 
  // https://wiki.iarduino.ru/page/a6_gprs_at/
 
+#ifndef SMSF_MAX_MODEMS
+  #ifdef ESP_PLATFORM
+    #define SMSF_MAX_MODEMS 1
+  #else
+    #define SMSF_MAX_MODEMS 8
+  #endif
+#endif
+
+#ifdef ESP_PLATFORM
+  #define AT_VERBS 12
+#else
+  #define AT_VERBS 24
+#endif
+#define AT_VERB_SIZE 8
+
+/**
+ * @brief Counters of one AT command of the modem, e.g. CMGR for AT+CMGR=<n>, ATE for ATE0.
+ *        Exchange is a command and its response up to the final result code, AT+CMGS prompt
+ *        and PDU that follows it are one exchange. Updated by the thread that drives the modem.
+ */
+struct at_stats {
+    char verb[AT_VERB_SIZE];     //! Last slot of the full table is "OTHER"
+    uint32_t calls;
+    uint32_t errors;             //! ERROR, +CMS ERROR, +CME ERROR or I/O error
+    uint32_t timeouts;           //! No final result code in time
+    uint32_t bytes_out;
+    uint32_t bytes_in;
+    struct histogram latency_us; //! Command sent to final result code received
+};
+
+ // Every modem keeps its own read buffer and URC state, the state is attached
+ // automatically on the first use of the device, attach it explicitly to check the limit
+ int ata_attach(int fd);
+ void ata_detach(int fd);
+
  // Send AT to check response
  int ata_ping(int fd);
  int ata_echo(int fd, int onoff);
@@ -46,11 +82,13 @@
  int ata_set_pdu_mode(int fd);
  int ata_set_cset_UCS2(int fd);
 
- // Send/Read SMS
- int ata_send_message(int fd, const char *number, struct sms_message *msg);
- int ata_send_message_multipart(int fd, const char *number, struct sms_message *msg);
+ // Send/Read SMS, PDUs are built in the scratch arena and released before return
+ int ata_send_message(int fd, const char *number, struct sms_message *msg, struct arena *scratch);
+ int ata_send_message_multipart(int fd, const char *number, struct sms_message *msg, struct arena *scratch);
 
  int ata_msg_count(int fd, int *msgs_to_read);
+ // Message slots of SIM as reported by the last ata_msg_count, -1 - unknown
+ int ata_sim_capacity(int fd);
 
  int ata_read_message(int fd, int msg_no, struct sms_message *msg);
 
@@ -61,6 +99,23 @@
  int ata_delete_message(int fd, int msg_no);
  int ata_delete_all_messages(int fd);
 
+ // New message indication, mt: 0 - none, 1 - +CMTI (stored to SIM), 2 - +CMT (routed to TE)
+ int ata_set_msg_indication(int fd, int mt);
+ // Sleep until the modem reports a new message, timeout in ms. Return 1 - event, 0 - timeout, -1 - error
+ int ata_wait_event(int fd, int timeout);
+ // Take next message routed to TE (+CMT). Return 1 - message decoded, 0 - queue is empty, -1 - error
+ int ata_read_routed_message(int fd, struct sms_message *msg);
+ // Send AT+CNMA, required for routed messages if AT+CSMS service is 1
+ int ata_ack_message(int fd);
+ // Send AT+CNMA=2 (RP-ERROR), network keeps the message and re-delivers it later
+ int ata_reject_message(int fd);
+ int ata_sms_service(int fd, int *service);
+
+ // Per AT command statistics. Return number of verbs, stats points to the modem table
+ int ata_stats(int fd, const struct at_stats **stats);
+ // Log statistics, one line per verb
+ void ata_log_stats(int fd, const char *title);
+
  int ata_write_contact(int fd, int num, const char *name, const char *phone); // -1 mean first free slot
  int ata_read_contact(int fd, int num, char *name, int name_size, char *phone, int phone_size);
 
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SMSF_CRC_H
+#define _SMSF_CRC_H
+
+#include <stdint.h>
+
+#define CRC16_INIT 0xFFFF
+
+/**
+ * @brief CRC-16/CCITT-FALSE, could be chained to hash data as it arrives, start with CRC16_INIT
+ *
+ * @param crc - CRC of the previous data or CRC16_INIT
+ * @param data - data to add
+ * @param len - data length
+ * @return uint16_t - CRC of the previous data followed by this one
+ */
+uint16_t crc16_update(uint16_t crc, const void *data, int len);
+
+/**
+ * @brief CRC16 for SMS hashing, the same as crc16_update(CRC16_INIT, data, len)
+ */
+int16_t crc16(const char* data, int len);
+
+#ifdef _PDU_TEST
+ int test_crc();
+#endif
+
+#endif
@@ -17,6 +17,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "smsf-hal.h"
 
@@ -24,124 +26,349 @@
 #include "smsf-ata.h"
 #include "smsf-util.h"
 
+#include "smsf-hash.h"
+#include "smsf-reasm.h"
+#include "smsf-pool.h"
+#include "smsf-journal.h"
+#include "smsf-outbox.h"
+#include "smsf-stats.h"
+#include "smsf-trace.h"
+#include "smsf-metrics.h"
 #include "smsf-flow.h"
 
 #define DA_CONTACT_NAME "PRIMARY NUMBER"
 #define DA_CONTACT_NAME_UCS2 "005000520049004D0041005200590020004E0055004D004200450052" // UNICODE version of contact text above
 
-#define SAVED_MESSAGES 32
 #define EXPIRE (1 * (3600 * 24)) // 1 Day
+#define EVENT_TIMEOUT (300 * 1000) // Run flow cycle at least every 5 min to handle expiration and retries
+#define SEND_BUDGET (30 * 1000) // Stop sending and read SIM again, the rest of outbox is sent on the next cycle
+#define MAX_MARKS 64 // Messages marked forwarded between commits
+#define ROUTED_RETENTION EXPIRE // Forwarded routed message is kept in the journal, network could re-deliver it if ack is lost
+
+#ifdef ESP_PLATFORM
+  #define ROUTED_RETAINED 16   // Journal of ESP32 holds 31 forwarded messages
+#else
+  #define ROUTED_RETAINED 256
+#endif
 
 extern struct smsf_options _opts;
 
-char _dest_addr[32]; //! Destination phone number
-struct sms_message *_saved_msgs[SAVED_MESSAGES]; //! List of read messages
-time_t _latest_msg_time;
+/**
+ * @brief Per-modem flow state, the modem is addressed by its device handle
+ */
+struct flow_modem {
+    int in_use;
+    int device;
+    char dest_addr[32]; //! Destination phone number
+    struct msg_table saved; //! Messages seen so far, keyed by fingerprint
+    struct reasm reasm;     //! Parts of long messages, point to messages in saved table
+    struct msg_pool pool;   //! Memory for messages in saved table
+    struct arena scratch;   //! Read buffers and forwarded text, reset after every flow cycle
+    struct journal journal; //! Forwarded messages, survives restart
+    struct outbox outbox;   //! Messages accepted for forwarding, sent by flow_send or flow_send_loop
+    struct trace_log trace; //! Lifecycle records of sent and deleted messages, written under lock
+    struct histogram forward_ms; //! Seen to sent latency, written under lock
+    uint32_t sent;          //! Messages sent, written under lock
+    uint32_t send_errors;   //! Failed send attempts, written under lock
+    struct metrics_modem *metrics; //! Counters shared with s3smsf-stat, NULL - not published
+    char op_info[METRICS_NAME_SIZE]; //! Last connection info
+    int sim_messages;       //! Messages on SIM at the start of the last cycle, -1 - unknown
+    uint32_t cycles;
+    uint32_t messages_read;
+    uint32_t messages_deleted;
+    uint32_t commands;
+    int send_device;        //! Separate port to send messages, -1 - sent by flow() between SIM reads
+    struct arena send_scratch; //! PDU buffers of the send stage, used with separate port only
+    pthread_mutex_t lock;   //! Outbox is shared by the read and send stages
+    pthread_cond_t committed; //! Signaled when new messages in the outbox are durable or destination is set
+    uint64_t marks[MAX_MARKS]; //! Fingerprints of messages to journal on the next commit
+    int n_marks;
+    struct {
+        uint64_t fingerprint;
+        time_t time;
+    } retained[ROUTED_RETAINED]; //! Forwarded routed messages, oldest first, deleted from the journal after ROUTED_RETENTION
+    int retained_head;
+    int retained_count;
+    time_t latest_msg_time;
+    int cnmi_mode;      //! New message indication mode actually set on the modem
+    int cycle_actions;  //! Number of messages forwarded or deleted during the last flow cycle
+    int cnma_required;  //! Routed messages should be acknowledged with AT+CNMA
+    int housekeeping;   //! Check SIM even if messages are routed to TE
+    int send_stop;      //! flow_send_loop returns, written under lock
+};
+
+struct flow_modem _flow_modems[SMSF_MAX_MODEMS];
 
 extern inline void fence();
 
-static struct sms_message *new_msg(int text_size, const struct sms_message *tpl) {
-    struct sms_message* msg = malloc(sizeof(struct sms_message) + text_size);
-    if (msg == NULL) {
-        log_err("Can't allocate %d bytes for message", sizeof(struct sms_message) + text_size);
-        abort();   // This error is not recoverable, so abort the program. TODO: recover
-        return NULL;
-    }
-    // Copy message header from template
-    if (tpl != NULL) {
-        memcpy(msg, tpl, sizeof(struct sms_message));
+// Find flow state by device handle, the state is attached on the first use
+static struct flow_modem *get_flow(int device) {
+    for (int i = 0; i < SMSF_MAX_MODEMS; ++i) {
+        if (__atomic_load_n(&_flow_modems[i].in_use, __ATOMIC_ACQUIRE) && _flow_modems[i].device == device) {
+            return &_flow_modems[i];
+        }
     }
-    msg->text[0] = 0;
-    msg->text_size = text_size;
-    return msg;
-};
 
-static int compare_messages(const struct sms_message *a, const struct sms_message *b) {
-    if (a->hash_id == b->hash_id) {
-        if (a->split_ref == b->split_ref &&
-            a->split_no == b->split_no &&
-            a->split_parts == b->split_parts &&
-            strcmp(a->ts, b->ts) == 0 &&
-            strcmp(a->sender, b->sender) == 0) {
-            return 1;
+    for (int i = 0; i < SMSF_MAX_MODEMS; ++i) {
+        int expected = 0;
+        // Claim free slot, modems could be attached from different threads
+        if (__atomic_compare_exchange_n(&_flow_modems[i].in_use, &expected, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            struct flow_modem *fm = &_flow_modems[i];
+            msg_table_init(&fm->saved);
+            reasm_init(&fm->reasm);
+            fm->journal.image = NULL;
+            fm->journal.set = NULL;
+            fm->outbox.image = NULL;
+            fm->trace.fp = NULL;
+            memset(&fm->forward_ms, 0, sizeof(fm->forward_ms));
+            fm->sent = 0;
+            fm->send_errors = 0;
+            fm->metrics = NULL;
+            fm->op_info[0] = 0;
+            fm->sim_messages = -1;
+            fm->cycles = 0;
+            fm->messages_read = 0;
+            fm->messages_deleted = 0;
+            fm->commands = 0;
+            fm->n_marks = 0;
+            fm->retained_head = 0;
+            fm->retained_count = 0;
+            fm->send_device = -1;
+            fm->send_scratch.base = NULL;
+            fm->send_stop = 0;
+            pthread_mutex_init(&fm->lock, NULL);
+            pthread_cond_init(&fm->committed, NULL);
+            fm->device = device;
+            fm->dest_addr[0] = 0;
+            fm->latest_msg_time = 0;
+            fm->cnmi_mode = 0;
+            fm->cycle_actions = 0;
+            fm->cnma_required = 0;
+            fm->housekeeping = 0;
+            __atomic_store_n(&fm->in_use, 1, __ATOMIC_RELEASE);
+            return fm;
         }
     }
 
-    return 0;
+    // Device handles are checked with ata_attach before, so it's not recoverable
+    log_err("Too many modems, %d is the limit", SMSF_MAX_MODEMS);
+    abort();
+    return NULL;
 }
 
-static int find_saved_message(const struct sms_message *msg) {
-    // Check hashed slot first
-    int idx = msg->hash_id % SAVED_MESSAGES;
-    if (_saved_msgs[idx] != NULL && compare_messages(msg, _saved_msgs[idx])) {
-        log_debug("Found MSG #%d %x: {%s} {%s} vs {%s} {%s}", idx, _saved_msgs[idx]->hash_id,\
-                                           _saved_msgs[idx]->ts, _saved_msgs[idx]->text,  msg->ts, msg->text);
-        return idx;
+static int find_saved_message(struct flow_modem *fm, const struct sms_message *msg) {
+    int idx = msg_table_find(&fm->saved, msg);
+    if (idx != -1) {
+        struct sms_message *c_msg = msg_table_at(&fm->saved, idx);
+        log_debug("Found MSG #%d %x: {%s} {%s} vs {%s} {%s}", idx, c_msg->hash_id, c_msg->ts, c_msg->text, msg->ts, msg->text);
     }
+    return idx;
+}
 
-    for (int i = 0; i < SAVED_MESSAGES; ++i) {
-        if (i != idx && _saved_msgs[i] != NULL && compare_messages(msg, _saved_msgs[i])) {
-            log_debug("Found MSG #%d %x: {%s} {%s} vs {%s} {%s}", i, _saved_msgs[i]->hash_id,\
-                                           _saved_msgs[i]->ts, _saved_msgs[i]->text,  msg->ts, msg->text);
-            return i;
-        }
+// Copy message read to the scratch arena into the pool and put it to the seen list.
+// If it fails the message is not tracked, so it will be processed again on the next cycle
+static struct sms_message *add_saved_message(struct flow_modem *fm, const struct sms_message *msg) {
+    struct sms_message *s_msg = msg_pool_get(&fm->pool);
+    if (s_msg == NULL) {
+        log_err("Message pool is exhausted (%d), can't save message From: %s TS: %s", fm->pool.capacity, msg->sender, msg->ts);
+        return NULL;
     }
 
-    // Nothing found
-    return -1;
+    int text_size = s_msg->text_size;
+    memcpy(s_msg, msg, sizeof(struct sms_message));
+    s_msg->text_size = text_size;
+    strncpy(s_msg->text, msg->text, text_size - 1);
+    s_msg->text[text_size - 1] = 0;
+
+    if (msg_table_insert(&fm->saved, s_msg) != 0) {
+        log_err("Can't save message From: %s TS: %s", msg->sender, msg->ts);
+        msg_pool_put(&fm->pool, s_msg);
+        return NULL;
+    }
+    return s_msg;
 }
 
-static int find_free_slot() {
-    for (int i = 0; i < SAVED_MESSAGES; ++i) {
-        if (_saved_msgs[i] == NULL) {
-            return i;
-        }
+static void remove_saved_message(struct flow_modem *fm, int idx) {
+    struct sms_message *msg = msg_table_remove(&fm->saved, idx);
+    journal_deleted(&fm->journal, msg->fingerprint);
+    reasm_forget(&fm->reasm, msg);
+    msg_pool_put(&fm->pool, msg);
+}
+
+// Routed message never reaches SIM, so nothing says when it's safe to forget it.
+// It's dropped from the saved table but stays in the journal until retention expires
+static void retain_routed_message(struct flow_modem *fm, int idx) {
+    struct sms_message *msg = msg_table_remove(&fm->saved, idx);
+    if (fm->retained_count == ROUTED_RETAINED) {
+        // Journal room is limited, the oldest one is forgotten early
+        journal_deleted(&fm->journal, fm->retained[fm->retained_head].fingerprint);
+        fm->retained_head = (fm->retained_head + 1) % ROUTED_RETAINED;
+        fm->retained_count -= 1;
     }
-    // Nothing found
-    return -1;
+    int tail = (fm->retained_head + fm->retained_count) % ROUTED_RETAINED;
+    fm->retained[tail].fingerprint = msg->fingerprint;
+    fm->retained[tail].time = time(NULL);
+    fm->retained_count += 1;
+    reasm_forget(&fm->reasm, msg);
+    msg_pool_put(&fm->pool, msg);
 }
 
-static void add_saved_message(struct sms_message *msg) {
-    int idx = msg->hash_id % SAVED_MESSAGES;
-    if (_saved_msgs[idx] != NULL) { // hashed slot already taken, linear scan for first free one
-        idx = find_free_slot(NULL);
+// Retained messages are checked as well, the journal could be disabled
+static int is_retained(struct flow_modem *fm, uint64_t fingerprint) {
+    for (int i = 0; i < fm->retained_count; ++i) {
+        if (fm->retained[(fm->retained_head + i) % ROUTED_RETAINED].fingerprint == fingerprint) {
+            return 1;
+        }
     }
-    if (idx == -1) {
-        log_err("Saved msgs buffer overflow");
-        return;
+    return journal_contains(&fm->journal, fingerprint);
+}
+
+static void expire_retained(struct flow_modem *fm) {
+    time_t now = time(NULL);
+    while (fm->retained_count > 0 && now - fm->retained[fm->retained_head].time > ROUTED_RETENTION) {
+        journal_deleted(&fm->journal, fm->retained[fm->retained_head].fingerprint);
+        fm->retained_head = (fm->retained_head + 1) % ROUTED_RETAINED;
+        fm->retained_count -= 1;
     }
-    _saved_msgs[idx] = msg;
 }
 
-static void remove_saved_message(int idx) {
-    free(_saved_msgs[idx]);
-    _saved_msgs[idx] = NULL;
+// Group commit: one sync for all messages accepted since the previous commit.
+// Outbox goes first, so the journal never says forwarded about a message that could be lost
+static void flow_commit(struct flow_modem *fm) {
+    pthread_mutex_lock(&fm->lock);
+    if (outbox_commit(&fm->outbox) != 0) {
+        log_errno("Can't commit outbox, %d messages could be lost on power failure", fm->outbox.count);
+    }
+    pthread_cond_signal(&fm->committed);
+    pthread_mutex_unlock(&fm->lock);
+    for (int i = 0; i < fm->n_marks; ++i) {
+        if (journal_forwarded(&fm->journal, fm->marks[i]) != 0) {
+            log_err("Can't journal message %llx, restart may forward it again", (unsigned long long) fm->marks[i]);
+        }
+    }
+    fm->n_marks = 0;
+    if (journal_commit(&fm->journal) != 0) {
+        log_errno("Can't commit journal, restart may forward messages again");
+    }
 }
 
-static int slot_taken(int idx) {
-    return _saved_msgs[idx] != NULL;
+// Message is accepted for forwarding or processed as a command, it's deleted on the next cycle.
+// Journal record is written on commit, before the message could be deleted from SIM
+static void mark_forwarded(struct flow_modem *fm, struct sms_message *msg) {
+    msg->forwarded = 1;
+    if (fm->n_marks == MAX_MARKS) {
+        flow_commit(fm);
+    }
+    fm->marks[fm->n_marks++] = msg->fingerprint;
 }
 
 // Expire messages based on relative time, i.e. delta between oldest and newest message
 static int message_expired(int device, struct sms_message *msg) {
+    struct flow_modem *fm = get_flow(device);
     time_t msg_time = iso2time(msg->ts);
-    time_t delta = _latest_msg_time - msg_time;
+    time_t delta = fm->latest_msg_time - msg_time;
 
     if (delta > EXPIRE) {
-        log_err("Message EXPIRED: %s {%s} %ld %ld - %ld", msg->sender, msg->ts, (long) msg_time, (long) _latest_msg_time,  (long) delta);
+        log_err("Message EXPIRED: %s {%s} %ld %ld - %ld", msg->sender, msg->ts, (long) msg_time, (long) fm->latest_msg_time,  (long) delta);
     }
     else {
-        log_noise("Message actual: %s {%s} %ld %ld - %ld", msg->sender, msg->ts, (long) msg_time, (long) _latest_msg_time,  (long) delta);
+        log_noise("Message actual: %s {%s} %ld %ld - %ld", msg->sender, msg->ts, (long) msg_time, (long) fm->latest_msg_time,  (long) delta);
     }
 
-    if (_latest_msg_time < msg_time) {
-        _latest_msg_time = msg_time;
+    if (fm->latest_msg_time < msg_time) {
+        fm->latest_msg_time = msg_time;
     }
 
     return (delta > EXPIRE);
 }
 
+// Trace the message sent and account seen to sent latency, called under lock
+static void trace_forwarded(struct flow_modem *fm, const struct sms_message *msg, int attempts) {
+    trace_sent(&fm->trace, msg, attempts);
+    fm->sent += 1;
+    if (msg->trace[TRACE_SEEN] != 0) {
+        hist_add(&fm->forward_ms, msg->trace[TRACE_SENT] - msg->trace[TRACE_SEEN]);
+    }
+}
+
+// Copy read stage counters to shared memory, once per cycle by the read stage
+static void publish_read(struct flow_modem *fm) {
+    if (fm->metrics == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&fm->lock);
+    int outbox_depth = fm->outbox.count;
+    pthread_mutex_unlock(&fm->lock);
+
+    struct metrics_read *r = &fm->metrics->read;
+    const struct at_stats *stats;
+    int n_stats = ata_stats(fm->device, &stats);
+
+    metrics_begin(&r->seq);
+    r->updated = time(NULL);
+    memcpy(r->op_info, fm->op_info, sizeof(r->op_info));
+    r->sim_messages = fm->sim_messages;
+    r->sim_capacity = ata_sim_capacity(fm->device);
+    r->cycles = fm->cycles;
+    r->messages_read = fm->messages_read;
+    r->messages_deleted = fm->messages_deleted;
+    r->commands = fm->commands;
+    r->outbox_depth = outbox_depth;
+    r->reasm_groups = fm->reasm.count;
+    r->saved = fm->saved.count;
+    r->n_at = (n_stats > 0) ? n_stats : 0;
+    if (r->n_at > 0) {
+        memcpy(r->at, stats, r->n_at * sizeof(struct at_stats));
+    }
+    metrics_end(&r->seq);
+}
+
+// Copy send stage counters to shared memory after every send, called under lock by the thread that sends
+static void publish_send(struct flow_modem *fm, int port) {
+    if (fm->metrics == NULL) {
+        return;
+    }
+
+    struct metrics_send *s = &fm->metrics->send;
+    const struct at_stats *stats;
+    // AT commands of the read port are published by the read stage
+    int n_stats = (port != fm->device) ? ata_stats(port, &stats) : 0;
+
+    metrics_begin(&s->seq);
+    s->updated = time(NULL);
+    s->messages_sent = fm->sent;
+    s->send_errors = fm->send_errors;
+    s->forward_ms = fm->forward_ms;
+    s->n_at = (n_stats > 0) ? n_stats : 0;
+    if (s->n_at > 0) {
+        memcpy(s->at, stats, s->n_at * sizeof(struct at_stats));
+    }
+    metrics_end(&s->seq);
+}
+
+// Send message prepared by forward_message through the port, read port or separate send port
+static int send_message(int port, const char *dest_addr, struct sms_message *msg, int flags, struct arena *scratch,
+                        notify_func_t *notify) {
+    int res = 0;
+
+    if (flags & OUTBOX_MULTIPART) {
+        log_noise("Sending message (multipart): %s {%s}", msg->sender, msg->text);
+        res = ata_send_message_multipart(port, dest_addr, msg, scratch);
+    }
+    else {
+        log_noise("Sending message (truncate): %s {%s}", msg->sender, msg->text);
+        res = ata_send_message(port, dest_addr, msg, scratch);
+    }
+
+    notify((res != 0) ? "Forward error %s" : "Forwarded %s", msg->sender);
+    return res;
+}
+
+// Add header and put message to the outbox, it's sent later by flow_send.
+// Return 0 if the message is accepted, so it could be deleted from SIM
 static int forward_message(int device, struct sms_message *msg, notify_func_t *notify) {
+    struct flow_modem *fm = get_flow(device);
     int res = 0;
     if (! _opts.forward) {
         log_err("Forwarding disabled, all SMS is kept until expires");
@@ -155,7 +382,12 @@ static int forward_message(int device, struct sms_message *msg, notify_func_t *n
     // TS is compacted, 2025-02-28T12:55:40Z+3 => 02-28T12:55
     int sender_len = strlen(msg->sender);
     int offs = 0;
-    struct sms_message* eh_msg = new_msg(msg->text_size + sender_len + 14 /* extra header */, msg);
+    int flags = (_opts.multipart) ? OUTBOX_MULTIPART : 0;
+    int mark = arena_mark(&fm->scratch);
+    struct sms_message* eh_msg = arena_new_msg(&fm->scratch, msg->text_size + sender_len + 14 /* extra header */, msg);
+    if (eh_msg == NULL) {
+        return -1;
+    }
 
     if (_opts.multipart) {
         memcpy(eh_msg->text + offs, msg->sender, sender_len); offs += sender_len;
@@ -164,9 +396,6 @@ static int forward_message(int device, struct sms_message *msg, notify_func_t *n
         *(eh_msg->text + offs) = ' '; offs += 1;
         memcpy(eh_msg->text + offs, msg->text, msg->text_size); offs += msg->text_size;
         *(eh_msg->text + offs) = 0;
-
-        log_noise("Sending message (multipart): %s {%s}", eh_msg->sender, eh_msg->text);
-        res = ata_send_message_multipart(device, _dest_addr, eh_msg);
     }
     else {
         memcpy(eh_msg->text, msg->text, msg->text_size); offs += msg->text_size;
@@ -174,18 +403,114 @@ static int forward_message(int device, struct sms_message *msg, notify_func_t *n
         memcpy(eh_msg->text + offs, msg->sender, sender_len); offs += sender_len;
         memcpy(eh_msg->text + offs, msg->ts + 5, 11); offs += 11;
         *(eh_msg->text + offs) = 0;
+    }
 
-        log_noise("Sending message (truncate): %s {%s}", eh_msg->sender, eh_msg->text);
-        res = ata_send_message(device, _dest_addr, eh_msg);
+    trace_mark(eh_msg, TRACE_QUEUED);
+    pthread_mutex_lock(&fm->lock);
+    res = outbox_put(&fm->outbox, eh_msg, flags);
+    pthread_mutex_unlock(&fm->lock);
+    if (res == OUTBOX_TOO_BIG) {
+        log_noise("Message From: %s doesn't fit the outbox, sending it right away", msg->sender);
+        trace_mark(eh_msg, TRACE_SENDING);
+        res = send_message(device, fm->dest_addr, eh_msg, flags, &fm->scratch, notify);
+        if (res == 0) {
+            trace_mark(eh_msg, TRACE_SENT);
+        }
+        pthread_mutex_lock(&fm->lock);
+        if (res == 0) {
+            trace_forwarded(fm, eh_msg, 1);
+        }
+        fm->send_errors += (res != 0);
+        publish_send(fm, device);
+        pthread_mutex_unlock(&fm->lock);
+        fm->cycle_actions += (res == 0);
     }
+    else if (res == OUTBOX_FULL) {
+        log_err("Outbox is full (%d), message From: %s TS: %s is kept for retry", fm->outbox.count, msg->sender, msg->ts);
+    }
+    else {
+        log_noise("Queued message From: %s TS: %s, %d in outbox", msg->sender, msg->ts, fm->outbox.count);
+    }
+    arena_rewind(&fm->scratch, mark);
 
-    notify((res != 0) ? "Forward error %s" : "Forwarded %s", msg->sender);
-    free(eh_msg);
+    return (res == 0) ? 0 : -1;
+}
 
-    return res;
+// Send the first due message from the outbox. The outbox is locked only to take the message
+// and to record the result, so the read stage isn't blocked by a slow send.
+// Return 1 - sent, -1 - failed and will be retried, 0 - nothing to send
+static int send_next(struct flow_modem *fm, int port, struct arena *scratch, notify_func_t *notify) {
+    char dest_addr[sizeof(fm->dest_addr)];
+    pthread_mutex_lock(&fm->lock);
+    int idx = outbox_due(&fm->outbox, monotonic_ms());
+    // Destination is read by flow_setup
+    if (idx == -1 || fm->dest_addr[0] == 0) {
+        pthread_mutex_unlock(&fm->lock);
+        return 0;
+    }
+    strcpy(dest_addr, fm->dest_addr);
+
+    // Copy, PDU encoder updates message header and the outbox could be compacted while sending
+    uint32_t id = fm->outbox.items[idx].id;
+    int flags = fm->outbox.items[idx].flags;
+    const struct sms_message *o_msg = outbox_msg(&fm->outbox, idx);
+    int mark = arena_mark(scratch);
+    struct sms_message *msg = arena_new_msg(scratch, o_msg->text_size, o_msg);
+    if (msg != NULL) {
+        strcpy(msg->text, o_msg->text);
+        if (flags & OUTBOX_REPLAYED) {
+            // Monotonic clock of the previous run
+            memset(msg->trace, 0, sizeof(msg->trace));
+        }
+    }
+    pthread_mutex_unlock(&fm->lock);
+    if (msg == NULL) {
+        return 0;
+    }
+
+    trace_mark(msg, TRACE_SENDING);
+    int res = send_message(port, dest_addr, msg, flags, scratch, notify);
+    if (res == 0) {
+        trace_mark(msg, TRACE_SENT);
+    }
+
+    pthread_mutex_lock(&fm->lock);
+    idx = outbox_find(&fm->outbox, id);
+    if (idx != -1 && res == 0) {
+        trace_forwarded(fm, msg, fm->outbox.items[idx].attempts + 1);
+        outbox_done(&fm->outbox, idx);
+    }
+    else if (idx != -1) {
+        outbox_retry(&fm->outbox, idx, monotonic_ms());
+        log_err("Message From: %s is not sent, attempt %d, retry in %d s", msg->sender, fm->outbox.items[idx].attempts,
+                (int) ((fm->outbox.items[idx].next_ms - monotonic_ms()) / 1000));
+    }
+    fm->send_errors += (res != 0);
+    publish_send(fm, port);
+    pthread_mutex_unlock(&fm->lock);
+    arena_rewind(scratch, mark);
+
+    return (res == 0) ? 1 : -1;
+}
+
+// Send messages from outbox through the read port, failed ones are retried with backoff.
+// Time is limited, so a long outbox doesn't stop draining SIM
+static void flow_send(int device, notify_func_t *notify) {
+    struct flow_modem *fm = get_flow(device);
+    int64_t start = monotonic_ms();
+    int res;
+
+    while (_opts.forward && (res = send_next(fm, device, &fm->scratch, notify)) != 0) {
+        fm->cycle_actions += (res == 1);
+        if (monotonic_ms() - start > SEND_BUDGET) {
+            log_noise("Send time is over, %d messages left in outbox", fm->outbox.count);
+            break;
+        }
+    }
 }
 
 static int delete_message(int device, int msg_no, notify_func_t *notify) {
+    struct flow_modem *fm = get_flow(device);
     int res = 0;
     // Force overrides the option to be able to delete
     // command and expired messages ever if the user decided to keep forwarded ones
@@ -201,6 +526,8 @@ static int delete_message(int device, int msg_no, notify_func_t *notify) {
     else {
         log_debug("Deleted message #%d", msg_no);
         notify("Deleted #%d", msg_no);
+        fm->cycle_actions += 1;
+        fm->messages_deleted += 1;
     }
     return res;
 }
@@ -219,6 +546,7 @@ static void set_option(const char *name, int *option, int new_val, int max_val)
 
 // Return 1 if it's a command message 0 - otherwise
 int process_command_message(int device, const char *text) {
+    struct flow_modem *fm = get_flow(device);
     if (*text != '+' && *(text+1) != '+') {
         // Not a command message
         return 0;
@@ -278,6 +606,11 @@ int process_command_message(int device, const char *text) {
             break;
         }
         case 'E': {
+            if (strncmp(text, "++ENCODING", 10) == 0) {
+                // Outgoing text encoding, 0 - GSM 7-bit or UCS2, 1 - transliterate Cyrillic if cheaper, 2 - always UCS2
+                set_option("ENCODING", &_opts.encoding, atoi(text + 11), 2);
+                return 1;
+            }
             if (strncmp(text, "++EXPIRE", 8) == 0) {
                 // Enable/Disable multipart support
                 set_option("EXPIRE", &_opts.expire, atoi(text + 9), 1);
@@ -318,12 +651,33 @@ int process_command_message(int device, const char *text) {
             break;
         }
         case 'S': {
+            if (strcmp(text, "++STATS") == 0) {
+                // AT command counters and latency of the modem
+                ata_log_stats(device, "read port");
+                if (fm->send_device != -1) {
+                    ata_log_stats(fm->send_device, "send port");
+                }
+                pthread_mutex_lock(&fm->lock);
+                struct histogram h = fm->forward_ms;
+                pthread_mutex_unlock(&fm->lock);
+                if (h.count > 0) {
+                    log_write("Seen to sent of %u messages, ms: avg %u p50 %u p90 %u p99 %u max %u", h.count,
+                              (uint32_t) (h.sum / h.count), hist_percentile(&h, 50), hist_percentile(&h, 90),
+                              hist_percentile(&h, 99), h.max);
+                }
+                return 1;
+            }
             if (strcmp(text, "++SAVED") == 0) {
                 // Dump all messages from hash table to console
-                for (int i = 0; i < SAVED_MESSAGES; ++i) {
-                    log_write("Message #%d (%x): From: %s TS: %s {%s}", i, \
-                    _saved_msgs[i]->hash_id, _saved_msgs[i]->sender, _saved_msgs[i]->ts, _saved_msgs[i]->text);
+                for (int i = 0; i < fm->saved.capacity; ++i) {
+                    struct sms_message *c_msg = msg_table_at(&fm->saved, i);
+                    if (c_msg == NULL) {
+                        continue;
+                    }
+                    log_write("Message #%d (%x): From: %s TS: %s {%s}", i, c_msg->hash_id, c_msg->sender, c_msg->ts, c_msg->text);
                 }
+                log_write("Pool: %d of %d messages, peak %d; scratch peak %d of %d bytes",
+                          fm->pool.used, fm->pool.capacity, fm->pool.peak, fm->scratch.peak, fm->scratch.size);
                 return 1;
             }
             break;
@@ -333,57 +687,260 @@ int process_command_message(int device, const char *text) {
     return 0;
 }
 
-int process_multipart_message(int device, const struct sms_message *msg,  notify_func_t *notify) {
-    // Walk through cache and ensure, that all parts are available
-    // Build L2 cache
-    int parts_found = 0;
-    int total_length = 0;
-    struct sms_message *msgs_as[msg->split_parts];
+// Forward assembled long message, or what is here if the group is evicted or timed out.
+// All received parts are marked as forwarded to delete them on the next cycle
+static int forward_group(int device, struct reasm_group *group, notify_func_t *notify) {
+    struct flow_modem *fm = get_flow(device);
+    int text_len = reasm_text(group, NULL, 0);
+    int mark = arena_mark(&fm->scratch);
+    struct sms_message* mp_msg = arena_new_msg(&fm->scratch, text_len + 1 /* trailing zero */, reasm_first(group));
+    if (mp_msg == NULL) {
+        return -1;
+    }
+    reasm_text(group, mp_msg->text, text_len + 1);
+
+    // Long message is seen with its first part and decoded with its last one
+    for (int j = 0; j < group->parts; ++j) {
+        const struct sms_message *part = group->part[j];
+        if (part == NULL) {
+            continue;
+        }
+        if (part->trace[TRACE_SEEN] != 0 && (int32_t) (part->trace[TRACE_SEEN] - mp_msg->trace[TRACE_SEEN]) < 0) {
+            mp_msg->trace[TRACE_SEEN] = part->trace[TRACE_SEEN];
+        }
+        if ((int32_t) (part->trace[TRACE_DECODED] - mp_msg->trace[TRACE_DECODED]) > 0) {
+            mp_msg->trace[TRACE_DECODED] = part->trace[TRACE_DECODED];
+        }
+    }
+    trace_mark(mp_msg, TRACE_REASSEMBLED);
+
+    log_noise("Forwarding multipart message (%x %d parts%s) From: %s TS: %s {%s}", group->ref, group->parts,
+              reasm_complete(group) ? "" : ", incomplete", mp_msg->sender, mp_msg->ts, mp_msg->text);
 
-    for (int j = 0; j < SAVED_MESSAGES; ++j) {
-        if (slot_taken(j)) {
-            if (_saved_msgs[j]->split_ref == msg->split_ref && _saved_msgs[j]->split_parts == msg->split_parts) {
-                parts_found += 1;
-                total_length += strlen(_saved_msgs[j]->text);
-                msgs_as[_saved_msgs[j]->split_no - 1] = _saved_msgs[j];
+    int res = forward_message(device, mp_msg, notify);
+    if (res == 0) {
+        for (int j = 0; j < group->parts; ++j) {
+            if (group->part[j] != NULL) {
+                mark_forwarded(fm, group->part[j]);
             }
         }
     }
 
-    // Not all parts already arrived
-    if (parts_found != msg->split_parts) {
-       log_debug("Not all messages has arrived: (%x %d/%d) From: %s TS: %s {%s}", msg->split_ref, msg->split_no, msg->split_parts, msg->sender, msg->ts, msg->text);
-       return -1;
+    arena_rewind(&fm->scratch, mark);
+    return res;
+}
+
+// Put part to the reassembly buffer, forward long message as soon as the last part arrives.
+// Part already in the buffer is a no-op, unless the message is complete and waits for retry.
+static void process_part(int device, struct sms_message *msg, notify_func_t *notify) {
+    struct flow_modem *fm = get_flow(device);
+    struct reasm_group *group = NULL;
+    int res;
+
+    while ((res = reasm_add(&fm->reasm, msg, monotonic_ms(), &group)) == REASM_FULL) {
+        // Make room, forward the oldest message as is
+        struct reasm_group *oldest = reasm_oldest(&fm->reasm);
+        log_err("Reassembly buffer is full, forwarding incomplete message (%x) From: %s", oldest->ref, oldest->sender);
+        forward_group(device, oldest, notify);
+        reasm_release(&fm->reasm, oldest);
     }
 
-    // Walk through L2 cache and extract text from parts,
-    // Mark collected message as forwarded to delete it on the next cycle
-    struct sms_message* mp_msg = new_msg(total_length + 1 /* trailing zero */, msg);
-    int offs = 0;
-    for (int j = 0; j < msg->split_parts; ++j) {
-        log_debug("Extracting text from multipart message #%d: (%x %d/%d) From: %s TS: %s {%s}", j, msgs_as[j]->split_ref, msgs_as[j]->split_no, msgs_as[j]->split_parts, msgs_as[j]->sender, msgs_as[j]->ts, msgs_as[j]->text);
-        strcpy(mp_msg->text + offs, msgs_as[j]->text);
-        offs += strlen(msgs_as[j]->text);
+    if (res == REASM_DUPLICATE) {
+        log_noise("Duplicate part (%x %d/%d) From: %s TS: %s", msg->split_ref, msg->split_no, msg->split_parts, msg->sender, msg->ts);
+        mark_forwarded(fm, msg); // Delete it along with forwarded messages
+        return;
     }
-    mp_msg->text[offs] = 0;
 
-    log_noise("Forwarding multipart message From: %s TS: %s {%s}", mp_msg->sender, mp_msg->ts, mp_msg->text);
+    if (res == REASM_COMPLETE && forward_group(device, group, notify) == 0) {
+        reasm_release(&fm->reasm, group);
+    }
+}
 
-    int res = forward_message(device, mp_msg, notify);
-    if (res == 0) {
-        // Long message sent successfully, mark all part as forwarded
-        for (int j = 0; j < msg->split_parts; ++j) {
-            msgs_as[j]->forwarded = 1;
+// Forward long messages with parts missing for too long
+static void flow_reassembly(int device, notify_func_t *notify) {
+    struct flow_modem *fm = get_flow(device);
+    int64_t now = monotonic_ms();
+    for (int i = 0; i < REASM_MAX_GROUPS; ++i) {
+        struct reasm_group *group = reasm_at(&fm->reasm, i);
+        if (group != NULL && !reasm_complete(group) && reasm_expired(group, now)) {
+            log_err("Not all parts arrived in time, forwarding incomplete message (%x) From: %s", group->ref, group->sender);
+            forward_group(device, group, notify);
+            reasm_release(&fm->reasm, group);
         }
     }
+}
 
-    free(mp_msg);
+// Message was not seen before: put it to the seen list, then run command or forward it.
+// Parts of long messages go to the reassembly buffer
+static void process_new_message(int device, int msg_no, const struct sms_message *r_msg, notify_func_t *notify) {
+    struct flow_modem *fm = get_flow(device);
+    // Save first, so the message is never forwarded twice if there is no room to track it
+    struct sms_message *msg = add_saved_message(fm, r_msg);
+    if (msg == NULL) {
+        return;
+    }
+
+    log_noise("Received new message #%d (%d/%d): From: {%s} TS: {%s} {%s}", msg_no, msg->split_no, msg->split_parts, msg->sender, msg->ts, msg->text);
+    fm->messages_read += 1;
+
+    // Forwarded before restart but not deleted yet
+    if (journal_contains(&fm->journal, msg->fingerprint)) {
+        log_noise("Message #%d was forwarded before restart: From: %s TS: %s", msg_no, msg->sender, msg->ts);
+        msg->forwarded = 1;
+        return;
+    }
+
+    // Ignore leading "+""
+    char *s_sender = (*msg->sender == '+') ? msg->sender + 1 : msg->sender;
+
+    if (strcmp(s_sender, fm->dest_addr) == 0) {
+        // Message come from DA_CONTACT_NAME, it could be a command message.
+        // Command message can affect SMS list, so re-read after processing command.
+        if (process_command_message(device, msg->text) == 1) {
+            // It was recognised command message, don't forward
+            // Command message may alter message sequence, so can't delete it immediately
+            mark_forwarded(fm, msg);
+            fm->commands += 1;
+        }
+    }
+
+    // Non-processed messages from DA will be forwarded as usual
+    if (msg->forwarded == 0 && !reasm_is_part(msg)) {
+        if (forward_message(device, msg, notify) == 0) {
+            mark_forwarded(fm, msg);
+        }
+    }
+
+    if (msg->forwarded == 0 && reasm_is_part(msg)) {
+        log_noise("Saving multipart message #%d: (%x %d/%d) From: %s TS: %s {%s}", msg_no, msg->split_ref, msg->split_no, msg->split_parts, msg->sender, msg->ts, msg->text);
+        process_part(device, msg, notify);
+    }
+}
+
+int flow_storage(int device, const char *prefix) {
+    struct flow_modem *fm = get_flow(device);
+    char name[256];
+    int res = 0;
+
+    if (fm->journal.image == NULL) {
+        snprintf(name, sizeof(name), "%s.journal", prefix);
+        res |= journal_open(&fm->journal, name);
+    }
+    if (fm->outbox.image == NULL) {
+        snprintf(name, sizeof(name), "%s.outbox", prefix);
+        res |= outbox_open(&fm->outbox, name);
+    }
+    if (fm->trace.fp == NULL) {
+#ifdef ESP_PLATFORM
+        // NVS keeps no files, trace records go to the log
+        trace_open(&fm->trace, NULL);
+#else
+        snprintf(name, sizeof(name), "%s.trace", prefix);
+        trace_open(&fm->trace, name);
+#endif
+    }
     return res;
 }
 
+void flow_metrics(int device, const char *port, const char *send_port) {
+    struct flow_modem *fm = get_flow(device);
+    if (fm->metrics == NULL) {
+        fm->metrics = metrics_attach(port, send_port);
+    }
+}
+
+int flow_send_port(int device, int send_device) {
+    struct flow_modem *fm = get_flow(device);
+    if (fm->send_scratch.base == NULL && arena_init(&fm->send_scratch, SCRATCH_SIZE) != 0) {
+        return -1;
+    }
+    // Send stage starts before flow_setup
+    if (fm->outbox.image == NULL && outbox_open(&fm->outbox, NULL) != 0) {
+        return -1;
+    }
+    fm->send_device = send_device;
+    return 0;
+}
+
+// Sleep until new messages are committed or the next retry is due
+static void wait_outbox(struct flow_modem *fm) {
+    pthread_mutex_lock(&fm->lock);
+    int64_t timeout = EVENT_TIMEOUT;
+    int64_t next_ms = outbox_next_ms(&fm->outbox);
+    if (_opts.forward && fm->dest_addr[0] != 0 && next_ms != -1) {
+        timeout = MIN(timeout, next_ms - monotonic_ms());
+    }
+    if (timeout > 0 && !fm->send_stop) {
+        // Condition variable uses realtime clock
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout / 1000;
+        ts.tv_nsec += (timeout % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec += 1;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&fm->committed, &fm->lock, &ts);
+    }
+    pthread_mutex_unlock(&fm->lock);
+}
+
+int flow_send_loop(int device, notify_func_t *notify) {
+    struct flow_modem *fm = get_flow(device);
+    int port = fm->send_device;
+    if (port == -1) {
+        log_err("Send port is not set");
+        return -1;
+    }
+
+    if (ata_echo(port, 0) != 0) {
+        log_err("Modem error, can't set echo mode on send port");
+        return -1;
+    }
+    if (ata_set_pdu_mode(port) != 0) {
+        log_err("Modem error, can't set PDU mode on send port");
+        return -1;
+    }
+
+    while (!__atomic_load_n(&fm->send_stop, __ATOMIC_ACQUIRE)) {
+        if (_opts.forward && send_next(fm, port, &fm->send_scratch, notify) != 0) {
+            // Sent messages are recorded at once, read stage may not commit for a while
+            pthread_mutex_lock(&fm->lock);
+            if (outbox_commit(&fm->outbox) != 0) {
+                log_errno("Can't commit outbox, sent messages could be sent again after restart");
+            }
+            pthread_mutex_unlock(&fm->lock);
+            continue;
+        }
+        wait_outbox(fm);
+    }
+    return 0;
+}
+
+void flow_send_stop(int device) {
+    struct flow_modem *fm = get_flow(device);
+    pthread_mutex_lock(&fm->lock);
+    __atomic_store_n(&fm->send_stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&fm->committed);
+    pthread_mutex_unlock(&fm->lock);
+}
+
 int flow_setup(int device, notify_func_t *notify, const char *da_override) {
+    struct flow_modem *fm = get_flow(device);
+
+    fm->latest_msg_time = 0;
 
-    _latest_msg_time = 0;
+    // Memory is allocated once, flow cycles don't touch the heap in steady state
+    if (fm->pool.blocks == NULL && msg_pool_init(&fm->pool, MSG_POOL_SIZE, MSG_DECODED_SIZE) != 0) {
+        return -1;
+    }
+    if (fm->scratch.base == NULL && arena_init(&fm->scratch, SCRATCH_SIZE) != 0) {
+        return -1;
+    }
+    // Storage is not configured, messages are kept in memory
+    if (fm->outbox.image == NULL && outbox_open(&fm->outbox, NULL) != 0) {
+        return -1;
+    }
 
     // Turn off echo and check modem is alive
     if (ata_echo(device, 0) != 0) {
@@ -392,7 +949,7 @@ int flow_setup(int device, notify_func_t *notify, const char *da_override) {
         return -1;
     }
 
-    if (_opts.verbosity >= LOG_DEBUG) {
+    if (log_enabled(LOG_DEBUG)) {
         ata_power_status(device);
         ata_network_status(device);
         //  ata_op_list(device);
@@ -422,9 +979,10 @@ int flow_setup(int device, notify_func_t *notify, const char *da_override) {
 
     log_warn("Connected to: %s", info);
     notify(info);
+    strncpy(fm->op_info, info, sizeof(fm->op_info) - 1);
 
-    // Load destination address
-    memset(_dest_addr, 0, sizeof(_dest_addr));
+    // Load destination address, send stage reads it under the lock
+    char dest_addr[sizeof(fm->dest_addr)] = {0};
 
     if (da_override == NULL) {
         // Forward number is not provided, read it from SIM card
@@ -440,31 +998,175 @@ int flow_setup(int device, notify_func_t *notify, const char *da_override) {
             // We need the only contact, so no reason to decode.
             if (strcmp(name, DA_CONTACT_NAME) == 0 || strcmp(name, DA_CONTACT_NAME_UCS2) == 0) {
                 const char *s_phone = (*phone == '+') ? phone + 1 : phone;
-                strncpy(_dest_addr, s_phone, sizeof(_dest_addr) - 2);
+                strncpy(dest_addr, s_phone, sizeof(dest_addr) - 2);
                 break;
             }
         }
     }
     else {
         const char *s_phone = (*da_override == '+') ? da_override + 1 : da_override;
-        strncpy(_dest_addr, s_phone, sizeof(_dest_addr) - 2);
+        strncpy(dest_addr, s_phone, sizeof(dest_addr) - 2);
     }
 
-    if (_dest_addr[0] == 0) {
+    pthread_mutex_lock(&fm->lock);
+    strcpy(fm->dest_addr, dest_addr);
+    pthread_cond_signal(&fm->committed);
+    pthread_mutex_unlock(&fm->lock);
+
+    if (fm->dest_addr[0] == 0) {
         // Destination address is not set. Bail out.
         return -1;
     }
 
-    log_warn("Forward set to phone: %s", _dest_addr);
-    notify(_dest_addr);
+    log_warn("Forward set to phone: %s", fm->dest_addr);
+    notify(fm->dest_addr);
+
+    // Ask modem to report new messages, fall back to polling if it's not supported
+    fm->cnmi_mode = _opts.cnmi;
+    if (fm->cnmi_mode != 0 && ata_set_msg_indication(device, fm->cnmi_mode) != 0) {
+        log_err("Modem error, can't set new message indication, polling SIM instead");
+        fm->cnmi_mode = 0;
+    }
+
+    // Phase 2+ service requires AT+CNMA for every message routed to TE
+    int service = 0;
+    fm->cnma_required = (fm->cnmi_mode == 2 && ata_sms_service(device, &service) == 0 && service == 1);
+
+    if (fm->cnmi_mode == 2 && fm->retained_count == 0) {
+        // Routed messages forwarded before restart are retained from now on,
+        // messages still on SIM are deleted from the journal as usual
+        uint64_t fingerprints[ROUTED_RETAINED];
+        int n = journal_fingerprints(&fm->journal, fingerprints, ROUTED_RETAINED);
+        for (int i = 0; i < n; ++i) {
+            fm->retained[i].fingerprint = fingerprints[i];
+            fm->retained[i].time = time(NULL);
+        }
+        fm->retained_head = 0;
+        fm->retained_count = n;
+    }
+    fm->housekeeping = 1;
 
     return 0;
 }
 
-int flow(int device, notify_func_t *notify) {
+/**
+ * @brief Routed message as it's left after processing, the network is answered after flow_commit
+ */
+struct routed_ack {
+    struct sms_message *saved; //! Copy in the saved table, NULL - there was no room to save it
+    int settled;               //! Re-delivery of a message that is retained or journaled
+};
+
+static void accept_routed_message(int device, const struct sms_message *msg, struct routed_ack *ack, notify_func_t *notify) {
+    struct flow_modem *fm = get_flow(device);
+    int idx = find_saved_message(fm, msg);
+    ack->settled = 0;
+
+    if (idx == -1 && is_retained(fm, msg->fingerprint)) {
+        log_noise("Routed message re-delivered: From: %s TS: %s", msg->sender, msg->ts);
+        ack->saved = NULL;
+        ack->settled = 1;
+        return;
+    }
+    if (idx != -1) {
+        log_noise("Routed message re-delivered: From: %s TS: %s", msg->sender, msg->ts);
+    }
+    else {
+        process_new_message(device, 0, msg, notify);
+        idx = find_saved_message(fm, msg);
+    }
+    ack->saved = (idx != -1) ? msg_table_at(&fm->saved, idx) : NULL;
+}
+
+// Network drops the message once it's acknowledged, so only messages that survive restart are acknowledged:
+// forwarded ones are in the outbox and the journal after flow_commit. Messages kept in memory, i.e. parts waiting
+// for reassembly, messages waiting for room in the outbox or not saved at all, are rejected to be re-delivered
+static int routed_settled(const struct routed_ack *ack) {
+    return ack->settled || (ack->saved != NULL && ack->saved->forwarded);
+}
+
+// Messages routed to TE (AT+CNMI=2,2) are decoded right from +CMT,
+// they never reach SIM so there is nothing to read or delete.
+static void flow_routed(int device, notify_func_t *notify) {
+    struct flow_modem *fm = get_flow(device);
+    struct sms_message* msg = arena_new_msg(&fm->scratch, MSG_DECODED_SIZE, NULL /* no template*/);
+    struct routed_ack acks[MAX_MARKS];
+    int n_acks = 0;
+    // The rest of the queue waits for the next cycle
+    while(msg != NULL && n_acks < MAX_MARKS) {
+        int res = ata_read_routed_message(device, msg);
+        if (res == 0) { // Queue is empty
+            break;
+        }
+
+        if (res == -1) {
+            // Acknowledge broken message right away, otherwise network re-delivers it again and again
+            if (fm->cnma_required && ata_ack_message(device) != 0) {
+                log_err("Can't acknowledge routed message");
+            }
+            continue;
+        }
+
+        log_debug("Routed message (%x): From: %s TS: %s {%s}", msg->hash_id, msg->sender, msg->ts, msg->text);
+        accept_routed_message(device, msg, &acks[n_acks++], notify);
+    }
+
+    // Journal accepted messages before they are dropped
+    flow_commit(fm);
+
+    for (int i = 0; i < n_acks && fm->cnma_required; ++i) {
+        if (routed_settled(&acks[i])) {
+            if (ata_ack_message(device) != 0) {
+                log_err("Can't acknowledge routed message");
+            }
+        }
+        else if (ata_reject_message(device) != 0) {
+            log_err("Can't reject routed message");
+        }
+    }
+
+    // Drop forwarded messages and retry the rest
+    for (int j = 0; j < fm->saved.capacity; ++j) {
+        struct sms_message *c_msg = msg_table_at(&fm->saved, j);
+        if (c_msg == NULL) {
+            continue;
+        }
+        if (c_msg->forwarded == 1) {
+            retain_routed_message(fm, j);
+            continue;
+        }
+        if (message_expired(device, c_msg)) {
+            remove_saved_message(fm, j);
+            continue;
+        }
+        if (reasm_is_part(c_msg)) {
+            process_part(device, c_msg, notify);
+        }
+        else if (forward_message(device, c_msg, notify) == 0) {
+            mark_forwarded(fm, c_msg);
+            retain_routed_message(fm, j);
+        }
+    }
+
+    expire_retained(fm);
+    flow_reassembly(device, notify);
+}
+
+static int flow_cycle(int device, notify_func_t *notify) {
+    struct flow_modem *fm = get_flow(device);
     int n_msgs = 0;
+    fm->cycle_actions = 0;
+
+    if (fm->cnmi_mode == 2) {
+        flow_routed(device, notify);
+        if (!fm->housekeeping) {
+            return 0;
+        }
+    }
+    fm->housekeeping = 0;
 
     if (ata_msg_count(device, &n_msgs) == 0) {
+        fm->sim_messages = n_msgs;
         if (n_msgs > 0) {
            notify("Messages: %-4d", n_msgs);
         }
@@ -476,6 +1178,7 @@ int flow(int device, notify_func_t *notify) {
             return -1;
         }
         log_noise("Connected to: %s messages %d", info, n_msgs);
+        strncpy(fm->op_info, info, sizeof(fm->op_info) - 1);
 
         // Using soft expire instead
         //
@@ -483,72 +1186,49 @@ int flow(int device, notify_func_t *notify) {
         //  _today = gsm2time(info);
         //  log_noise("Read GSM time as {%s} (%ld)", info, (long) _today);
 
-        for (int i = 1; i < n_msgs+1; ++i) {
-            // Read messages one by one
-            struct sms_message* msg = new_msg(MSG_TEXT_LIMIT + 1, NULL /* no template*/);
+        // Read messages one by one into the same buffer, new messages are copied to the pool
+        struct sms_message* msg = arena_new_msg(&fm->scratch, MSG_DECODED_SIZE, NULL /* no template*/);
+        if (msg == NULL) {
+            return -1;
+        }
 
+        for (int i = 1; i < n_msgs+1; ++i) {
             if (ata_read_message(device, i, msg) != 0) {
                 // Ignore message reading error
                 log_err("Message #%d reading error", i); // Report error, delete bad message
-                free(msg);
                 continue;
             }
 
             log_debug("Found message #%d (%x): From: %s TS: %s {%s}", i, msg->hash_id, msg->sender, msg->ts, msg->text);
 
-            int idx = find_saved_message(msg);
+            int idx = find_saved_message(fm, msg);
 
             // 1. Message was not seen before
             if (idx == -1) {
-                log_noise("Received new message #%d (%d/%d): From: {%s} TS: {%s} {%s}", i, msg->split_no, msg->split_parts, msg->sender, msg->ts, msg->text);
-
-                // Ignore leading "+""
-                char *s_sender = (*msg->sender == '+') ? msg->sender + 1 : msg->sender;
-
-                if (strcmp(s_sender, _dest_addr) == 0) {
-                    // Message come from DA_CONTACT_NAME, it could be a command message.
-                    // Command message can affect SMS list, so re-read after processing command.
-                    if (process_command_message(device, msg->text) == 1) {
-                        // It was recognised command message, don't forward
-                        // Command message may alter message sequence, so can't delete it immediately
-                        msg->forwarded = 1;
-                    }
-                }
-
-                // Non-processed messages from DA will be forwarded as usual
-                // Multipart messages are not forwarded but saved for further processing
-                if (msg->forwarded == 0 && msg->split_no == 0) {
-                    if (forward_message(device, msg, notify) == 0) {
-                        msg->forwarded = 1;
-                    }
-                }
-
-                if (msg->forwarded == 0 && msg->split_no != 0) {
-                    log_noise("Saving multipart message #%d: (%x %d/%d) From: %s TS: %s {%s}", i, msg->split_ref, msg->split_no, msg->split_parts, msg->sender, msg->ts, msg->text);
-                }
-
-                add_saved_message(msg);
+                process_new_message(device, i, msg, notify);
                 continue;
             }
 
             // 2. Message was seen before
             if (idx != -1) {
-                struct sms_message *c_msg = _saved_msgs[idx]; // shortcut
+                struct sms_message *c_msg = msg_table_at(&fm->saved, idx); // shortcut
 
                 // 2.0 Message expired
                 if (message_expired(device, c_msg)) {
                     log_noise("Deleting expired message #%d: From: %s TS: %s {%s}", i, c_msg->sender, c_msg->ts, c_msg->text);
                     if (delete_message(device, i, notify) == 0) {
                         // Remove message from seen list only if it's successfully deleted
-                        remove_saved_message(idx);
+                        remove_saved_message(fm, idx);
                     }
                     continue;
                 }
 
                 // 2.1 Message was not forwarded and is not a part of multipart message
-                if (c_msg->forwarded == 0 && c_msg->split_no == 0) {
+                if (c_msg->forwarded == 0 && !reasm_is_part(c_msg)) {
+                    // The message is in the lifecycle since it was seen first
+                    memcpy(msg->trace, c_msg->trace, sizeof(msg->trace));
                     if (forward_message(device, msg, notify) == 0) {
-                        c_msg->forwarded = 1;
+                        mark_forwarded(fm, c_msg);
                     }
                     continue;
                 }
@@ -557,21 +1237,128 @@ int flow(int device, notify_func_t *notify) {
                 if (c_msg->forwarded == 1) {
                     log_noise("Deleting forwarded message #%d: From: %s TS: %s {%s}", i, c_msg->sender, c_msg->ts, c_msg->text);
                     if (delete_message(device, i, notify) == 0) {
+                        trace_mark(c_msg, TRACE_DELETED);
+                        pthread_mutex_lock(&fm->lock);
+                        trace_deleted(&fm->trace, c_msg);
+                        pthread_mutex_unlock(&fm->lock);
                         // Remove message from seen list only if it's successfully deleted
-                        remove_saved_message(idx);
+                        remove_saved_message(fm, idx);
                     }
                     continue;
                 }
 
-                // 2.3 Message is the last part of multipart messages
-                // All previous parts shall be already cached, forwarded messages are already handled
-                if (c_msg->split_no > 0 && c_msg->split_no == c_msg->split_parts) {
-                    log_noise("Found last part of multipart message #%d: (%x %d/%d) From: %s TS: %s {%s}", i, c_msg->split_ref, c_msg->split_no, c_msg->split_parts, c_msg->sender, c_msg->ts, c_msg->text);
-                    process_multipart_message (device, c_msg, notify);
-                }
+                // 2.3 Message is a part of multipart message, waiting for other parts or retry
+                process_part(device, c_msg, notify);
             }
         } // End For
     }
 
+    flow_reassembly(device, notify);
+    return 0;
+}
+
+int flow(int device, notify_func_t *notify) {
+    struct flow_modem *fm = get_flow(device);
+    int res = flow_cycle(device, notify);
+    flow_commit(fm);
+    if (fm->send_device == -1) {
+        flow_send(device, notify);
+    }
+    fm->cycles += 1;
+    publish_read(fm);
+    // Everything allocated from scratch during the cycle is released at once
+    arena_reset(&fm->scratch);
+    journal_maintain(&fm->journal);
+    return res;
+}
+
+int flow_wait(int device, notify_func_t *notify) {
+    struct flow_modem *fm = get_flow(device);
+    // Polling mode or previous cycle made progress, e.g. forwarded message waits for deletion
+    if (fm->cnmi_mode == 0 || fm->cycle_actions > 0) {
+        return 0;
+    }
+
+    // Wake up in time to retry messages from outbox, unless they are sent through separate port
+    int timeout = EVENT_TIMEOUT;
+    int64_t next_ms = -1;
+    if (fm->send_device == -1) {
+        pthread_mutex_lock(&fm->lock);
+        next_ms = outbox_next_ms(&fm->outbox);
+        pthread_mutex_unlock(&fm->lock);
+    }
+    if (next_ms != -1) {
+        int64_t now = monotonic_ms();
+        if (next_ms <= now) {
+            return 0;
+        }
+        timeout = MIN(timeout, next_ms - now);
+    }
+
+    int res = ata_wait_event(device, timeout);
+    if (res == -1) {
+        log_err("Modem error while waiting for new messages");
+        return -1;
+    }
+
+    log_debug((res == 1) ? "New message reported" : "No new messages reported, housekeeping");
+    fm->housekeeping = (res == 0);
     return 0;
 }
+
+#ifdef _PDU_TEST
+#define STATUS ((ok) ? "+OK " : "!ERR")
+#define TEST_DEVICE -100 // Flow state only, the modem is never touched
+
+static struct sms_message *test_message(struct flow_modem *fm, int hash_id, int split_no, int split_parts) {
+    struct sms_message *msg = arena_new_msg(&fm->scratch, MSG_DECODED_SIZE, NULL);
+    strcpy(msg->sender, "+79219800469");
+    strcpy(msg->ts, "2025-03-03T20:31:32Z+3");
+    snprintf(msg->text, msg->text_size, "Routed message %d", hash_id);
+    msg->hash_id = hash_id;
+    msg->split_ref = (split_parts > 1) ? 0x42 : 0;
+    msg->split_no = split_no;
+    msg->split_parts = split_parts;
+    msg->forwarded = 0;
+    msg->fingerprint = msg_fingerprint(msg);
+    return msg;
+}
+
+int test_flow() {
+    printf("\n Testing routed messages:\n");
+
+    struct flow_modem *fm = get_flow(TEST_DEVICE);
+    struct routed_ack acks[5];
+    int errors = 0;
+    int ok;
+
+    // Room for three messages only
+    ok = msg_pool_init(&fm->pool, 3, MSG_DECODED_SIZE) == 0 &&
+         arena_init(&fm->scratch, SCRATCH_SIZE) == 0 && outbox_open(&fm->outbox, NULL) == 0;
+
+    accept_routed_message(TEST_DEVICE, test_message(fm, 1, 0, 0), &acks[0], NULL);
+    accept_routed_message(TEST_DEVICE, test_message(fm, 2, 1, 2), &acks[1], NULL);
+    flow_commit(fm);
+    ok = ok && routed_settled(&acks[0]) && acks[1].saved != NULL && !routed_settled(&acks[1]);
+    printf("%s Forwarded message is acknowledged, part waiting for reassembly is not\n", STATUS);
+    errors += !ok;
+
+    struct sms_message *filler = test_message(fm, 0, 0, 0);
+    while (outbox_put(&fm->outbox, filler, 0) == 0) {
+    }
+    accept_routed_message(TEST_DEVICE, test_message(fm, 3, 0, 0), &acks[2], NULL);
+    accept_routed_message(TEST_DEVICE, test_message(fm, 4, 0, 0), &acks[3], NULL);
+    flow_commit(fm);
+    ok = acks[2].saved != NULL && !routed_settled(&acks[2]) && acks[3].saved == NULL && !routed_settled(&acks[3]);
+    printf("%s Message kept in memory on full outbox or not saved on exhausted pool is not acknowledged\n", STATUS);
+    errors += !ok;
+
+    accept_routed_message(TEST_DEVICE, test_message(fm, 1, 0, 0), &acks[4], NULL);
+    ok = routed_settled(&acks[4]) && fm->saved.count == 3;
+    printf("%s Re-delivered forwarded message is acknowledged\n", STATUS);
+    errors += !ok;
+
+    printf("Total results: %d errors\n\n", errors);
+    return errors;
+}
+#endif
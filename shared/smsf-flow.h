@@ -28,6 +28,55 @@ typedef void (notify_func_t)(char *format, ... );
  */
 int process_command_message(int device, const char *text);
 
+/**
+ * @brief Open persistent state: journal of forwarded messages, so restart doesn't forward them again,
+ *        and outbox of messages to send, so accepted messages survive power loss.
+ *        Must be called before flow_setup, without it the state is kept in memory only.
+ *
+ * @param device
+ * @param prefix - file name prefix (Linux) or NVS key prefix (ESP32), .journal and .outbox are appended
+ * @return int - 0 - success, -1 - storage can't be opened, flow works without it
+ */
+int flow_storage(int device, const char *prefix);
+
+/**
+ * @brief Publish counters of the modem to the metrics region opened by metrics_open,
+ *        read stage updates them once per flow cycle, send stage after every send
+ *
+ * @param device - read port
+ * @param port - read port name
+ * @param send_port - separate send port name or NULL
+ */
+void flow_metrics(int device, const char *port, const char *send_port);
+
+/**
+ * @brief Send messages through a separate modem port, so reading SIM doesn't wait for slow sends.
+ *        Must be called before flow_setup, after it flow() only queues messages and
+ *        flow_send_loop has to be run by a separate thread.
+ *
+ * @param device - read port
+ * @param send_device - port to send messages, e.g. the second AT port of the same modem
+ * @return int - 0 - success, -1 - error
+ */
+int flow_send_port(int device, int send_device);
+
+/**
+ * @brief Send stage, sends messages from the outbox through the send port as they are committed
+ *        by the read stage. The outbox is bounded, when it's full messages stay on SIM.
+ *
+ * @param device - read port
+ * @param notify - display notification callback
+ * @return int - -1 - send port setup error, 0 - stopped by flow_send_stop
+ */
+int flow_send_loop(int device, notify_func_t *notify);
+
+/**
+ * @brief Make flow_send_loop return after the message it's sending now, if any
+ *
+ * @param device - read port
+ */
+void flow_send_stop(int device);
+
 /**
  * @brief Pre-requsites for main flow loop
  *
@@ -48,4 +97,18 @@ int flow_setup(int device, notify_func_t *notify_func, const char *da_override);
 
 int flow(int device, notify_func_t *notify_func);
 
+/**
+ * @brief Sleep between flow cycles until the modem reports a new message,
+ *        return immediately if the previous cycle still has work to do
+ *
+ * @param device
+ * @param notify_func
+ * @return int - 0 - time to run the next cycle, -1 - modem error
+ */
+int flow_wait(int device, notify_func_t *notify_func);
+
+#ifdef _PDU_TEST
+ int test_flow();
+#endif
+
 #endif
@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "smsf-gsm.h"
+
+// https://en.wikipedia.org/wiki/GSM_03.38
+
+// Unicode code point of every septet of the default alphabet, escape is shown as no-break space
+static const uint16_t _gsm_default[128] = {
+    0x0040, 0x00A3, 0x0024, 0x00A5, 0x00E8, 0x00E9, 0x00F9, 0x00EC,
+    0x00F2, 0x00C7, 0x000A, 0x00D8, 0x00F8, 0x000D, 0x00C5, 0x00E5,
+    0x0394, 0x005F, 0x03A6, 0x0393, 0x039B, 0x03A9, 0x03A0, 0x03A8,
+    0x03A3, 0x0398, 0x039E, 0x00A0, 0x00C6, 0x00E6, 0x00DF, 0x00C9,
+    0x0020, 0x0021, 0x0022, 0x0023, 0x00A4, 0x0025, 0x0026, 0x0027,
+    0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+    0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+    0x00A1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+    0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+    0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+    0x0058, 0x0059, 0x005A, 0x00C4, 0x00D6, 0x00D1, 0x00DC, 0x00A7,
+    0x00BF, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+    0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+    0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+    0x0078, 0x0079, 0x007A, 0x00E4, 0x00F6, 0x00F1, 0x00FC, 0x00E0,
+};
+
+// Extension table, septet after escape and its code point
+static const struct { uint8_t septet; uint16_t code; } _gsm_extension[] = {
+    { 0x0A, 0x000C },
+    { 0x14, 0x005E },
+    { 0x28, 0x007B },
+    { 0x29, 0x007D },
+    { 0x2F, 0x005C },
+    { 0x3C, 0x005B },
+    { 0x3D, 0x007E },
+    { 0x3E, 0x005D },
+    { 0x40, 0x007C },
+    { 0x65, 0x20AC },
+};
+
+#define GSM_EXTENSION_SIZE ((int) (sizeof(_gsm_extension) / sizeof(_gsm_extension[0])))
+
+// Septet of every ASCII character, GSM_EXTENDED bit means escape is needed, 0xFF - no such character
+#define GSM_EXTENDED 0x80
+#define GSM_NONE 0xFF
+
+static const uint8_t _gsm_ascii[128] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x0A, 0xFF, 0x8A, 0x0D, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0x20, 0x21, 0x22, 0x23, 0x02, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
+    0x00, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
+    0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0xBC, 0xAF, 0xBE, 0x94, 0x11,
+    0xFF, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x6B, 0x6C, 0x6D, 0x6E, 0x6F,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0xA8, 0xC0, 0xA9, 0xBD, 0xFF,
+};
+
+// Septet of non-ASCII characters, sorted by code point for binary search
+static const struct { uint16_t code; uint8_t septet; } _gsm_unicode[] = {
+    { 0x00A1, 0x40 },
+    { 0x00A3, 0x01 },
+    { 0x00A4, 0x24 },
+    { 0x00A5, 0x03 },
+    { 0x00A7, 0x5F },
+    { 0x00BF, 0x60 },
+    { 0x00C4, 0x5B },
+    { 0x00C5, 0x0E },
+    { 0x00C6, 0x1C },
+    { 0x00C7, 0x09 },
+    { 0x00C9, 0x1F },
+    { 0x00D1, 0x5D },
+    { 0x00D6, 0x5C },
+    { 0x00D8, 0x0B },
+    { 0x00DC, 0x5E },
+    { 0x00DF, 0x1E },
+    { 0x00E0, 0x7F },
+    { 0x00E4, 0x7B },
+    { 0x00E5, 0x0F },
+    { 0x00E6, 0x1D },
+    { 0x00E8, 0x04 },
+    { 0x00E9, 0x05 },
+    { 0x00EC, 0x07 },
+    { 0x00F1, 0x7D },
+    { 0x00F2, 0x08 },
+    { 0x00F6, 0x7C },
+    { 0x00F8, 0x0C },
+    { 0x00F9, 0x06 },
+    { 0x00FC, 0x7E },
+    { 0x0393, 0x13 },
+    { 0x0394, 0x10 },
+    { 0x0398, 0x19 },
+    { 0x039B, 0x14 },
+    { 0x039E, 0x1A },
+    { 0x03A0, 0x16 },
+    { 0x03A3, 0x18 },
+    { 0x03A6, 0x12 },
+    { 0x03A8, 0x17 },
+    { 0x03A9, 0x15 },
+    { 0x20AC, 0xE5 },
+};
+
+#define GSM_UNICODE_SIZE ((int) (sizeof(_gsm_unicode) / sizeof(_gsm_unicode[0])))
+
+static int unicode_to_gsm(uint32_t code) {
+    if (code < 0x80) {
+        return _gsm_ascii[code];
+    }
+    int lo = 0, hi = GSM_UNICODE_SIZE - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (_gsm_unicode[mid].code == code) {
+            return _gsm_unicode[mid].septet;
+        }
+        if (_gsm_unicode[mid].code < code) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return GSM_NONE;
+}
+
+// Latin transliteration of Cyrillic letters, index is code point - 0x400, NULL - no transliteration.
+// Russian letters follow the passport system, hard and soft signs are dropped
+static const char *const _translit[0x60] = {
+    NULL, "Yo", NULL, NULL, "Ye", NULL, "I", "Yi",
+    NULL, NULL, NULL, NULL, NULL, NULL, "U", NULL,
+    "A", "B", "V", "G", "D", "E", "Zh", "Z",
+    "I", "Y", "K", "L", "M", "N", "O", "P",
+    "R", "S", "T", "U", "F", "Kh", "Ts", "Ch",
+    "Sh", "Shch", "", "Y", "", "E", "Yu", "Ya",
+    "a", "b", "v", "g", "d", "e", "zh", "z",
+    "i", "y", "k", "l", "m", "n", "o", "p",
+    "r", "s", "t", "u", "f", "kh", "ts", "ch",
+    "sh", "shch", "", "y", "", "e", "yu", "ya",
+    NULL, "yo", NULL, NULL, "ye", NULL, "i", "yi",
+    NULL, NULL, NULL, NULL, NULL, NULL, "u", NULL,
+};
+
+static const char *translit_of(uint32_t code) {
+    return (code >= 0x400 && code < 0x400 + 0x60) ? _translit[code - 0x400] : NULL;
+}
+
+// Read one UTF-8 character, return its length or -1 for invalid sequence
+static int utf8_get(const unsigned char *s, int len, uint32_t *code) {
+    int n = (s[0] < 0x80) ? 1 : ((s[0] & 0xE0) == 0xC0) ? 2 : ((s[0] & 0xF0) == 0xE0) ? 3 : ((s[0] & 0xF8) == 0xF0) ? 4 : -1;
+    if (n == -1 || n > len) {
+        return -1;
+    }
+    uint32_t c = (n == 1) ? s[0] : s[0] & (0x7F >> n);
+    for (int i = 1; i < n; ++i) {
+        if ((s[i] & 0xC0) != 0x80) {
+            return -1;
+        }
+        c = (c << 6) | (s[i] & 0x3F);
+    }
+    *code = c;
+    return n;
+}
+
+static int utf8_put(uint32_t code, char *out) {
+    if (code < 0x80) {
+        out[0] = code;
+        return 1;
+    }
+    if (code < 0x800) {
+        out[0] = 0xC0 | (code >> 6);
+        out[1] = 0x80 | (code & 0x3F);
+        return 2;
+    }
+    out[0] = 0xE0 | (code >> 12);
+    out[1] = 0x80 | ((code >> 6) & 0x3F);
+    out[2] = 0x80 | (code & 0x3F);
+    return 3;
+}
+
+int gsm_encode(const char *text, int text_len, char *septets) {
+    const unsigned char *s = (const unsigned char *) text;
+    int i = 0, n = 0;
+
+    while (i < text_len) {
+        int septet;
+        if (s[i] < 0x80) { // Fast path, most of the text
+            septet = _gsm_ascii[s[i]];
+            i += 1;
+        }
+        else {
+            uint32_t code;
+            int len = utf8_get(s + i, text_len - i, &code);
+            if (len == -1) {
+                return -1;
+            }
+            septet = unicode_to_gsm(code);
+            i += len;
+        }
+
+        if (septet == GSM_NONE) {
+            return -1;
+        }
+        if (septet & GSM_EXTENDED) {
+            if (septets != NULL) {
+                septets[n] = GSM_ESCAPE;
+            }
+            n += 1;
+            septet &= ~GSM_EXTENDED;
+        }
+        if (septets != NULL) {
+            septets[n] = septet;
+        }
+        n += 1;
+    }
+    return n;
+}
+
+// Septets of the part, the text is split when it doesn't fit to a single message
+#define GSM_SINGLE 160
+#define GSM_PART 153
+
+// Add character of width septets to the part, start the next one if it doesn't fit
+static void count_septets(int width, int *total, int *parts, int *part) {
+    *total += width;
+    if (*part + width > GSM_PART) {
+        *parts += 1;
+        *part = width;
+    }
+    else {
+        *part += width;
+    }
+}
+
+int gsm_parts(const char *text, int text_len, int translit) {
+    const unsigned char *s = (const unsigned char *) text;
+    int total = 0, parts = 1, part = 0;
+    int i = 0;
+
+    while (i < text_len) {
+        uint32_t code;
+        int len = utf8_get(s + i, text_len - i, &code);
+        if (len == -1) {
+            return 0;
+        }
+        i += len;
+
+        const char *latin = (translit) ? translit_of(code) : NULL;
+        if (latin != NULL) {
+            for (; *latin != 0; ++latin) {
+                count_septets((_gsm_ascii[(int) *latin] & GSM_EXTENDED) ? 2 : 1, &total, &parts, &part);
+            }
+            continue;
+        }
+
+        int septet = unicode_to_gsm(code);
+        if (septet == GSM_NONE) {
+            return 0;
+        }
+        count_septets((septet & GSM_EXTENDED) ? 2 : 1, &total, &parts, &part);
+    }
+    return (total <= GSM_SINGLE) ? 1 : parts;
+}
+
+int gsm_translit(const char *text, int text_len, char *out) {
+    const unsigned char *s = (const unsigned char *) text;
+    int i = 0, j = 0;
+
+    while (i < text_len) {
+        uint32_t code;
+        int len = utf8_get(s + i, text_len - i, &code);
+        const char *latin = (len != -1) ? translit_of(code) : NULL;
+        if (latin == NULL) {
+            // Everything else is copied as is, invalid byte as well
+            len = (len == -1) ? 1 : len;
+            memcpy(out + j, text + i, len);
+            j += len;
+        }
+        else {
+            int latin_len = strlen(latin);
+            memcpy(out + j, latin, latin_len);
+            j += latin_len;
+        }
+        i += len;
+    }
+    out[j] = 0;
+    return j;
+}
+
+int gsm_decode(const char *septets, int count, char *text, int text_size) {
+    int j = 0;
+
+    for (int i = 0; i < count; ++i) {
+        uint32_t code = _gsm_default[septets[i] & 0x7F];
+        if (septets[i] == GSM_ESCAPE && i + 1 < count) {
+            // Unknown extension is shown as the default alphabet character
+            int ext = septets[++i] & 0x7F;
+            code = _gsm_default[ext];
+            for (int k = 0; k < GSM_EXTENSION_SIZE; ++k) {
+                if (_gsm_extension[k].septet == ext) {
+                    code = _gsm_extension[k].code;
+                    break;
+                }
+            }
+        }
+
+        char utf8[3];
+        int len = utf8_put(code, utf8);
+        if (j + len >= text_size) {
+            break; // Character doesn't fit, don't cut it in the middle
+        }
+        memcpy(text + j, utf8, len);
+        j += len;
+    }
+    text[j] = 0;
+    return j;
+}
+
+int gsm_length(const char *septets, int count, int limit) {
+    if (count <= limit) {
+        return count;
+    }
+    // Escape is always followed by extension septet, don't leave it at the end
+    return (septets[limit - 1] == GSM_ESCAPE) ? limit - 1 : limit;
+}
+
+#ifdef _PDU_TEST
+
+#define STATUS ((ok) ? "+OK " : "!ERR")
+
+int test_gsm() {
+    printf("\n Testing GSM 03.38 alphabet:\n");
+
+    int errors = 0;
+    int ok;
+    char septets[256];
+    char text[512];
+
+    // Every septet of the default alphabet and every extension round trip through UTF-8
+    int n = 0;
+    for (int i = 0; i < 128; ++i) {
+        if (i != GSM_ESCAPE) {
+            septets[n++] = i;
+        }
+    }
+    for (int k = 0; k < GSM_EXTENSION_SIZE; ++k) {
+        septets[n++] = GSM_ESCAPE;
+        septets[n++] = _gsm_extension[k].septet;
+    }
+    int len = gsm_decode(septets, n, text, sizeof(text));
+    char back[256];
+    ok = gsm_encode(text, len, back) == n && memcmp(back, septets, n) == 0 && gsm_encode(text, len, NULL) == n;
+    printf("%s Round trip of %d septets, %d bytes of UTF-8\n", STATUS, n, len);
+    errors += !ok;
+
+    struct {
+        const char *text;
+        int septets; // -1 - UCS2 is required
+    } cases[] = {
+        { "Test IoT", 8 },
+        { "user@example.com $5 a_b", 23 },
+        { "{x} [y] ~ \\ | ^", 23 },
+        { "\xE2\x82\xAC 10", 5 },            // Euro sign is in the extension table
+        { "\xC3\xA9t\xC3\xA9 \xC3\x9C \xCE\xA9", 7 },  // e-acute, U-umlaut and Omega are in the default one
+        { "`quoted`", -1 },
+        { "tab\t", -1 },
+        { "\xD0\x9F\xD1\x80\xD0\xB8", -1 },  // Cyrillic
+        { "\xC3", -1 },                    // Truncated UTF-8
+    };
+    ok = 1;
+    for (int i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); ++i) {
+        int res = gsm_encode(cases[i].text, strlen(cases[i].text), septets);
+        if (res != cases[i].septets) {
+            printf("!ERR Septets of {%s} %d vs %d\n", cases[i].text, cases[i].septets, res);
+            ok = 0;
+            continue;
+        }
+        if (res > 0) {
+            gsm_decode(septets, res, text, sizeof(text));
+            if (strcmp(text, cases[i].text) != 0) {
+                printf("!ERR Decoded {%s} vs {%s}\n", cases[i].text, text);
+                ok = 0;
+            }
+        }
+    }
+    printf("%s Septet count and UCS2 detection\n", STATUS);
+    errors += !ok;
+
+    // Character that doesn't fit isn't cut, escape isn't left at the end of a part
+    gsm_encode("ab\xE2\x82\xAC", 5, septets);
+    ok = gsm_decode(septets, 4, text, 5) == 2 && strcmp(text, "ab") == 0;
+    ok = ok && gsm_length(septets, 4, 3) == 2 && gsm_length(septets, 4, 4) == 4 && gsm_length(septets, 4, 2) == 2;
+    printf("%s Truncation\n", STATUS);
+    errors += !ok;
+
+    // Parts are counted the same way as the text is split, escape isn't split between parts
+    char long_text[400];
+    memset(long_text, 'a', sizeof(long_text));
+    ok = gsm_parts(long_text, 160, 0) == 1 && gsm_parts(long_text, 161, 0) == 2 && gsm_parts(long_text, 306, 0) == 2 && gsm_parts(long_text, 307, 0) == 3;
+    memcpy(long_text + 152, "{", 1);
+    ok = ok && gsm_parts(long_text, 306, 0) == 3 && gsm_parts(long_text, 0, 0) == 1;
+    ok = ok && gsm_parts("\xD0\xAF", 2, 0) == 0 && gsm_parts("\xD0\xAF", 2, 1) == 1 && gsm_parts("\xF0\x9F\x98\x80", 4, 1) == 0;
+    printf("%s Number of parts\n", STATUS);
+    errors += !ok;
+
+    const char *cyrillic = "\xD0\xA9\xD1\x83\xD0\xBA\xD0\xB0 \xD0\x81\xD0\xB6, \xD0\xBF\xD0\xBE\xD0\xB4\xD1\x8A\xD0\xB5\xD0\xB7\xD0\xB4 \xE2\x82\xAC";
+    len = gsm_translit(cyrillic, strlen(cyrillic), text);
+    ok = strcmp(text, "Shchuka Yozh, podezd \xE2\x82\xAC") == 0 && len == (int) strlen(text);
+    printf("%s Transliteration {{%s}}\n", STATUS, text);
+    errors += !ok;
+
+    printf("Total results: %d errors\n\n", errors);
+    return errors;
+}
+
+#endif
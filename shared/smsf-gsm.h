@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SMSF_GSM_H
+#define _SMSF_GSM_H
+
+#define GSM_ESCAPE 0x1B
+
+/**
+ * @brief Convert UTF-8 text to septets of GSM 03.38 default alphabet,
+ *        characters of the extension table take two septets, escape and the character
+ *
+ * @param text - UTF-8 text
+ * @param text_len - text length in bytes
+ * @param septets - output, 2 * text_len is always enough, NULL to count septets only
+ * @return int - number of septets, -1 - text has a character GSM alphabet doesn't have, UCS2 is required
+ */
+int gsm_encode(const char *text, int text_len, char *septets);
+
+/**
+ * @brief Convert septets of GSM 03.38 default alphabet to UTF-8, output is null-terminated.
+ *        Character that doesn't fit to the output is not written
+ *
+ * @param septets - septets, escape is followed by extension table character
+ * @param count - number of septets
+ * @param text - output
+ * @param text_size - output size, including trailing zero
+ * @return int - number of bytes written
+ */
+int gsm_decode(const char *septets, int count, char *text, int text_size);
+
+/**
+ * @brief Number of septets that fit to limit without splitting escape sequence
+ *
+ * @return int - count if it's within limit, otherwise limit or limit - 1
+ */
+int gsm_length(const char *septets, int count, int limit);
+
+/**
+ * @brief Number of messages the text takes in GSM 7-bit encoding, 160 septets or 153 per part of multipart message
+ *
+ * @param text - UTF-8 text
+ * @param text_len - text length in bytes
+ * @param translit - count Cyrillic letters as their Latin transliteration, see gsm_translit
+ * @return int - number of parts, 0 - text has a character GSM alphabet doesn't have
+ */
+int gsm_parts(const char *text, int text_len, int translit);
+
+/**
+ * @brief Replace Cyrillic letters with Latin ones, e.g. "Щука" with "Shchuka", the rest of the text is copied
+ *
+ * @param text - UTF-8 text
+ * @param text_len - text length in bytes
+ * @param out - null-terminated output, 2 * text_len + 1 is always enough
+ * @return int - output length
+ */
+int gsm_translit(const char *text, int text_len, char *out);
+
+#ifdef _PDU_TEST
+ int test_gsm();
+#endif
+
+#endif
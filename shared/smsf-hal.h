@@ -46,18 +46,54 @@ void com_close(int fd);
 int com_write(int fd, const char *data, int data_size, int *bytes_written);
 
 /**
- * @brief read data from com port
+ * @brief read data from com port, return as soon as some data is available
+ *        i.e. don't wait for the buffer to be filled up
  *
  * @param fd  - descriptor to read
  * @param data - data buffer to read to
  * @param data_size - size of data buffer
- * @param timeout - time to block readin
- * @param bytes_written - bytes actually written
- * @return int - 0 - success, -1 - errors
+ * @param timeout - time to wait for the first byte, milliseconds
+ * @param bytes_read - bytes actually read, 0 if timeout expired
+ * @return int - 0 - success or timeout, -1 - errors
  */
 
 int com_read(int fd, char *data, int data_size, int timeout, int *bytes_read);
 
+/**
+ * @brief number of system (driver) calls made by com_write/com_read, all ports together
+ *
+ * @return long - calls made so far, 0 if the platform doesn't count them
+ */
+long com_syscalls();
+
+/**
+ * @brief open persistent storage as a byte image of fixed size, it's created zero-filled if it doesn't exist.
+ *        Linux maps a file, ESP32 loads a blob from NVS.
+ *
+ * @param name - file name (Linux) or NVS key (ESP32)
+ * @param size - image size
+ * @param image - output image, changes are persisted by store_sync
+ * @param handle - output storage handle
+ * @return int - 0 - success, -1 - errors
+ */
+int store_open(const char *name, int size, char **image, int *handle);
+
+/**
+ * @brief make changed range of the image durable, the range is a hint and a platform may write more
+ *
+ * @param handle - storage handle
+ * @param image - image returned by store_open
+ * @param offs - offset of changed range
+ * @param len - length of changed range
+ * @return int - 0 - success, -1 - errors
+ */
+int store_sync(int handle, char *image, int offs, int len);
+
+/**
+ * @brief release the image, no sync is performed
+ */
+void store_close(int handle, char *image, int size);
+
 /**
  * @brief Insert full fence
  *
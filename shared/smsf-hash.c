@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "smsf-logging.h"
+#include "smsf-util.h"
+#include "smsf-pdu.h"
+#include "smsf-hash.h"
+
+#define INITIAL_CAPACITY 32
+#define MSG_TOMBSTONE ((struct sms_message *) 1)
+
+// Fold high bits in, capacity is a power of two so only low bits select the slot
+static int home_slot(uint64_t fingerprint, int capacity) {
+    return (int) ((fingerprint ^ (fingerprint >> 32)) & (capacity - 1));
+}
+
+static int is_live(const struct msg_entry *e) {
+    return e->msg != NULL && e->msg != MSG_TOMBSTONE;
+}
+
+// Fingerprint match is checked first, full compare protects from 64-bit collisions
+static int same_message(const struct sms_message *a, const struct sms_message *b) {
+    return a->hash_id == b->hash_id &&
+           a->split_ref == b->split_ref &&
+           a->split_no == b->split_no &&
+           a->split_parts == b->split_parts &&
+           strcmp(a->ts, b->ts) == 0 &&
+           strcmp(a->sender, b->sender) == 0;
+}
+
+void msg_table_init(struct msg_table *table) {
+    table->entries = NULL;
+    table->capacity = 0;
+    table->count = 0;
+    table->tombstones = 0;
+}
+
+void msg_table_free(struct msg_table *table) {
+    free(table->entries);
+    msg_table_init(table);
+}
+
+// Re-insert live entries into a new array, tombstones are dropped
+static int rehash(struct msg_table *table, int new_capacity) {
+    struct msg_entry *entries = calloc(new_capacity, sizeof(struct msg_entry));
+    if (entries == NULL) {
+        log_err("Can't allocate %d entries for message table", new_capacity);
+        return -1;
+    }
+
+    for (int i = 0; i < table->capacity; ++i) {
+        struct msg_entry *e = &table->entries[i];
+        if (!is_live(e)) {
+            continue;
+        }
+        int idx = home_slot(e->fingerprint, new_capacity);
+        while (entries[idx].msg != NULL) {
+            idx = (idx + 1) & (new_capacity - 1);
+        }
+        entries[idx] = *e;
+    }
+
+    if (table->capacity > 0) {
+        log_debug("Message table resized %d -> %d, %d messages %d tombstones",
+                  table->capacity, new_capacity, table->count, table->tombstones);
+    }
+
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = new_capacity;
+    table->tombstones = 0;
+    return 0;
+}
+
+int msg_table_find(const struct msg_table *table, const struct sms_message *msg) {
+    if (table->capacity == 0) {
+        return -1;
+    }
+
+    int idx = home_slot(msg->fingerprint, table->capacity);
+    // Load factor is kept below 3/4, so there is always an empty slot to stop at
+    while (table->entries[idx].msg != NULL) {
+        const struct msg_entry *e = &table->entries[idx];
+        if (e->msg != MSG_TOMBSTONE && e->fingerprint == msg->fingerprint && same_message(e->msg, msg)) {
+            return idx;
+        }
+        idx = (idx + 1) & (table->capacity - 1);
+    }
+    return -1;
+}
+
+int msg_table_insert(struct msg_table *table, struct sms_message *msg) {
+    // Keep used slots (live and tombstones) below 3/4 of capacity,
+    // grow if live entries take more than half, otherwise just sweep tombstones
+    if ((table->count + table->tombstones + 1) * 4 > table->capacity * 3) {
+        int new_capacity = (table->capacity == 0) ? INITIAL_CAPACITY : table->capacity;
+        if ((table->count + 1) * 2 > new_capacity) {
+            new_capacity *= 2;
+        }
+        CHECK(rehash(table, new_capacity));
+    }
+
+    int idx = home_slot(msg->fingerprint, table->capacity);
+    while (is_live(&table->entries[idx])) {
+        idx = (idx + 1) & (table->capacity - 1);
+    }
+
+    if (table->entries[idx].msg == MSG_TOMBSTONE) {
+        table->tombstones -= 1;
+    }
+    table->entries[idx].fingerprint = msg->fingerprint;
+    table->entries[idx].msg = msg;
+    table->count += 1;
+    return 0;
+}
+
+struct sms_message *msg_table_remove(struct msg_table *table, int idx) {
+    struct msg_entry *e = &table->entries[idx];
+    if (!is_live(e)) {
+        return NULL;
+    }
+
+    struct sms_message *msg = e->msg;
+    table->count -= 1;
+
+    // Chain ends right after this slot, so no need to keep a tombstone here
+    if (table->entries[(idx + 1) & (table->capacity - 1)].msg == NULL) {
+        e->msg = NULL;
+    }
+    else {
+        e->msg = MSG_TOMBSTONE;
+        table->tombstones += 1;
+    }
+    return msg;
+}
+
+struct sms_message *msg_table_at(const struct msg_table *table, int idx) {
+    if (idx < 0 || idx >= table->capacity || !is_live(&table->entries[idx])) {
+        return NULL;
+    }
+    return table->entries[idx].msg;
+}
+
+#ifdef _PDU_TEST
+
+#define STATUS ((ok) ? "+OK " : "!ERR")
+#define TEST_MESSAGES 1000
+
+int test_msg_table() {
+    printf("\n Testing message table:\n");
+
+    struct msg_table table;
+    struct sms_message *msgs = calloc(TEST_MESSAGES, sizeof(struct sms_message));
+    int errors = 0;
+    int ok;
+
+    msg_table_init(&table);
+
+    // Same sender and ts, messages differ by hash only, as it happens during message storm
+    for (int i = 0; i < TEST_MESSAGES; ++i) {
+        strcpy(msgs[i].sender, "+79219800469");
+        strcpy(msgs[i].ts, "2025-03-03T20:31:32Z+3");
+        msgs[i].hash_id = i;
+        msgs[i].fingerprint = msg_fingerprint(&msgs[i]);
+        if (msg_table_insert(&table, &msgs[i]) != 0) {
+            errors += 1;
+        }
+    }
+    ok = (table.count == TEST_MESSAGES && errors == 0);
+    printf("%s Inserted %d messages, capacity %d\n", STATUS, table.count, table.capacity);
+    errors += !ok;
+
+    // Remove every other message, the rest should be still reachable through tombstones
+    for (int i = 0; i < TEST_MESSAGES; i += 2) {
+        int idx = msg_table_find(&table, &msgs[i]);
+        if (idx == -1 || msg_table_remove(&table, idx) != &msgs[i]) {
+            errors += 1;
+        }
+    }
+    int found = 0;
+    for (int i = 0; i < TEST_MESSAGES; ++i) {
+        int idx = msg_table_find(&table, &msgs[i]);
+        found += (idx != -1 && msg_table_at(&table, idx) == &msgs[i]);
+    }
+    ok = (found == TEST_MESSAGES / 2 && table.count == TEST_MESSAGES / 2);
+    printf("%s Found %d messages after removal\n", STATUS, found);
+    errors += !ok;
+
+    // Removed messages could be inserted again, tombstones are reused or swept
+    for (int i = 0; i < TEST_MESSAGES; i += 2) {
+        msg_table_insert(&table, &msgs[i]);
+    }
+    found = 0;
+    for (int i = 0; i < table.capacity; ++i) {
+        found += (msg_table_at(&table, i) != NULL);
+    }
+    ok = (found == TEST_MESSAGES && table.count == TEST_MESSAGES);
+    printf("%s Iterated %d messages, tombstones %d\n", STATUS, found, table.tombstones);
+    errors += !ok;
+
+    msg_table_free(&table);
+    free(msgs);
+
+    printf("Total results: %d errors\n\n", errors);
+    return errors;
+}
+
+#endif
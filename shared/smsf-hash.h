@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SMSF_HASH_H
+#define _SMSF_HASH_H
+
+#include <stdint.h>
+
+struct sms_message;
+
+struct msg_entry {
+    uint64_t fingerprint;
+    struct sms_message *msg; //! NULL - never used, MSG_TOMBSTONE - removed
+};
+
+/**
+ * @brief Open-addressing hash table of seen messages, linear probing with tombstones.
+ *        Keyed by msg->fingerprint, grows on demand, so it never overflows.
+ *        Slot index stays valid until the next insert.
+ */
+struct msg_table {
+    struct msg_entry *entries;
+    int capacity;     //! Power of two, 0 if nothing is allocated yet
+    int count;        //! Live entries
+    int tombstones;   //! Removed entries, still taking slots in probe chains
+};
+
+/**
+ * @brief Initialize empty table, memory is allocated on the first insert
+ *
+ * @param table - table to initialize
+ */
+void msg_table_init(struct msg_table *table);
+
+/**
+ * @brief Release table memory, messages are not freed
+ *
+ * @param table - table to release
+ */
+void msg_table_free(struct msg_table *table);
+
+/**
+ * @brief Find message with the same fingerprint and content
+ *
+ * @param table - table to search
+ * @param msg - message to look for
+ * @return int - slot index, -1 if not found
+ */
+int msg_table_find(const struct msg_table *table, const struct sms_message *msg);
+
+/**
+ * @brief Insert message, the table keeps the pointer, grows the table if required
+ *
+ * @param table - table to insert to
+ * @param msg - message to insert, msg->fingerprint must be set
+ * @return int - 0 - success, -1 - out of memory
+ */
+int msg_table_insert(struct msg_table *table, struct sms_message *msg);
+
+/**
+ * @brief Remove message from slot, message is not freed
+ *
+ * @param table - table
+ * @param idx - slot index returned by msg_table_find or used with msg_table_at
+ * @return struct sms_message* - removed message
+ */
+struct sms_message *msg_table_remove(struct msg_table *table, int idx);
+
+/**
+ * @brief Get message by slot index, to iterate over table use 0..capacity-1
+ *
+ * @param table - table
+ * @param idx - slot index
+ * @return struct sms_message* - message or NULL if slot is empty
+ */
+struct sms_message *msg_table_at(const struct msg_table *table, int idx);
+
+#ifdef _PDU_TEST
+ int test_msg_table();
+#endif
+
+#endif
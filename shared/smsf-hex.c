@@ -0,0 +1,443 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "smsf-util.h"
+#include "smsf-hex.h"
+
+// SSE2 is the baseline of x86-64, AVX2 is checked at runtime
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+  #define HEX_X86 1
+  #include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+  #define HEX_NEON 1
+  #include <arm_neon.h>
+#endif
+
+// Words are loaded with memcpy, the first character is the lowest byte
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  #define HEX_SWAR 1
+#endif
+
+/**
+ * @brief Hex codec implementation, vector ones convert whole blocks and leave the tail,
+ *        or the block with invalid character, to the scalar one
+ */
+struct hex_codec {
+    const char *name;
+    int (*encode)(const unsigned char *bin, int bi_len, char *hex);
+    int (*decode)(const char *hex, int hex_len, unsigned char *bin);
+    int (*supported)();
+};
+
+static const char _hex_digits[] = "0123456789ABCDEF";
+
+static inline int hex_digit(unsigned char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+static int bin2hex_scalar(const unsigned char *bin, int bi_len, char *hex) {
+    for (int bi = 0; bi < bi_len; ++bi) {
+        hex[2 * bi] = _hex_digits[bin[bi] >> 4];
+        hex[2 * bi + 1] = _hex_digits[bin[bi] & 0xF];
+    }
+    return 2 * bi_len;
+}
+
+static int hex2bin_scalar(const char *hex, int hex_len, unsigned char *bin) {
+    int hi = 0;
+    for (; hi + 2 <= hex_len; hi += 2) {
+        int h = hex_digit(hex[hi]);
+        int l = hex_digit(hex[hi + 1]);
+        if (h < 0 || l < 0) {
+            break;
+        }
+        bin[hi / 2] = (h << 4) | l;
+    }
+    return hi;
+}
+
+static int always() {
+    return 1;
+}
+
+#ifdef HEX_SWAR
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS (ONES * 0x80)
+#define EVEN_BYTES 0x00FF00FF00FF00FFULL
+#define EVEN_WORDS 0x0000FFFF0000FFFFULL
+
+// High bit of every byte is set if the byte is within lo .. hi, bytes must be below 0x80
+static inline uint64_t swar_in_range(uint64_t x, unsigned lo, unsigned hi) {
+    uint64_t ge = x + ONES * (0x80 - lo);
+    uint64_t gt = x + ONES * (0x7F - hi);
+    return ge & ~gt & HIGHS;
+}
+
+// 8 characters to 4 bytes per step
+static int hex2bin_swar(const char *hex, int hex_len, unsigned char *bin) {
+    int hi = 0;
+    for (; hi + 8 <= hex_len; hi += 8) {
+        uint64_t x;
+        memcpy(&x, hex + hi, sizeof(x));
+        uint64_t digit = swar_in_range(x, '0', '9');
+        uint64_t alpha = swar_in_range(x | (ONES * 0x20), 'a', 'f');
+        if ((x & HIGHS) != 0 || (digit | alpha) != HIGHS) {
+            break;
+        }
+
+        // Letters are 1 .. 6 in the low nibble
+        uint64_t nib = (x & (ONES * 0x0F)) + (alpha >> 7) * 9;
+        // Even byte takes high nibble from itself and low one from the next byte, then even bytes are packed
+        uint64_t t = ((nib << 4) | (nib >> 8)) & EVEN_BYTES;
+        t = (t | (t >> 8)) & EVEN_WORDS;
+        uint32_t out = (uint32_t) (t | (t >> 16));
+        memcpy(bin + hi / 2, &out, sizeof(out));
+    }
+    return hi + hex2bin_scalar(hex + hi, hex_len - hi, bin + hi / 2);
+}
+
+// 4 bytes to 8 characters per step
+static int bin2hex_swar(const unsigned char *bin, int bi_len, char *hex) {
+    int bi = 0;
+    for (; bi + 4 <= bi_len; bi += 4) {
+        uint32_t in;
+        memcpy(&in, bin + bi, sizeof(in));
+        // Spread bytes to even positions, then high nibble goes to even and low one to odd position
+        uint64_t x = in;
+        x = (x | (x << 16)) & EVEN_WORDS;
+        x = (x | (x << 8)) & EVEN_BYTES;
+        uint64_t nib = ((x >> 4) & (ONES * 0x0F) & EVEN_BYTES) | ((x & (ONES * 0x0F)) << 8);
+        uint64_t letter = ((nib + ONES * 6) >> 4) & ONES;
+        uint64_t out = nib + ONES * '0' + letter * 7;
+        memcpy(hex + 2 * bi, &out, sizeof(out));
+    }
+    bin2hex_scalar(bin + bi, bi_len - bi, hex + 2 * bi);
+    return 2 * bi_len;
+}
+
+#endif
+
+#ifdef HEX_X86
+
+static inline __m128i sse2_ascii(__m128i n) {
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8(7));
+    return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), letter);
+}
+
+// Characters to nibbles, return 0 if any character is not a hex digit
+static inline int sse2_nibbles(__m128i v, __m128i *nib) {
+    // Signed compare, characters above 0x7F are negative and never match
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    *nib = _mm_add_epi8(_mm_and_si128(v, _mm_set1_epi8(0x0F)), _mm_and_si128(alpha, _mm_set1_epi8(9)));
+    return _mm_movemask_epi8(_mm_or_si128(digit, alpha)) == 0xFFFF;
+}
+
+// Pairs of nibbles to bytes in 16-bit lanes
+static inline __m128i sse2_pairs(__m128i nib) {
+    return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nib, _mm_set1_epi16(0x00FF)), 4), _mm_srli_epi16(nib, 8));
+}
+
+// 32 characters to 16 bytes per step
+static int hex2bin_sse2(const char *hex, int hex_len, unsigned char *bin) {
+    int hi = 0;
+    for (; hi + 32 <= hex_len; hi += 32) {
+        __m128i a, b;
+        if (!sse2_nibbles(_mm_loadu_si128((const __m128i *) (hex + hi)), &a) ||
+            !sse2_nibbles(_mm_loadu_si128((const __m128i *) (hex + hi + 16)), &b)) {
+            break;
+        }
+        _mm_storeu_si128((__m128i *) (bin + hi / 2), _mm_packus_epi16(sse2_pairs(a), sse2_pairs(b)));
+    }
+    return hi + hex2bin_scalar(hex + hi, hex_len - hi, bin + hi / 2);
+}
+
+// 16 bytes to 32 characters per step
+static int bin2hex_sse2(const unsigned char *bin, int bi_len, char *hex) {
+    int bi = 0;
+    for (; bi + 16 <= bi_len; bi += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (bin + bi));
+        __m128i h = sse2_ascii(_mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0F)));
+        __m128i l = sse2_ascii(_mm_and_si128(v, _mm_set1_epi8(0x0F)));
+        _mm_storeu_si128((__m128i *) (hex + 2 * bi), _mm_unpacklo_epi8(h, l));
+        _mm_storeu_si128((__m128i *) (hex + 2 * bi + 16), _mm_unpackhi_epi8(h, l));
+    }
+    bin2hex_scalar(bin + bi, bi_len - bi, hex + 2 * bi);
+    return 2 * bi_len;
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+static int have_avx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+AVX2 static inline __m256i avx2_ascii(__m256i n) {
+    __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(n, _mm256_set1_epi8(9)), _mm256_set1_epi8(7));
+    return _mm256_add_epi8(_mm256_add_epi8(n, _mm256_set1_epi8('0')), letter);
+}
+
+AVX2 static inline int avx2_nibbles(__m256i v, __m256i *nib) {
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+    *nib = _mm256_add_epi8(_mm256_and_si256(v, _mm256_set1_epi8(0x0F)), _mm256_and_si256(alpha, _mm256_set1_epi8(9)));
+    return _mm256_movemask_epi8(_mm256_or_si256(digit, alpha)) == -1;
+}
+
+AVX2 static inline __m256i avx2_pairs(__m256i nib) {
+    return _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(nib, _mm256_set1_epi16(0x00FF)), 4), _mm256_srli_epi16(nib, 8));
+}
+
+// 64 characters to 32 bytes per step, pack works within 128-bit lanes, so quarters are put back in order
+AVX2 static int hex2bin_avx2(const char *hex, int hex_len, unsigned char *bin) {
+    int hi = 0;
+    for (; hi + 64 <= hex_len; hi += 64) {
+        __m256i a, b;
+        if (!avx2_nibbles(_mm256_loadu_si256((const __m256i *) (hex + hi)), &a) ||
+            !avx2_nibbles(_mm256_loadu_si256((const __m256i *) (hex + hi + 32)), &b)) {
+            break;
+        }
+        __m256i packed = _mm256_packus_epi16(avx2_pairs(a), avx2_pairs(b));
+        _mm256_storeu_si256((__m256i *) (bin + hi / 2), _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+    return hi + hex2bin_sse2(hex + hi, hex_len - hi, bin + hi / 2);
+}
+
+// 32 bytes to 64 characters per step
+AVX2 static int bin2hex_avx2(const unsigned char *bin, int bi_len, char *hex) {
+    int bi = 0;
+    for (; bi + 32 <= bi_len; bi += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (bin + bi));
+        __m256i h = avx2_ascii(_mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F)));
+        __m256i l = avx2_ascii(_mm256_and_si256(v, _mm256_set1_epi8(0x0F)));
+        __m256i lo = _mm256_unpacklo_epi8(h, l);
+        __m256i hi = _mm256_unpackhi_epi8(h, l);
+        _mm256_storeu_si256((__m256i *) (hex + 2 * bi), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *) (hex + 2 * bi + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    bin2hex_sse2(bin + bi, bi_len - bi, hex + 2 * bi);
+    return 2 * bi_len;
+}
+
+#endif
+
+#ifdef HEX_NEON
+
+static inline int neon_nibbles(uint8x16_t v, uint8x16_t *nib) {
+    uint8x16_t d = vsubq_u8(v, vdupq_n_u8('0'));
+    uint8x16_t a = vsubq_u8(vorrq_u8(v, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    uint8x16_t digit = vcleq_u8(d, vdupq_n_u8(9));
+    uint8x16_t alpha = vcleq_u8(a, vdupq_n_u8(5));
+    *nib = vbslq_u8(digit, d, vaddq_u8(a, vdupq_n_u8(10)));
+    return vminvq_u8(vorrq_u8(digit, alpha)) == 0xFF;
+}
+
+// 32 characters to 16 bytes per step, load splits high and low nibble characters
+static int hex2bin_neon(const char *hex, int hex_len, unsigned char *bin) {
+    int hi = 0;
+    for (; hi + 32 <= hex_len; hi += 32) {
+        uint8x16x2_t v = vld2q_u8((const uint8_t *) hex + hi);
+        uint8x16_t h, l;
+        if (!neon_nibbles(v.val[0], &h) || !neon_nibbles(v.val[1], &l)) {
+            break;
+        }
+        vst1q_u8(bin + hi / 2, vorrq_u8(vshlq_n_u8(h, 4), l));
+    }
+    return hi + hex2bin_scalar(hex + hi, hex_len - hi, bin + hi / 2);
+}
+
+// 16 bytes to 32 characters per step, store interleaves high and low nibble characters
+static int bin2hex_neon(const unsigned char *bin, int bi_len, char *hex) {
+    const uint8x16_t digits = vld1q_u8((const uint8_t *) _hex_digits);
+    int bi = 0;
+    for (; bi + 16 <= bi_len; bi += 16) {
+        uint8x16_t v = vld1q_u8(bin + bi);
+        uint8x16x2_t out;
+        out.val[0] = vqtbl1q_u8(digits, vshrq_n_u8(v, 4));
+        out.val[1] = vqtbl1q_u8(digits, vandq_u8(v, vdupq_n_u8(0x0F)));
+        vst2q_u8((uint8_t *) hex + 2 * bi, out);
+    }
+    bin2hex_scalar(bin + bi, bi_len - bi, hex + 2 * bi);
+    return 2 * bi_len;
+}
+
+#endif
+
+// The first supported one is used
+static const struct hex_codec _codecs[] = {
+#ifdef HEX_X86
+    { "avx2", bin2hex_avx2, hex2bin_avx2, have_avx2 },
+    { "sse2", bin2hex_sse2, hex2bin_sse2, always },
+#endif
+#ifdef HEX_NEON
+    { "neon", bin2hex_neon, hex2bin_neon, always },
+#endif
+#ifdef HEX_SWAR
+    { "swar", bin2hex_swar, hex2bin_swar, always },
+#endif
+    { "scalar", bin2hex_scalar, hex2bin_scalar, always },
+};
+
+#define HEX_CODECS ((int) (sizeof(_codecs) / sizeof(_codecs[0])))
+
+static const struct hex_codec *_codec;
+
+// Selected by CPU detection on the first call, every thread selects the same one
+static const struct hex_codec *codec() {
+    const struct hex_codec *c = __atomic_load_n(&_codec, __ATOMIC_ACQUIRE);
+    if (c == NULL) {
+        for (c = _codecs; !c->supported(); ++c);
+        __atomic_store_n(&_codec, c, __ATOMIC_RELEASE);
+    }
+    return c;
+}
+
+int bin2hex(const unsigned char *bin, int bi_len, char *hex) {
+    return codec()->encode(bin, bi_len, hex);
+}
+
+int hex2bin(const char *hex, int hex_len, unsigned char *bin) {
+    return codec()->decode(hex, hex_len, bin);
+}
+
+const char *hex_impl() {
+    return codec()->name;
+}
+
+#define BENCH_PDU 256 // Bytes, 512 characters is the longest PDU
+
+int hex_bench(int count) {
+    unsigned char bin[BENCH_PDU];
+    unsigned char out[BENCH_PDU];
+    char hex[2 * BENCH_PDU];
+    unsigned sink = 0;
+
+    for (int i = 0; i < BENCH_PDU; ++i) {
+        bin[i] = (unsigned char) (i * 37 + 11);
+    }
+
+    printf("Hex codec benchmark, %d PDUs of %d characters, ns per PDU\n", count, 2 * BENCH_PDU);
+    for (int c = 0; c < HEX_CODECS; ++c) {
+        const struct hex_codec *hc = &_codecs[c];
+        if (!hc->supported()) {
+            continue;
+        }
+
+        int64_t start = monotonic_us();
+        for (int i = 0; i < count; ++i) {
+            bin[0] = (unsigned char) i; // Not hoisted out of the loop
+            hc->encode(bin, BENCH_PDU, hex);
+            sink += hex[i & 0xFF];
+        }
+        int64_t encoded = monotonic_us();
+        for (int i = 0; i < count; ++i) {
+            hex[0] = _hex_digits[i & 0xF];
+            sink += hc->decode(hex, 2 * BENCH_PDU, out) + out[i & 0xFF];
+        }
+        int64_t decoded = monotonic_us();
+
+        printf("  %-6s encode %7.1f decode %7.1f%s\n", hc->name, (encoded - start) * 1000.0 / count,
+               (decoded - encoded) * 1000.0 / count, (hc == codec()) ? "  (selected)" : "");
+    }
+    return (sink != 0) ? 0 : -1;
+}
+
+#ifdef _PDU_TEST
+
+#define STATUS ((ok) ? "+OK " : "!ERR")
+
+int test_hex() {
+    printf("\n Testing hex codec (%s):\n", hex_impl());
+
+    int errors = 0;
+    int ok;
+    unsigned char bin[300];
+    unsigned char out[300], ref[300];
+    char hex[601], ref_hex[600];
+
+    srand(7);
+    for (int i = 0; i < (int) sizeof(bin); ++i) {
+        bin[i] = (unsigned char) rand();
+    }
+
+    // Every length, so every block size and tail is covered
+    ok = 1;
+    for (int c = 0; c < HEX_CODECS; ++c) {
+        if (!_codecs[c].supported()) {
+            continue;
+        }
+        for (int len = 0; len <= (int) sizeof(bin) && ok; ++len) {
+            memset(hex, 'x', sizeof(hex));
+            bin2hex_scalar(bin, len, ref_hex);
+            ok = _codecs[c].encode(bin, len, hex) == 2 * len && memcmp(hex, ref_hex, 2 * len) == 0 && hex[2 * len] == 'x';
+            ok = ok && _codecs[c].decode(hex, 2 * len, out) == 2 * len && memcmp(out, bin, len) == 0;
+        }
+        if (!ok) {
+            printf("!ERR %s round trip\n", _codecs[c].name);
+        }
+    }
+    printf("%s Round trip of 0 .. %d bytes\n", STATUS, (int) sizeof(bin));
+    errors += !ok;
+
+    // Lower case is accepted, conversion stops at the pair with invalid character at any position
+    const char invalid[] = { 'g', 'G', '@', '`', '/', ':', 0x10, '\r', 0, (char) 0x80, (char) 0xC1 };
+    int len = bin2hex_scalar(bin, 100, hex);
+    for (int i = 0; i < len; ++i) {
+        hex[i] = (i % 3 == 0 && hex[i] >= 'A') ? hex[i] | 0x20 : hex[i];
+    }
+    ok = 1;
+    for (int c = 0; c < HEX_CODECS; ++c) {
+        if (!_codecs[c].supported()) {
+            continue;
+        }
+        ok = ok && _codecs[c].decode(hex, len, out) == len && memcmp(out, bin, 100) == 0;
+        ok = ok && _codecs[c].decode(hex, len - 1, out) == len - 2;
+        for (int pos = 0; pos < len && ok; ++pos) {
+            for (int k = 0; k < (int) sizeof(invalid) && ok; ++k) {
+                char saved = hex[pos];
+                hex[pos] = invalid[k];
+                int expected = hex2bin_scalar(hex, len, ref);
+                ok = (expected == (pos & ~1) && _codecs[c].decode(hex, len, out) == expected && memcmp(out, ref, expected / 2) == 0);
+                hex[pos] = saved;
+            }
+        }
+        if (!ok) {
+            printf("!ERR %s validation\n", _codecs[c].name);
+        }
+    }
+    printf("%s Invalid characters are detected\n", STATUS);
+    errors += !ok;
+
+    printf("Total results: %d errors\n\n", errors);
+    return errors;
+}
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SMSF_HEX_H
+#define _SMSF_HEX_H
+
+/**
+ * @brief Convert bytes to upper case hex string, the string is not terminated
+ *
+ * @return int - number of characters written, 2 * bi_len
+ */
+int bin2hex(const unsigned char *bin, int bi_len, char *hex);
+
+/**
+ * @brief Convert hex string to bytes, upper and lower case digits are accepted.
+ *        Conversion stops at the first character that is not a hex digit, e.g. trailing \r or \0,
+ *        odd trailing digit is not converted
+ *
+ * @return int - number of characters converted, hex_len if the whole string is valid
+ */
+int hex2bin(const char *hex, int hex_len, unsigned char *bin);
+
+/**
+ * @brief Name of the implementation selected for this CPU, e.g. "avx2", "sse2", "neon" or "swar"
+ */
+const char *hex_impl();
+
+/**
+ * @brief Measure encode and decode cost of 512 character PDU for every implementation
+ *        available on this CPU and print results, one line per implementation
+ *
+ * @param count - PDUs per case
+ * @return int - 0 - success, -1 - error
+ */
+int hex_bench(int count);
+
+#ifdef _PDU_TEST
+ int test_hex();
+#endif
+
+#endif
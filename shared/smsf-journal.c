@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "smsf-hal.h"
+#include "smsf-logging.h"
+#include "smsf-util.h"
+#include "smsf-journal.h"
+
+#define JOURNAL_MAGIC 0x4A534D53 // SMSJ
+#define REGION_SIZE (JOURNAL_SIZE / 2)
+
+struct journal_header {
+    uint32_t magic;
+    uint32_t generation;  //! Region with the highest valid generation is active
+    uint32_t reserved;
+    uint32_t check;
+};
+
+// Records of previous generations left in the region fail the check,
+// so replay stops at the first record that is torn or not written yet
+struct journal_record {
+    uint64_t fingerprint;
+    uint32_t generation;
+    uint16_t op;
+    uint16_t check;
+};
+
+static uint32_t header_check(const struct journal_header *h) {
+    return (uint32_t) fnv1a64(FNV64_INIT, h, offsetof(struct journal_header, check));
+}
+
+static uint16_t record_check(const struct journal_record *r) {
+    return (uint16_t) fnv1a64(FNV64_INIT, r, offsetof(struct journal_record, check));
+}
+
+static struct journal_header *region_header(const struct journal *j, int region) {
+    return (struct journal_header *) (j->image + region * REGION_SIZE);
+}
+
+static int record_offs(int region, int idx) {
+    return region * REGION_SIZE + sizeof(struct journal_header) + idx * sizeof(struct journal_record);
+}
+
+static struct journal_record *region_record(const struct journal *j, int region, int idx) {
+    return (struct journal_record *) (j->image + record_offs(region, idx));
+}
+
+// Fingerprint set, linear probing with backward shift deletion, so no tombstones.
+// Zero marks an empty slot, so zero fingerprint is stored as 1
+static uint64_t set_key(uint64_t fingerprint) {
+    return (fingerprint == 0) ? 1 : fingerprint;
+}
+
+static int set_find(const struct journal *j, uint64_t key) {
+    int mask = j->set_size - 1;
+    int idx = (int) ((key ^ (key >> 32)) & mask);
+    while (j->set[idx] != 0) {
+        if (j->set[idx] == key) {
+            return idx;
+        }
+        idx = (idx + 1) & mask;
+    }
+    return -1;
+}
+
+static void set_add(struct journal *j, uint64_t key) {
+    int mask = j->set_size - 1;
+    int idx = (int) ((key ^ (key >> 32)) & mask);
+    while (j->set[idx] != 0) {
+        if (j->set[idx] == key) {
+            return;
+        }
+        idx = (idx + 1) & mask;
+    }
+    j->set[idx] = key;
+    j->live += 1;
+}
+
+static void set_remove(struct journal *j, uint64_t key) {
+    int mask = j->set_size - 1;
+    int idx = set_find(j, key);
+    if (idx == -1) {
+        return;
+    }
+
+    // Move back entries that would become unreachable after the hole
+    int next = (idx + 1) & mask;
+    while (j->set[next] != 0) {
+        int home = (int) ((j->set[next] ^ (j->set[next] >> 32)) & mask);
+        if (((next - home) & mask) >= ((next - idx) & mask)) {
+            j->set[idx] = j->set[next];
+            idx = next;
+        }
+        next = (next + 1) & mask;
+    }
+    j->set[idx] = 0;
+    j->live -= 1;
+}
+
+static void write_header(struct journal *j, int region, uint32_t generation) {
+    struct journal_header *h = region_header(j, region);
+    h->magic = JOURNAL_MAGIC;
+    h->generation = generation;
+    h->reserved = 0;
+    h->check = header_check(h);
+}
+
+static void write_record(struct journal *j, int region, int idx, uint32_t generation, uint64_t fingerprint, int op) {
+    struct journal_record *r = region_record(j, region, idx);
+    r->fingerprint = fingerprint;
+    r->generation = generation;
+    r->op = op;
+    r->check = record_check(r);
+}
+
+// Write live records to the other region, switch to it when the header is durable
+static int compact(struct journal *j) {
+    int target = 1 - j->region;
+    int records = 0;
+    uint32_t generation = j->generation + 1;
+
+    for (int i = 0; i < j->set_size; ++i) {
+        if (j->set[i] != 0) {
+            write_record(j, target, records++, generation, j->set[i], JOURNAL_FORWARDED);
+        }
+    }
+    CHECK(store_sync(j->handle, j->image, record_offs(target, 0), records * sizeof(struct journal_record)));
+
+    write_header(j, target, generation);
+    CHECK(store_sync(j->handle, j->image, target * REGION_SIZE, sizeof(struct journal_header)));
+
+    log_debug("Journal compacted %d -> %d records, generation %u", j->records, records, generation);
+    j->generation = generation;
+    j->region = target;
+    j->records = records;
+    j->synced = records;
+    return 0;
+}
+
+static int append(struct journal *j, uint64_t fingerprint, int op) {
+    if (j->records == j->capacity && compact(j) != 0) {
+        log_err("Journal compaction error");
+        return -1;
+    }
+    write_record(j, j->region, j->records, j->generation, fingerprint, op);
+    j->records += 1;
+    return 0;
+}
+
+// Find active region and rebuild the set of forwarded messages
+static int journal_load(struct journal *j) {
+    j->capacity = (REGION_SIZE - sizeof(struct journal_header)) / sizeof(struct journal_record);
+    j->set_size = 1;
+    while (j->set_size < j->capacity) {
+        j->set_size <<= 1;
+    }
+    j->set = calloc(j->set_size, sizeof(uint64_t));
+    if (j->set == NULL) {
+        log_err("Can't allocate journal index");
+        return -1;
+    }
+    j->live = 0;
+    j->region = -1;
+    j->generation = 0;
+
+    for (int i = 0; i < 2; ++i) {
+        const struct journal_header *h = region_header(j, i);
+        if (h->magic == JOURNAL_MAGIC && h->check == header_check(h) && (j->region == -1 || h->generation > j->generation)) {
+            j->region = i;
+            j->generation = h->generation;
+        }
+    }
+
+    if (j->region == -1) {
+        // New or broken journal, start from scratch
+        j->region = 0;
+        j->generation = 1;
+        j->records = 0;
+        j->synced = 0;
+        write_header(j, 0, j->generation);
+        return store_sync(j->handle, j->image, 0, sizeof(struct journal_header));
+    }
+
+    int n = 0;
+    while (n < j->capacity) {
+        const struct journal_record *r = region_record(j, j->region, n);
+        if (r->generation != j->generation || r->check != record_check(r)) {
+            break;
+        }
+        if (r->op == JOURNAL_FORWARDED) {
+            set_add(j, set_key(r->fingerprint));
+        }
+        else if (r->op == JOURNAL_DELETED) {
+            set_remove(j, set_key(r->fingerprint));
+        }
+        n += 1;
+    }
+    j->records = n;
+    j->synced = n;
+    return 0;
+}
+
+int journal_open(struct journal *j, const char *name) {
+    j->image = NULL;
+    j->set = NULL;
+
+    if (store_open(name, JOURNAL_SIZE, &j->image, &j->handle) != 0) {
+        log_errno("Can't open journal %s, restart may forward messages again", name);
+        j->image = NULL;
+        return -1;
+    }
+
+    if (journal_load(j) != 0) {
+        journal_close(j);
+        return -1;
+    }
+
+    log_noise("Journal %s: %d records, %d forwarded messages, generation %u", name, j->records, j->live, j->generation);
+    return 0;
+}
+
+int journal_forwarded(struct journal *j, uint64_t fingerprint) {
+    uint64_t key = set_key(fingerprint);
+    if (j->image == NULL || set_find(j, key) != -1) {
+        return 0;
+    }
+
+    // Half of the region is kept for appends, so compaction always makes room
+    if (j->live >= j->capacity / 2) {
+        log_err("Journal is full, %d messages are forwarded but not deleted", j->live);
+        return -1;
+    }
+
+    CHECK(append(j, key, JOURNAL_FORWARDED));
+    set_add(j, key);
+    return 0;
+}
+
+int journal_commit(struct journal *j) {
+    if (j->image == NULL || j->synced == j->records) {
+        return 0;
+    }
+    int offs = record_offs(j->region, j->synced);
+    CHECK(store_sync(j->handle, j->image, offs, (j->records - j->synced) * sizeof(struct journal_record)));
+    j->synced = j->records;
+    return 0;
+}
+
+void journal_deleted(struct journal *j, uint64_t fingerprint) {
+    uint64_t key = set_key(fingerprint);
+    if (j->image == NULL || set_find(j, key) == -1) {
+        return;
+    }
+
+    // Lost record only leaves the message in the journal until the next compaction
+    if (append(j, key, JOURNAL_DELETED) == 0) {
+        set_remove(j, key);
+    }
+}
+
+int journal_contains(const struct journal *j, uint64_t fingerprint) {
+    return j->image != NULL && set_find(j, set_key(fingerprint)) != -1;
+}
+
+int journal_fingerprints(const struct journal *j, uint64_t *out, int max) {
+    int n = 0;
+    for (int i = 0; j->image != NULL && i < j->set_size && n < max; ++i) {
+        if (j->set[i] != 0) {
+            out[n++] = j->set[i];
+        }
+    }
+    return n;
+}
+
+void journal_maintain(struct journal *j) {
+    if (j->image != NULL && j->records - j->live > j->capacity / 2) {
+        if (compact(j) != 0) {
+            log_err("Journal compaction error");
+        }
+    }
+}
+
+void journal_close(struct journal *j) {
+    if (j->image != NULL) {
+        store_close(j->handle, j->image, JOURNAL_SIZE);
+    }
+    free(j->set);
+    j->image = NULL;
+    j->set = NULL;
+}
+
+#ifdef _PDU_TEST
+
+#define STATUS ((ok) ? "+OK " : "!ERR")
+
+// Replay the same image as if the program is restarted
+static int reopen(struct journal *j, struct journal *r) {
+    r->image = j->image;
+    r->handle = j->handle;
+    return journal_load(r);
+}
+
+int test_journal() {
+    printf("\n Testing journal:\n");
+
+    struct journal j, r;
+    int errors = 0;
+    int ok;
+
+    ok = (journal_open(&j, "test.journal") == 0);
+    journal_forwarded(&j, 101);
+    journal_forwarded(&j, 102);
+    journal_forwarded(&j, 103);
+    journal_forwarded(&j, 102);
+    journal_deleted(&j, 101);
+    ok = ok && reopen(&j, &r) == 0 && r.records == 4 && r.live == 2 &&
+         !journal_contains(&r, 101) && journal_contains(&r, 102) && journal_contains(&r, 103);
+    printf("%s Replayed %d records, %d forwarded messages\n", STATUS, r.records, r.live);
+    errors += !ok;
+    free(r.set);
+
+    uint64_t live[4];
+    int n_live = journal_fingerprints(&j, live, 4);
+    ok = (n_live == 2 && live[0] + live[1] == 102 + 103 && journal_fingerprints(&j, live, 1) == 1);
+    printf("%s Listed %d forwarded messages\n", STATUS, n_live);
+    errors += !ok;
+
+    // Torn record at the tail is ignored
+    journal_forwarded(&j, 104);
+    region_record(&j, j.region, j.records - 1)->check ^= 1;
+    ok = reopen(&j, &r) == 0 && r.records == 4 && !journal_contains(&r, 104);
+    printf("%s Torn record is dropped\n", STATUS);
+    errors += !ok;
+    free(r.set);
+
+    // Forward and delete many messages, compaction keeps only live ones
+    uint32_t generation = j.generation;
+    for (int i = 0; i < j.capacity * 3; ++i) {
+        journal_forwarded(&j, 1000 + i);
+        journal_deleted(&j, 1000 + i);
+        journal_maintain(&j);
+    }
+    ok = reopen(&j, &r) == 0 && r.generation > generation && r.records < r.capacity &&
+         journal_contains(&r, 103) && !journal_contains(&r, 1000);
+    printf("%s Compacted to generation %u, %d records, %d forwarded messages\n", STATUS, r.generation, r.records, r.live);
+    errors += !ok;
+    free(r.set);
+
+    ok = 1;
+    for (int i = 0; i < j.capacity; ++i) {
+        if (journal_forwarded(&j, 5000 + i) != 0) {
+            break;
+        }
+    }
+    ok = (j.live == j.capacity / 2 && journal_forwarded(&j, 9999) == -1);
+    printf("%s Journal is capped at %d forwarded messages\n", STATUS, j.live);
+    errors += !ok;
+
+    journal_close(&j);
+
+    printf("Total results: %d errors\n\n", errors);
+    return errors;
+}
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SMSF_JOURNAL_H
+#define _SMSF_JOURNAL_H
+
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+  #define JOURNAL_SIZE 2048     //! Two regions of 63 records, NVS blob
+#else
+  #define JOURNAL_SIZE 65536    //! Two regions of 2047 records, mapped file
+#endif
+
+#define JOURNAL_FORWARDED 1    //! Message is forwarded, don't forward it again after restart
+#define JOURNAL_DELETED 2      //! Message is removed from the seen list, the record is dropped by compaction
+
+/**
+ * @brief Append-only journal of forwarded messages, keyed by message fingerprint.
+ *        The image holds two regions, records are appended to the active one,
+ *        compaction writes live records to the other region and switches to it.
+ *        Replay scans one region at most, so recovery time is bounded by JOURNAL_SIZE.
+ */
+struct journal {
+    char *image;        //! NULL - journal is disabled, all calls are no-op
+    int handle;
+    int region;         //! Active region, 0 or 1
+    uint32_t generation;
+    int records;        //! Records in the active region
+    int synced;         //! Records of the active region already durable
+    int capacity;       //! Records fitting into one region
+    int live;           //! Forwarded messages not deleted yet
+    uint64_t *set;      //! Open-addressing set of live fingerprints, 0 - empty slot
+    int set_size;       //! Power of two, at least twice the live limit
+};
+
+/**
+ * @brief Open journal and replay it
+ *
+ * @param j - journal
+ * @param name - storage name, file name or NVS key, see store_open
+ * @return int - 0 - success, -1 - journal is disabled
+ */
+int journal_open(struct journal *j, const char *name);
+
+/**
+ * @brief Record that the message is forwarded, the record is durable after journal_commit
+ *
+ * @param j - journal
+ * @param fingerprint - message fingerprint
+ * @return int - 0 - success, -1 - storage error or too many live records
+ */
+int journal_forwarded(struct journal *j, uint64_t fingerprint);
+
+/**
+ * @brief Make all appended records durable with one sync
+ *
+ * @return int - 0 - success, -1 - storage error
+ */
+int journal_commit(struct journal *j);
+
+/**
+ * @brief Record that the message is gone, the record is synced with the next commit
+ *
+ * @param j - journal
+ * @param fingerprint - message fingerprint
+ */
+void journal_deleted(struct journal *j, uint64_t fingerprint);
+
+/**
+ * @brief Check the message was forwarded before restart
+ *
+ * @return int - 1 - forwarded, 0 - not found or journal is disabled
+ */
+int journal_contains(const struct journal *j, uint64_t fingerprint);
+
+/**
+ * @brief Copy fingerprints of forwarded messages that are not deleted yet
+ *
+ * @param j - journal
+ * @param out - fingerprints
+ * @param max - size of out
+ * @return int - number of fingerprints copied, 0 - journal is disabled
+ */
+int journal_fingerprints(const struct journal *j, uint64_t *out, int max);
+
+/**
+ * @brief Compact the journal if most of the records are dead, called once per flow cycle
+ *
+ * @param j - journal
+ */
+void journal_maintain(struct journal *j);
+
+void journal_close(struct journal *j);
+
+#ifdef _PDU_TEST
+ int test_journal();
+#endif
+
+#endif
@@ -17,7 +17,10 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #ifdef HAVE_SYSLOG
   #include <syslog.h>
@@ -25,87 +28,396 @@
 
 #include "smsf-logging.h"
 #include "smsf-util.h"
+#include "smsf-queue.h"
 
-struct smsf_options _opts = { SMSF_VERSION, LOG_DEBUG, 0 /* SYSLOG */, 0 /*SLOW_READ*/, 1 /* FORWARD */, 1 /* MULTIPART */, 1 /* MAY DELETE */, 1 /* HEADER */, 1 /* EXPIRE */ };
+struct smsf_options _opts = { SMSF_VERSION, LOG_DEBUG, 0 /* SYSLOG */, 0 /*SLOW_READ*/, 1 /* FORWARD */, 1 /* MULTIPART */, 1 /* MAY DELETE */, 1 /* HEADER */, 1 /* EXPIRE */, 0 /* CNMI */, 0 /* ENCODING */ };
 FILE *_log_stream = NULL;
 
+#ifdef ESP_PLATFORM
+  #define LOG_TEXT 120        // Longer lines are truncated
+  #define LOG_RING 32
+  #define LOG_STACK (3 * 1024)
+#else
+  #define LOG_TEXT 480        // Fits PDU of the longest message with the prefix
+  #define LOG_RING 1024
+#endif
+
+static const char *VB_NAMES[8] = {"EMEGR", "ALERT", "CRIT", "ERR", "WARNING", "NOTICE", "INFO", "DEBUG"};
+
+/**
+ * @brief Formatted message waiting for output. Time stamp is formatted and written
+ *        by the flusher, so the caller pays only for vsnprintf and a slot claim.
+ */
+struct log_record {
+    time_t time;
+    uint16_t len;
+    uint8_t verbosity;
+    uint8_t kind;             //! REC_TEXT, REC_RAW or REC_HEX, dumps are written to stderr
+    char text[LOG_TEXT];
+};
+
+#define REC_TEXT 0            // Log message, written with time stamp and level
+#define REC_RAW 1             // Output of dump(), written as is
+#define REC_HEX 2             // Binary data, formatted by the flusher
+#define HEX_ROW 16            // Bytes per line of hex dump
+
+static struct mpsc_queue _log_ring;
+static pthread_mutex_t _log_flush_lock = PTHREAD_MUTEX_INITIALIZER; // Ring has the only consumer
+static pthread_t _log_flusher;
+static pthread_mutex_t _log_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _log_wake = PTHREAD_COND_INITIALIZER;
+static int _log_sleeping = 0; //! Flusher found the ring empty and waits, the next producer wakes it
+static int _log_async = 0;    //! Records go to the ring, otherwise they are written by the caller
+static int _log_running = 0;
+static int _log_dropped = 0;  //! Records lost because the ring was full
+
+// Every modem is driven by its own thread under linux, ESP32 uart and display tasks log concurrently too.
+// ESP-IDF reserves __thread variables at the top of every task stack, the fallback record takes ~140 bytes of it.
+static __thread const char *_log_tag = NULL;
+
+void log_set_tag(const char *tag) {
+    _log_tag = tag;
+}
+
 #ifdef __linux__
-static void time_decorator(char *buffer) {
-   time_t rawtime;
-   struct tm *info;
-   time(&rawtime);
-   info = localtime( &rawtime );
-   strftime(buffer,20,"%Y-%m-%d %H:%M:%S", info);
+static void time_decorator(time_t rawtime, char *buffer) {
+    // Records come in batches with the same time stamp
+    static time_t last_time = 0;
+    static char last_ts[20];
+
+    if (rawtime != last_time) {
+        struct tm info;
+        localtime_r(&rawtime, &info);
+        strftime(last_ts, sizeof(last_ts), "%Y-%m-%d %H:%M:%S", &info);
+        last_time = rawtime;
+    }
+    memcpy(buffer, last_ts, sizeof(last_ts));
 }
 #endif
 
+static void write_hex(const struct log_record *rec) {
+    static const char digits[] = "0123456789abcdef";
+    char line[HEX_ROW * 3 + 1];
 
-int log_impl(int verbosity, int err_code, const char *err_str, const char *format, ...) {
-    static char buf[4096] = {0};
-    static char *VB_NAMES[8] = {"EMEGR", "ALERT", "CRIT", "ERR", "WARNING", "NOTICE", "INFO", "DEBUG"};
+    for (int row = 0; row < rec->len; row += HEX_ROW) {
+        int n = 0;
+        for (int i = row; i < rec->len && i < row + HEX_ROW; ++i) {
+            uint8_t b = (uint8_t) rec->text[i];
+            line[n++] = digits[b >> 4];
+            line[n++] = digits[b & 0xF];
+            line[n++] = ' ';
+        }
+        line[n++] = '\n';
+        fwrite(line, n, 1, stderr);
+    }
+}
+
+static void write_record(const struct log_record *rec) {
+    if (rec->kind == REC_RAW) {
+        fwrite(rec->text, rec->len, 1, stderr);
+        return;
+    }
+    if (rec->kind == REC_HEX) {
+        write_hex(rec);
+        return;
+    }
+
+#ifdef HAVE_SYSLOG
+    if (_opts.syslog) {
+        // No need to set prefix manually for syslog
+        syslog(rec->verbosity, "%s", rec->text);
+    }
+#endif
+    FILE *fp = (_log_stream != NULL) ? _log_stream : stderr;
+
+#ifdef __linux__
+    // Under linux add time decorator
+    char ts[20];
+    time_decorator(rec->time, ts);
+    fprintf(fp, "%s [%s]:%s\n", ts, VB_NAMES[rec->verbosity], rec->text);
+#else
+    // Used plain stderr to reduce the number of places where we have os specific staff, but
+    //   esp_log_write((verbosity == 1) ? ESP_LOG_ERROR : ESP_LOG_INFO), LOG_PREFIX, "%s\r\n", buf);
+    // might be better choice.
+    fprintf(fp, "%s[%s]:%s\n", LOG_PREFIX, VB_NAMES[rec->verbosity], rec->text);
+#endif
+}
 
-    int offs = 0;
+static void flush_streams() {
+    fflush((_log_stream != NULL) ? _log_stream : stderr);
+    fflush(stderr);
+}
 
+/**
+ * @brief Write out everything published so far, one flush per batch
+ *
+ * @return int - number of records written
+ */
+static int log_drain() {
+    int count = 0;
+    struct log_record *rec;
+
+    pthread_mutex_lock(&_log_flush_lock);
+    while ((rec = mpsc_peek(&_log_ring)) != NULL) {
+        write_record(rec);
+        mpsc_release(&_log_ring);
+        count += 1;
+    }
+
+    int dropped = __atomic_exchange_n(&_log_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+        struct log_record note = { time(NULL), 0, LOG_WARNING, REC_TEXT, "" };
+        note.len = snprintf(note.text, sizeof(note.text), "%d log records dropped, logger is behind", dropped);
+        write_record(&note);
+        count += 1;
+    }
+
+    if (count > 0) {
+        flush_streams();
+    }
+    pthread_mutex_unlock(&_log_flush_lock);
+    return count;
+}
+
+/**
+ * @brief Sleep until a record is published or the logger is stopped.
+ *        Flusher raises _log_sleeping before it checks the ring and producers check it after they publish,
+ *        so either the flusher sees the record or the producer sees the flusher sleeping.
+ */
+static void log_sleep() {
+    pthread_mutex_lock(&_log_wake_lock);
+    __atomic_store_n(&_log_sleeping, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (mpsc_peek(&_log_ring) != NULL) {
+        __atomic_store_n(&_log_sleeping, 0, __ATOMIC_RELAXED);
+    }
+    while (__atomic_load_n(&_log_sleeping, __ATOMIC_SEQ_CST) && __atomic_load_n(&_log_running, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&_log_wake, &_log_wake_lock);
+    }
+    pthread_mutex_unlock(&_log_wake_lock);
+}
+
+static void log_wake() {
+    // Only the first record after the ring became empty pays for the wake up
+    if (__atomic_load_n(&_log_sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&_log_sleeping, 0, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&_log_wake_lock);
+        pthread_cond_signal(&_log_wake);
+        pthread_mutex_unlock(&_log_wake_lock);
+    }
+}
+
+static void *log_flusher(void *arg) {
+    while (__atomic_load_n(&_log_running, __ATOMIC_ACQUIRE)) {
+        if (log_drain() == 0) {
+            log_sleep();
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Slot for the next record, in the ring if the logger is started or thread local buffer otherwise.
+ *        Warnings and errors are never dropped, if the ring is full they are written by the caller.
+ *
+ * @return struct log_record* - record to fill, NULL - ring is full, record is dropped
+ */
+static struct log_record *log_reserve(int verbosity, uint32_t *pos, int *async) {
+    static __thread struct log_record local;
+
+    *async = __atomic_load_n(&_log_async, __ATOMIC_ACQUIRE);
+    if (*async) {
+        struct log_record *rec = mpsc_reserve(&_log_ring, pos);
+        if (rec != NULL) {
+            return rec;
+        }
+        if (verbosity > LOG_WARNING) {
+            __atomic_fetch_add(&_log_dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        *async = 0;
+    }
+    return &local;
+}
+
+static void log_commit(struct log_record *rec, uint32_t pos, int async) {
+    if (async) {
+        mpsc_publish(&_log_ring, pos);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        log_wake();
+    }
+    else {
+        pthread_mutex_lock(&_log_flush_lock);
+        write_record(rec);
+        flush_streams();
+        pthread_mutex_unlock(&_log_flush_lock);
+    }
+}
+
+int log_impl(int verbosity, int err_code, const char *err_str, const char *format, ...) {
     if (_opts.verbosity >= verbosity) {
+        uint32_t pos;
+        int async;
+        struct log_record *rec = log_reserve(verbosity, &pos, &async);
+        if (rec == NULL) {
+            return -1;
+        }
+
+        int offs = 0;
+        if (_log_tag != NULL) {
+            offs += snprintf(rec->text, sizeof(rec->text), "%s: ", _log_tag);
+        }
+
         va_list args;
         va_start(args, format);
-        offs += vsnprintf(buf + offs, sizeof(buf) - offs, format, args);
+        offs += vsnprintf(rec->text + offs, sizeof(rec->text) - offs, format, args);
         va_end(args);
 
-        if (err_str != NULL) {
-            snprintf(buf + offs, sizeof(buf) - offs, " - %s (%d)", err_str, err_code);
+        if (err_str != NULL && offs < (int) sizeof(rec->text)) {
+            offs += snprintf(rec->text + offs, sizeof(rec->text) - offs, " - %s (%d)", err_str, err_code);
         }
 
-#ifdef HAVE_SYSLOG
-        if (_opts.syslog) {
-            // No need to set prefix manually for syslog
-            syslog(verbosity, "%s", buf);
+        rec->time = time(NULL);
+        rec->len = (offs < (int) sizeof(rec->text)) ? offs : sizeof(rec->text) - 1;
+        rec->verbosity = verbosity;
+        rec->kind = REC_TEXT;
+        log_commit(rec, pos, async);
+    }
+
+    // Shorthand that allows to use log_* macro in return statement
+    return -1;
+}
+
+static void log_raw(int kind, const char *ptr, int len) {
+    // Hex record holds whole rows
+    int limit = (kind == REC_HEX) ? LOG_TEXT - LOG_TEXT % HEX_ROW : LOG_TEXT;
+
+    while (len > 0) {
+        uint32_t pos;
+        int async;
+        struct log_record *rec = log_reserve(LOG_DEBUG, &pos, &async);
+        if (rec == NULL) {
+            return;
         }
+        int chunk = (len < limit) ? len : limit;
+        memcpy(rec->text, ptr, chunk);
+        rec->time = 0;
+        rec->len = chunk;
+        rec->verbosity = LOG_DEBUG;
+        rec->kind = kind;
+        log_commit(rec, pos, async);
+        ptr += chunk;
+        len -= chunk;
+    }
+}
+
+int log_start() {
+    static int at_exit = 0;
+
+    if (_log_async) {
+        return 0;
+    }
+    if (_log_ring.slots == NULL && mpsc_init(&_log_ring, LOG_RING, sizeof(struct log_record)) != 0) {
+        return -1;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+#ifdef ESP_PLATFORM
+    pthread_attr_setstacksize(&attr, LOG_STACK);
 #endif
-        if (_log_stream == NULL) {
-            _log_stream = stderr;
+    __atomic_store_n(&_log_running, 1, __ATOMIC_RELEASE);
+    int res = pthread_create(&_log_flusher, &attr, log_flusher, NULL);
+    pthread_attr_destroy(&attr);
+    if (res != 0) {
+        _log_running = 0;
+        return log_err("Can't start log flusher (%d), logging synchronously", res);
+    }
+
+    if (!at_exit) {
+        // Records queued before exit() are not lost
+        atexit(log_flush);
+        at_exit = 1;
+    }
+    __atomic_store_n(&_log_async, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void log_stop() {
+    if (!_log_async) {
+        return;
+    }
+    __atomic_store_n(&_log_async, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&_log_wake_lock);
+    __atomic_store_n(&_log_running, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&_log_wake);
+    pthread_mutex_unlock(&_log_wake_lock);
+    pthread_join(_log_flusher, NULL);
+    log_drain();
+}
+
+void log_flush() {
+    if (_log_ring.slots != NULL) {
+        log_drain();
+    }
+}
+
+static void write_all(int fd, const char *ptr, int len) {
+    while (len > 0) {
+        int n = write(fd, ptr, len);
+        if (n <= 0) {
+            return;
         }
+        ptr += n;
+        len -= n;
+    }
+}
 
-#ifdef __linux__
-        // Under linux add time decorator
-        char ts[20];
-        time_decorator(ts);
-        fprintf(_log_stream, "%s [%s]:%s\n", ts, VB_NAMES[verbosity], buf);
-#else
-        // Used plain stderr to reduce the number of places where we have os specific staff, but
-        //   esp_log_write((verbosity == 1) ? ESP_LOG_ERROR : ESP_LOG_INFO), LOG_PREFIX, "%s\r\n", buf);
-        // might be better choice.
-        fprintf(_log_stream, "%s[%s]:%s\n", LOG_PREFIX, VB_NAMES[verbosity], buf);
-#endif
-        fflush(_log_stream);
+void log_flush_crash() {
+    // The crashed thread could hold the lock, or be in the middle of a batch
+    if (_log_ring.slots == NULL || pthread_mutex_trylock(&_log_flush_lock) != 0) {
+        return;
     }
 
-    // Shorthand that allows to use log_* macro in return statement
-    return -1;
+    int fd = (_log_stream != NULL) ? fileno(_log_stream) : STDERR_FILENO;
+    struct log_record *rec;
+    while ((rec = mpsc_peek(&_log_ring)) != NULL) {
+        if (rec->kind == REC_RAW) {
+            write_all(STDERR_FILENO, rec->text, rec->len);
+        }
+        else if (rec->kind == REC_TEXT) {
+            // No stdio and no time stamp, localtime isn't signal safe
+            char line[LOG_TEXT + 16];
+            const char *name = VB_NAMES[rec->verbosity];
+            int name_len = strlen(name);
+            line[0] = '[';
+            memcpy(line + 1, name, name_len);
+            memcpy(line + 1 + name_len, "]:", 2);
+            memcpy(line + 3 + name_len, rec->text, rec->len);
+            line[3 + name_len + rec->len] = '\n';
+            write_all(fd, line, 4 + name_len + rec->len);
+        }
+        // Hex dumps are skipped
+        mpsc_release(&_log_ring);
+    }
+    pthread_mutex_unlock(&_log_flush_lock);
 }
 
-void dump(const char *ptr, int len) {
+void dump_impl(const char *ptr, int len) {
     if (_opts.verbosity >= LOG_DEBUG) {
-        fwrite(ptr, len, 1, stderr);
+        log_raw(REC_RAW, ptr, len);
     }
 }
 
-void dump_as_hex(const char *msg, const uint8_t *ptr, int len) {
+void dump_as_hex_impl(const char *msg, const uint8_t *ptr, int len) {
     if (_opts.verbosity >= LOG_DEBUG) {
-        FILE *fp = stdout;
-
-        fprintf(fp, "======= %s (%d) : =========\n", msg, len);
-        for (int i = 0; i < len; i++) {
-            fprintf(fp, "%02x ", ptr[i]);
-            if (((i+1) % 16) == 0)
-              fprintf(fp, "\n");
-        }
-        fprintf(fp, "\n");
-        fflush(fp);
+        char title[LOG_TEXT];
+        int title_len = snprintf(title, sizeof(title), "======= %s (%d) : =========\n", msg, len);
+        log_raw(REC_RAW, title, MIN(title_len, (int) sizeof(title) - 1));
+        log_raw(REC_HEX, (const char *) ptr, len);
     }
 }
 
-void dump_by_line(const char *buf) {
+void dump_by_line_impl(const char *buf) {
     if (_opts.verbosity >= LOG_DEBUG) {
         int pos = 0;
         const char *line;
@@ -114,9 +426,189 @@ void dump_by_line(const char *buf) {
         while(pos != -1) {
             read_line(buf, &pos, &line, &line_len);
             if (line_len > 0) {
-                fwrite(line, line_len, 1, stderr);
+                log_raw(REC_RAW, line, line_len);
             }
         }
-        fflush(stderr);
     }
 }
+
+#ifdef _PDU_TEST
+
+#define STATUS ((ok) ? "+OK " : "!ERR")
+#define TEST_RECORDS 300
+
+static void *test_writer(void *arg) {
+    int id = *(int *) arg;
+    for (int i = 0; i < TEST_RECORDS; ++i) {
+        log_noise("T%d %d", id, i);
+    }
+    return NULL;
+}
+
+int test_log() {
+    printf("\n Testing logger:\n");
+
+    FILE *saved_stream = _log_stream;
+    int saved_verbosity = _opts.verbosity;
+    int errors = 0;
+    int ok;
+    char line[LOG_TEXT + 64];
+
+    _opts.verbosity = LOG_NOTICE;
+    _log_stream = tmpfile();
+    if (_log_stream == NULL) {
+        _log_stream = saved_stream;
+        return 1;
+    }
+
+    // Every record of every thread is written once, in thread order
+    int ids[2] = { 0, 1 };
+    pthread_t threads[2];
+    ok = (log_start() == 0);
+    for (int i = 0; i < 2 && ok; ++i) {
+        pthread_create(&threads[i], NULL, test_writer, &ids[i]);
+    }
+    for (int i = 0; i < 2 && ok; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    log_stop();
+
+    int next[2] = { 0, 0 };
+    rewind(_log_stream);
+    while (ok && fgets(line, sizeof(line), _log_stream) != NULL) {
+        int id, seq;
+        char *text = strstr(line, "]:T");
+        if (text == NULL || sscanf(text, "]:T%d %d", &id, &seq) != 2 || id < 0 || id > 1) {
+            ok = 0;
+            break;
+        }
+        ok = (seq == next[id]);
+        next[id] += 1;
+    }
+    ok = ok && next[0] == TEST_RECORDS && next[1] == TEST_RECORDS;
+    printf("%s Records of two threads through the flusher\n", STATUS);
+    errors += !ok;
+
+    // Idle flusher sleeps until the next record
+    rewind(_log_stream);
+    ftruncate(fileno(_log_stream), 0);
+    ok = (log_start() == 0);
+    for (int i = 0; i < 100 && ok && !__atomic_load_n(&_log_sleeping, __ATOMIC_SEQ_CST); ++i) {
+        usleep(10 * 1000);
+    }
+    ok = ok && __atomic_load_n(&_log_sleeping, __ATOMIC_SEQ_CST);
+    log_noise("W 0");
+    for (int i = 0; i < 100 && ok && ftell(_log_stream) == 0; ++i) {
+        usleep(10 * 1000);
+        fseek(_log_stream, 0, SEEK_END);
+    }
+    ok = ok && ftell(_log_stream) > 0;
+    log_stop();
+    printf("%s Idle flusher sleeps and wakes on a record\n", STATUS);
+    errors += !ok;
+
+    // Long message is truncated to the record, the rest of the line is intact
+    char long_text[LOG_TEXT * 2];
+    memset(long_text, 'x', sizeof(long_text) - 1);
+    long_text[sizeof(long_text) - 1] = 0;
+    rewind(_log_stream);
+    ftruncate(fileno(_log_stream), 0);
+    log_noise("%s", long_text);
+    rewind(_log_stream);
+    ok = (fgets(line, sizeof(line), _log_stream) != NULL);
+    ok = ok && strchr(line, '\n') != NULL && strspn(strstr(line, "]:") + 2, "x") == LOG_TEXT - 1;
+    printf("%s Long message is truncated\n", STATUS);
+    errors += !ok;
+
+    // Full ring drops records and reports them, nothing consumes the ring until log_flush
+    rewind(_log_stream);
+    ftruncate(fileno(_log_stream), 0);
+    __atomic_store_n(&_log_async, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < LOG_RING + 10; ++i) {
+        log_noise("F %d", i);
+    }
+    log_err("E 0");
+    __atomic_store_n(&_log_async, 0, __ATOMIC_RELEASE);
+    // Records are filled and written in place, every slot of the ring is aligned for time_t
+    struct log_record *head = mpsc_peek(&_log_ring);
+    int aligned = (head != NULL && (uintptr_t) head % _Alignof(struct log_record) == 0 &&
+                   _log_ring.stride % _Alignof(struct log_record) == 0);
+    log_flush();
+    int written = 0, dropped = 0, err_written = 0;
+    rewind(_log_stream);
+    while (fgets(line, sizeof(line), _log_stream) != NULL) {
+        if (strstr(line, "]:F ") != NULL) {
+            written += 1;
+        }
+        else if (strstr(line, "]:E 0") != NULL) {
+            err_written += 1;
+        }
+        else {
+            char *text = strstr(line, "]:");
+            dropped = (text != NULL) ? atoi(text + 2) : -1;
+        }
+    }
+    ok = (written == LOG_RING && dropped == 10 && err_written == 1);
+    printf("%s Full ring drops records but errors, drops are reported\n", STATUS);
+    errors += !ok;
+
+    ok = aligned;
+    printf("%s Records in the ring are aligned to %d\n", STATUS, (int) _Alignof(struct log_record));
+    errors += !ok;
+
+    // Crash flush writes queued records with write(2), and gives up if the log is being written
+    rewind(_log_stream);
+    ftruncate(fileno(_log_stream), 0);
+    __atomic_store_n(&_log_async, 1, __ATOMIC_RELEASE);
+    log_noise("C 0");
+    pthread_mutex_lock(&_log_flush_lock);
+    log_flush_crash();
+    pthread_mutex_unlock(&_log_flush_lock);
+    ok = (ftell(_log_stream) == 0 && lseek(fileno(_log_stream), 0, SEEK_END) == 0);
+    log_flush_crash();
+    __atomic_store_n(&_log_async, 0, __ATOMIC_RELEASE);
+    ok = ok && lseek(fileno(_log_stream), 0, SEEK_SET) == 0 && read(fileno(_log_stream), line, sizeof(line)) == 13;
+    ok = ok && strncmp(line, "[NOTICE]:C 0\n", 13) == 0 && mpsc_peek(&_log_ring) == NULL;
+    printf("%s Crash flush doesn't wait for the lock\n", STATUS);
+    errors += !ok;
+
+    // Disabled level doesn't evaluate arguments
+    int calls = 0;
+    log_debug("%d", ++calls);
+    dump_by_line((++calls, "OK"));
+    ok = (calls == 0);
+    printf("%s Disabled level doesn't evaluate arguments\n", STATUS);
+    errors += !ok;
+
+    // Hex dump is formatted by row, dumps go to stderr
+    uint8_t bytes[20];
+    for (int i = 0; i < (int) sizeof(bytes); ++i) {
+        bytes[i] = 0xF0 + i;
+    }
+    rewind(_log_stream);
+    ftruncate(fileno(_log_stream), 0);
+    _opts.verbosity = LOG_DEBUG;
+    fflush(stderr);
+    int saved_stderr = dup(2);
+    dup2(fileno(_log_stream), 2);
+    dump_as_hex("bytes", bytes, sizeof(bytes));
+    fflush(stderr);
+    dup2(saved_stderr, 2);
+    close(saved_stderr);
+    rewind(_log_stream);
+    ok = (fgets(line, sizeof(line), _log_stream) != NULL && strcmp(line, "======= bytes (20) : =========\n") == 0);
+    ok = ok && fgets(line, sizeof(line), _log_stream) != NULL && strncmp(line, "f0 f1 f2", 8) == 0 && strlen(line) == HEX_ROW * 3 + 1;
+    ok = ok && fgets(line, sizeof(line), _log_stream) != NULL && strcmp(line, "00 01 02 03 \n") == 0;
+    ok = ok || SMSF_LOG_LEVEL < LOG_DEBUG;
+    printf("%s Hex dump is formatted lazily\n", STATUS);
+    errors += !ok;
+
+    fclose(_log_stream);
+    _log_stream = saved_stream;
+    _opts.verbosity = saved_verbosity;
+
+    printf("Total results: %d errors\n\n", errors);
+    return errors;
+}
+
+#endif
@@ -44,6 +44,8 @@ struct smsf_options {
     int may_delete;   //! Delete forwarded messages, if disabled - keep messages until explicit clean or expire.
     int header;       //! Add original sender and TS information as an extra header
     int expire;       //! Expire mode - 0 disabled, 1 - soft, calculate the difference between earliest and latest SMS, 2 - hard, rely on network clock (not recommended)
+    int cnmi;         //! New message indication - 0 poll SIM in a loop, 1 - sleep until modem reports new message (+CMTI), 2 - route messages to TE (+CMT), bypass SIM
+    int encoding;     //! Outgoing text encoding - 0 GSM 7-bit if possible, otherwise UCS2, 1 - also transliterate Cyrillic if it takes fewer messages, 2 - always UCS2
 };
 
 #ifndef HAVE_SYSLOG
@@ -61,25 +63,96 @@ struct smsf_options {
 
 #define LOG_PREFIX "smsf:"
 
+/* Most verbose level compiled in, log_* calls above it and their arguments are removed by the compiler */
+#ifndef SMSF_LOG_LEVEL
+  #ifdef ESP_PLATFORM
+    // idf.py -DSMSF_LOG_LEVEL=7 build to keep debug output in the firmware
+    #define SMSF_LOG_LEVEL LOG_NOTICE
+  #else
+    #define SMSF_LOG_LEVEL LOG_DEBUG
+  #endif
+#endif
+
+extern struct smsf_options _opts;
+
+/* Checked before any argument is evaluated, level is a constant in every log_* macro */
+#define log_enabled(level) ((level) <= SMSF_LOG_LEVEL && (level) <= __atomic_load_n(&_opts.verbosity, __ATOMIC_RELAXED))
+#define log_at(level, err_code, err_str, fmt, args...) \
+    (log_enabled(level) ? log_impl(level, err_code, err_str, fmt, ##args) : log_skip())
+
+// Result of disabled log_* call, function rather than constant keeps compiler quiet about unused value
+static inline int log_skip() {
+    return -1;
+}
+
 /* Convience error checking */
 #define CHECK(a) if ((a) == -1) { return -1; }
 #define CHECK0(var, a) { var = (a); if (var != 0) { return var; } }
 
 /* Logging */
-#define log_write(fmt, args...)  log_impl(LOG_EMERG, 0, NULL, fmt, ##args)
-#define log_err(fmt, args...)    log_impl(LOG_ERR, 0, NULL, fmt, ##args)
-#define log_errno(fmt, args...)  log_impl(LOG_ERR, errno, strerror(errno), fmt, ##args)
-#define log_warn(fmt, args...)  log_impl(LOG_WARNING, 0, NULL, fmt, ##args)
-#define log_noise(fmt, args...)  log_impl(LOG_NOTICE, 0, NULL, fmt, ##args)
-// Not used #define log_info(fmt, args...)  log_impl(LOG_INFO, 0, NULL, fmt, ##args)
-#define log_debug(fmt, args...)  log_impl(LOG_DEBUG, 0, NULL, fmt, ##args)
+#define log_write(fmt, args...)  log_at(LOG_EMERG, 0, NULL, fmt, ##args)
+#define log_err(fmt, args...)    log_at(LOG_ERR, 0, NULL, fmt, ##args)
+#define log_errno(fmt, args...)  log_at(LOG_ERR, errno, strerror(errno), fmt, ##args)
+#define log_warn(fmt, args...)  log_at(LOG_WARNING, 0, NULL, fmt, ##args)
+#define log_noise(fmt, args...)  log_at(LOG_NOTICE, 0, NULL, fmt, ##args)
+// Not used #define log_info(fmt, args...)  log_at(LOG_INFO, 0, NULL, fmt, ##args)
+#define log_debug(fmt, args...)  log_at(LOG_DEBUG, 0, NULL, fmt, ##args)
 
 #define assert_ret(cond, fmt, args...) { if (!(cond)){ log_impl(LOG_ERR, 0, NULL, "%s:%d " fmt, __FILE__, __LINE__, ##args); return -1; }}
 
 int log_impl(int should_log, int err_code, const char *err_str, const char *format, ...);
 
-void dump(const char *ptr, int len);
-void dump_as_hex(const char *msg, const uint8_t *ptr, int len);
-void dump_by_line(const char *ptr);
+/**
+ * @brief Set prefix for log messages of the calling thread, e.g. modem port
+ *
+ * @param tag - null-terminated string, should outlive the thread, NULL to reset
+ */
+void log_set_tag(const char *tag);
+
+/**
+ * @brief Move log output to the background flusher. The caller only formats the message
+ *        into a slot of the lock-free ring, the flusher adds time stamps and writes records
+ *        in batches with one fflush per batch. If the ring is full, errors and warnings are written
+ *        by the caller, other records are dropped and the number of dropped records is reported later.
+ *        Before log_start and after log_stop records are written by the caller.
+ *
+ * @return int - 0 - success, -1 - error, logging stays synchronous
+ */
+int log_start();
+
+/**
+ * @brief Stop the flusher and write out queued records
+ */
+void log_stop();
+
+/**
+ * @brief Write out queued records, called at exit
+ */
+void log_flush();
+
+/**
+ * @brief Write out queued records from a signal handler, before abort. Doesn't use stdio and doesn't wait:
+ *        if another thread is writing the log, or the crashed thread was, nothing is written.
+ */
+void log_flush_crash();
+
+/* Dumps are debug output, disabled dump doesn't call anything */
+#define dump(ptr, len) (log_enabled(LOG_DEBUG) ? dump_impl(ptr, len) : (void) 0)
+#define dump_as_hex(msg, ptr, len) (log_enabled(LOG_DEBUG) ? dump_as_hex_impl(msg, ptr, len) : (void) 0)
+#define dump_by_line(ptr) (log_enabled(LOG_DEBUG) ? dump_by_line_impl(ptr) : (void) 0)
+
+void dump_impl(const char *ptr, int len);
+
+/**
+ * @brief Hex dump of binary data, the bytes are copied as is and formatted by the flusher
+ *
+ * @param msg - title of the dump
+ */
+void dump_as_hex_impl(const char *msg, const uint8_t *ptr, int len);
+void dump_by_line_impl(const char *ptr);
+
+#ifdef _PDU_TEST
+ int test_log();
+#endif
 
 #endif
@@ -0,0 +1,435 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "smsf-hal.h"
+#include "smsf-logging.h"
+#include "smsf-metrics.h"
+
+#define COPY_ATTEMPTS 1000 // Writer holds a section for microseconds, give up if it looks stuck
+
+static struct metrics_region *_metrics;
+static int _metrics_handle;
+
+int metrics_open(const char *name) {
+    char *image;
+    if (name == NULL) {
+        image = calloc(1, sizeof(struct metrics_region));
+        _metrics_handle = -1;
+        if (image == NULL) {
+            return log_err("Can't allocate %d bytes for metrics", (int) sizeof(struct metrics_region));
+        }
+    }
+    else if (store_open(name, sizeof(struct metrics_region), &image, &_metrics_handle) != 0) {
+        return log_errno("Can't open metrics %s", name);
+    }
+
+    // Counters of the previous run are dropped, header is valid only after magic is set
+    struct metrics_region *r = (struct metrics_region *) image;
+    __atomic_store_n(&r->magic, 0, __ATOMIC_RELEASE);
+    memset((char *) r + sizeof(r->magic), 0, sizeof(struct metrics_region) - sizeof(r->magic));
+    r->version = METRICS_VERSION;
+    r->size = sizeof(struct metrics_region);
+    r->pid = getpid();
+    r->started = time(NULL);
+    __atomic_store_n(&r->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+
+    _metrics = r;
+    return 0;
+}
+
+void metrics_close() {
+    if (_metrics != NULL && _metrics_handle == -1) {
+        free(_metrics);
+    }
+    else if (_metrics != NULL) {
+        store_close(_metrics_handle, (char *) _metrics, sizeof(struct metrics_region));
+    }
+    _metrics = NULL;
+}
+
+struct metrics_modem *metrics_attach(const char *port, const char *send_port) {
+    if (_metrics == NULL) {
+        return NULL;
+    }
+
+    for (int i = 0; i < SMSF_MAX_MODEMS; ++i) {
+        struct metrics_modem *mm = &_metrics->modems[i];
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&mm->in_use, &expected, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            strncpy(mm->port, port, sizeof(mm->port) - 1);
+            if (send_port != NULL) {
+                strncpy(mm->send_port, send_port, sizeof(mm->send_port) - 1);
+            }
+            mm->read.sim_messages = -1;
+            mm->read.sim_capacity = -1;
+            __atomic_store_n(&mm->in_use, 1, __ATOMIC_RELEASE);
+            return mm;
+        }
+    }
+    log_err("No metrics slot for %s", port);
+    return NULL;
+}
+
+void metrics_begin(uint32_t *seq) {
+    uint32_t s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+    __atomic_store_n(seq, s + 1, __ATOMIC_RELAXED);
+    // Readers that see the data being changed also see odd seq
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void metrics_end(uint32_t *seq) {
+    uint32_t s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+    __atomic_store_n(seq, s + 1, __ATOMIC_RELEASE);
+}
+
+int metrics_copy(void *dst, const void *src, size_t size) {
+    const uint32_t *seq = (const uint32_t *) src;
+    for (int i = 0; i < COPY_ATTEMPTS; ++i) {
+        uint32_t s1 = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if (s1 & 1) {
+            continue;
+        }
+        memcpy(dst, src, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(seq, __ATOMIC_RELAXED) == s1) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Prometheus exposition, one family per metric, samples of all modems in a row
+
+struct prom_modem {
+    const struct metrics_modem *mm;
+    struct metrics_read read;
+    struct metrics_send send;
+};
+
+struct prom_counter {
+    const char *name;
+    const char *type;
+    const char *help;
+    int send;           //! Taken from send section
+    size_t offs;        //! uint32_t or int32_t field, negative is unknown and skipped
+};
+
+static const struct prom_counter _prom_counters[] = {
+    { "messages_read_total", "counter", "New messages read from SIM or routed by the modem", 0, offsetof(struct metrics_read, messages_read) },
+    { "messages_deleted_total", "counter", "Messages deleted from SIM", 0, offsetof(struct metrics_read, messages_deleted) },
+    { "commands_total", "counter", "Command messages processed", 0, offsetof(struct metrics_read, commands) },
+    { "flow_cycles_total", "counter", "Flow cycles, every cycle reads SIM or routed messages", 0, offsetof(struct metrics_read, cycles) },
+    { "forward_success_total", "counter", "Messages sent to the destination", 1, offsetof(struct metrics_send, messages_sent) },
+    { "forward_failures_total", "counter", "Failed send attempts, retried from the outbox", 1, offsetof(struct metrics_send, send_errors) },
+    { "sim_messages", "gauge", "Messages stored on SIM", 0, offsetof(struct metrics_read, sim_messages) },
+    { "sim_capacity", "gauge", "Message slots of SIM", 0, offsetof(struct metrics_read, sim_capacity) },
+    { "outbox_messages", "gauge", "Messages waiting to be sent", 0, offsetof(struct metrics_read, outbox_depth) },
+    { "reassembly_pending", "gauge", "Long messages waiting for parts", 0, offsetof(struct metrics_read, reasm_groups) },
+    { "tracked_messages", "gauge", "Messages tracked until deleted from SIM", 0, offsetof(struct metrics_read, saved) },
+};
+
+// Latency buckets, us
+static const uint32_t _at_buckets[] = { 1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000 };
+// Latency buckets, ms
+static const uint32_t _forward_buckets[] = { 500, 1000, 2000, 5000, 10000, 30000, 60000, 120000, 300000, 600000 };
+
+// Append label to the label list, value is quoted, backslash, quote and new line are escaped
+static int append_label(char *buf, int size, int len, const char *name, const char *value) {
+    len += snprintf(buf + len, size - len, "%s%s=\"", (len > 0) ? "," : "", name);
+    for (const char *s = value; *s != 0 && len < size - 3; ++s) {
+        if (*s == '\\' || *s == '"' || *s == '\n') {
+            buf[len++] = '\\';
+        }
+        buf[len++] = (*s == '\n') ? 'n' : *s;
+    }
+    buf[len++] = '"';
+    buf[len] = 0;
+    return len;
+}
+
+static void prom_family(FILE *fp, const char *name, const char *type, const char *help) {
+    fprintf(fp, "# HELP s3smsf_%s %s\n# TYPE s3smsf_%s %s\n", name, help, name, type);
+}
+
+static void prom_histogram(FILE *fp, const char *name, const char *labels, const struct histogram *h,
+                           const uint32_t *bounds, int n_bounds, double scale) {
+    for (int i = 0; i < n_bounds; ++i) {
+        fprintf(fp, "s3smsf_%s_bucket{%s,le=\"%g\"} %u\n", name, labels, bounds[i] * scale, hist_count_below(h, bounds[i]));
+    }
+    fprintf(fp, "s3smsf_%s_bucket{%s,le=\"+Inf\"} %u\n", name, labels, h->count);
+    fprintf(fp, "s3smsf_%s_sum{%s} %g\n", name, labels, h->sum * scale);
+    fprintf(fp, "s3smsf_%s_count{%s} %u\n", name, labels, h->count);
+}
+
+// Labels of the modem, the read port names the modem everywhere
+static int modem_labels(char *buf, int size, const struct metrics_modem *mm, const char *at_port, const char *verb) {
+    int len = append_label(buf, size, 0, "modem", mm->port);
+    if (at_port != NULL) {
+        len = append_label(buf, size, len, "port", at_port);
+        len = append_label(buf, size, len, "verb", verb);
+    }
+    return len;
+}
+
+struct prom_at {
+    const char *name;
+    const char *help;
+    size_t offs;
+};
+
+static const struct prom_at _prom_at[] = {
+    { "at_commands_total", "AT commands sent", offsetof(struct at_stats, calls) },
+    { "at_errors_total", "AT commands answered with error", offsetof(struct at_stats, errors) },
+    { "at_timeouts_total", "AT commands without final result code in time", offsetof(struct at_stats, timeouts) },
+    { "at_sent_bytes_total", "Bytes sent to the modem", offsetof(struct at_stats, bytes_out) },
+    { "at_received_bytes_total", "Bytes received from the modem", offsetof(struct at_stats, bytes_in) },
+};
+
+// Visit AT stats of both ports of the modem
+static int prom_at_table(const struct prom_modem *pm, int send, const struct at_stats **stats, const char **port) {
+    if (send) {
+        *stats = pm->send.at;
+        *port = pm->mm->send_port;
+        return pm->send.n_at;
+    }
+    *stats = pm->read.at;
+    *port = pm->mm->port;
+    return pm->read.n_at;
+}
+
+int metrics_write_prom(FILE *fp, const struct metrics_region *region) {
+    // Snapshots are large, the exporter is the only caller
+    static struct prom_modem modems[SMSF_MAX_MODEMS];
+    char labels[256];
+    int n = 0;
+
+    if (__atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC || region->version != METRICS_VERSION ||
+        region->size != sizeof(struct metrics_region)) {
+        return -1;
+    }
+
+    for (int i = 0; i < SMSF_MAX_MODEMS; ++i) {
+        const struct metrics_modem *mm = &region->modems[i];
+        if (__atomic_load_n(&mm->in_use, __ATOMIC_ACQUIRE) != 1) {
+            continue;
+        }
+        modems[n].mm = mm;
+        if (metrics_copy(&modems[n].read, &mm->read, sizeof(modems[n].read)) == 0 &&
+            metrics_copy(&modems[n].send, &mm->send, sizeof(modems[n].send)) == 0) {
+            n += 1;
+        }
+    }
+
+    prom_family(fp, "start_time_seconds", "gauge", "Start time of the daemon since unix epoch");
+    fprintf(fp, "s3smsf_start_time_seconds %lld\n", (long long) region->started);
+
+    prom_family(fp, "operator_info", "gauge", "Connection info as reported by the modem");
+    for (int i = 0; i < n; ++i) {
+        int len = modem_labels(labels, sizeof(labels), modems[i].mm, NULL, NULL);
+        append_label(labels, sizeof(labels), len, "operator", modems[i].read.op_info);
+        fprintf(fp, "s3smsf_operator_info{%s} 1\n", labels);
+    }
+
+    prom_family(fp, "last_cycle_timestamp_seconds", "gauge", "End of the last flow cycle since unix epoch");
+    for (int i = 0; i < n; ++i) {
+        modem_labels(labels, sizeof(labels), modems[i].mm, NULL, NULL);
+        fprintf(fp, "s3smsf_last_cycle_timestamp_seconds{%s} %lld\n", labels, (long long) modems[i].read.updated);
+    }
+
+    for (int c = 0; c < (int) (sizeof(_prom_counters) / sizeof(_prom_counters[0])); ++c) {
+        const struct prom_counter *pc = &_prom_counters[c];
+        prom_family(fp, pc->name, pc->type, pc->help);
+        for (int i = 0; i < n; ++i) {
+            const char *section = (pc->send) ? (const char *) &modems[i].send : (const char *) &modems[i].read;
+            int32_t value;
+            memcpy(&value, section + pc->offs, sizeof(value));
+            if (strcmp(pc->type, "gauge") == 0 && value < 0) {
+                continue;
+            }
+            modem_labels(labels, sizeof(labels), modems[i].mm, NULL, NULL);
+            fprintf(fp, "s3smsf_%s{%s} %u\n", pc->name, labels, (uint32_t) value);
+        }
+    }
+
+    prom_family(fp, "forward_latency_seconds", "histogram", "Message seen on SIM to sent");
+    for (int i = 0; i < n; ++i) {
+        modem_labels(labels, sizeof(labels), modems[i].mm, NULL, NULL);
+        prom_histogram(fp, "forward_latency_seconds", labels, &modems[i].send.forward_ms, _forward_buckets,
+                       sizeof(_forward_buckets) / sizeof(_forward_buckets[0]), 1e-3);
+    }
+
+    for (int c = 0; c < (int) (sizeof(_prom_at) / sizeof(_prom_at[0])); ++c) {
+        prom_family(fp, _prom_at[c].name, "counter", _prom_at[c].help);
+        for (int i = 0; i < n; ++i) {
+            for (int send = 0; send < 2; ++send) {
+                const struct at_stats *stats;
+                const char *port;
+                int count = prom_at_table(&modems[i], send, &stats, &port);
+                for (int j = 0; j < count; ++j) {
+                    uint32_t value;
+                    memcpy(&value, (const char *) &stats[j] + _prom_at[c].offs, sizeof(value));
+                    modem_labels(labels, sizeof(labels), modems[i].mm, port, stats[j].verb);
+                    fprintf(fp, "s3smsf_%s{%s} %u\n", _prom_at[c].name, labels, value);
+                }
+            }
+        }
+    }
+
+    prom_family(fp, "at_latency_seconds", "histogram", "AT command sent to final result code received");
+    for (int i = 0; i < n; ++i) {
+        for (int send = 0; send < 2; ++send) {
+            const struct at_stats *stats;
+            const char *port;
+            int count = prom_at_table(&modems[i], send, &stats, &port);
+            for (int j = 0; j < count; ++j) {
+                modem_labels(labels, sizeof(labels), modems[i].mm, port, stats[j].verb);
+                prom_histogram(fp, "at_latency_seconds", labels, &stats[j].latency_us, _at_buckets,
+                               sizeof(_at_buckets) / sizeof(_at_buckets[0]), 1e-6);
+            }
+        }
+    }
+
+    return ferror(fp) ? -1 : 0;
+}
+
+int metrics_export(const char *name) {
+    char tmp[256];
+    if (_metrics == NULL) {
+        return -1;
+    }
+
+    // Collector never sees half written file, it reads *.prom only
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        return -1;
+    }
+    int res = metrics_write_prom(fp, _metrics);
+    res |= fclose(fp);
+    if (res != 0 || rename(tmp, name) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef _PDU_TEST
+
+#define STATUS ((ok) ? "+OK " : "!ERR")
+#define TEST_UPDATES 200000
+
+static void *test_writer(void *arg) {
+    struct metrics_read *section = (struct metrics_read *) arg;
+    for (uint32_t i = 1; i <= TEST_UPDATES; ++i) {
+        metrics_begin(&section->seq);
+        section->cycles = i;
+        section->messages_read = i;
+        section->at[AT_VERBS - 1].calls = i;
+        metrics_end(&section->seq);
+    }
+    return NULL;
+}
+
+int test_metrics() {
+    printf("\n Testing metrics:\n");
+
+    int errors = 0;
+    int ok;
+
+    ok = (metrics_attach("/dev/null", NULL) == NULL && metrics_open("smsf-test.metrics") == 0);
+    struct metrics_modem *mm = metrics_attach("/dev/ttyUSB0", "/dev/ttyUSB1");
+    ok = ok && _metrics->magic == METRICS_MAGIC && _metrics->size == sizeof(struct metrics_region);
+    ok = ok && mm != NULL && strcmp(mm->port, "/dev/ttyUSB0") == 0 && strcmp(mm->send_port, "/dev/ttyUSB1") == 0;
+    ok = ok && mm->read.sim_messages == -1 && mm->read.seq == 0;
+    printf("%s Open and attach\n", STATUS);
+    errors += !ok;
+
+    // Reader never sees a section the writer is in the middle of
+    struct metrics_read copy;
+    if (mm != NULL) {
+        metrics_begin(&mm->read.seq);
+        ok = ok && metrics_copy(&copy, &mm->read, sizeof(copy)) == -1;
+        mm->read.cycles = 5;
+        metrics_end(&mm->read.seq);
+        ok = ok && metrics_copy(&copy, &mm->read, sizeof(copy)) == 0 && copy.cycles == 5 && copy.seq == 2;
+        metrics_begin(&mm->read.seq);
+        mm->read.cycles = 0;
+        metrics_end(&mm->read.seq);
+    }
+    printf("%s Busy section is not copied\n", STATUS);
+    errors += !ok;
+
+    // Every copy taken while another thread updates the section is consistent
+    pthread_t writer;
+    int copies = 0;
+    ok = (mm != NULL && pthread_create(&writer, NULL, test_writer, &mm->read) == 0);
+    if (ok) {
+        do {
+            if (metrics_copy(&copy, &mm->read, sizeof(copy)) == 0) {
+                ok = ok && copy.cycles == copy.messages_read && copy.cycles == copy.at[AT_VERBS - 1].calls;
+                copies += 1;
+            }
+        } while (copy.cycles != TEST_UPDATES);
+        pthread_join(writer, NULL);
+    }
+    printf("%s Concurrent update, %d consistent copies\n", STATUS, copies);
+    errors += !ok;
+
+    // Exposition has families of every modem, quotes in labels are escaped
+    char prom[16384];
+    ok = (mm != NULL);
+    if (ok) {
+        metrics_begin(&mm->read.seq);
+        strcpy(mm->read.op_info, "Mega\"Fon\" 15");
+        mm->read.sim_messages = 3;
+        mm->read.n_at = 1;
+        strcpy(mm->read.at[0].verb, "CMGS");
+        mm->read.at[0].calls = 2;
+        memset(&mm->read.at[0].latency_us, 0, sizeof(struct histogram));
+        hist_add(&mm->read.at[0].latency_us, 3000);
+        hist_add(&mm->read.at[0].latency_us, 2000000);
+        metrics_end(&mm->read.seq);
+
+        FILE *fp = fmemopen(prom, sizeof(prom), "w");
+        ok = (fp != NULL && metrics_write_prom(fp, _metrics) == 0);
+        if (fp != NULL) {
+            fputc(0, fp);
+            fclose(fp);
+        }
+    }
+    ok = ok && strstr(prom, "# TYPE s3smsf_sim_messages gauge\ns3smsf_sim_messages{modem=\"/dev/ttyUSB0\"} 3\n") != NULL;
+    ok = ok && strstr(prom, "s3smsf_operator_info{modem=\"/dev/ttyUSB0\",operator=\"Mega\\\"Fon\\\" 15\"} 1\n") != NULL;
+    ok = ok && strstr(prom, "s3smsf_at_commands_total{modem=\"/dev/ttyUSB0\",port=\"/dev/ttyUSB0\",verb=\"CMGS\"} 2\n") != NULL;
+    ok = ok && strstr(prom, "s3smsf_at_latency_seconds_bucket{modem=\"/dev/ttyUSB0\",port=\"/dev/ttyUSB0\",verb=\"CMGS\",le=\"0.005\"} 1\n") != NULL;
+    ok = ok && strstr(prom, "s3smsf_at_latency_seconds_count{modem=\"/dev/ttyUSB0\",port=\"/dev/ttyUSB0\",verb=\"CMGS\"} 2\n") != NULL;
+    ok = ok && strstr(prom, "s3smsf_sim_capacity{") == NULL;
+    printf("%s Prometheus exposition\n", STATUS);
+    errors += !ok;
+
+    metrics_close();
+
+    printf("Total results: %d errors\n\n", errors);
+    return errors;
+}
+
+#endif
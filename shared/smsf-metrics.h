@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SMSF_METRICS_H
+#define _SMSF_METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "smsf-stats.h"
+#include "smsf-ata.h"
+
+#define METRICS_MAGIC 0x4D534D53 // SMSM
+#define METRICS_VERSION 1
+#define METRICS_NAME_SIZE 64
+
+/**
+ * @brief Counters of the read stage, written by the thread that reads SIM once per flow cycle.
+ *        Every section is guarded by its own seqlock: the writer makes seq odd, updates the section
+ *        and makes it even again, readers copy the section and retry if seq was odd or changed.
+ */
+struct metrics_read {
+    uint32_t seq;
+    int64_t updated;                //! Unix time of the last update
+    char op_info[METRICS_NAME_SIZE]; //! Operator and signal as reported by ata_op_info
+    int32_t sim_messages;           //! -1 - unknown
+    int32_t sim_capacity;           //! -1 - unknown
+    uint32_t cycles;
+    uint32_t messages_read;         //! New messages, parts of long messages are counted one by one
+    uint32_t messages_deleted;
+    uint32_t commands;
+    uint32_t outbox_depth;
+    uint32_t reasm_groups;          //! Long messages waiting for parts
+    uint32_t saved;                 //! Messages tracked until deleted from SIM
+    int32_t n_at;
+    struct at_stats at[AT_VERBS];
+};
+
+/**
+ * @brief Counters of the send stage, written after every send by the thread that sends
+ */
+struct metrics_send {
+    uint32_t seq;
+    int64_t updated;
+    uint32_t messages_sent;
+    uint32_t send_errors;
+    struct histogram forward_ms;    //! Seen to sent
+    int32_t n_at;                   //! 0 - the modem sends through the read port
+    struct at_stats at[AT_VERBS];
+};
+
+struct metrics_modem {
+    int32_t in_use;
+    char port[METRICS_NAME_SIZE];
+    char send_port[METRICS_NAME_SIZE]; //! Empty - the modem sends through the read port
+    struct metrics_read read;
+    struct metrics_send send;
+};
+
+/**
+ * @brief Memory mapped file shared with s3smsf-stat, updates cost no system calls.
+ *        Readers check magic, version and size, so the tool never misreads a region of other build.
+ */
+struct metrics_region {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    int32_t pid;
+    int64_t started;                //! Unix time
+    struct metrics_modem modems[SMSF_MAX_MODEMS];
+};
+
+/**
+ * @brief Create or reset metrics file and map it
+ *
+ * @param name - file name, e.g. /run/s3smsf.metrics, NULL - keep metrics in memory for metrics_export only
+ * @return int - 0 - success, -1 - error, metrics are not published
+ */
+int metrics_open(const char *name);
+void metrics_close();
+
+/**
+ * @brief Claim modem slot in the region
+ *
+ * @param port - read port
+ * @param send_port - separate send port or NULL
+ * @return struct metrics_modem* - slot, NULL - metrics are not open or no free slot
+ */
+struct metrics_modem *metrics_attach(const char *port, const char *send_port);
+
+// Writer side of section seqlock, one writer per section
+void metrics_begin(uint32_t *seq);
+void metrics_end(uint32_t *seq);
+
+/**
+ * @brief Reader side of section seqlock, copy consistent snapshot of the section
+ *
+ * @param dst - output
+ * @param src - section, starts with seq
+ * @param size - section size
+ * @return int - 0 - success, -1 - the writer is always busy
+ */
+int metrics_copy(void *dst, const void *src, size_t size);
+
+/**
+ * @brief Write metrics in Prometheus text exposition format
+ *
+ * @param fp - output
+ * @param region - region of this process or mapped by s3smsf-stat
+ * @return int - 0 - success, -1 - region is not valid or write error
+ */
+int metrics_write_prom(FILE *fp, const struct metrics_region *region);
+
+/**
+ * @brief Replace Prometheus textfile collector file with current metrics,
+ *        the file is written to <name>.tmp and renamed, so the collector never reads it half written
+ *
+ * @param name - file name, e.g. /var/lib/node_exporter/textfile/s3smsf.prom
+ * @return int - 0 - success, -1 - error, errno is set, nothing is logged
+ */
+int metrics_export(const char *name);
+
+#ifdef _PDU_TEST
+ int test_metrics();
+#endif
+
+#endif
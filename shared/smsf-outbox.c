@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "smsf-hal.h"
+#include "smsf-logging.h"
+#include "smsf-util.h"
+#include "smsf-pdu.h"
+#include "smsf-outbox.h"
+
+#define OUTBOX_MAGIC 0x32534D53 // SMS2, message header with trace stamps, SMSO images are not replayed
+#define REGION_SIZE (OUTBOX_SIZE / 2)
+#define ALIGN8(x) (((x) + 7) & ~7)
+
+#define OP_PUT 1
+#define OP_DONE 2
+
+struct outbox_header {
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t reserved;
+    uint32_t check;
+};
+
+// Entry is followed by the message (OP_PUT only), padded to 8 bytes
+struct outbox_entry {
+    uint32_t generation;
+    uint32_t id;
+    uint16_t len;       //! Message length
+    uint8_t op;
+    uint8_t flags;
+    uint32_t check;     //! Covers the entry and the message, so torn writes are detected
+};
+
+#define REGION_START(region) ((region) * REGION_SIZE + (int) sizeof(struct outbox_header))
+#define REGION_END(region) ((region + 1) * REGION_SIZE)
+
+static uint32_t header_check(const struct outbox_header *h) {
+    return (uint32_t) fnv1a64(FNV64_INIT, h, offsetof(struct outbox_header, check));
+}
+
+static uint32_t entry_check(const struct outbox_entry *e) {
+    uint64_t h = fnv1a64(FNV64_INIT, e, offsetof(struct outbox_entry, check));
+    return (uint32_t) fnv1a64(h, e + 1, e->len);
+}
+
+static int entry_size(int len) {
+    return sizeof(struct outbox_entry) + ALIGN8(len);
+}
+
+static int msg_len(const struct sms_message *msg) {
+    return sizeof(struct sms_message) + strlen(msg->text) + 1;
+}
+
+static int sync_range(struct outbox *o, int offs, int len) {
+    if (o->handle == -1 || len == 0) {
+        return 0;
+    }
+    return store_sync(o->handle, o->image, offs, len);
+}
+
+static void write_header(struct outbox *o, int region, uint32_t generation) {
+    struct outbox_header *h = (struct outbox_header *) (o->image + region * REGION_SIZE);
+    h->magic = OUTBOX_MAGIC;
+    h->generation = generation;
+    h->reserved = 0;
+    h->check = header_check(h);
+}
+
+// Write entry at offs, return its size
+static int write_entry(struct outbox *o, int offs, uint32_t generation, uint32_t id, int op, int flags, const void *data, int len) {
+    struct outbox_entry *e = (struct outbox_entry *) (o->image + offs);
+    e->generation = generation;
+    e->id = id;
+    e->len = len;
+    e->op = op;
+    e->flags = flags;
+    if (len > 0) {
+        memcpy(e + 1, data, len);
+    }
+    e->check = entry_check(e);
+    return entry_size(len);
+}
+
+int outbox_find(const struct outbox *o, uint32_t id) {
+    for (int i = 0; i < o->count; ++i) {
+        if (o->items[i].id == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void remove_item(struct outbox *o, int idx) {
+    // Keep the order, messages are sent as they arrived
+    memmove(&o->items[idx], &o->items[idx + 1], (o->count - idx - 1) * sizeof(struct outbox_item));
+    o->count -= 1;
+}
+
+// Copy pending messages to the other region, switch to it when the header is durable
+static int compact(struct outbox *o) {
+    int target = 1 - o->region;
+    int offs = REGION_START(target);
+    uint32_t generation = o->generation + 1;
+    int new_offs[OUTBOX_MAX_PENDING];
+
+    for (int i = 0; i < o->count; ++i) {
+        const struct outbox_entry *e = (const struct outbox_entry *) (o->image + o->items[i].offs) - 1;
+        new_offs[i] = offs + sizeof(struct outbox_entry);
+        offs += write_entry(o, offs, generation, e->id, OP_PUT, e->flags, e + 1, e->len);
+    }
+    CHECK(sync_range(o, REGION_START(target), offs - REGION_START(target)));
+
+    write_header(o, target, generation);
+    CHECK(sync_range(o, target * REGION_SIZE, sizeof(struct outbox_header)));
+
+    log_debug("Outbox compacted %d -> %d bytes, %d messages, generation %u", o->used, offs - REGION_START(target), o->count, generation);
+    for (int i = 0; i < o->count; ++i) {
+        o->items[i].offs = new_offs[i];
+    }
+    o->generation = generation;
+    o->region = target;
+    o->used = offs - REGION_START(target);
+    o->synced = o->used;
+    return 0;
+}
+
+// Append entry to the active region, compact it if there is no room
+static int append(struct outbox *o, uint32_t id, int op, int flags, const void *data, int len) {
+    int size = entry_size(len);
+    if (REGION_START(o->region) + o->used + size > REGION_END(o->region)) {
+        if (compact(o) != 0) {
+            log_err("Outbox compaction error");
+            return -1;
+        }
+        if (REGION_START(o->region) + o->used + size > REGION_END(o->region)) {
+            return -1;
+        }
+    }
+
+    int offs = REGION_START(o->region) + o->used;
+    o->used += write_entry(o, offs, o->generation, id, op, flags, data, len);
+    return offs + sizeof(struct outbox_entry);
+}
+
+static int outbox_load(struct outbox *o) {
+    o->region = -1;
+    o->generation = 0;
+    o->count = 0;
+    o->next_id = 1;
+
+    for (int i = 0; i < 2; ++i) {
+        const struct outbox_header *h = (const struct outbox_header *) (o->image + i * REGION_SIZE);
+        if (h->magic == OUTBOX_MAGIC && h->check == header_check(h) && (o->region == -1 || h->generation > o->generation)) {
+            o->region = i;
+            o->generation = h->generation;
+        }
+    }
+
+    if (o->region == -1) {
+        o->region = 0;
+        o->generation = 1;
+        o->used = 0;
+        o->synced = 0;
+        o->committed_id = o->next_id;
+        write_header(o, 0, o->generation);
+        return sync_range(o, 0, sizeof(struct outbox_header));
+    }
+
+    int offs = REGION_START(o->region);
+    while (offs + (int) sizeof(struct outbox_entry) <= REGION_END(o->region)) {
+        const struct outbox_entry *e = (const struct outbox_entry *) (o->image + offs);
+        if (e->generation != o->generation || offs + entry_size(e->len) > REGION_END(o->region) || e->check != entry_check(e)) {
+            break;
+        }
+
+        if (e->op == OP_PUT && o->count < OUTBOX_MAX_PENDING) {
+            struct outbox_item *item = &o->items[o->count++];
+            item->id = e->id;
+            item->offs = offs + sizeof(struct outbox_entry);
+            item->flags = e->flags | OUTBOX_REPLAYED;
+            item->attempts = 0;
+            item->next_ms = 0;
+        }
+        else if (e->op == OP_DONE) {
+            int idx = outbox_find(o, e->id);
+            if (idx != -1) {
+                remove_item(o, idx);
+            }
+        }
+
+        if (e->id >= o->next_id) {
+            o->next_id = e->id + 1;
+        }
+        offs += entry_size(e->len);
+    }
+
+    o->used = offs - REGION_START(o->region);
+    o->synced = o->used;
+    o->committed_id = o->next_id;
+    return 0;
+}
+
+int outbox_open(struct outbox *o, const char *name) {
+    o->handle = -1;
+    if (name == NULL) {
+        o->image = calloc(1, OUTBOX_SIZE);
+        if (o->image == NULL) {
+            log_err("Can't allocate %d bytes for outbox", OUTBOX_SIZE);
+            return -1;
+        }
+    }
+    else if (store_open(name, OUTBOX_SIZE, &o->image, &o->handle) != 0) {
+        log_errno("Can't open outbox %s", name);
+        return -1;
+    }
+
+    CHECK(outbox_load(o));
+    if (o->count > 0) {
+        log_noise("Outbox %s: %d messages to send, generation %u", (name != NULL) ? name : "(memory)", o->count, o->generation);
+    }
+    return 0;
+}
+
+int outbox_put(struct outbox *o, const struct sms_message *msg, int flags) {
+    int len = msg_len(msg);
+    if (REGION_START(0) + entry_size(len) > REGION_END(0)) {
+        return OUTBOX_TOO_BIG;
+    }
+    if (o->count == OUTBOX_MAX_PENDING) {
+        return OUTBOX_FULL;
+    }
+
+    // Copy the header and actual text only, text_size is trimmed to match
+    int offs = append(o, o->next_id, OP_PUT, flags, msg, len);
+    if (offs == -1) {
+        return OUTBOX_FULL;
+    }
+    struct outbox_entry *e = (struct outbox_entry *) (o->image + offs) - 1;
+    ((struct sms_message *) (e + 1))->text_size = len - sizeof(struct sms_message);
+    e->check = entry_check(e);
+
+    struct outbox_item *item = &o->items[o->count++];
+    item->id = o->next_id++;
+    item->offs = offs;
+    item->flags = flags;
+    item->attempts = 0;
+    item->next_ms = 0;
+    return 0;
+}
+
+int outbox_commit(struct outbox *o) {
+    int start = REGION_START(o->region);
+    CHECK(sync_range(o, start + o->synced, o->used - o->synced));
+    o->synced = o->used;
+    o->committed_id = o->next_id;
+    return 0;
+}
+
+int outbox_due(const struct outbox *o, int64_t now) {
+    for (int i = 0; i < o->count; ++i) {
+        if (o->items[i].next_ms <= now && o->items[i].id < o->committed_id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const struct sms_message *outbox_msg(const struct outbox *o, int idx) {
+    return (const struct sms_message *) (o->image + o->items[idx].offs);
+}
+
+void outbox_done(struct outbox *o, int idx) {
+    uint32_t id = o->items[idx].id;
+    remove_item(o, idx);
+    // Synced with the next commit, lost record means the message is sent once more after power loss
+    if (append(o, id, OP_DONE, 0, NULL, 0) == -1) {
+        log_err("Can't record sent message %u", id);
+    }
+}
+
+void outbox_retry(struct outbox *o, int idx, int64_t now) {
+    struct outbox_item *item = &o->items[idx];
+    int64_t delay = (int64_t) OUTBOX_RETRY_MIN << MIN(item->attempts, 16);
+    item->attempts += 1;
+    item->next_ms = now + MIN(delay, OUTBOX_RETRY_MAX);
+}
+
+int64_t outbox_next_ms(const struct outbox *o) {
+    int64_t next = -1;
+    for (int i = 0; i < o->count; ++i) {
+        if (o->items[i].id >= o->committed_id) {
+            break;
+        }
+        if (next == -1 || o->items[i].next_ms < next) {
+            next = o->items[i].next_ms;
+        }
+    }
+    return next;
+}
+
+void outbox_close(struct outbox *o) {
+    if (o->image == NULL) {
+        return;
+    }
+    if (o->handle == -1) {
+        free(o->image);
+    }
+    else {
+        store_close(o->handle, o->image, OUTBOX_SIZE);
+    }
+    o->image = NULL;
+}
+
+#ifdef _PDU_TEST
+
+#define STATUS ((ok) ? "+OK " : "!ERR")
+
+static struct sms_message *make_msg(char *buf, const char *text) {
+    struct sms_message *msg = (struct sms_message *) buf;
+    memset(msg, 0, sizeof(struct sms_message));
+    strcpy(msg->sender, "+79219800469");
+    strcpy(msg->text, text);
+    msg->text_size = strlen(text) + 1;
+    return msg;
+}
+
+int test_outbox() {
+    printf("\n Testing outbox:\n");
+
+    struct outbox *o = malloc(sizeof(struct outbox));
+    struct outbox *r = malloc(sizeof(struct outbox));
+    char buf[sizeof(struct sms_message) + 256];
+    int errors = 0;
+    int ok;
+
+    ok = (outbox_open(o, NULL) == 0);
+    outbox_put(o, make_msg(buf, "First"), 0);
+    outbox_put(o, make_msg(buf, "Second"), OUTBOX_MULTIPART);
+    outbox_put(o, make_msg(buf, "Third"), 0);
+    ok = ok && outbox_due(o, 0) == -1 && outbox_next_ms(o) == -1;
+    printf("%s Messages are not sent before commit\n", STATUS);
+    errors += !ok;
+
+    outbox_commit(o);
+    outbox_done(o, 0);
+
+    // Replay the same image as if the program is restarted
+    memcpy(r, o, sizeof(struct outbox));
+    ok = outbox_load(r) == 0 && r->count == 2 &&
+         strcmp(outbox_msg(r, 0)->text, "Second") == 0 && r->items[0].flags == (OUTBOX_MULTIPART | OUTBOX_REPLAYED) &&
+         strcmp(outbox_msg(r, 1)->text, "Third") == 0 && r->next_id == 4;
+    printf("%s Replayed %d messages\n", STATUS, r->count);
+    errors += !ok;
+
+    outbox_retry(o, 0, 1000);
+    outbox_retry(o, 0, 1000);
+    ok = (outbox_due(o, 1000) == 1 && o->items[0].next_ms == 1000 + 2 * OUTBOX_RETRY_MIN &&
+          outbox_next_ms(o) == 0);
+    printf("%s Failed message is retried with backoff\n", STATUS);
+    errors += !ok;
+
+    // Send and receive many messages, compaction keeps pending ones
+    uint32_t generation = o->generation;
+    memset(buf + sizeof(struct sms_message), 'A', 200);
+    for (int i = 0; i < OUTBOX_SIZE / 100; ++i) {
+        buf[sizeof(struct sms_message) + 200] = 0;
+        outbox_put(o, (struct sms_message *) buf, 0);
+        outbox_done(o, o->count - 1);
+    }
+    outbox_commit(o);
+    memcpy(r, o, sizeof(struct outbox));
+    ok = outbox_load(r) == 0 && r->generation > generation && r->count == 2 &&
+         strcmp(outbox_msg(r, 0)->text, "Second") == 0;
+    printf("%s Compacted to generation %u, %d messages\n", STATUS, r->generation, r->count);
+    errors += !ok;
+
+    ok = (outbox_put(o, make_msg(buf, ""), 0) == 0);
+    memset(buf + sizeof(struct sms_message), 'A', 255);
+    buf[sizeof(struct sms_message) + 255] = 0;
+    while (outbox_put(o, (struct sms_message *) buf, 0) == 0);
+    ok = ok && o->count == OUTBOX_MAX_PENDING;
+    printf("%s Outbox is capped at %d messages\n", STATUS, o->count);
+    errors += !ok;
+
+    outbox_close(o);
+    free(o);
+    free(r);
+
+    printf("Total results: %d errors\n\n", errors);
+    return errors;
+}
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SMSF_OUTBOX_H
+#define _SMSF_OUTBOX_H
+
+#include <stdint.h>
+
+struct sms_message;
+
+#ifdef ESP_PLATFORM
+  #define OUTBOX_SIZE 4096          //! Two regions, NVS blob
+  #define OUTBOX_MAX_PENDING 16     //! Messages waiting to be sent
+#else
+  #define OUTBOX_SIZE (256 * 1024)  //! Two regions, mapped file
+  #define OUTBOX_MAX_PENDING 256
+#endif
+
+#define OUTBOX_RETRY_MIN (2 * 1000)     //! First retry delay, doubled on every failure, ms
+#define OUTBOX_RETRY_MAX (300 * 1000)   //! Retry delay limit, ms
+
+#define OUTBOX_FULL -1      //! No room, try later
+#define OUTBOX_TOO_BIG -2   //! Message never fits the outbox, send it directly
+
+struct outbox_item {
+    uint32_t id;
+    int offs;           //! Message offset in the image
+    uint8_t flags;      //! OUTBOX_MULTIPART, OUTBOX_REPLAYED
+    int attempts;
+    int64_t next_ms;    //! Don't retry before this time, monotonic ms
+};
+
+#define OUTBOX_MULTIPART 1
+#define OUTBOX_REPLAYED 2   //! Put before restart, trace stamps of the message are not valid, never written
+
+/**
+ * @brief Durable queue of messages to send, write-ahead log with group commit.
+ *        Messages are appended by outbox_put and become durable together on outbox_commit.
+ *        Layout and compaction are the same as in the journal: two regions, the one
+ *        with the highest valid generation is active, so replay scans one region at most.
+ */
+struct outbox {
+    char *image;
+    int handle;         //! -1 - image is not persisted
+    int region;
+    uint32_t generation;
+    int used;           //! Bytes used in the active region
+    int synced;         //! Bytes of the active region already durable
+    uint32_t next_id;
+    uint32_t committed_id;  //! Messages with lower id are durable, only they are sent
+    int count;
+    struct outbox_item items[OUTBOX_MAX_PENDING];
+};
+
+/**
+ * @brief Open outbox and replay it, messages accepted before restart are sent again
+ *
+ * @param o - outbox
+ * @param name - storage name, see store_open, NULL - keep messages in memory only
+ * @return int - 0 - success, -1 - error, the outbox is not usable
+ */
+int outbox_open(struct outbox *o, const char *name);
+
+/**
+ * @brief Append message, it's durable only after outbox_commit
+ *
+ * @param o - outbox
+ * @param msg - message to send, header and text are copied
+ * @param flags - OUTBOX_MULTIPART to send long message as several parts, otherwise truncate it
+ * @return int - 0 - success, OUTBOX_FULL or OUTBOX_TOO_BIG
+ */
+int outbox_put(struct outbox *o, const struct sms_message *msg, int flags);
+
+/**
+ * @brief Make all appended messages durable with one sync
+ *
+ * @return int - 0 - success, -1 - storage error
+ */
+int outbox_commit(struct outbox *o);
+
+/**
+ * @brief Find message ready to be sent, messages not committed yet are skipped
+ *
+ * @param o - outbox
+ * @param now - current time, monotonic ms
+ * @return int - item index, -1 if nothing is due
+ */
+int outbox_due(const struct outbox *o, int64_t now);
+
+/**
+ * @brief Find item by message id, index of the item changes when other items are removed
+ *
+ * @return int - item index, -1 if the message is not in the outbox
+ */
+int outbox_find(const struct outbox *o, uint32_t id);
+
+/**
+ * @brief Message of the item, it points into the outbox and must be copied before sending
+ */
+const struct sms_message *outbox_msg(const struct outbox *o, int idx);
+
+/**
+ * @brief Message is sent, remove it from the outbox
+ */
+void outbox_done(struct outbox *o, int idx);
+
+/**
+ * @brief Sending failed, retry later with exponential backoff
+ */
+void outbox_retry(struct outbox *o, int idx, int64_t now);
+
+/**
+ * @brief Time of the earliest retry
+ *
+ * @return int64_t - monotonic ms, -1 if there is nothing to send
+ */
+int64_t outbox_next_ms(const struct outbox *o);
+
+void outbox_close(struct outbox *o);
+
+#ifdef _PDU_TEST
+ int test_outbox();
+#endif
+
+#endif
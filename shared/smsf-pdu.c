@@ -22,30 +22,22 @@
 #include "smsf-util.h"
 #include "smsf-logging.h"
 #include "smsf-pdu.h"
+#include "smsf-pool.h"
+#include "smsf-gsm.h"
 
 // https://en.wikipedia.org/wiki/GSM_03.40
 
 extern struct smsf_options _opts;
 
-static struct sms_pdu *new_pdus(int n_pdus) {
-    struct sms_pdu *pdus = malloc(sizeof(struct sms_pdu) * n_pdus);
+// PDUs live until the caller rewinds the scratch arena
+static struct sms_pdu *new_pdus(struct arena *scratch, int n_pdus) {
+    struct sms_pdu *pdus = arena_alloc(scratch, sizeof(struct sms_pdu) * n_pdus);
     if (pdus == NULL) {
-       log_err("Can't allocate %d bytes memory for %d pdus", sizeof(struct sms_pdu) * n_pdus, n_pdus);
-       abort();
-       return NULL;
+       log_err("Can't allocate %d bytes memory for %d pdus", (int) sizeof(struct sms_pdu) * n_pdus, n_pdus);
     }
     return pdus;
 }
 
-static int need_ucs2(const char *input, int input_len) {
-    for(int i = 0; i < input_len; ++i) {
-        if ((input[i] & 0x80) != 0) {
-            return 1; // Has non- ascii characters, need UCS2 encoding
-        }
-    }
-    return 0; // 7-bit is enough
-}
-
 // Convert a phone number to semi-octet format, keep hex representation
 static int encode_semi_octets(const char *input, int input_len, unsigned char *output) {
     int i, j;
@@ -65,61 +57,126 @@ static int encode_semi_octets(const char *input, int input_len, unsigned char *o
 static int decode_semi_octets(const unsigned char* input, int input_len, char* output, int output_size) {
     int j = 0;
     for (int i = 0; i < input_len; ++i) {
-        output[j] = '0' + (input[i] & 0x0F);
-        output[j + 1] = ((input[i] >> 4) == 0xF) ? 0 : '0' + (input[i] >> 4);
-        if (j >= output_size) {
+        if (j + 1 >= output_size) {
             log_debug("decode_semi_octet output truncated to %d", output_size);
             break;
         }
+        output[j] = '0' + (input[i] & 0x0F);
+        output[j + 1] = ((input[i] >> 4) == 0xF) ? 0 : '0' + (input[i] >> 4);
         j += 2;
     }
-    output[j] = 0;
+    output[MIN(j, output_size - 1)] = 0;
     return j; // output_len
 }
 
-// Function to encode a message text into 7-bit GSM default alphabet
-static int encode_7bit(const char *input, int input_len, unsigned char *output) {
-    int bit_offset = 0;
+// Septets are packed 8 to 7 octets, groups are loaded and stored as 64-bit words
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  #define SEPTET_WORDS 1
+#endif
 
-    for (int i = 0; i < input_len; i++) {
-        int current_char = input[i] & 0x7F;
-        int shift = bit_offset % 8;
-        if (shift == 0) {
-            output[bit_offset / 8] = current_char;
-        } else {
-            output[bit_offset / 8] |= current_char << shift;
-            output[bit_offset / 8 + 1] = current_char >> (8 - shift);
+/**
+ * @brief Pack septets to octets, least significant bit first
+ *
+ * @param input - septets, see gsm_encode
+ * @param input_len - number of septets to pack
+ * @param fill_bits - zero bits before the first septet, aligns text after UDH to septet boundary
+ * @param output - (fill_bits + 7 * input_len + 7) / 8 bytes
+ * @return int - number of bytes written
+ */
+static int pack_7bit(const char *input, int input_len, int fill_bits, unsigned char *output) {
+    uint64_t acc = 0;   // Bits not written yet, always less than 8
+    int acc_bits = fill_bits;
+    int i = 0, j = 0;
+
+#ifdef SEPTET_WORDS
+    for (; i + 8 <= input_len; i += 8, j += 7) {
+        uint64_t x;
+        memcpy(&x, input + i, sizeof(x));
+        // Squeeze out the high bit of every byte: 8x7 -> 4x14 -> 2x28 -> 56 bits
+        x &= 0x7F7F7F7F7F7F7F7FULL;
+        x = (x & 0x007F007F007F007FULL) | ((x & 0x7F007F007F007F00ULL) >> 1);
+        x = (x & 0x00003FFF00003FFFULL) | ((x & 0x3FFF00003FFF0000ULL) >> 2);
+        x = (x & 0x000000000FFFFFFFULL) | ((x & 0x0FFFFFFF00000000ULL) >> 4);
+        x = acc | (x << acc_bits);
+        memcpy(output + j, &x, 7);
+        acc = x >> 56;
+    }
+#endif
+
+    for (; i < input_len; ++i) {
+        acc |= (uint64_t) (input[i] & 0x7F) << acc_bits;
+        acc_bits += 7;
+        if (acc_bits >= 8) {
+            output[j++] = acc & 0xFF;
+            acc >>= 8;
+            acc_bits -= 8;
         }
-        bit_offset += 7;
     }
-    int output_len = (bit_offset + 7) / 8;
-    output[output_len] = 0;
-    return output_len;
+    if (acc_bits > 0) {
+        output[j++] = acc & 0xFF;
+    }
+    return j;
 }
 
-// Function to decode GSM 7-bit encoded string
-static int decode_7bit(const unsigned char *input, int input_length, char *output, int output_size) {
-    int i = 0, j = 0, shift = 0;
-    unsigned char prev = 0;
+/**
+ * @brief Unpack septets, the caller ensures that input has them
+ *
+ * @param input - user data
+ * @param input_len - number of bytes available in input
+ * @param start_bit - position of the first septet, UDH and fill bits are skipped
+ * @param septets - number of septets to unpack
+ * @param output - septets output, not terminated
+ * @return int - number of septets written
+ */
+static int unpack_7bit(const unsigned char *input, int input_len, int start_bit, int septets, char *output) {
+    int i = 0;
+    int bit = start_bit;
+
+#ifdef SEPTET_WORDS
+    // 56 bits of the group start within the first byte of 8 loaded
+    for (; i + 8 <= septets && bit / 8 + 8 <= input_len; i += 8, bit += 56) {
+        uint64_t x;
+        memcpy(&x, input + bit / 8, sizeof(x));
+        x = (x >> (bit % 8)) & 0x00FFFFFFFFFFFFFFULL;
+        // Spread 56 bits to high bits clear bytes: 2x28 -> 4x14 -> 8x7
+        x = (x & 0x000000000FFFFFFFULL) | ((x & 0x00FFFFFFF0000000ULL) << 4);
+        x = (x & 0x00003FFF00003FFFULL) | ((x & 0x0FFFC0000FFFC000ULL) << 2);
+        x = (x & 0x007F007F007F007FULL) | ((x & 0x3F803F803F803F80ULL) << 1);
+        memcpy(output + i, &x, sizeof(x));
+    }
+#endif
 
-    while(i < input_length) {
-        output[j] = ((input[i] << shift) & 0x7F) | (prev >> (8 - shift));
-        prev = input[i];
-        shift++;
-        if (j >= output_size) {
-            log_debug("decode_7bit output truncated to %d", output_size);
-            break;
-        }
-        j += 1;
-        if (shift == 7) { // flash the accum
-            output[j++] = prev >> 1;
-            shift = 0;
-            prev = 0;
+    for (; i < septets; ++i, bit += 7) {
+        unsigned v = input[bit / 8];
+        if (bit / 8 + 1 < input_len) {
+            v |= input[bit / 8 + 1] << 8;
         }
-        i += 1;
+        output[i] = (v >> (bit % 8)) & 0x7F;
     }
-    output[i] = 0;  // Null-terminate the output string
-    return j; // output_len
+    return i;
+}
+
+/**
+ * @brief Decode 7-bit GSM default alphabet to UTF-8, output is null-terminated
+ *
+ * @param input - user data
+ * @param input_len - number of bytes available in input
+ * @param start_bit - position of the first septet, UDH and fill bits are skipped
+ * @param septets - number of septets to decode, it's truncated to input size
+ * @param output - output buffer, text is truncated to its size
+ * @param output_size - output buffer size, including trailing zero
+ * @return int - number of bytes written
+ */
+static int decode_7bit(const unsigned char *input, int input_len, int start_bit, int septets, char *output, int output_size) {
+    int available = (input_len * 8 - start_bit) / 7;
+    if (septets > available) {
+        log_debug("decode_7bit input truncated from %d to %d septets", septets, available);
+        septets = (available > 0) ? available : 0;
+    }
+
+    char septets_tmp[septets + 1];
+    int count = unpack_7bit(input, input_len, start_bit, septets, septets_tmp);
+    return gsm_decode(septets_tmp, count, output, output_size);
 }
 
 // Function to encode UTF-8 string to UCS2
@@ -207,8 +264,8 @@ static void decode_ts(const unsigned char *pdu, char* out_ts) {
     ui_to_str(btz, out_ts+offs);
 }
 
-// Function to create a PDU string
-static int create_pdu_impl(const char *dest_addr, int coding, const uint8_t *encoded_text, int encoded_len, struct sms_message *msg, struct sms_pdu *output) {
+// Function to create a PDU string, data_len is the text length in septets for 7-bit or bytes for UCS2
+static int create_pdu_impl(const char *dest_addr, int coding, const uint8_t *encoded_text, int encoded_len, int data_len, struct sms_message *msg, struct sms_pdu *output) {
     // Copy header from the template
     const char *pdu_hdr = (msg->split_ref == 0) ? "0011000B91" : "0051000B91"; // Without/With UHDI
     memcpy(output, pdu_hdr, 10);
@@ -230,14 +287,11 @@ static int create_pdu_impl(const char *dest_addr, int coding, const uint8_t *enc
     ui_to_hex(coding, output->pdu + offs); offs += 2; // coding
     ui_to_hex(0, output->pdu + offs); offs += 2; // TS (default)
 
-    if (coding == 8 /*ucs2*/) {
-        int data_len = (msg->split_ref == 0) ? encoded_len : encoded_len + 6;
-        ui_to_hex(data_len, output->pdu + offs); offs += 2; // length of the encoded message
-    }
-    else {
-        int data_len = (msg->split_ref == 0) ? (encoded_len/7)*8 : (encoded_len/7*8) + 6;
-        ui_to_hex(data_len, output->pdu + offs); offs += 2; // length of the original text
+    if (msg->split_ref != 0) {
+        // UDH is 6 bytes, for 7-bit it's 7 septets including the fill bit
+        data_len += (coding == 8) ? 6 : 7;
     }
+    ui_to_hex(data_len, output->pdu + offs); offs += 2; // length of the user data
 
     // build UDH if required
     // Support multipart messages:
@@ -248,100 +302,199 @@ static int create_pdu_impl(const char *dest_addr, int coding, const uint8_t *enc
         udh_bin[0] = 5;
         udh_bin[1] = 0;
         udh_bin[2] = 3;
-        udh_bin[3] = msg->split_ref;
+        udh_bin[3] = msg->split_ref & 0xFF;
         udh_bin[4] = msg->split_parts;
         udh_bin[5] = msg->split_no;
 
-        log_debug("Writing UDH %d:6 %02x %02x %02x %02x %02x %02x %02x", offs, udh_bin[0],udh_bin[1],udh_bin[2],udh_bin[3],udh_bin[4],udh_bin[5],udh_bin[6]);
+        log_debug("Writing UDH %d:6 %02x %02x %02x %02x %02x %02x", offs, udh_bin[0],udh_bin[1],udh_bin[2],udh_bin[3],udh_bin[4],udh_bin[5]);
         offs += bin2hex(udh_bin, 6, output->pdu + offs);
     }
 
-    log_debug("Writing text %d:%d {%s}", offs, encoded_len, encoded_text);
+    log_debug("Writing text %d:%d", offs, encoded_len);
     offs += bin2hex(encoded_text, encoded_len, output->pdu + offs);
     output->pdu[offs] = 0;
     output->len = offs-1; // output len
     return 0;
 }
 
+// Number of bytes the text takes in UCS2, characters outside of BMP are dropped by encode_ucs2
+static int ucs2_length(const char *text, int text_len) {
+    int len = 0;
+    for (int i = 0; i < text_len; ++i) {
+        unsigned char c = text[i];
+        if ((c & 0xC0) != 0x80 && c < 0xF0) {
+            len += 2;
+        }
+    }
+    return len;
+}
+
+int plan_encoding(const char *text, int text_len, int policy, struct encoding_plan *plan) {
+    int ucs2_len = ucs2_length(text, text_len);
+    plan->ucs2_parts = (ucs2_len <= MSG_TEXT_LIMIT) ? 1 : (ucs2_len + MSG_TEXT_LIMIT - 7) / (MSG_TEXT_LIMIT - 6);
+    plan->gsm_parts = gsm_parts(text, text_len, 0);
+    plan->translit_parts = (policy == ENCODING_TRANSLIT) ? gsm_parts(text, text_len, 1) : 0;
+    plan->coding = 8;
+    plan->translit = 0;
+
+    if (policy == ENCODING_UCS2) {
+        return plan->coding;
+    }
+    // Exact encodings win ties, transliteration is used only if it saves messages
+    if (plan->gsm_parts > 0 && plan->gsm_parts <= plan->ucs2_parts) {
+        plan->coding = 0;
+    }
+    else if (plan->translit_parts > 0 && plan->translit_parts < plan->ucs2_parts) {
+        plan->coding = 0;
+        plan->translit = 1;
+    }
+    return plan->coding;
+}
+
+// Pick encoding by policy, transliterated text is allocated from the scratch arena
+static int choose_encoding(const char **text, int *text_len, struct arena *scratch) {
+    struct encoding_plan plan;
+    int policy = __atomic_load_n(&_opts.encoding, __ATOMIC_RELAXED);
+    plan_encoding(*text, *text_len, policy, &plan);
+    log_debug("Encoding plan, policy %d: gsm %d ucs2 %d translit %d parts, selected %s", policy, plan.gsm_parts,
+              plan.ucs2_parts, plan.translit_parts, (plan.coding == 8) ? "ucs2" : (plan.translit) ? "translit" : "gsm");
+
+    if (plan.translit) {
+        char *latin = arena_alloc(scratch, *text_len * 2 + 1);
+        if (latin == NULL) {
+            log_err("Can't allocate %d bytes for transliteration", *text_len * 2 + 1);
+            return -1;
+        }
+        *text_len = gsm_translit(*text, *text_len, latin);
+        *text = latin;
+    }
+    return plan.coding;
+}
+
 // Create pdu truncate long message
-int create_pdu(const char *dest_addr, struct sms_message *msg, struct sms_pdu **p_output) {
-    int text_len = strlen(msg->text);
-    int coding = need_ucs2(msg->text, text_len) ? 8 : 0;
-    uint8_t enc_tmp[text_len * 2]; // Worst case 1-byte UTF-8 converted to UCS2
+int create_pdu(const char *dest_addr, struct sms_message *msg, struct sms_pdu **p_output, struct arena *scratch) {
+    const char *text = msg->text;
+    int text_len = strlen(text);
+    int coding = choose_encoding(&text, &text_len, scratch);
+    if (coding == -1) {
+        return -1;
+    }
+    uint8_t enc_tmp[text_len * 2 + 1]; // Worst case 1-byte UTF-8 converted to UCS2 or to escaped septets
+    uint8_t part_tmp[MSG_TEXT_LIMIT];
+    int septets = (coding == 8) ? 0 : gsm_encode(text, text_len, (char *) enc_tmp);
 
     // Max PDU size is 255 char, calc size to not overflow
-    int enc_len = (coding == 8) ? encode_ucs2(msg->text, text_len, enc_tmp) :
-                                  encode_7bit(msg->text, text_len, enc_tmp);
-
-    if (enc_len > MSG_TEXT_LIMIT) {
-        log_noise("Message is too long %d (%d), truncated to %d", text_len, enc_len, MSG_TEXT_LIMIT);
-        enc_len = MSG_TEXT_LIMIT;
+    int enc_len, data_len;
+    if (coding == 8) {
+        enc_len = encode_ucs2(text, text_len, enc_tmp);
+        if (enc_len > MSG_TEXT_LIMIT) {
+            log_noise("Message is too long %d (%d), truncated to %d", text_len, enc_len, MSG_TEXT_LIMIT);
+            enc_len = MSG_TEXT_LIMIT;
+        }
+        data_len = enc_len;
+    }
+    else {
+        data_len = gsm_length((char *) enc_tmp, septets, MSG_SEPTETS_LIMIT);
+        if (data_len < septets) {
+            log_noise("Message is too long %d (%d), truncated to %d", text_len, septets, data_len);
+        }
+        enc_len = pack_7bit((char *) enc_tmp, data_len, 0, part_tmp);
     }
 
     msg->split_ref = 0; // Ensure single message without UDH
-    struct sms_pdu *output = new_pdus(1);
-    int res = create_pdu_impl(dest_addr, coding, enc_tmp, enc_len, msg, output);
+    struct sms_pdu *output = new_pdus(scratch, 1);
+    if (output == NULL) {
+        return -1;
+    }
+    int res = create_pdu_impl(dest_addr, coding, (coding == 8) ? enc_tmp : part_tmp, enc_len, data_len, msg, output);
     *p_output = output;
     if (res != 0) {
         log_err("Can't create the single PDU for: %s (%d/%d) {%s}", msg->sender, enc_len, text_len, msg->text);
-        free(output);
     }
     return res;
 }
 
 // Create pdu split long message
-int create_pdu_multipart(const char *dest_addr, struct sms_message *msg, struct sms_pdu **p_output, int *p_parts) {
-    int text_len = strlen(msg->text);
-    int coding = need_ucs2(msg->text, text_len) ? 8 : 0;
-    uint8_t enc_tmp[text_len * 2]; // Worst case 1-byte UTF-8 converted to UCS2
+int create_pdu_multipart(const char *dest_addr, struct sms_message *msg, struct sms_pdu **p_output, int *p_parts, struct arena *scratch) {
+    const char *text = msg->text;
+    int text_len = strlen(text);
+    int coding = choose_encoding(&text, &text_len, scratch);
+    if (coding == -1) {
+        return -1;
+    }
+    uint8_t enc_tmp[text_len * 2 + 1]; // Worst case 1-byte UTF-8 converted to UCS2 or to escaped septets
+    uint8_t part_tmp[MSG_TEXT_LIMIT];
+    int septets = (coding == 8) ? 0 : gsm_encode(text, text_len, (char *) enc_tmp);
 
-    // Max PDU size is 255 char, calc size to not overflow
-    int enc_len = (coding == 8) ? encode_ucs2(msg->text, text_len, enc_tmp) :
-                                  encode_7bit(msg->text, text_len, enc_tmp);
+    // UCS2 text is split by bytes, 7-bit text by septets and every part is packed separately,
+    // so the part starts at septet boundary after UDH
+    int enc_len = (coding == 8) ? encode_ucs2(text, text_len, enc_tmp) : septets;
+    int single_limit = (coding == 8) ? MSG_TEXT_LIMIT : MSG_SEPTETS_LIMIT;
 
     struct sms_pdu *output = NULL;
 
-    if (enc_len < MSG_TEXT_LIMIT) {
+    if (enc_len <= single_limit) {
         msg->split_ref = 0; // Ensure single message without UDH
-        output = new_pdus(1);
-        int res = create_pdu_impl(dest_addr, coding, enc_tmp, enc_len, msg, output);
+        output = new_pdus(scratch, 1);
+        if (output == NULL) {
+            return -1;
+        }
+        int data_len = enc_len;
+        if (coding != 8) {
+            enc_len = pack_7bit((char *) enc_tmp, septets, 0, part_tmp);
+        }
+        int res = create_pdu_impl(dest_addr, coding, (coding == 8) ? enc_tmp : part_tmp, enc_len, data_len, msg, output);
         *p_output = output;
         *p_parts = 1;
         if (res != 0) {
-            log_err("Can't create PDU for single message: %s (%d/%d/%d) {%s}", msg->sender, enc_len, text_len, MSG_TEXT_LIMIT, msg->text);
-            free(output);
+            log_err("Can't create PDU for single message: %s (%d/%d/%d) {%s}", msg->sender, enc_len, text_len, single_limit, msg->text);
             return -1;
         }
         return res;
     }
 
-    int text_limit = MSG_TEXT_LIMIT - 6; // Len of UDH
-    int split_parts = enc_len/text_limit + 1;
-    uint16_t split_ref = crc16(msg->text, text_len);
+    int text_limit = (coding == 8) ? MSG_TEXT_LIMIT - 6 : MSG_SEPTETS_LIMIT - 7; // Len of UDH
+    int split_parts = 0;
+    for (int o = 0; o < enc_len; ++split_parts) {
+        o += (coding == 8) ? text_limit : gsm_length((char *) enc_tmp + o, enc_len - o, text_limit);
+    }
+    uint16_t split_ref = crc16(text, text_len);
     int split_no = 0;
     int offs = 0;
     int res = 0;
 
-    output = new_pdus(split_parts);
+    output = new_pdus(scratch, split_parts);
+    if (output == NULL) {
+        return -1;
+    }
 
     while(split_no < split_parts) {
-        int len = MIN(text_limit, enc_len - offs);
-        msg->split_ref = (split_ref & 0xFF); // ensue multipart
+        int len = (coding == 8) ? MIN(text_limit, enc_len - offs) : gsm_length((char *) enc_tmp + offs, enc_len - offs, text_limit);
+        msg->split_ref = (split_ref & 0xFF) ? (split_ref & 0xFF) : 1; // ensure multipart, 0 means single message
         msg->split_parts = split_parts;
         msg->split_no = ++split_no;
 
-        if (_opts.verbosity > LOG_INFO) {
-            char log_tmp[text_limit];
-            res = (coding == 8) ?
-                decode_ucs2(enc_tmp +offs, len, log_tmp, text_limit):
-                decode_7bit(enc_tmp +offs, len, log_tmp, text_limit);
+        if (log_enabled(LOG_DEBUG)) {
+            char log_tmp[MSG_DECODED_SIZE];
+            if (coding == 8) {
+                decode_ucs2(enc_tmp + offs, len, log_tmp, sizeof(log_tmp));
+            }
+            else {
+                gsm_decode((char *) enc_tmp + offs, len, log_tmp, sizeof(log_tmp));
+            }
             log_debug("Building part of multipart message: %s (%d/%d/%d) (%d %d/%d) {{%s}}", msg->sender, len, text_len, text_limit, split_ref, split_no, split_parts, log_tmp);
         }
 
-        res = create_pdu_impl(dest_addr, coding, enc_tmp + offs, len, msg, &(output[split_no - 1]));
+        if (coding == 8) {
+            res = create_pdu_impl(dest_addr, coding, enc_tmp + offs, len, len, msg, &(output[split_no - 1]));
+        }
+        else {
+            // 6 bytes of UDH are 48 bits, one fill bit aligns the text
+            int part_len = pack_7bit((char *) enc_tmp + offs, len, 1, part_tmp);
+            res = create_pdu_impl(dest_addr, coding, part_tmp, part_len, len, msg, &(output[split_no - 1]));
+        }
         if (res != 0) {
             log_err("Can't create PDU for multipart message: %s (%d/%d/%d) (%d %d/%d)", msg->sender, len, text_len, text_limit, split_ref, split_no, split_parts);
-            free(output);
             return -1;
         }
         offs += len;
@@ -356,14 +509,20 @@ int create_pdu_multipart(const char *dest_addr, struct sms_message *msg, struct
 // Function to decode a PDU message
 int decode_pdu(const char* pdu, int pdu_len, struct sms_message *msg) {
     // assert_ret((pdu_len & 0x1) == 0, "PDU len %d should be even", pdu_len);
-    unsigned char pdu_bin[pdu_len/2];
-    hex2bin(pdu, pdu_len, pdu_bin);
+    int bin_len = pdu_len / 2;
+    unsigned char pdu_bin[bin_len];
+    // Line could end with \r, everything before it should be hex
+    if (hex2bin(pdu, pdu_len, pdu_bin) < (pdu_len & ~1)) {
+        log_err("Invalid character in PDU '%.*s'", pdu_len, pdu);
+        return -1;
+    }
 
     // Initialize fields msg structure
     msg->hash_id = crc16(pdu, pdu_len);
     msg->forwarded = 0;
     msg->split_ref = 0;
     msg->split_parts = 0;
+    memset(msg->trace, 0, sizeof(msg->trace));
     msg->split_no = 0;
 
     size_t offs = 0;
@@ -377,7 +536,8 @@ int decode_pdu(const char* pdu, int pdu_len, struct sms_message *msg) {
     int udhi = (pdu_header >> 6) & 0x1;  // User data has additional header
     offs += 1;
 
-    int sa_len = (pdu_bin[offs++] + 1) / 2; // sender address len in bytes
+    int sa_digits = pdu_bin[offs++];     // sender address len in semi-octets
+    int sa_len = (sa_digits + 1) / 2;    // sender address len in bytes
     int ton = (pdu_bin[offs] >> 4) & 0x7; // type of number
     // int npi = pdu_bin[offs] & 0xF; // numbering plan, ignored for now
     offs += 1;
@@ -388,7 +548,7 @@ int decode_pdu(const char* pdu, int pdu_len, struct sms_message *msg) {
             decode_semi_octets(pdu_bin + offs, sa_len, msg->sender+1, sizeof(msg->sender) - 1);
             break;
         case 5: // Alpha-numeric sender
-            decode_7bit(pdu_bin + offs, sa_len, msg->sender, sizeof(msg->sender));
+            decode_7bit(pdu_bin + offs, sa_len, 0, sa_digits * 4 / 7, msg->sender, sizeof(msg->sender));
             break;
         case 4: // Subscriber number, fail through
             decode_semi_octets(pdu_bin + offs, sa_len, msg->sender, sizeof(msg->sender));
@@ -412,9 +572,8 @@ int decode_pdu(const char* pdu, int pdu_len, struct sms_message *msg) {
     offs += 7;
     int data_len = pdu_bin[offs++];
 
-    char *msg_out = msg->text;
-    int msg_out_len = msg->text_size;
     int udh_len = 0;
+    int skip_bits = 0; // UDH and fill bits before the first septet
 
     if (udhi == 1) {
         // The only supported type of UDHI - multipart messages
@@ -430,14 +589,16 @@ int decode_pdu(const char* pdu, int pdu_len, struct sms_message *msg) {
             msg->split_no = pdu_bin[offs + 5]; // Number of part in split, starting from 1.
         }
 
-        offs += udh_len;
-        data_len -= (udh_len+1);
-        // In case of 7 bits encoding last byte of UDH contains 7bit of first character.
+        // In case of 7 bits encoding data_len is in septets and UDH is padded to septet boundary
         if (dcs < 4) {
-            *msg_out = pdu_bin[offs++] >> 1;
-            msg_out += 1;
-            msg_out_len -= 1;
-            data_len -= 1;
+            int udh_septets = ((udh_len + 1) * 8 + 6) / 7;
+            skip_bits = udh_septets * 7;
+            data_len -= udh_septets;
+            offs -= 1; // text is unpacked from the start of user data
+        }
+        else {
+            offs += udh_len;
+            data_len -= (udh_len+1);
         }
     }
 
@@ -447,14 +608,23 @@ int decode_pdu(const char* pdu, int pdu_len, struct sms_message *msg) {
     }
 
     if (dcs < 4 ) { // DCS 0,1,2,3 - means 7bit
-         decode_7bit(pdu_bin + offs, data_len, msg_out, msg_out_len);
+         decode_7bit(pdu_bin + offs, bin_len - offs, skip_bits, data_len, msg->text, msg->text_size);
     } else { // 8,9,10,11 means UCS2
-         decode_ucs2(pdu_bin + offs, data_len, msg_out, msg_out_len);
+         decode_ucs2(pdu_bin + offs, data_len, msg->text, msg->text_size);
     }
 
+    msg->fingerprint = msg_fingerprint(msg);
     return 0; // 0 - success, -1 - error
 }
 
+uint64_t msg_fingerprint(const struct sms_message *msg) {
+    uint8_t split[4] = { msg->split_ref >> 8, msg->split_ref & 0xFF, msg->split_parts, msg->split_no };
+    uint64_t h = fnv1a64(FNV64_INIT, msg->sender, strlen(msg->sender) + 1);
+    h = fnv1a64(h, msg->ts, strlen(msg->ts) + 1);
+    h = fnv1a64(h, split, sizeof(split));
+    return fnv1a64(h, &msg->hash_id, sizeof(msg->hash_id));
+}
+
 int decode_contact(const char *name, int name_len, char *out_name, int out_size) {
     int name_bin_len = name_len/2;
     unsigned char name_tmp[name_len];
@@ -468,17 +638,19 @@ int decode_contact(const char *name, int name_len, char *out_name, int out_size)
 
 int test_w_pdu(const char *ref_pdu, const char *sender, const char *text) {
     struct sms_pdu *new_pdu = NULL;
+    struct arena scratch;
+    arena_init(&scratch, sizeof(struct sms_pdu));
     struct sms_message *msg = malloc(sizeof(struct sms_message) + strlen(text) + 1);
 
     strcpy(msg->sender, sender);
     strcpy(msg->text, text);
 
-    create_pdu(msg->sender, msg, &new_pdu);
+    create_pdu(msg->sender, msg, &new_pdu, &scratch);
     int ok = strcmp(ref_pdu, new_pdu->pdu) == 0 ? 1 : 0;
     printf("--- Sender: {{%s}} Text {{%s}}\n", sender, text);
     printf("%s PDU.pdu: {{%s}} vs {{%s}}\n", STATUS, ref_pdu, new_pdu->pdu);
     free(msg);
-    free(new_pdu);
+    free(scratch.base);
     return !ok;
 }
 
@@ -487,13 +659,15 @@ int test_w_pdu_multipart(const char *ref_pdu[], int ref_parts, const char *sende
 
     struct sms_pdu *pdus = NULL;
     struct sms_message *msg = malloc(sizeof(struct sms_message) + strlen(text) + 1);
+    struct arena scratch;
+    arena_init(&scratch, sizeof(struct sms_pdu) * (ref_parts + 1));
 
     strcpy(msg->sender, sender);
     strcpy(msg->text, text);
     msg->split_ref = crc16(msg->text, strlen(msg->text)) & 0xFF;
 
     int n_parts = 0;
-    create_pdu_multipart(msg->sender, msg, &pdus, &n_parts);
+    create_pdu_multipart(msg->sender, msg, &pdus, &n_parts, &scratch);
     printf("--- Sender: {{%s}} Text {{%s}}\n", sender, text);
     if (n_parts != ref_parts) {
         printf("Wrong number of split parts %d vs %d\n", n_parts, ref_parts);
@@ -507,12 +681,13 @@ int test_w_pdu_multipart(const char *ref_pdu[], int ref_parts, const char *sende
     }
 
     free(msg);
-    free(pdus);
+    free(scratch.base);
     return errors;
 }
 
 int test_r_pdu(const char *pdu, const char *sender, const char *ts, const char *text) {
-    struct sms_message *msg = malloc(sizeof(struct sms_message) + MSG_TEXT_LIMIT + 1);
+    struct sms_message *msg = malloc(sizeof(struct sms_message) + MSG_DECODED_SIZE);
+    msg->text_size = MSG_DECODED_SIZE;
     int res = decode_pdu(pdu, strlen(pdu), msg);
     if (res != 0) {
         printf("PDU {{%s}} decoding error", pdu);
@@ -538,9 +713,183 @@ int test_r_pdu(const char *pdu, const char *sender, const char *ts, const char *
     return errors;
 }
 
+// Full length message of non-ASCII characters decoded from SMS-DELIVER, UTF-8 text is longer than septets
+static int test_r_pdu_utf8(const char *ch, int count, int ref_len) {
+    char text[MSG_DECODED_SIZE];
+    char septets[MSG_SEPTETS_LIMIT];
+    unsigned char packed[MSG_TEXT_LIMIT];
+    char pdu[64 + 2 * MSG_TEXT_LIMIT + 1] = "07919712690080F8040B919712890064F9000052202121933321";
+    struct sms_message *msg = malloc(sizeof(struct sms_message) + MSG_DECODED_SIZE);
+    msg->text_size = MSG_DECODED_SIZE;
+
+    text[0] = 0;
+    for (int i = 0; i < count; ++i) {
+        strcat(text, ch);
+    }
+    int n_septets = gsm_encode(text, strlen(text), septets);
+    int packed_len = pack_7bit(septets, n_septets, 0, packed);
+    int offs = strlen(pdu);
+    offs += sprintf(pdu + offs, "%02X", n_septets);
+    bin2hex(packed, packed_len, pdu + offs);
+
+    int ok = n_septets == MSG_SEPTETS_LIMIT && decode_pdu(pdu, strlen(pdu), msg) == 0 &&
+             (int) strlen(msg->text) == ref_len && strcmp(msg->text, text) == 0;
+    printf("%s Full length message of %d '%s' decoded to %d bytes\n", STATUS, count, ch, (int) strlen(msg->text));
+    free(msg);
+    return !ok;
+}
+
+// Bit by bit packing, reference for the word kernels
+static void ref_pack_7bit(const char *input, int count, int fill_bits, unsigned char *output) {
+    memset(output, 0, (fill_bits + count * 7 + 7) / 8);
+    for (int b = 0; b < count * 7; ++b) {
+        int pos = fill_bits + b;
+        output[pos / 8] |= ((input[b / 7] >> (b % 7)) & 1) << (pos % 8);
+    }
+}
+
+// Create multipart PDUs and decode them back the same way as SMS-SUBMIT
+static int test_w_7bit_multipart(const char *text, int ref_parts, int ref_first_len) {
+    struct sms_message *msg = malloc(sizeof(struct sms_message) + strlen(text) + 1);
+    struct arena scratch;
+    struct sms_pdu *pdus = NULL;
+    int n_parts = 0;
+    char out[2 * MSG_SEPTETS_LIMIT + 1];
+    char joined[4 * MSG_SEPTETS_LIMIT + 1] = "";
+    arena_init(&scratch, sizeof(struct sms_pdu) * ref_parts);
+    strcpy(msg->sender, "79219800469");
+    strcpy(msg->text, text);
+
+    int ok = create_pdu_multipart(msg->sender, msg, &pdus, &n_parts, &scratch) == 0 && n_parts == ref_parts;
+    for (int p = 0; p < n_parts && ok; ++p) {
+        unsigned char bin[sizeof(pdus[p].pdu) / 2];
+        int bin_len = hex2bin(pdus[p].pdu, strlen(pdus[p].pdu), bin) / 2;
+        int udl = bin[14]; // SMSC, header, MR, DA (12 digits), PID, DCS, VP
+        ok = bin[15] == 5 && bin[20] == p + 1 && (p > 0 || udl - 7 == ref_first_len);
+        decode_7bit(bin + 15, bin_len - 15, 49, udl - 7, out, sizeof(out));
+        strcat(joined, out);
+    }
+    ok = ok && strcmp(joined, text) == 0;
+    printf("%s Multipart 7-bit message: {{%s}}\n", STATUS, joined);
+    free(msg);
+    free(scratch.base);
+    return !ok;
+}
+
+static int test_septets() {
+    int errors = 0;
+    int ok = 1;
+    char text[MSG_SEPTETS_LIMIT + 1];
+    char out[MSG_SEPTETS_LIMIT + 1];
+    unsigned char packed[MSG_TEXT_LIMIT + 2];
+    unsigned char ref[MSG_TEXT_LIMIT + 2];
+
+    printf("\nTesting 7-bit packing.\n");
+
+    srand(22);
+    for (int i = 0; i < MSG_SEPTETS_LIMIT; ++i) {
+        text[i] = (rand() % 0x7F) + 1;
+    }
+
+    // Every length and fill, so every word/tail split and input alignment is covered
+    for (int fill = 0; fill < 7 && ok; ++fill) {
+        for (int len = 0; len <= MSG_SEPTETS_LIMIT && ok; ++len) {
+            for (int align = 0; align < 8 && ok; ++align) {
+                char src[MSG_SEPTETS_LIMIT + 8];
+                memcpy(src + align, text, len);
+                int n_bytes = (fill + len * 7 + 7) / 8;
+                ref_pack_7bit(text, len, fill, ref);
+                ok = pack_7bit(src + align, len, fill, packed) == n_bytes && memcmp(packed, ref, n_bytes) == 0;
+                ok = ok && unpack_7bit(packed, n_bytes, fill, len, out) == len && memcmp(out, text, len) == 0;
+                if (!ok) {
+                    printf("!ERR 7-bit round trip, len %d fill %d align %d\n", len, fill, align);
+                }
+            }
+        }
+    }
+    printf("%s Round trip of 0 .. %d septets with 0 .. 6 fill bits\n", STATUS, MSG_SEPTETS_LIMIT);
+    errors += !ok;
+
+    // Output is truncated to buffer and input sizes
+    pack_7bit("ABCDEFGH", 8, 0, packed);
+    ok = decode_7bit(packed, 7, 0, 8, out, 5) == 4 && strcmp(out, "ABCD") == 0;
+    ok = ok && decode_7bit(packed, 6, 0, 8, out, sizeof(out)) == 6 && strcmp(out, "ABCDEF") == 0;
+    printf("%s Truncation to output and input sizes\n", STATUS);
+    errors += !ok;
+
+    // Multipart parts start at septet boundary after UDH
+    errors += test_w_7bit_multipart("Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua. "
+                                    "Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.", 2, 153);
+
+    // Escape and extension character are not split between parts
+    char escaped[MSG_SEPTETS_LIMIT + 8];
+    memset(escaped, 'a', MSG_SEPTETS_LIMIT - 8);
+    strcpy(escaped + MSG_SEPTETS_LIMIT - 8, "{} [x]");
+    errors += test_w_7bit_multipart(escaped, 2, 152);
+
+    return errors;
+}
+
+static int test_plan(const char *text, int policy, int ref_coding, int ref_translit, int ref_gsm, int ref_ucs2, int ref_translit_parts) {
+    struct encoding_plan plan;
+    int ok = plan_encoding(text, strlen(text), policy, &plan) == ref_coding && plan.coding == ref_coding && plan.translit == ref_translit;
+    ok = ok && plan.gsm_parts == ref_gsm && plan.ucs2_parts == ref_ucs2 && plan.translit_parts == ref_translit_parts;
+    printf("%s Policy %d, gsm %d ucs2 %d translit %d parts, coding %d translit %d: {%.24s}\n", STATUS, policy,
+           plan.gsm_parts, plan.ucs2_parts, plan.translit_parts, plan.coding, plan.translit, text);
+    return !ok;
+}
+
+static int test_encoding() {
+    int errors = 0;
+    char text[MSG_SEPTETS_LIMIT + 8];
+
+    printf("\nTesting encoding selection.\n");
+
+    // One Cyrillic letter in a long Latin text takes 3 UCS2 parts, or a single 7-bit one transliterated
+    memset(text, 'a', 150);
+    strcpy(text + 150, "Ж");
+    errors += test_plan("Hello {world}", ENCODING_EXACT, 0, 0, 1, 1, 0);
+    errors += test_plan("Hello {world}", ENCODING_UCS2, 8, 0, 1, 1, 0);
+    errors += test_plan(text, ENCODING_EXACT, 8, 0, 0, 3, 0);
+    errors += test_plan(text, ENCODING_TRANSLIT, 0, 1, 0, 3, 1);
+    // UCS2 is kept on a tie, it's lossless
+    errors += test_plan("Привет", ENCODING_TRANSLIT, 8, 0, 0, 1, 1);
+    // Emoji can't be transliterated
+    errors += test_plan("Ж\xF0\x9F\x98\x80", ENCODING_TRANSLIT, 8, 0, 0, 1, 0);
+
+    struct sms_message *msg = malloc(sizeof(struct sms_message) + strlen(text) + 1);
+    struct arena scratch;
+    struct sms_pdu *pdus = NULL;
+    int n_parts = 0;
+    char out[MSG_SEPTETS_LIMIT + 1];
+    arena_init(&scratch, sizeof(struct sms_pdu) * 3 + sizeof(text) * 2 + 64);
+    strcpy(msg->sender, "79219800469");
+    strcpy(msg->text, text);
+
+    int saved = _opts.encoding;
+    _opts.encoding = ENCODING_TRANSLIT;
+    int ok = create_pdu_multipart(msg->sender, msg, &pdus, &n_parts, &scratch) == 0 && n_parts == 1;
+    _opts.encoding = saved;
+    if (ok) {
+        unsigned char bin[sizeof(pdus[0].pdu) / 2];
+        int bin_len = hex2bin(pdus[0].pdu, strlen(pdus[0].pdu), bin) / 2;
+        ok = bin[13] == 0 && decode_7bit(bin + 15, bin_len - 15, 0, bin[14], out, sizeof(out)) == 152;
+        ok = ok && strncmp(out, text, 150) == 0 && strcmp(out + 150, "Zh") == 0;
+    }
+    printf("%s Transliterated message in %d part\n", STATUS, n_parts);
+    errors += !ok;
+    free(msg);
+    free(scratch.base);
+
+    return errors;
+}
+
 int test_pdu() {
     int errors = 0;
 
+    errors += test_septets();
+    errors += test_encoding();
+
     printf("\nTesting Contact decoding.\n");
     char tmp[]="005000520049004D0041005200590020004E0055004D004200450052";
     char decoded[512];
@@ -558,6 +907,8 @@ int test_pdu() {
     errors += test_w_pdu_multipart(ref_pdu, 2, "79219800469", "Ветер порывами до 18 м/с прогнозируется в Санкт-Петербурге 06 марта. Будьте внимательны и осторожны! Вызов ЭОС-112.");
 
     printf("\nTesting PDU parsing.\n");
+    errors += test_r_pdu_utf8("ä", MSG_SEPTETS_LIMIT, 2 * MSG_SEPTETS_LIMIT);
+    errors += test_r_pdu_utf8("€", MSG_SEPTETS_LIMIT / 2, 3 * MSG_SEPTETS_LIMIT / 2);
     errors += test_r_pdu(
         "0791448720003023240DD0E474D81C0EBB010000111011315214000BE474D81C0EBB5DE3771B",
         "diafaan", "2011-01-11T13:25:41Z+0","diafaan.com");
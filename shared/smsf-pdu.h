@@ -17,8 +17,14 @@
 #ifndef _SMSF_PDU_H
 #define _SMSF_PDU_H
 
+#include "smsf-trace.h"
+
 // maximum number of bytes SMS can contain
 #define MSG_TEXT_LIMIT 140
+// maximum number of 7-bit characters, 140 bytes of septets
+#define MSG_SEPTETS_LIMIT 160
+// decoded text buffer size, UTF-8 character takes up to 3 bytes per septet or UCS2 character, e.g. ä, € or Greek letters
+#define MSG_DECODED_SIZE (3 * MSG_SEPTETS_LIMIT + 1)
 
 // the size of extra header (sender + TS) we append to message on forwarding
 #define FORWARD_HEADER_SIZE 34
@@ -27,11 +33,13 @@ struct sms_message {
    char sender[14];
    char ts[24];
    uint16_t hash_id;
+   uint64_t fingerprint; // Sender, TS, split info and hash_id, see msg_fingerprint
    uint8_t forwarded;
-   uint8_t split_ref;
+   uint16_t split_ref;   // 8 or 16 bit reference of concatenated message, outgoing messages use 8 bit
    uint8_t split_parts;
    uint8_t split_no;
    uint16_t text_size;
+   uint32_t trace[TRACE_STAGES]; // Monotonic ms of lifecycle stages, 0 - not reached, see smsf-trace.h
    char text[];        // Must be the last item, the size may vary and it's handled at malloc time
 };
 
@@ -41,10 +49,49 @@ struct sms_pdu {
    int len;
 };
 
-int create_pdu(const char* dest_addr, struct sms_message *msg, struct sms_pdu** output_pdu);
-int create_pdu_multipart(const char *dest_addr, struct sms_message *msg, struct sms_pdu **output, int *parts);
+struct arena;
+
+// Output PDUs are allocated from the scratch arena, -1 is returned if it's exhausted
+int create_pdu(const char* dest_addr, struct sms_message *msg, struct sms_pdu** output_pdu, struct arena *scratch);
+int create_pdu_multipart(const char *dest_addr, struct sms_message *msg, struct sms_pdu **output, int *parts, struct arena *scratch);
+
+// Outgoing text encoding policy, _opts.encoding
+#define ENCODING_EXACT 0    // GSM 7-bit if the alphabet has all characters, UCS2 otherwise
+#define ENCODING_TRANSLIT 1 // Also Cyrillic transliterated to Latin, if it takes fewer messages than UCS2
+#define ENCODING_UCS2 2     // Always UCS2
+
+/**
+ * @brief Number of messages the text takes in every encoding and the cheapest one allowed by policy
+ */
+struct encoding_plan {
+    int coding;         //! Selected coding, 0 - GSM 7-bit, 8 - UCS2
+    int translit;       //! Selected GSM 7-bit of transliterated text
+    int gsm_parts;      //! Number of messages, 0 - the encoding can't represent the text or isn't allowed
+    int ucs2_parts;
+    int translit_parts;
+};
+
+/**
+ * @brief Choose encoding of outgoing text, create_pdu and create_pdu_multipart use it with _opts.encoding
+ *
+ * @param text - UTF-8 text
+ * @param text_len - text length in bytes
+ * @param policy - ENCODING_EXACT, ENCODING_TRANSLIT or ENCODING_UCS2
+ * @param plan - out, number of parts of every encoding and selected one
+ * @return int - selected coding, 0 - GSM 7-bit, 8 - UCS2
+ */
+int plan_encoding(const char *text, int text_len, int policy, struct encoding_plan *plan);
 
 int decode_pdu(const char *pdu,  int pdu_len, struct sms_message *msg);
+/**
+ * @brief Calculate 64-bit fingerprint of the message used as a hash table key,
+ *        decode_pdu stores it to msg->fingerprint
+ *
+ * @param msg - message with sender, ts, hash_id and split info set
+ * @return uint64_t - fingerprint
+ */
+uint64_t msg_fingerprint(const struct sms_message *msg);
+
 int decode_contact(const char *name, int name_len, char *out_name, int out_size);
 
 #ifdef _PDU_TEST
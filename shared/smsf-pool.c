@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "smsf-logging.h"
+#include "smsf-util.h"
+#include "smsf-pdu.h"
+#include "smsf-pool.h"
+
+#define ALIGN8(x) (((x) + 7) & ~7)
+
+int msg_pool_init(struct msg_pool *pool, int capacity, int text_size) {
+    pool->block_size = ALIGN8((int) sizeof(struct sms_message) + text_size);
+    pool->blocks = malloc((size_t) pool->block_size * capacity);
+    if (pool->blocks == NULL) {
+        log_err("Can't allocate %d bytes for message pool", pool->block_size * capacity);
+        return -1;
+    }
+
+    // Thread all blocks to the free list, the first block is taken first
+    pool->free_list = NULL;
+    for (int i = capacity - 1; i >= 0; --i) {
+        void **block = (void **) (pool->blocks + (size_t) i * pool->block_size);
+        *block = pool->free_list;
+        pool->free_list = block;
+    }
+
+    pool->text_size = text_size;
+    pool->capacity = capacity;
+    pool->used = 0;
+    pool->peak = 0;
+    return 0;
+}
+
+struct sms_message *msg_pool_get(struct msg_pool *pool) {
+    if (pool->free_list == NULL) {
+        return NULL;
+    }
+
+    void **block = pool->free_list;
+    pool->free_list = *block;
+    pool->used += 1;
+    if (pool->used > pool->peak) {
+        pool->peak = pool->used;
+    }
+
+    struct sms_message *msg = (struct sms_message *) block;
+    memset(msg, 0, sizeof(struct sms_message));
+    msg->text[0] = 0;
+    msg->text_size = pool->text_size;
+    return msg;
+}
+
+void msg_pool_put(struct msg_pool *pool, struct sms_message *msg) {
+    if (msg == NULL) {
+        return;
+    }
+
+    void **block = (void **) msg;
+    *block = pool->free_list;
+    pool->free_list = block;
+    pool->used -= 1;
+}
+
+int arena_init(struct arena *a, int size) {
+    a->base = malloc(size);
+    if (a->base == NULL) {
+        log_err("Can't allocate %d bytes for scratch arena", size);
+        return -1;
+    }
+    a->size = size;
+    a->used = 0;
+    a->peak = 0;
+    return 0;
+}
+
+void *arena_alloc(struct arena *a, int size) {
+    int offs = ALIGN8(a->used);
+    if (size < 0 || offs + size > a->size) {
+        log_err("Scratch arena is exhausted, %d bytes requested, %d of %d used", size, a->used, a->size);
+        return NULL;
+    }
+
+    a->used = offs + size;
+    if (a->used > a->peak) {
+        a->peak = a->used;
+    }
+    return a->base + offs;
+}
+
+struct sms_message *arena_new_msg(struct arena *a, int text_size, const struct sms_message *tpl) {
+    struct sms_message *msg = arena_alloc(a, sizeof(struct sms_message) + text_size);
+    if (msg == NULL) {
+        return NULL;
+    }
+    // Copy message header from template
+    if (tpl != NULL) {
+        memcpy(msg, tpl, sizeof(struct sms_message));
+    }
+    else {
+        memset(msg, 0, sizeof(struct sms_message));
+    }
+    msg->text[0] = 0;
+    msg->text_size = text_size;
+    return msg;
+}
+
+int arena_mark(const struct arena *a) {
+    return a->used;
+}
+
+void arena_rewind(struct arena *a, int mark) {
+    a->used = mark;
+}
+
+void arena_reset(struct arena *a) {
+    a->used = 0;
+}
+
+#ifdef _PDU_TEST
+
+#define STATUS ((ok) ? "+OK " : "!ERR")
+
+int test_pool() {
+    printf("\n Testing message pool and scratch arena:\n");
+
+    struct msg_pool pool;
+    struct arena a;
+    struct sms_message *msgs[4];
+    int errors = 0;
+    int ok;
+
+    ok = (msg_pool_init(&pool, 3, MSG_TEXT_LIMIT + 1) == 0);
+    for (int i = 0; i < 4; ++i) {
+        msgs[i] = msg_pool_get(&pool);
+    }
+    ok = ok && msgs[0] != NULL && msgs[2] != NULL && msgs[3] == NULL && pool.used == 3;
+    ok = ok && msgs[0]->text_size == MSG_TEXT_LIMIT + 1 && ((uintptr_t) msgs[1] & 7) == 0;
+    printf("%s Pool is capped at %d messages\n", STATUS, pool.used);
+    errors += !ok;
+
+    // Fill the whole text, neighbour block must stay intact
+    memset(msgs[0]->text, 'A', MSG_TEXT_LIMIT);
+    msgs[0]->text[MSG_TEXT_LIMIT] = 0;
+    strcpy(msgs[1]->sender, "+79219800469");
+    msg_pool_put(&pool, msgs[1]);
+    msgs[3] = msg_pool_get(&pool);
+    ok = (msgs[3] == msgs[1] && msgs[3]->sender[0] == 0 && pool.used == 3 && pool.peak == 3 &&
+          strlen(msgs[0]->text) == MSG_TEXT_LIMIT);
+    printf("%s Released message is reused\n", STATUS);
+    errors += !ok;
+
+    ok = (arena_init(&a, 1024) == 0);
+    struct sms_message *tmp = arena_new_msg(&a, 100, msgs[0]);
+    int mark = arena_mark(&a);
+    void *big = arena_alloc(&a, 900);
+    ok = ok && tmp != NULL && tmp->text[0] == 0 && tmp->text_size == 100 && big == NULL;
+    arena_rewind(&a, mark);
+    big = arena_alloc(&a, 512);
+    ok = ok && big != NULL && ((uintptr_t) big & 7) == 0;
+    arena_reset(&a);
+    ok = ok && arena_new_msg(&a, 100, NULL) == tmp;
+    printf("%s Arena rewinds and resets, peak %d\n", STATUS, a.peak);
+    errors += !ok;
+
+    free(pool.blocks);
+    free(a.base);
+
+    printf("Total results: %d errors\n\n", errors);
+    return errors;
+}
+
+#endif
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SMSF_POOL_H
+#define _SMSF_POOL_H
+
+struct sms_message;
+
+#ifdef ESP_PLATFORM
+  #define MSG_POOL_SIZE 48          //! Messages kept in memory at the same time, per modem
+  #define SCRATCH_SIZE (24 * 1024)  //! Temporaries of one flow cycle, per modem
+#else
+  #define MSG_POOL_SIZE 1024
+  #define SCRATCH_SIZE (64 * 1024)
+#endif
+
+/**
+ * @brief Fixed-capacity slab of equally sized message blocks.
+ *        Memory is allocated once at startup, blocks are recycled through the free list.
+ */
+struct msg_pool {
+    char *blocks;
+    void *free_list;  //! Next free block pointer is stored in the block itself
+    int block_size;
+    int text_size;    //! Text capacity of every message, including trailing zero
+    int capacity;
+    int used;
+    int peak;
+};
+
+/**
+ * @brief Bump allocator for short-lived buffers, everything is released at once by arena_reset.
+ */
+struct arena {
+    char *base;
+    int size;
+    int used;
+    int peak;
+};
+
+/**
+ * @brief Allocate pool memory
+ *
+ * @param pool - pool to initialize
+ * @param capacity - number of messages
+ * @param text_size - text capacity of each message, including trailing zero
+ * @return int - 0 - success, -1 - out of memory
+ */
+int msg_pool_init(struct msg_pool *pool, int capacity, int text_size);
+
+/**
+ * @brief Take message from the pool
+ *
+ * @param pool - pool
+ * @return struct sms_message* - message with empty text and text_size set, NULL if the pool is exhausted
+ */
+struct sms_message *msg_pool_get(struct msg_pool *pool);
+
+/**
+ * @brief Return message to the pool
+ *
+ * @param pool - pool the message was taken from
+ * @param msg - message, could be NULL
+ */
+void msg_pool_put(struct msg_pool *pool, struct sms_message *msg);
+
+/**
+ * @brief Allocate arena memory
+ *
+ * @param a - arena to initialize
+ * @param size - size in bytes
+ * @return int - 0 - success, -1 - out of memory
+ */
+int arena_init(struct arena *a, int size);
+
+/**
+ * @brief Allocate buffer from the arena, it's valid until arena_rewind or arena_reset
+ *
+ * @param a - arena
+ * @param size - size in bytes
+ * @return void* - pointer aligned to 8 bytes, NULL if the arena is exhausted
+ */
+void *arena_alloc(struct arena *a, int size);
+
+/**
+ * @brief Allocate message with given text capacity from the arena
+ *
+ * @param a - arena
+ * @param text_size - text capacity, including trailing zero
+ * @param tpl - message to copy header from, could be NULL
+ * @return struct sms_message* - message with empty text, NULL if the arena is exhausted
+ */
+struct sms_message *arena_new_msg(struct arena *a, int text_size, const struct sms_message *tpl);
+
+/**
+ * @brief Current position, release everything allocated after it with arena_rewind
+ */
+int arena_mark(const struct arena *a);
+void arena_rewind(struct arena *a, int mark);
+void arena_reset(struct arena *a);
+
+#ifdef _PDU_TEST
+ int test_pool();
+#endif
+
+#endif
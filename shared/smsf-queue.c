@@ -0,0 +1,446 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "smsf-logging.h"
+#include "smsf-queue.h"
+
+// Items are aligned for any type, e.g. time_t of log record. malloc returns memory aligned the same way
+#define QUEUE_ALIGN ((int) _Alignof(max_align_t))
+#define ALIGN_ITEM(x) (((x) + QUEUE_ALIGN - 1) & ~(QUEUE_ALIGN - 1))
+#define MPSC_HEADER ALIGN_ITEM((int) sizeof(uint32_t))
+
+static uint32_t ring_size(int capacity) {
+    uint32_t size = 1;
+    while (size < (uint32_t) capacity) {
+        size <<= 1;
+    }
+    return size;
+}
+
+int spsc_init(struct spsc_queue *q, int capacity, int item_size) {
+    uint32_t size = ring_size(capacity);
+    q->slots = malloc((size_t) size * item_size);
+    if (q->slots == NULL) {
+        log_err("Can't allocate %d slots for queue", (int) size);
+        return -1;
+    }
+    q->item_size = item_size;
+    q->mask = size - 1;
+    q->head = 0;
+    q->tail_cache = 0;
+    q->tail = 0;
+    q->head_cache = 0;
+    return 0;
+}
+
+int spsc_push(struct spsc_queue *q, const void *item) {
+    uint32_t tail = q->tail;
+    if (tail - q->head_cache > q->mask) {
+        // Looks full, check where the consumer actually is
+        q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        if (tail - q->head_cache > q->mask) {
+            return -1;
+        }
+    }
+    memcpy(q->slots + (size_t) (tail & q->mask) * q->item_size, item, q->item_size);
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int spsc_pop(struct spsc_queue *q, void *item) {
+    uint32_t head = q->head;
+    if (head == q->tail_cache) {
+        q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (head == q->tail_cache) {
+            return -1;
+        }
+    }
+    memcpy(item, q->slots + (size_t) (head & q->mask) * q->item_size, q->item_size);
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void spsc_free(struct spsc_queue *q) {
+    free(q->slots);
+    q->slots = NULL;
+}
+
+static uint32_t *mpsc_slot(struct mpsc_queue *q, uint32_t pos) {
+    return (uint32_t *) (q->slots + (size_t) (pos & q->mask) * q->stride);
+}
+
+int mpsc_init(struct mpsc_queue *q, int capacity, int item_size) {
+    uint32_t size = ring_size(capacity);
+    q->stride = MPSC_HEADER + ALIGN_ITEM(item_size);
+    q->slots = malloc((size_t) size * q->stride);
+    if (q->slots == NULL) {
+        log_err("Can't allocate %d slots for queue", (int) size);
+        return -1;
+    }
+    q->item_size = item_size;
+    q->mask = size - 1;
+    q->head = 0;
+    q->tail = 0;
+
+    // Slot is free for the producer claiming position equal to its sequence number
+    for (uint32_t i = 0; i < size; ++i) {
+        *mpsc_slot(q, i) = i;
+    }
+    return 0;
+}
+
+void *mpsc_reserve(struct mpsc_queue *q, uint32_t *pos) {
+    uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    uint32_t *slot;
+
+    while (1) {
+        slot = mpsc_slot(q, tail);
+        int32_t dif = (int32_t) (__atomic_load_n(slot, __ATOMIC_ACQUIRE) - tail);
+        if (dif == 0) {
+            // Failed CAS reloads tail, another producer took the slot
+            if (__atomic_compare_exchange_n(&q->tail, &tail, tail + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (dif < 0) {
+            // Slot is not consumed since the previous lap
+            return NULL;
+        }
+        else {
+            tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    *pos = tail;
+    return (char *) slot + MPSC_HEADER;
+}
+
+void mpsc_publish(struct mpsc_queue *q, uint32_t pos) {
+    __atomic_store_n(mpsc_slot(q, pos), pos + 1, __ATOMIC_RELEASE);
+}
+
+void *mpsc_peek(struct mpsc_queue *q) {
+    uint32_t *slot = mpsc_slot(q, q->head);
+    if ((int32_t) (__atomic_load_n(slot, __ATOMIC_ACQUIRE) - (q->head + 1)) < 0) {
+        return NULL;
+    }
+    return (char *) slot + MPSC_HEADER;
+}
+
+void mpsc_release(struct mpsc_queue *q) {
+    uint32_t pos = q->head;
+    // Free the slot for the producer of the next lap
+    __atomic_store_n(mpsc_slot(q, pos), pos + q->mask + 1, __ATOMIC_RELEASE);
+    q->head = pos + 1;
+}
+
+int mpsc_push(struct mpsc_queue *q, const void *item) {
+    uint32_t pos;
+    void *slot = mpsc_reserve(q, &pos);
+    if (slot == NULL) {
+        return -1;
+    }
+    memcpy(slot, item, q->item_size);
+    mpsc_publish(q, pos);
+    return 0;
+}
+
+int mpsc_pop(struct mpsc_queue *q, void *item) {
+    void *slot = mpsc_peek(q);
+    if (slot == NULL) {
+        return -1;
+    }
+    memcpy(item, slot, q->item_size);
+    mpsc_release(q);
+    return 0;
+}
+
+void mpsc_free(struct mpsc_queue *q) {
+    free(q->slots);
+    q->slots = NULL;
+}
+
+// Benchmark
+
+#define BENCH_ITEM 32    // Display line or notify event
+#define BENCH_RING 256
+#define BENCH_PRODUCERS 2
+
+/**
+ * @brief Mutex protected ring, the baseline lock-free queues are compared to
+ */
+struct locked_queue {
+    pthread_mutex_t lock;
+    struct spsc_queue ring;
+};
+
+enum bench_kind { BENCH_SPSC, BENCH_MPSC, BENCH_LOCKED };
+
+struct bench_run {
+    enum bench_kind kind;
+    void *q;
+    int count;          //! Items per producer
+};
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_push(enum bench_kind kind, void *q, const void *item) {
+    if (kind == BENCH_SPSC) {
+        return spsc_push(q, item);
+    }
+    if (kind == BENCH_MPSC) {
+        return mpsc_push(q, item);
+    }
+    struct locked_queue *lq = q;
+    pthread_mutex_lock(&lq->lock);
+    int res = spsc_push(&lq->ring, item);
+    pthread_mutex_unlock(&lq->lock);
+    return res;
+}
+
+static int bench_pop(enum bench_kind kind, void *q, void *item) {
+    if (kind == BENCH_SPSC) {
+        return spsc_pop(q, item);
+    }
+    if (kind == BENCH_MPSC) {
+        return mpsc_pop(q, item);
+    }
+    struct locked_queue *lq = q;
+    pthread_mutex_lock(&lq->lock);
+    int res = spsc_pop(&lq->ring, item);
+    pthread_mutex_unlock(&lq->lock);
+    return res;
+}
+
+static void *bench_producer(void *arg) {
+    struct bench_run *run = arg;
+    char item[BENCH_ITEM] = {0};
+    for (int i = 0; i < run->count; ++i) {
+        memcpy(item, &i, sizeof(i));
+        while (bench_push(run->kind, run->q, item) != 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// Push and pop in one thread, cost of the operations without contention
+static double bench_single(enum bench_kind kind, void *q, int count) {
+    char item[BENCH_ITEM] = {0};
+    int64_t start = now_ns();
+    for (int i = 0; i < count; ++i) {
+        bench_push(kind, q, item);
+        bench_pop(kind, q, item);
+    }
+    return (double) (now_ns() - start) / count;
+}
+
+// Producers in their own threads, consumer in the calling thread
+static double bench_threads(enum bench_kind kind, void *q, int producers, int count) {
+    struct bench_run run = { kind, q, count };
+    pthread_t threads[BENCH_PRODUCERS];
+    char item[BENCH_ITEM];
+    int total = producers * count;
+
+    int64_t start = now_ns();
+    for (int i = 0; i < producers; ++i) {
+        if (pthread_create(&threads[i], NULL, bench_producer, &run) != 0) {
+            log_errno("Can't start producer thread");
+            return -1;
+        }
+    }
+    for (int received = 0; received < total; ) {
+        if (bench_pop(kind, q, item) == 0) {
+            received += 1;
+        }
+        else {
+            sched_yield();
+        }
+    }
+    int64_t elapsed = now_ns() - start;
+    for (int i = 0; i < producers; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    return (double) elapsed / total;
+}
+
+int queue_bench(int count) {
+    struct spsc_queue *spsc = malloc(sizeof(struct spsc_queue));
+    struct mpsc_queue *mpsc = malloc(sizeof(struct mpsc_queue));
+    struct locked_queue *locked = malloc(sizeof(struct locked_queue));
+    if (spsc == NULL || mpsc == NULL || locked == NULL ||
+        spsc_init(spsc, BENCH_RING, BENCH_ITEM) != 0 || mpsc_init(mpsc, BENCH_RING, BENCH_ITEM) != 0 ||
+        spsc_init(&locked->ring, BENCH_RING, BENCH_ITEM) != 0) {
+        return -1;
+    }
+    pthread_mutex_init(&locked->lock, NULL);
+
+    printf("Queue benchmark, %d items of %d bytes, ring %d, ns per item\n", count, BENCH_ITEM, BENCH_RING);
+    printf("  push+pop, one thread:  spsc %.1f mpsc %.1f mutex %.1f\n",
+           bench_single(BENCH_SPSC, spsc, count), bench_single(BENCH_MPSC, mpsc, count),
+           bench_single(BENCH_LOCKED, locked, count));
+    printf("  1 producer thread:     spsc %.1f mpsc %.1f mutex %.1f\n",
+           bench_threads(BENCH_SPSC, spsc, 1, count), bench_threads(BENCH_MPSC, mpsc, 1, count),
+           bench_threads(BENCH_LOCKED, locked, 1, count));
+    printf("  %d producer threads:    mpsc %.1f mutex %.1f\n", BENCH_PRODUCERS,
+           bench_threads(BENCH_MPSC, mpsc, BENCH_PRODUCERS, count),
+           bench_threads(BENCH_LOCKED, locked, BENCH_PRODUCERS, count));
+
+    spsc_free(spsc);
+    mpsc_free(mpsc);
+    spsc_free(&locked->ring);
+    free(spsc);
+    free(mpsc);
+    free(locked);
+    return 0;
+}
+
+#ifdef _PDU_TEST
+
+#define STATUS ((ok) ? "+OK " : "!ERR")
+
+struct test_run {
+    struct mpsc_queue *q;
+    int base;
+    int count;
+};
+
+static void *test_producer(void *arg) {
+    struct test_run *run = arg;
+    for (int i = 0; i < run->count; ++i) {
+        int item = run->base + i;
+        while (mpsc_push(run->q, &item) != 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+int test_queue() {
+    printf("\n Testing queues:\n");
+
+    struct spsc_queue sq;
+    struct mpsc_queue mq;
+    int errors = 0;
+    int ok, item;
+
+    // Ring of 5 is rounded up to 8, several laps to check wrap around
+    ok = (spsc_init(&sq, 5, sizeof(int)) == 0);
+    for (int lap = 0; lap < 3 && ok; ++lap) {
+        int pushed = 0;
+        for (item = 0; spsc_push(&sq, &item) == 0; ++item) {
+            pushed += 1;
+        }
+        ok = (pushed == 8);
+        for (int i = 0; i < pushed && ok; ++i) {
+            ok = (spsc_pop(&sq, &item) == 0 && item == i);
+        }
+        ok = ok && spsc_pop(&sq, &item) == -1;
+    }
+    printf("%s SPSC keeps order and capacity\n", STATUS);
+    errors += !ok;
+    spsc_free(&sq);
+
+    ok = (mpsc_init(&mq, 8, sizeof(int)) == 0);
+    for (int lap = 0; lap < 3 && ok; ++lap) {
+        int pushed = 0;
+        for (item = 0; mpsc_push(&mq, &item) == 0; ++item) {
+            pushed += 1;
+        }
+        ok = (pushed == 8);
+        for (int i = 0; i < pushed && ok; ++i) {
+            ok = (mpsc_pop(&mq, &item) == 0 && item == i);
+        }
+        ok = ok && mpsc_pop(&mq, &item) == -1;
+    }
+    printf("%s MPSC keeps order and capacity\n", STATUS);
+    errors += !ok;
+
+    // Slot filled in place is seen only when it and the slots before it are published
+    uint32_t pos1, pos2;
+    int *slot1 = mpsc_reserve(&mq, &pos1);
+    int *slot2 = mpsc_reserve(&mq, &pos2);
+    ok = (slot1 != NULL && slot2 != NULL);
+    if (ok) {
+        *slot2 = 2;
+        mpsc_publish(&mq, pos2);
+        ok = (mpsc_peek(&mq) == NULL);
+        *slot1 = 1;
+        mpsc_publish(&mq, pos1);
+        ok = ok && mpsc_pop(&mq, &item) == 0 && item == 1;
+        ok = ok && mpsc_pop(&mq, &item) == 0 && item == 2;
+        ok = ok && mpsc_peek(&mq) == NULL;
+    }
+    printf("%s MPSC reserve and publish out of order\n", STATUS);
+    errors += !ok;
+
+    // Item of odd size is still aligned for any type
+    struct mpsc_queue aq;
+    ok = (mpsc_init(&aq, 4, 5) == 0);
+    for (int i = 0; i < 6 && ok; ++i) {
+        uint32_t pos;
+        void *slot = mpsc_reserve(&aq, &pos);
+        ok = (slot != NULL && (uintptr_t) slot % _Alignof(max_align_t) == 0);
+        mpsc_publish(&aq, pos);
+        slot = mpsc_peek(&aq);
+        ok = ok && (uintptr_t) slot % _Alignof(max_align_t) == 0;
+        mpsc_release(&aq);
+    }
+    printf("%s MPSC items are aligned to %d\n", STATUS, (int) _Alignof(max_align_t));
+    errors += !ok;
+    mpsc_free(&aq);
+
+    // Every item of every producer arrives once, in producer order
+    struct test_run runs[2] = { { &mq, 0, 20000 }, { &mq, 1000000, 20000 } };
+    pthread_t threads[2];
+    int next[2] = { 0, 1000000 };
+    ok = 1;
+    for (int i = 0; i < 2; ++i) {
+        pthread_create(&threads[i], NULL, test_producer, &runs[i]);
+    }
+    for (int received = 0; received < 40000; ) {
+        if (mpsc_pop(&mq, &item) == 0) {
+            int p = (item >= 1000000);
+            ok = ok && (item == next[p]);
+            next[p] += 1;
+            received += 1;
+        }
+    }
+    for (int i = 0; i < 2; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    printf("%s MPSC with two producer threads\n", STATUS);
+    errors += !ok;
+    mpsc_free(&mq);
+
+    printf("Total results: %d errors\n\n", errors);
+    return errors;
+}
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SMSF_QUEUE_H
+#define _SMSF_QUEUE_H
+
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+  #define QUEUE_CACHE_LINE 32
+#else
+  #define QUEUE_CACHE_LINE 64
+#endif
+
+/**
+ * @brief Lock-free ring of fixed-size slots, one producer and one consumer.
+ *        Items are copied in and out, memory is allocated once by spsc_init.
+ *        Producer and consumer indexes live on separate cache lines, each side keeps
+ *        a cached copy of the other index and reloads it only when the ring looks full or empty.
+ */
+struct spsc_queue {
+    char *slots;
+    int item_size;
+    uint32_t mask;
+
+    uint32_t head __attribute__((aligned(QUEUE_CACHE_LINE))); //! Next slot to read, written by consumer
+    uint32_t tail_cache;                                       //! Consumer copy of tail
+
+    uint32_t tail __attribute__((aligned(QUEUE_CACHE_LINE))); //! Next slot to write, written by producer
+    uint32_t head_cache;                                       //! Producer copy of head
+};
+
+/**
+ * @brief Lock-free ring of fixed-size slots, many producers and one consumer.
+ *        Every slot carries a sequence number, producers claim slots with CAS on tail,
+ *        the consumer sees a slot only after its producer has published it.
+ */
+struct mpsc_queue {
+    char *slots;        //! Slot is uint32 sequence number followed by the item, both aligned to max_align_t
+    int item_size;
+    int stride;
+    uint32_t mask;
+
+    uint32_t head __attribute__((aligned(QUEUE_CACHE_LINE))); //! Next slot to read, written by consumer
+    uint32_t tail __attribute__((aligned(QUEUE_CACHE_LINE))); //! Next slot to claim, shared by producers
+};
+
+/**
+ * @brief Allocate the ring
+ *
+ * @param q - queue to initialize
+ * @param capacity - number of slots, rounded up to power of two
+ * @param item_size - size of every item
+ * @return int - 0 - success, -1 - out of memory
+ */
+int spsc_init(struct spsc_queue *q, int capacity, int item_size);
+
+/**
+ * @brief Copy item to the queue, producer side
+ *
+ * @return int - 0 - success, -1 - queue is full
+ */
+int spsc_push(struct spsc_queue *q, const void *item);
+
+/**
+ * @brief Copy the oldest item out of the queue, consumer side
+ *
+ * @return int - 0 - success, -1 - queue is empty
+ */
+int spsc_pop(struct spsc_queue *q, void *item);
+
+void spsc_free(struct spsc_queue *q);
+
+/**
+ * @brief Allocate the ring
+ *
+ * @param q - queue to initialize
+ * @param capacity - number of slots, rounded up to power of two
+ * @param item_size - size of every item
+ * @return int - 0 - success, -1 - out of memory
+ */
+int mpsc_init(struct mpsc_queue *q, int capacity, int item_size);
+
+/**
+ * @brief Copy item to the queue, could be called by several threads at once
+ *
+ * @return int - 0 - success, -1 - queue is full
+ */
+int mpsc_push(struct mpsc_queue *q, const void *item);
+
+/**
+ * @brief Copy the oldest published item out of the queue, consumer side
+ *
+ * @return int - 0 - success, -1 - queue is empty
+ */
+int mpsc_pop(struct mpsc_queue *q, void *item);
+
+/**
+ * @brief Claim the next slot to fill it in place, could be called by several threads at once.
+ *        The consumer doesn't see the slot, and slots after it, until mpsc_publish
+ *
+ * @param pos - out, position to pass to mpsc_publish
+ * @return void* - slot of item_size bytes, NULL - queue is full
+ */
+void *mpsc_reserve(struct mpsc_queue *q, uint32_t *pos);
+void mpsc_publish(struct mpsc_queue *q, uint32_t pos);
+
+/**
+ * @brief Oldest published item in place, consumer side. The slot stays valid until mpsc_release
+ *
+ * @return void* - item, NULL - queue is empty
+ */
+void *mpsc_peek(struct mpsc_queue *q);
+void mpsc_release(struct mpsc_queue *q);
+
+void mpsc_free(struct mpsc_queue *q);
+
+/**
+ * @brief Measure enqueue/dequeue cost and print results, one line per case.
+ *        Built on all platforms, the Linux build runs it as s3smsf-qbench,
+ *        the ESP32 build runs it at startup when built with SMSF_QUEUE_BENCH
+ *
+ * @param count - items per case
+ * @return int - 0 - success, -1 - error
+ */
+int queue_bench(int count);
+
+#ifdef _PDU_TEST
+ int test_queue();
+#endif
+
+#endif
@@ -0,0 +1,333 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "smsf-logging.h"
+#include "smsf-util.h"
+#include "smsf-pdu.h"
+#include "smsf-reasm.h"
+
+#define SLOT_EMPTY -1
+#define SLOT_REMOVED -2
+#define GAP_MARKER "(...)"
+
+static uint64_t group_key(const struct sms_message *msg) {
+    uint8_t split[3] = { msg->split_ref >> 8, msg->split_ref & 0xFF, msg->split_parts };
+    uint64_t h = fnv1a64(FNV64_INIT, msg->sender, strlen(msg->sender) + 1);
+    return fnv1a64(h, split, sizeof(split));
+}
+
+static int home_slot(uint64_t key) {
+    return (int) ((key ^ (key >> 32)) % REASM_SLOTS);
+}
+
+static int same_group(const struct reasm_group *g, uint64_t key, const struct sms_message *msg) {
+    return g->key == key && g->ref == msg->split_ref && g->parts == msg->split_parts &&
+           strcmp(g->sender, msg->sender) == 0;
+}
+
+void reasm_init(struct reasm *r) {
+    memset(r->groups, 0, sizeof(r->groups));
+    memset(r->index, SLOT_EMPTY, sizeof(r->index));
+    r->count = 0;
+    r->tombstones = 0;
+    r->bytes = 0;
+}
+
+int reasm_is_part(const struct sms_message *msg) {
+    return msg->split_parts > 1 && msg->split_parts <= REASM_MAX_PARTS &&
+           msg->split_no > 0 && msg->split_no <= msg->split_parts;
+}
+
+// Index slot of the group, -1 if there is no such group
+static int find_slot(const struct reasm *r, uint64_t key, const struct sms_message *msg) {
+    int slot = home_slot(key);
+    for (int i = 0; i < REASM_SLOTS && r->index[slot] != SLOT_EMPTY; ++i) {
+        if (r->index[slot] >= 0 && same_group(&r->groups[r->index[slot]], key, msg)) {
+            return slot;
+        }
+        slot = (slot + 1) % REASM_SLOTS;
+    }
+    return -1;
+}
+
+// Rebuild index without tombstones, the index is small so it's cheap
+static void rebuild_index(struct reasm *r) {
+    memset(r->index, SLOT_EMPTY, sizeof(r->index));
+    for (int i = 0; i < REASM_MAX_GROUPS; ++i) {
+        if (r->groups[i].in_use) {
+            int slot = home_slot(r->groups[i].key);
+            while (r->index[slot] != SLOT_EMPTY) {
+                slot = (slot + 1) % REASM_SLOTS;
+            }
+            r->index[slot] = i;
+        }
+    }
+    r->tombstones = 0;
+}
+
+static struct reasm_group *new_group(struct reasm *r, uint64_t key, const struct sms_message *msg, int64_t now) {
+    if (r->tombstones > REASM_SLOTS / 4) {
+        rebuild_index(r);
+    }
+
+    int gi = 0;
+    while (r->groups[gi].in_use) {
+        gi += 1;
+    }
+    struct reasm_group *g = &r->groups[gi];
+    memset(g, 0, sizeof(*g));
+    g->key = key;
+    g->created_ms = now;
+    g->ref = msg->split_ref;
+    g->parts = msg->split_parts;
+    g->in_use = 1;
+    strcpy(g->sender, msg->sender);
+
+    // Groups take at most half of the index, so a free slot always exists
+    int slot = home_slot(key);
+    while (r->index[slot] >= 0) {
+        slot = (slot + 1) % REASM_SLOTS;
+    }
+    if (r->index[slot] == SLOT_REMOVED) {
+        r->tombstones -= 1;
+    }
+    r->index[slot] = gi;
+    r->count += 1;
+    return g;
+}
+
+int reasm_add(struct reasm *r, struct sms_message *msg, int64_t now, struct reasm_group **group) {
+    uint64_t key = group_key(msg);
+    int len = strlen(msg->text);
+    int slot = find_slot(r, key, msg);
+
+    struct reasm_group *g = (slot != -1) ? &r->groups[r->index[slot]] : NULL;
+    uint32_t bit = 1u << (msg->split_no - 1);
+
+    if (g != NULL && (g->received & bit) != 0) {
+        *group = g;
+        return (g->part[msg->split_no - 1] == msg) ? reasm_complete(g) : REASM_DUPLICATE;
+    }
+
+    if ((g == NULL && r->count == REASM_MAX_GROUPS) || r->bytes + len > REASM_MAX_BYTES) {
+        return REASM_FULL;
+    }
+
+    if (g == NULL) {
+        g = new_group(r, key, msg, now);
+    }
+
+    g->part[msg->split_no - 1] = msg;
+    g->received |= bit;
+    g->bytes += len;
+    r->bytes += len;
+
+    *group = g;
+    return reasm_complete(g);
+}
+
+void reasm_forget(struct reasm *r, const struct sms_message *msg) {
+    if (!reasm_is_part(msg)) {
+        return;
+    }
+
+    int slot = find_slot(r, group_key(msg), msg);
+    if (slot == -1) {
+        return;
+    }
+
+    struct reasm_group *g = &r->groups[r->index[slot]];
+    if (g->part[msg->split_no - 1] != msg) {
+        return;
+    }
+
+    int len = strlen(msg->text);
+    g->part[msg->split_no - 1] = NULL;
+    g->received &= ~(1u << (msg->split_no - 1));
+    g->bytes -= len;
+    r->bytes -= len;
+
+    if (g->received == 0) {
+        reasm_release(r, g);
+    }
+}
+
+void reasm_release(struct reasm *r, struct reasm_group *group) {
+    int gi = group - r->groups;
+    int slot = home_slot(group->key);
+    while (r->index[slot] != gi) {
+        slot = (slot + 1) % REASM_SLOTS;
+    }
+
+    // Tombstone is not needed at the end of probe chain
+    if (r->index[(slot + 1) % REASM_SLOTS] == SLOT_EMPTY) {
+        r->index[slot] = SLOT_EMPTY;
+    }
+    else {
+        r->index[slot] = SLOT_REMOVED;
+        r->tombstones += 1;
+    }
+
+    r->bytes -= group->bytes;
+    r->count -= 1;
+    group->in_use = 0;
+}
+
+struct reasm_group *reasm_at(struct reasm *r, int idx) {
+    return (r->groups[idx].in_use) ? &r->groups[idx] : NULL;
+}
+
+struct reasm_group *reasm_oldest(struct reasm *r) {
+    struct reasm_group *oldest = NULL;
+    for (int i = 0; i < REASM_MAX_GROUPS; ++i) {
+        struct reasm_group *g = reasm_at(r, i);
+        if (g != NULL && (oldest == NULL || g->created_ms < oldest->created_ms)) {
+            oldest = g;
+        }
+    }
+    return oldest;
+}
+
+int reasm_complete(const struct reasm_group *group) {
+    uint32_t all = (group->parts == 32) ? 0xFFFFFFFFu : (1u << group->parts) - 1;
+    return group->received == all;
+}
+
+int reasm_expired(const struct reasm_group *group, int64_t now) {
+    return now - group->created_ms > REASM_TIMEOUT;
+}
+
+struct sms_message *reasm_first(const struct reasm_group *group) {
+    for (int i = 0; i < group->parts; ++i) {
+        if (group->part[i] != NULL) {
+            return group->part[i];
+        }
+    }
+    return NULL;
+}
+
+int reasm_text(const struct reasm_group *group, char *out, int out_size) {
+    int len = 0;
+    for (int i = 0; i < group->parts; ++i) {
+        const char *text = (group->part[i] != NULL) ? group->part[i]->text : GAP_MARKER;
+        int text_len = strlen(text);
+        if (out != NULL) {
+            int n = MIN(text_len, out_size - 1 - len);
+            memcpy(out + len, text, n);
+            out[len + n] = 0;
+        }
+        len += text_len;
+    }
+    return len;
+}
+
+#ifdef _PDU_TEST
+
+#define STATUS ((ok) ? "+OK " : "!ERR")
+
+static void make_part(struct sms_message *msg, const char *sender, int ref, int parts, int no, const char *text) {
+    memset(msg, 0, sizeof(struct sms_message));
+    strcpy(msg->sender, sender);
+    strcpy(msg->ts, "2025-03-03T20:31:32Z+3");
+    msg->split_ref = ref;
+    msg->split_parts = parts;
+    msg->split_no = no;
+    strcpy(msg->text, text);
+}
+
+int test_reasm() {
+    printf("\n Testing multipart reassembly:\n");
+
+    struct reasm *r = malloc(sizeof(struct reasm));
+    struct sms_message *parts[6];
+    struct reasm_group *g = NULL;
+    char text[64];
+    int errors = 0;
+    int ok;
+
+    for (int i = 0; i < 6; ++i) {
+        parts[i] = malloc(sizeof(struct sms_message) + 32);
+    }
+
+    reasm_init(r);
+
+    // Parts arrive out of order, two senders use the same 16-bit reference
+    make_part(parts[0], "+79219800469", 0x1234, 3, 3, "C");
+    make_part(parts[1], "+79219800470", 0x1234, 3, 1, "x");
+    make_part(parts[2], "+79219800469", 0x1234, 3, 1, "A");
+    make_part(parts[3], "+79219800469", 0x1234, 3, 2, "B");
+    make_part(parts[4], "+79219800469", 0x1234, 3, 2, "Dup");
+    make_part(parts[5], "+79219800469", 0x0034, 3, 2, "Other");
+
+    ok = reasm_add(r, parts[0], 0, &g) == REASM_PENDING &&
+         reasm_add(r, parts[1], 0, &g) == REASM_PENDING &&
+         reasm_add(r, parts[5], 0, &g) == REASM_PENDING &&
+         reasm_add(r, parts[2], 0, &g) == REASM_PENDING &&
+         reasm_add(r, parts[3], 0, &g) == REASM_COMPLETE;
+    reasm_text(g, text, sizeof(text));
+    ok = ok && strcmp(text, "ABC") == 0 && r->count == 3;
+    printf("%s Completed on middle part {%s}, groups %d\n", STATUS, text, r->count);
+    errors += !ok;
+
+    ok = reasm_add(r, parts[4], 0, &g) == REASM_DUPLICATE && reasm_add(r, parts[3], 0, &g) == REASM_COMPLETE;
+    printf("%s Duplicate part detected\n", STATUS);
+    errors += !ok;
+
+    reasm_release(r, g);
+    reasm_forget(r, parts[1]);
+    g = reasm_oldest(r);
+    ok = (r->count == 1 && g != NULL && !reasm_expired(g, REASM_TIMEOUT) && reasm_expired(g, REASM_TIMEOUT + 1));
+    reasm_text(g, text, sizeof(text));
+    ok = ok && strcmp(text, GAP_MARKER "Other" GAP_MARKER) == 0;
+    printf("%s Incomplete group {%s}, groups %d\n", STATUS, text, r->count);
+    errors += !ok;
+
+    // One group is already here, fill up the buffer and try one more
+    int full = 0;
+    for (int i = 0; i < REASM_MAX_GROUPS; ++i) {
+        make_part(parts[0], "+79219800469", i + 1, 2, 1, "Z");
+        struct sms_message *p = malloc(sizeof(struct sms_message) + 32);
+        memcpy(p, parts[0], sizeof(struct sms_message) + 32);
+        if (reasm_add(r, p, i + 1, &g) == REASM_FULL) {
+            full += 1;
+            free(p);
+        }
+    }
+    ok = (full == 1 && r->count == REASM_MAX_GROUPS);
+    printf("%s Buffer is capped at %d groups\n", STATUS, r->count);
+    errors += !ok;
+
+    for (int i = 0; i < REASM_MAX_GROUPS; ++i) {
+        g = reasm_at(r, i);
+        if (g != NULL && g->ref != 0x0034) {
+            free(g->part[0]);
+        }
+    }
+    for (int i = 0; i < 6; ++i) {
+        free(parts[i]);
+    }
+    free(r);
+
+    printf("Total results: %d errors\n\n", errors);
+    return errors;
+}
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SMSF_REASM_H
+#define _SMSF_REASM_H
+
+#include <stdint.h>
+
+struct sms_message;
+
+#ifdef ESP_PLATFORM
+  #define REASM_MAX_GROUPS 8        //! Long messages being assembled at the same time
+  #define REASM_MAX_BYTES 4096      //! Text of all buffered parts
+#else
+  #define REASM_MAX_GROUPS 32
+  #define REASM_MAX_BYTES 65536
+#endif
+
+#define REASM_MAX_PARTS 32          //! Longer messages are forwarded part by part
+#define REASM_SLOTS (REASM_MAX_GROUPS * 2)
+#define REASM_TIMEOUT (3600 * 1000) //! Forward incomplete message if missing parts don't arrive in time, ms
+
+#define REASM_FULL -1      //! No room for a new group, evict the oldest one and retry
+#define REASM_PENDING 0    //! Part is added, waiting for other parts
+#define REASM_COMPLETE 1   //! All parts are here
+#define REASM_DUPLICATE 2  //! Another message already took this part number
+
+/**
+ * @brief Parts of one long message, key is (sender, reference, total parts).
+ *        Parts are not owned by the group, they stay in the seen-message table.
+ */
+struct reasm_group {
+    uint64_t key;
+    int64_t created_ms;
+    uint32_t received;    //! Bitmap, bit n-1 is set when part n is here
+    uint16_t ref;
+    uint8_t parts;
+    uint8_t in_use;
+    char sender[14];
+    int bytes;            //! Text length of received parts
+    struct sms_message *part[REASM_MAX_PARTS];
+};
+
+struct reasm {
+    struct reasm_group groups[REASM_MAX_GROUPS];
+    int8_t index[REASM_SLOTS]; //! Open-addressing index of groups by key, -1 - empty, -2 - removed
+    int count;
+    int tombstones;
+    int bytes;
+};
+
+/**
+ * @brief Initialize empty reassembly buffer
+ *
+ * @param r - buffer
+ */
+void reasm_init(struct reasm *r);
+
+/**
+ * @brief Check the message is a part of long message that could be assembled
+ *
+ * @param msg - message
+ * @return int - 1 - part of valid long message, 0 - single message or broken UDH
+ */
+int reasm_is_part(const struct sms_message *msg);
+
+/**
+ * @brief Add part to its group, the group is created if required
+ *
+ * @param r - buffer
+ * @param msg - part, reasm_is_part(msg) must be true
+ * @param now - current time, monotonic ms
+ * @param group - group of the part, set if the result is not REASM_FULL
+ * @return int - REASM_PENDING, REASM_COMPLETE, REASM_DUPLICATE or REASM_FULL
+ */
+int reasm_add(struct reasm *r, struct sms_message *msg, int64_t now, struct reasm_group **group);
+
+/**
+ * @brief Drop the part if the message is removed elsewhere
+ *
+ * @param r - buffer
+ * @param msg - part
+ */
+void reasm_forget(struct reasm *r, const struct sms_message *msg);
+
+/**
+ * @brief Release the group, parts are not freed
+ *
+ * @param r - buffer
+ * @param group - group to release
+ */
+void reasm_release(struct reasm *r, struct reasm_group *group);
+
+/**
+ * @brief Get group by index to iterate over the buffer, 0..REASM_MAX_GROUPS-1
+ *
+ * @return struct reasm_group* - group or NULL if the slot is free
+ */
+struct reasm_group *reasm_at(struct reasm *r, int idx);
+
+/**
+ * @brief Oldest group, a candidate for eviction
+ *
+ * @return struct reasm_group* - group or NULL if the buffer is empty
+ */
+struct reasm_group *reasm_oldest(struct reasm *r);
+
+int reasm_complete(const struct reasm_group *group);
+int reasm_expired(const struct reasm_group *group, int64_t now);
+
+/**
+ * @brief Any received part, it's used as a template for sender and ts
+ */
+struct sms_message *reasm_first(const struct reasm_group *group);
+
+/**
+ * @brief Concatenate text of received parts, missing parts are marked with (...)
+ *
+ * @param group - group
+ * @param out - output buffer, could be NULL to calculate the size
+ * @param out_size - size of output buffer
+ * @return int - length of text without trailing zero
+ */
+int reasm_text(const struct reasm_group *group, char *out, int out_size);
+
+#ifdef _PDU_TEST
+ int test_reasm();
+#endif
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "smsf-stats.h"
+
+#define HIST_LINEAR (1 << (HIST_SUB_BITS + 1))
+#define HIST_SUB_MASK ((1 << HIST_SUB_BITS) - 1)
+
+int hist_bucket(uint32_t value) {
+    if (value < HIST_LINEAR) {
+        return value;
+    }
+
+    int exp = 31 - __builtin_clz(value);
+    int bucket = ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((value >> (exp - HIST_SUB_BITS)) & HIST_SUB_MASK);
+    return (bucket < HIST_BUCKETS) ? bucket : HIST_BUCKETS - 1;
+}
+
+uint32_t hist_bucket_high(int bucket) {
+    if (bucket < HIST_LINEAR) {
+        return bucket;
+    }
+    if (bucket == HIST_BUCKETS - 1) {
+        return UINT32_MAX;
+    }
+
+    int exp = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint32_t low = (1U << exp) + ((uint32_t) (bucket & HIST_SUB_MASK) << (exp - HIST_SUB_BITS));
+    return low + (1U << (exp - HIST_SUB_BITS)) - 1;
+}
+
+void hist_add(struct histogram *h, uint32_t value) {
+    h->buckets[hist_bucket(value)] += 1;
+    h->count += 1;
+    h->sum += value;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+uint32_t hist_percentile(const struct histogram *h, int pct) {
+    if (h->count == 0) {
+        return 0;
+    }
+
+    // Rank of the value, 1-based, rounded up
+    uint32_t rank = (uint32_t) (((uint64_t) h->count * pct + 99) / 100);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    uint32_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint32_t high = hist_bucket_high(i);
+            return (high < h->max) ? high : h->max;
+        }
+    }
+    return h->max;
+}
+
+uint32_t hist_count_below(const struct histogram *h, uint32_t value) {
+    int last = hist_bucket(value);
+    uint32_t count = 0;
+    for (int i = 0; i <= last; ++i) {
+        count += h->buckets[i];
+    }
+    return count;
+}
+
+#ifdef _PDU_TEST
+
+#define STATUS ((ok) ? "+OK " : "!ERR")
+
+int test_stats() {
+    printf("\n Testing histograms:\n");
+
+    int errors = 0;
+    int ok = 1;
+
+    // Every value is inside its bucket and buckets are contiguous
+    uint32_t values[] = { 0, 1, 7, 8, 9, 15, 16, 100, 1000, 12345, 999999, (1U << 26) - 1 };
+    for (int i = 0; i < (int) (sizeof(values) / sizeof(values[0])); ++i) {
+        int b = hist_bucket(values[i]);
+        uint32_t low = (b == 0) ? 0 : hist_bucket_high(b - 1) + 1;
+        ok = ok && values[i] >= low && values[i] <= hist_bucket_high(b);
+    }
+    for (int b = 1; b < HIST_BUCKETS - 1 && ok; ++b) {
+        ok = (hist_bucket(hist_bucket_high(b - 1) + 1) == b);
+    }
+    ok = ok && hist_bucket(UINT32_MAX) == HIST_BUCKETS - 1;
+    printf("%s Values map to contiguous buckets\n", STATUS);
+    errors += !ok;
+
+    // Bucket is at most 25% wide, so is the error of percentile
+    struct histogram h;
+    memset(&h, 0, sizeof(h));
+    for (uint32_t v = 1; v <= 1000; ++v) {
+        hist_add(&h, v * 100);
+    }
+    uint32_t p50 = hist_percentile(&h, 50);
+    uint32_t p99 = hist_percentile(&h, 99);
+    ok = (h.count == 1000 && h.max == 100000 && h.sum == 50050000);
+    ok = ok && p50 >= 50000 && p50 <= 50000 * 5 / 4;
+    ok = ok && p99 >= 99000 && p99 <= 100000;
+    ok = ok && hist_percentile(&h, 100) == 100000;
+    printf("%s Percentiles are within bucket width\n", STATUS);
+    errors += !ok;
+
+    uint32_t below = hist_count_below(&h, 50000);
+    ok = (below >= 500 && below <= 500 * 5 / 4);
+    ok = ok && hist_count_below(&h, 79) == 0 && hist_count_below(&h, 100) == 1 && hist_count_below(&h, UINT32_MAX) == 1000;
+    printf("%s Count below is within bucket width\n", STATUS);
+    errors += !ok;
+
+    printf("Total results: %d errors\n\n", errors);
+    return errors;
+}
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SMSF_STATS_H
+#define _SMSF_STATS_H
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 2        // 4 buckets per power of two, bucket is at most 25% wide
+#define HIST_BUCKETS 100       // Covers 0 .. 2^26 - 1, larger values go to the last bucket
+
+/**
+ * @brief Log-linear histogram of non-negative values, e.g. latency in microseconds.
+ *        Values below 2^(HIST_SUB_BITS + 1) have a bucket each, every next power of two
+ *        is split into 2^HIST_SUB_BITS buckets. Fixed size, no allocation.
+ */
+struct histogram {
+    uint32_t count;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t buckets[HIST_BUCKETS];
+};
+
+void hist_add(struct histogram *h, uint32_t value);
+
+/**
+ * @brief Bucket the value is counted in
+ */
+int hist_bucket(uint32_t value);
+
+/**
+ * @brief Largest value counted in the bucket
+ */
+uint32_t hist_bucket_high(int bucket);
+
+/**
+ * @brief Approximate percentile, upper bound of the bucket that holds it, never above max
+ *
+ * @param pct - percentile 0 .. 100
+ * @return uint32_t - value, 0 if histogram is empty
+ */
+uint32_t hist_percentile(const struct histogram *h, int pct);
+
+/**
+ * @brief Approximate number of values not above the value, e.g. Prometheus bucket,
+ *        the bucket that holds the value is counted whole
+ */
+uint32_t hist_count_below(const struct histogram *h, uint32_t value);
+
+#ifdef _PDU_TEST
+ int test_stats();
+#endif
+
+#endif
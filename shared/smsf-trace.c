@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smsf-logging.h"
+#include "smsf-util.h"
+#include "smsf-pdu.h"
+#include "smsf-trace.h"
+
+#define TRACE_LINE 256
+
+uint32_t trace_now() {
+    uint32_t now = (uint32_t) monotonic_ms();
+    return (now != 0) ? now : 1;
+}
+
+void trace_mark(struct sms_message *msg, enum trace_stage stage) {
+    msg->trace[stage] = trace_now();
+}
+
+int trace_open(struct trace_log *t, const char *name) {
+    t->fp = NULL;
+    t->size = 0;
+    t->name[0] = 0;
+    if (name == NULL) {
+        return 0;
+    }
+
+    strncpy(t->name, name, sizeof(t->name) - 1);
+    t->name[sizeof(t->name) - 1] = 0;
+    t->fp = fopen(t->name, "a");
+    if (t->fp == NULL) {
+        return log_errno("Can't open trace %s, trace records go to the log", t->name);
+    }
+    fseek(t->fp, 0, SEEK_END);
+    t->size = ftell(t->fp);
+    return 0;
+}
+
+void trace_close(struct trace_log *t) {
+    if (t->fp != NULL) {
+        fclose(t->fp);
+        t->fp = NULL;
+    }
+}
+
+static void trace_write(struct trace_log *t, const char *line, int len) {
+    if (t->fp == NULL) {
+        log_noise("Trace %.*s", len - 1, line);
+        return;
+    }
+
+    fwrite(line, len, 1, t->fp);
+    fflush(t->fp);
+    t->size += len;
+
+    if (t->size > TRACE_MAX_SIZE) {
+        // Keep one old file, so the trace never takes more than twice the limit
+        char old[sizeof(t->name) + 2];
+        snprintf(old, sizeof(old), "%s.1", t->name);
+        fclose(t->fp);
+        rename(t->name, old);
+        t->fp = fopen(t->name, "a");
+        t->size = 0;
+        if (t->fp == NULL) {
+            log_errno("Can't reopen trace %s, trace records go to the log", t->name);
+        }
+    }
+}
+
+// Unix ms of the seen stage
+static int64_t seen_unix_ms(const struct sms_message *msg) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t now = (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    return (msg->trace[TRACE_SEEN] != 0) ? now - (uint32_t) (trace_now() - msg->trace[TRACE_SEEN]) : now;
+}
+
+static int format_stage(char *buf, int size, const struct sms_message *msg, enum trace_stage stage) {
+    if (msg->trace[stage] == 0 || msg->trace[TRACE_SEEN] == 0) {
+        return snprintf(buf, size, " -");
+    }
+    return snprintf(buf, size, " %d", (int32_t) (msg->trace[stage] - msg->trace[TRACE_SEEN]));
+}
+
+void trace_sent(struct trace_log *t, const struct sms_message *msg, int attempts) {
+    char line[TRACE_LINE];
+    char sender[sizeof(msg->sender)];
+
+    // Alphanumeric sender may have spaces
+    int n = 0;
+    for (const char *s = msg->sender; *s != 0 && n < (int) sizeof(sender) - 1; ++s) {
+        sender[n++] = (*s > ' ' && *s < 0x7F) ? *s : '_';
+    }
+    sender[n] = 0;
+
+    int len = snprintf(line, sizeof(line), "S %lld %016llx %s %d %d", (long long) seen_unix_ms(msg),
+                       (unsigned long long) msg->fingerprint, (n > 0) ? sender : "-", (msg->split_parts > 0) ? msg->split_parts : 1, attempts);
+    for (int stage = TRACE_DECODED; stage <= TRACE_SENT; ++stage) {
+        len += format_stage(line + len, sizeof(line) - len, msg, stage);
+    }
+    len += snprintf(line + len, sizeof(line) - len, "\n");
+    trace_write(t, line, len);
+}
+
+void trace_deleted(struct trace_log *t, const struct sms_message *msg) {
+    char line[TRACE_LINE];
+    int len = snprintf(line, sizeof(line), "D %lld %016llx", (long long) seen_unix_ms(msg), (unsigned long long) msg->fingerprint);
+    len += format_stage(line + len, sizeof(line) - len, msg, TRACE_DELETED);
+    len += snprintf(line + len, sizeof(line) - len, "\n");
+    trace_write(t, line, len);
+}
+
+static int32_t parse_stage(const char *token) {
+    return (strcmp(token, "-") == 0) ? -1 : atoi(token);
+}
+
+int trace_parse(const char *line, struct trace_record *rec) {
+    long long seen;
+    unsigned long long fingerprint;
+    char stage[5][16];
+
+    memset(rec, 0, sizeof(struct trace_record));
+    for (int i = 0; i < TRACE_STAGES; ++i) {
+        rec->stage[i] = -1;
+    }
+
+    if (line[0] == 'S' && sscanf(line, "S %lld %llx %15s %d %d %15s %15s %15s %15s %15s", &seen, &fingerprint, rec->sender,
+                                 &rec->parts, &rec->attempts, stage[0], stage[1], stage[2], stage[3], stage[4]) == 10) {
+        for (int i = 0; i < 5; ++i) {
+            rec->stage[TRACE_DECODED + i] = parse_stage(stage[i]);
+        }
+    }
+    else if (line[0] == 'D' && sscanf(line, "D %lld %llx %15s", &seen, &fingerprint, stage[0]) == 3) {
+        rec->stage[TRACE_DELETED] = parse_stage(stage[0]);
+    }
+    else {
+        return -1;
+    }
+
+    rec->kind = line[0];
+    rec->seen = seen;
+    rec->fingerprint = fingerprint;
+    rec->stage[TRACE_SEEN] = 0;
+    return 0;
+}
+
+#ifdef _PDU_TEST
+
+#define STATUS ((ok) ? "+OK " : "!ERR")
+
+int test_trace() {
+    printf("\n Testing trace:\n");
+
+    int errors = 0;
+    int ok;
+    char buf[sizeof(struct sms_message) + 16];
+    struct sms_message *msg = (struct sms_message *) buf;
+    struct trace_record rec;
+    char name[] = "/tmp/smsf-trace-test.XXXXXX";
+    char line[TRACE_LINE];
+
+    memset(msg, 0, sizeof(struct sms_message));
+    strcpy(msg->sender, "Bank OTP");
+    msg->fingerprint = 0x1234abcdULL;
+    msg->split_parts = 2;
+    uint32_t seen = trace_now() - 5000;
+    msg->trace[TRACE_SEEN] = seen;
+    msg->trace[TRACE_DECODED] = seen + 20;
+    msg->trace[TRACE_QUEUED] = seen + 150;
+    msg->trace[TRACE_SENDING] = seen + 200;
+    msg->trace[TRACE_SENT] = seen + 4200;
+    msg->trace[TRACE_DELETED] = seen + 4300;
+
+    int fd = mkstemp(name);
+    struct trace_log t;
+    ok = (fd != -1 && trace_open(&t, name) == 0);
+    if (ok) {
+        trace_sent(&t, msg, 2);
+        trace_deleted(&t, msg);
+        trace_close(&t);
+    }
+
+    // Stages are relative to seen, missing stage is "-", sender has no spaces
+    FILE *fp = fopen(name, "r");
+    ok = ok && fp != NULL && fgets(line, sizeof(line), fp) != NULL && trace_parse(line, &rec) == 0;
+    ok = ok && rec.kind == 'S' && rec.fingerprint == 0x1234abcdULL && strcmp(rec.sender, "Bank_OTP") == 0;
+    ok = ok && rec.parts == 2 && rec.attempts == 2;
+    ok = ok && rec.stage[TRACE_DECODED] == 20 && rec.stage[TRACE_REASSEMBLED] == -1 && rec.stage[TRACE_QUEUED] == 150;
+    ok = ok && rec.stage[TRACE_SENDING] == 200 && rec.stage[TRACE_SENT] == 4200;
+    printf("%s Sent record\n", STATUS);
+    errors += !ok;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t now = (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    ok = (fp != NULL && fgets(line, sizeof(line), fp) != NULL && trace_parse(line, &rec) == 0);
+    ok = ok && rec.kind == 'D' && rec.fingerprint == 0x1234abcdULL && rec.stage[TRACE_DELETED] == 4300;
+    ok = ok && rec.seen > now - 6000 && rec.seen <= now - 5000;
+    ok = ok && trace_parse("X 1 2", &rec) == -1;
+    printf("%s Deleted record\n", STATUS);
+    errors += !ok;
+
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    if (fd != -1) {
+        close(fd);
+        unlink(name);
+    }
+
+    printf("Total results: %d errors\n\n", errors);
+    return errors;
+}
+
+#endif
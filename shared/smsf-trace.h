@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SMSF_TRACE_H
+#define _SMSF_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct sms_message;
+
+/**
+ * @brief Lifecycle stages of a message, every message keeps monotonic ms of the stages it reached
+ */
+enum trace_stage {
+    TRACE_SEEN,         //! Read from SIM started or +CMT received
+    TRACE_DECODED,      //! PDU decoded
+    TRACE_REASSEMBLED,  //! The last part of long message arrived
+    TRACE_QUEUED,       //! Put to the outbox
+    TRACE_SENDING,      //! Send started, the last attempt
+    TRACE_SENT,         //! Modem acknowledged the send
+    TRACE_DELETED,      //! Deleted from SIM
+    TRACE_STAGES
+};
+
+#ifdef ESP_PLATFORM
+  #define TRACE_MAX_SIZE 0                  //! No file system, records go to the log
+#else
+  #define TRACE_MAX_SIZE (1024 * 1024)      //! Trace file is rotated to <name>.1 when it grows beyond
+#endif
+
+/**
+ * @brief Trace records of one modem, one line per sent message and per message deleted from SIM
+ *
+ * Sent:    S <seen, unix ms> <fingerprint> <sender> <parts> <attempts> <decoded> <reassembled> <queued> <sending> <sent>
+ * Deleted: D <seen, unix ms> <fingerprint> <deleted>
+ *
+ * Stages are ms since seen, "-" if the stage is not reached, all stages are "-" for messages
+ * sent after restart. Long message is traced under the fingerprint of its first part.
+ */
+struct trace_log {
+    FILE *fp;           //! NULL - records go to the log
+    char name[256];
+    long size;
+};
+
+/**
+ * @brief Parsed trace record
+ */
+struct trace_record {
+    char kind;          //! 'S' or 'D'
+    int64_t seen;       //! Unix ms
+    uint64_t fingerprint;
+    char sender[16];
+    int parts;
+    int attempts;
+    int32_t stage[TRACE_STAGES]; //! ms since seen, -1 - not reached
+};
+
+// Current monotonic ms as it's kept in the message, never 0
+uint32_t trace_now();
+
+// Record the stage of the message now
+void trace_mark(struct sms_message *msg, enum trace_stage stage);
+
+/**
+ * @brief Open trace file for append
+ *
+ * @param t - trace
+ * @param name - file name, NULL - write records to the log
+ * @return int - 0 - success, -1 - error, records go to the log
+ */
+int trace_open(struct trace_log *t, const char *name);
+void trace_close(struct trace_log *t);
+
+// Message is sent, attempts - number of send attempts including the last one
+void trace_sent(struct trace_log *t, const struct sms_message *msg, int attempts);
+// Message is deleted from SIM
+void trace_deleted(struct trace_log *t, const struct sms_message *msg);
+
+/**
+ * @brief Parse trace line
+ *
+ * @return int - 0 - success, -1 - not a trace record
+ */
+int trace_parse(const char *line, struct trace_record *rec);
+
+#ifdef _PDU_TEST
+ int test_trace();
+#endif
+
+#endif
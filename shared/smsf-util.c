@@ -78,42 +78,6 @@ void ui_to_hex(unsigned int num, char *str) {
 }
 
 
-/* Convert hex string to bin array, return the number of converted bytes */
-int bin2hex(const unsigned char *bin, int bi_len, char *hex) {
-    const char * hex_digs = "0123456789ABCDEF";
-    int hi = 0, bi = 0;
-    while(bi < bi_len) {
-        hex[hi] = hex_digs[(bin[bi] >> 4) & 0xf];
-        hex[hi+1] = hex_digs[bin[bi]& 0xf];
-        bi ++;
-        hi += 2;
-    }
-    return hi;
-}
-
-/* Convert hex string to bin array, return the number of converted bytes */
-int hex2bin(const char *hex, int hex_len, unsigned char *bin) {
-    int hi = 0, bi = 0;
-    while(hi < hex_len) {
-        unsigned char c1 = (hex[hi] | 0x20);
-        unsigned char c2 = (hex[hi+1] | 0x20);
-        if (c1 == 0 || c2 == 0) {
-           break;
-        }
-        c1 = (c1 >= '0' && c1 <= '9') ? c1 - '0' : \
-               (c1 >= 'a' && c1 <= 'f') ? c1 - 'a' + 10 : c1;
-        c2 = (c2 >= '0' && c2 <= '9') ? c2 - '0' : \
-               (c2 >= 'a' && c2 <= 'f') ? c2 - 'a' + 10 : c2;
-        if (c1 > 16 || c2 > 16) {
-           break;
-        }
-        bin[bi] = (c1 << 4) | c2;
-        bi ++;
-        hi += 2;
-    }
-    return hi;
-}
-
 void read_line(const char *buf, int *pos, const char **line, int *line_len) {
     const char *p = buf +(*pos);
     const char *s = strchr(p, '\n');
@@ -166,19 +130,6 @@ int copy_quoted(char *dest, int dest_size, const char *src, int src_len) {
     return s - src;
 }
 
-int16_t crc16(const char* data, int len) {
-    uint8_t i;
-    uint16_t crc = 0xffff;
-    while (len--) {
-        crc ^= *(unsigned char *)data++ << 8;
-        for (i = 0; i < 8; i++) {
-            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
-        }
-    }
-
-    return crc & 0xffff;
-}
-
 #if 0
 time_t iso2ctime(const char *iso_time) {
     struct tm tm = {0};
@@ -232,4 +183,23 @@ time_t gsm2time(const char *gsm_time) {
     return mktime(&tm);
 }
 
+int64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
+uint64_t fnv1a64(uint64_t hash, const void *data, int len) {
+    const uint8_t *p = data;
+    while (len--) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
@@ -20,14 +20,14 @@
 #include <stdint.h>
 #include <time.h>
 
+#include "smsf-hex.h"
+#include "smsf-crc.h"
+
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
 void ui_to_str(unsigned int num, char *str);
 void ui_to_hex(unsigned int num, char *str);
 
-int bin2hex(const unsigned char *bin, int bi_len, char *hex);
-int hex2bin(const char *hex, int hex_len, unsigned char *bin);
-
 
 /**
  * @brief Read buffer by line, starting with pos.
@@ -50,16 +50,6 @@ void read_line(const char *buf, int *pos, const char **line, int *line_len);
  */
 int copy_quoted(char *dest, int dest_size, const char *src, int src_len);
 
-/**
- * @brief src16 for SMS hashing
- *
- * @param data
- * @param len
- * @return int16_t
- */
-
-int16_t crc16(const char* data, int len);
-
 /**
  * @brief Convert ISO 8601 ts to unix ts
  *        TimeZone is not respected
@@ -80,4 +70,32 @@ time_t iso2time(const char *iso_time);
 
 time_t gsm2time(const char *gsm_time);
 
+/**
+ * @brief Monotonic clock in milliseconds, not affected by network clock sync
+ *
+ * @return int64_t - milliseconds since unspecified starting point
+ */
+
+int64_t monotonic_ms();
+
+/**
+ * @brief Monotonic clock in microseconds, to time modem round trips
+ *
+ * @return int64_t - microseconds since unspecified starting point
+ */
+int64_t monotonic_us();
+
+#define FNV64_INIT 0xcbf29ce484222325ULL
+
+/**
+ * @brief FNV-1a 64-bit hash, could be chained, start with FNV64_INIT
+ *
+ * @param hash - hash of the previous data or FNV64_INIT
+ * @param data - data to hash
+ * @param len - length of data
+ * @return uint64_t - hash value
+ */
+
+uint64_t fnv1a64(uint64_t hash, const void *data, int len);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,374 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * End-to-end forwarding benchmark. Simulator runs in a separate thread,
+ * flow_setup()/flow()/flow_wait() run in the main thread against
+ * the simulator pseudo-terminal, exactly as the daemon does.
+ * Results are printed to stdout as JSON.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smsf-logging.h"
+#include "smsf-util.h"
+#include "smsf-hal.h"
+#include "smsf-ata.h"
+#include "smsf-flow.h"
+#include "smsf-sim.h"
+
+extern struct smsf_options _opts;
+
+struct bench {
+    struct sim_modem sim;
+    int count;
+    double rate;
+    int mix[SIM_MSG_KINDS];
+    int64_t deadline;
+
+    int64_t *injected_ms;   //! Indexed by message sequence number
+    int64_t *forwarded_ms;
+    int forwarded;          //! Updated by simulator thread, read by flow thread
+    int woken;              //! Flow thread is woken up after the last message is sent through the second port
+    int stop;
+    int injected;
+    int64_t start_ms;       //! Set by flow thread once setup is done
+    int fd;                 //! First AT port, messages are read there
+    int send_fd;            //! Second AT port, -1 - messages are sent through the first one
+    pthread_t port_thread;  //! Serves the second port
+};
+
+static void usage() {
+    printf("Usage: s3smsf-bench [-n count] [-r rate] [-m mix] [-i mode] [-s slots] [-l ms] [-L verb=ms,...] \n"
+           "                    [-P ports] [-t seconds] [-v verbosity]\n"
+           "    -n number of messages to inject, default 100\n"
+           "    -r messages per second, default 10\n"
+           "    -m weights of single,multipart,ucs2,alphanumeric messages, default 60,20,10,10\n"
+           "    -i new message indication mode passed to flow, default 1\n"
+           "    -s SIM storage slots, default 20\n"
+           "    -l simulated latency of every command, milliseconds\n"
+           "    -L simulated per-command latency, e.g. CMGS=2000,CMGL=300\n"
+           "    -P AT command ports, 2 - send messages through the second port, default 1\n"
+           "    -t give up after this time, default 120 seconds\n"
+           "    -v verbosity level 3 (ERROR), 5 (NOISE), 7 (DEBUG), default - ERROR\n");
+}
+
+static void notify(char *format, ...) {
+    // Nothing to display
+}
+
+// Forwarded text carries #<seq> put there by the simulator
+static void on_sent(void *arg, const char *text) {
+    struct bench *b = arg;
+    const char *s = strchr(text, '#');
+    while (s != NULL && !(s[1] >= '0' && s[1] <= '9')) {
+        s = strchr(s + 1, '#');
+    }
+    if (s == NULL) {
+        return;
+    }
+    int seq = atoi(s + 1);
+    if (seq < 1 || seq > b->count || b->forwarded_ms[seq] != 0) {
+        return;
+    }
+    b->forwarded_ms[seq] = monotonic_ms();
+    __atomic_add_fetch(&b->forwarded, 1, __ATOMIC_RELEASE);
+}
+
+static enum sim_msg_kind pick_kind(struct bench *b) {
+    int total = 0;
+    for (int i = 0; i < SIM_MSG_KINDS; ++i) {
+        total += b->mix[i];
+    }
+    int r = (total > 0) ? rand() % total : 0;
+    for (int i = 0; i < SIM_MSG_KINDS; ++i) {
+        if (r < b->mix[i]) {
+            return i;
+        }
+        r -= b->mix[i];
+    }
+    return SIM_MSG_7BIT;
+}
+
+static void *sim_thread(void *arg) {
+    struct bench *b = arg;
+    int64_t interval = (int64_t) (1000 / b->rate);
+    int64_t next = 0;
+
+    while (!__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE)) {
+        int64_t now = monotonic_ms();
+        if (now > b->deadline) {
+            log_err("Benchmark timeout, %d of %d messages forwarded", b->forwarded, b->count);
+            break;
+        }
+        if (b->send_fd != -1 && !b->woken && __atomic_load_n(&b->forwarded, __ATOMIC_ACQUIRE) == b->count) {
+            // Last message is sent by the send thread, while the flow thread could wait for events on the first port
+            static const char wake[] = "\r\n+CMTI: \"SM\",1\r\n";
+            if (write(b->sim.ports[0].master, wake, sizeof(wake) - 1) < 0) {
+                log_errno("Can't wake up flow thread");
+            }
+            b->woken = 1;
+        }
+        if (next == 0) {
+            // Don't inject anything until setup is done
+            next = __atomic_load_n(&b->start_ms, __ATOMIC_ACQUIRE);
+        }
+        if (next != 0 && b->injected < b->count && now >= next) {
+            int seq = sim_inject(&b->sim, pick_kind(b));
+            if (seq > 0 && seq <= b->count) {
+                b->injected_ms[seq] = now;
+                b->injected += 1;
+            }
+            next += interval;
+            continue;
+        }
+        int timeout = (next != 0 && b->injected < b->count) ? (int) MIN(next - now, 10) : 10;
+        if (sim_poll(&b->sim, timeout) == -1) {
+            break;
+        }
+    }
+
+    // Closing the master side wakes up the flow thread, if it waits for the modem
+    __atomic_store_n(&b->stop, 1, __ATOMIC_RELEASE);
+    if (b->send_fd != -1) {
+        pthread_join(b->port_thread, NULL);
+    }
+    sim_close(&b->sim);
+    return NULL;
+}
+
+// Second port is served by its own thread, as a real modem does
+static void *port_thread(void *arg) {
+    struct bench *b = arg;
+    while (!__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE)) {
+        if (sim_poll_port(&b->sim, 1, 10) == -1) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *send_thread(void *arg) {
+    struct bench *b = arg;
+    // Returns 0 when stopped by flow_send_stop, retry port setup errors
+    while (flow_send_loop(b->fd, notify) != 0 && !__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE)) {
+        usleep(10000);
+    }
+    return NULL;
+}
+
+static int cmp_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted array
+static int64_t percentile(const int64_t *sorted, int n, int p) {
+    if (n == 0) {
+        return 0;
+    }
+    int rank = (p * n + 99) / 100;
+    return sorted[(rank > 0) ? rank - 1 : 0];
+}
+
+// Per AT command counters collected by the modem layer, setup commands included
+static void print_at_stats(const char *name, int fd, const char *tail) {
+    const struct at_stats *stats;
+    int count = ata_stats(fd, &stats);
+
+    printf(" \"%s\": {", name);
+    for (int i = 0; i < count; ++i) {
+        const struct histogram *h = &stats[i].latency_us;
+        printf("%s\n  \"%s\": {\"calls\": %u, \"errors\": %u, \"timeouts\": %u, \"bytes_out\": %u, \"bytes_in\": %u, "
+               "\"p50_us\": %u, \"p99_us\": %u, \"max_us\": %u}",
+               (i > 0) ? "," : "", stats[i].verb, stats[i].calls, stats[i].errors, stats[i].timeouts,
+               stats[i].bytes_out, stats[i].bytes_in, hist_percentile(h, 50), hist_percentile(h, 99), h->max);
+    }
+    printf("}%s", tail);
+}
+
+int main(int argc, char **argv) {
+    struct sim_config cfg = { .slots = 20, .echo = 1, .da = "79210000000", .ports = 1 };
+    struct bench *b = calloc(1, sizeof(struct bench));
+    int timeout = 120;
+    int opt;
+
+    if (b == NULL) {
+        exit(2);
+    }
+
+    b->count = 100;
+    b->rate = 10;
+    b->mix[SIM_MSG_7BIT] = 60;
+    b->mix[SIM_MSG_MULTIPART] = 20;
+    b->mix[SIM_MSG_UCS2] = 10;
+    b->mix[SIM_MSG_ALNUM] = 10;
+
+    _opts.verbosity = LOG_ERR;
+    _opts.cnmi = 1;
+
+    while ((opt = getopt(argc, argv, "n:r:m:i:s:l:L:P:t:v:h")) != -1) {
+        switch (opt) {
+        case 'n': b->count = atoi(optarg); break;
+        case 'r': b->rate = atof(optarg); break;
+        case 'i': _opts.cnmi = atoi(optarg); break;
+        case 's': cfg.slots = atoi(optarg); break;
+        case 'l': cfg.latency_ms = atoi(optarg); break;
+        case 'P': cfg.ports = atoi(optarg); break;
+        case 't': timeout = atoi(optarg); break;
+        case 'v': _opts.verbosity = atoi(optarg); break;
+        case 'm':
+            if (sscanf(optarg, "%d,%d,%d,%d", &b->mix[0], &b->mix[1], &b->mix[2], &b->mix[3]) != SIM_MSG_KINDS) {
+                fprintf(stderr, "Invalid mix %s\n", optarg);
+                exit(7);
+            }
+            break;
+        case 'L':
+            if (sim_parse_verbs(&cfg, optarg, 0) == -1) {
+                fprintf(stderr, "Invalid list %s\n", optarg);
+                exit(7);
+            }
+            break;
+        default:
+            usage();
+            exit(7);
+        }
+    }
+
+    if (b->count < 1 || b->rate <= 0 || _opts.cnmi < 0 || _opts.cnmi > 2) {
+        usage();
+        exit(7);
+    }
+
+    b->injected_ms = calloc(b->count + 1, sizeof(int64_t));
+    b->forwarded_ms = calloc(b->count + 1, sizeof(int64_t));
+    if (b->injected_ms == NULL || b->forwarded_ms == NULL) {
+        exit(2);
+    }
+
+    // Same as the daemon, flow thread doesn't wait for log output
+    log_start();
+
+    if (sim_open(&b->sim, &cfg) == -1) {
+        exit(2);
+    }
+    b->sim.on_sent = on_sent;
+    b->sim.on_sent_arg = b;
+
+    int fd;
+    if (com_open(b->sim.ports[0].slave_name, &fd) == -1) {
+        log_errno("Can't open %s", b->sim.ports[0].slave_name);
+        exit(2);
+    }
+    b->fd = fd;
+    b->send_fd = -1;
+    if (b->sim.n_ports > 1) {
+        if (com_open(b->sim.ports[1].slave_name, &b->send_fd) == -1) {
+            log_errno("Can't open %s", b->sim.ports[1].slave_name);
+            exit(2);
+        }
+        flow_send_port(fd, b->send_fd);
+    }
+
+    // Simulator has to answer setup commands
+    b->deadline = monotonic_ms() + timeout * 1000;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sim_thread, b) != 0) {
+        log_errno("Can't start simulator thread");
+        exit(2);
+    }
+    pthread_t send_tid;
+    if (b->send_fd != -1 && (pthread_create(&b->port_thread, NULL, port_thread, b) != 0 ||
+                             pthread_create(&send_tid, NULL, send_thread, b) != 0)) {
+        log_errno("Can't start send port threads");
+        exit(2);
+    }
+
+    if (flow_setup(fd, notify, NULL) != 0) {
+        log_err("Flow setup error");
+        exit(2);
+    }
+
+    // Measure forwarding only, setup cost is excluded
+    long commands_base = __atomic_load_n(&b->sim.stats.commands, __ATOMIC_RELAXED);
+    long syscalls_base = com_syscalls();
+    int64_t start = monotonic_ms();
+    __atomic_store_n(&b->start_ms, start, __ATOMIC_RELEASE);
+
+    while (__atomic_load_n(&b->forwarded, __ATOMIC_ACQUIRE) < b->count &&
+           !__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE)) {
+        if (flow(fd, notify) == -1 || flow_wait(fd, notify) == -1) {
+            usleep(10000); // Modem errors are expected when error injection is on
+        }
+    }
+
+    long syscalls = com_syscalls() - syscalls_base;
+    if (b->send_fd != -1) {
+        // Simulator still serves the second port, so the message being sent, if any, is completed
+        flow_send_stop(fd);
+        pthread_join(send_tid, NULL);
+    }
+    __atomic_store_n(&b->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    com_close(fd);
+    if (b->send_fd != -1) {
+        com_close(b->send_fd);
+    }
+
+    long commands = b->sim.stats.commands - commands_base;
+    int forwarded = b->forwarded;
+    int64_t *latency = calloc(b->count, sizeof(int64_t));
+    int64_t last = start;
+    int n = 0;
+    for (int seq = 1; seq <= b->count; ++seq) {
+        if (b->forwarded_ms[seq] != 0) {
+            latency[n++] = b->forwarded_ms[seq] - b->injected_ms[seq];
+            last = (b->forwarded_ms[seq] > last) ? b->forwarded_ms[seq] : last;
+        }
+    }
+    qsort(latency, n, sizeof(int64_t), cmp_int64);
+
+    double elapsed_ms = (last > start) ? (double) (last - start) : 1;
+    double per_msg = (forwarded > 0) ? (double) forwarded : 1;
+
+    printf("{\"version\": \"%x\", \"mode\": %d, \"rate\": %.2f, \"mix\": [%d, %d, %d, %d], "
+           "\"latency_cmd_ms\": %d, \"slots\": %d, \"ports\": %d,\n",
+           SMSF_VERSION, _opts.cnmi, b->rate, b->mix[0], b->mix[1], b->mix[2], b->mix[3],
+           cfg.latency_ms, cfg.slots, b->sim.n_ports);
+    printf(" \"injected\": %d, \"forwarded\": %d, \"elapsed_ms\": %.0f, \"msgs_per_min\": %.1f,\n",
+           b->count, forwarded, elapsed_ms, forwarded * 60000.0 / elapsed_ms);
+    printf(" \"latency_ms\": {\"p50\": %lld, \"p95\": %lld, \"p99\": %lld, \"max\": %lld},\n",
+           (long long) percentile(latency, n, 50), (long long) percentile(latency, n, 95),
+           (long long) percentile(latency, n, 99), (long long) ((n > 0) ? latency[n - 1] : 0));
+    printf(" \"at_round_trips_per_msg\": %.2f, \"syscalls_per_msg\": %.2f, \"parts_sent\": %ld,\n",
+           commands / per_msg, syscalls / per_msg, b->sim.stats.sent);
+    print_at_stats("at", fd, (b->send_fd != -1) ? ",\n" : "}\n");
+    if (b->send_fd != -1) {
+        print_at_stats("at_send", b->send_fd, "}\n");
+    }
+
+    int res = (forwarded == b->count) ? 0 : 1;
+    free(latency);
+    free(b->injected_ms);
+    free(b->forwarded_ms);
+    free(b);
+    return res;
+}
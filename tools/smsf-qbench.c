@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Queue and hex codec microbenchmark, the same code runs on ESP32 when built with SMSF_QUEUE_BENCH
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "smsf-logging.h"
+#include "smsf-queue.h"
+#include "smsf-hex.h"
+
+extern struct smsf_options _opts;
+
+static void usage() {
+    printf("Usage: s3smsf-qbench [-n count] [-x]\n"
+           "    -n items per case, default 1000000\n"
+           "    -x measure hex codec instead of queues, items are 512 character PDUs\n");
+}
+
+int main(int argc, char **argv) {
+    int count = 1000000;
+    int hex = 0;
+    int opt;
+
+    _opts.verbosity = LOG_ERR;
+
+    while ((opt = getopt(argc, argv, "n:xh")) != -1) {
+        switch (opt) {
+        case 'n': count = atoi(optarg); break;
+        case 'x': hex = 1; break;
+        default:
+            usage();
+            exit(7);
+        }
+    }
+
+    if (count < 1) {
+        usage();
+        exit(7);
+    }
+    if (hex) {
+        return (hex_bench(count) == 0) ? 0 : 2;
+    }
+    return (queue_bench(count) == 0) ? 0 : 2;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smsf-logging.h"
+#include "smsf-util.h"
+#include "smsf-sim.h"
+
+extern struct smsf_options _opts;
+
+static volatile sig_atomic_t _stop = 0;
+
+static void usage() {
+    printf("Usage: s3smsf-sim [-n count] [-r rate] [-m mix] [-s slots] [-l ms] [-L verb=ms,...] \n"
+           "                  [-e percent] [-E verb=percent,...] [-a number] [-P ports] [-v verbosity]\n"
+           "    -n number of incoming messages to generate, default 0\n"
+           "    -r incoming messages per second, default 1\n"
+           "    -m weights of single,multipart,ucs2,alphanumeric messages, default 60,20,10,10\n"
+           "    -s SIM storage slots, default 20\n"
+           "    -l latency of every command, milliseconds\n"
+           "    -L per-command latency, e.g. CMGS=2000,CMGL=300\n"
+           "    -e percent of commands answered with error\n"
+           "    -E per-command error rate, e.g. CMGS=10\n"
+           "    -a number stored as PRIMARY NUMBER contact\n"
+           "    -P AT command ports, 1 or 2, messages are indicated on the first one\n"
+           "    -v verbosity level 3 (ERROR), 5 (NOISE), 7 (DEBUG), default - ERROR\n"
+           "Prints pseudo-terminal names, one per port, and runs until interrupted\n");
+}
+
+// Extra ports are served by their own threads, so latency of one port doesn't block others
+static void *port_thread(void *arg) {
+    struct sim_modem *sim = arg;
+    while (!_stop) {
+        if (sim_poll_port(sim, 1, 100) == -1) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void on_signal(int sig) {
+    _stop = 1;
+}
+
+static int parse_mix(const char *s, int *mix) {
+    for (int i = 0; i < SIM_MSG_KINDS; ++i) {
+        mix[i] = atoi(s);
+        s = strchr(s, ',');
+        if (s == NULL) {
+            return (i == SIM_MSG_KINDS - 1) ? 0 : -1;
+        }
+        s += 1;
+    }
+    return -1;
+}
+
+static enum sim_msg_kind pick_kind(const int *mix) {
+    int total = 0;
+    for (int i = 0; i < SIM_MSG_KINDS; ++i) {
+        total += mix[i];
+    }
+    int r = (total > 0) ? rand() % total : 0;
+    for (int i = 0; i < SIM_MSG_KINDS; ++i) {
+        if (r < mix[i]) {
+            return i;
+        }
+        r -= mix[i];
+    }
+    return SIM_MSG_7BIT;
+}
+
+int main(int argc, char **argv) {
+    struct sim_config cfg = { .slots = 20, .echo = 1, .da = "79210000000", .ports = 1 };
+    struct sim_modem *sim;
+    int count = 0;
+    double rate = 1;
+    int mix[SIM_MSG_KINDS] = { 60, 20, 10, 10 };
+    int opt;
+
+    _opts.verbosity = LOG_ERR;
+
+    while ((opt = getopt(argc, argv, "n:r:m:s:l:L:e:E:a:P:v:h")) != -1) {
+        switch (opt) {
+        case 'n': count = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 's': cfg.slots = atoi(optarg); break;
+        case 'l': cfg.latency_ms = atoi(optarg); break;
+        case 'e': cfg.error_rate = atoi(optarg); break;
+        case 'a': snprintf(cfg.da, sizeof(cfg.da), "%s", optarg); break;
+        case 'P': cfg.ports = atoi(optarg); break;
+        case 'v': _opts.verbosity = atoi(optarg); break;
+        case 'm':
+            if (parse_mix(optarg, mix) == -1) {
+                fprintf(stderr, "Invalid mix %s\n", optarg);
+                exit(7);
+            }
+            break;
+        case 'L':
+        case 'E':
+            if (sim_parse_verbs(&cfg, optarg, opt == 'E') == -1) {
+                fprintf(stderr, "Invalid list %s\n", optarg);
+                exit(7);
+            }
+            break;
+        default:
+            usage();
+            exit(7);
+        }
+    }
+
+    if (rate <= 0) {
+        rate = 1;
+    }
+
+    sim = malloc(sizeof(struct sim_modem));
+    if (sim == NULL || sim_open(sim, &cfg) == -1) {
+        exit(2);
+    }
+
+    for (int i = 0; i < sim->n_ports; ++i) {
+        printf("%s\n", sim->ports[i].slave_name);
+    }
+    fflush(stdout);
+
+    pthread_t thread;
+    if (sim->n_ports > 1 && pthread_create(&thread, NULL, port_thread, sim) != 0) {
+        log_errno("Can't start port thread");
+        exit(2);
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    int64_t interval = (int64_t) (1000 / rate);
+    int64_t next = monotonic_ms() + interval;
+    int generated = 0;
+
+    while (!_stop) {
+        int64_t now = monotonic_ms();
+        if (generated < count && now >= next) {
+            if (sim_inject(sim, pick_kind(mix)) != -1) {
+                generated += 1;
+            }
+            next += interval;
+            continue;
+        }
+        int timeout = (generated < count) ? (int) MIN(next - now, 100) : 100;
+        if (sim_poll(sim, timeout) == -1) {
+            break;
+        }
+    }
+
+    fprintf(stderr, "commands %ld errors %ld generated %ld delivered %ld deleted %ld sent %ld\n",
+            sim->stats.commands, sim->stats.errors, sim->stats.generated,
+            sim->stats.delivered, sim->stats.deleted, sim->stats.sent);
+
+    sim_close(sim);
+    free(sim);
+    return 0;
+}
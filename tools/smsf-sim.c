@@ -0,0 +1,876 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Modem simulator, talks AT commands over pseudo-terminal.
+ * Models SIM storage, phone book, +CMTI/+CMT indications and
+ * the network side, that keeps messages while SIM is full.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smsf-logging.h"
+#include "smsf-util.h"
+#include "smsf-sim.h"
+
+#define CRLF "\r\n"
+#define CTRL_Z 0x1A
+#define ESC 0x1B
+
+#define SMSC_HEADER "07919712690080F8" // SMSC +79219600088
+#define SENDER_NUMBER "79219800469"
+#define SENDER_ALNUM "SIMBANK"
+
+#define PART_SEPTETS 153   // 7-bit septets per part with UDH
+#define PART_UCS2 67       // UCS2 characters per part with UDH
+
+static const char *_lorem = "Lorem ipsum dolor sit amet, consectetur adipiscing elit, "
+                            "sed do eiusmod tempor incididunt ut labore et dolore magna aliqua. "
+                            "Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris "
+                            "nisi ut aliquip ex ea commodo consequat. Duis aute irure dolor in "
+                            "reprehenderit in voluptate velit esse cillum dolore eu fugiat nulla pariatur.";
+
+static int sim_rand(struct sim_modem *sim) {
+    sim->rand_state = sim->rand_state * 1103515245 + 12345;
+    return (sim->rand_state >> 16) & 0x7FFF;
+}
+
+static int sim_write(struct sim_modem *sim, const char *str, int len) {
+    while (len > 0) {
+        int bw = write(sim->port->master, str, len);
+        if (bw == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            log_errno("Simulator write error");
+            return -1;
+        }
+        str += bw;
+        len -= bw;
+    }
+    return 0;
+}
+
+static int sim_printf(struct sim_modem *sim, const char *fmt, ...) {
+    char buf[SIM_PDU_SIZE + 64];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    return sim_write(sim, buf, MIN(len, (int) sizeof(buf) - 1));
+}
+
+// Semi-octet (swapped nibbles) encoding of decimal digits
+static int put_semi_octets(uint8_t *out, const char *digits) {
+    int len = strlen(digits);
+    for (int i = 0; i < len; i += 2) {
+        uint8_t lo = digits[i] - '0';
+        uint8_t hi = (i + 1 < len) ? digits[i + 1] - '0' : 0xF;
+        out[i / 2] = (hi << 4) | lo;
+    }
+    return (len + 1) / 2;
+}
+
+// Pack septets to octets, starting fill_bits into the first octet
+static int pack_7bit(const char *septets, int count, int fill_bits, uint8_t *out) {
+    int bits = fill_bits;
+    int nbytes = (fill_bits + count * 7 + 7) / 8;
+    memset(out, 0, nbytes);
+    for (int i = 0; i < count; ++i, bits += 7) {
+        uint16_t v = (septets[i] & 0x7F) << (bits % 8);
+        out[bits / 8] |= v & 0xFF;
+        if ((bits % 8) > 1) {
+            out[bits / 8 + 1] |= v >> 8;
+        }
+    }
+    return nbytes;
+}
+
+static void unpack_7bit(const uint8_t *in, int start_bit, int count, char *out) {
+    for (int i = 0; i < count; ++i) {
+        int bit = start_bit + i * 7;
+        uint16_t v = in[bit / 8] | (in[bit / 8 + 1] << 8);
+        out[i] = (v >> (bit % 8)) & 0x7F;
+        if (out[i] == 0) {
+            out[i] = '@'; // GSM alphabet, don't terminate the string
+        }
+    }
+    out[count] = 0;
+}
+
+static int utf8_to_ucs2(const char *str, uint8_t *out, int max_chars) {
+    const uint8_t *s = (const uint8_t *) str;
+    int n = 0;
+    while (*s && n < max_chars) {
+        uint16_t c;
+        if (*s < 0x80) {
+            c = *s++;
+        }
+        else if ((*s & 0xE0) == 0xC0 && s[1] != 0) {
+            c = ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+            s += 2;
+        }
+        else if ((*s & 0xF0) == 0xE0 && s[1] != 0 && s[2] != 0) {
+            c = ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+            s += 3;
+        }
+        else {
+            c = '?';
+            s += 1;
+        }
+        out[n * 2] = c >> 8;
+        out[n * 2 + 1] = c & 0xFF;
+        n += 1;
+    }
+    return n;
+}
+
+static int ucs2_to_utf8(const uint8_t *in, int chars, char *out, int out_size) {
+    int n = 0;
+    for (int i = 0; i < chars && n < out_size - 4; ++i) {
+        uint16_t c = (in[i * 2] << 8) | in[i * 2 + 1];
+        if (c < 0x80) {
+            out[n++] = c;
+        }
+        else if (c < 0x800) {
+            out[n++] = 0xC0 | (c >> 6);
+            out[n++] = 0x80 | (c & 0x3F);
+        }
+        else {
+            out[n++] = 0xE0 | (c >> 12);
+            out[n++] = 0x80 | ((c >> 6) & 0x3F);
+            out[n++] = 0x80 | (c & 0x3F);
+        }
+    }
+    out[n] = 0;
+    return n;
+}
+
+static uint8_t bcd(int v) {
+    return ((v % 10) << 4) | (v / 10);
+}
+
+/*
+ * Build SMS-DELIVER PDU and queue it to the network side.
+ * part/parts - 1/1 for single message, udh with 8-bit reference otherwise
+ * ucs2 - text is UCS2 bytes (text_len characters) or GSM septets (text_len septets)
+ */
+static int queue_deliver(struct sim_modem *sim, int alnum, int ucs2, int ref, int part, int parts,
+                         const char *text, int text_len) {
+    if (sim->net_count == SIM_NET_QUEUE) {
+        log_err("Network queue is full, message dropped");
+        return -1;
+    }
+
+    uint8_t bin[200];
+    int o = 0;
+    int udhi = (parts > 1);
+
+    bin[o++] = 0x04 | (udhi ? 0x40 : 0); // SMS-DELIVER, no more messages to send
+
+    if (alnum) {
+        int septets = strlen(SENDER_ALNUM);
+        int nbytes = pack_7bit(SENDER_ALNUM, septets, 0, bin + o + 2);
+        bin[o++] = (septets * 7 + 3) / 4;   // Address length in semi-octets
+        bin[o++] = 0xD0;                    // Alphanumeric
+        o += nbytes;
+    }
+    else {
+        bin[o++] = strlen(SENDER_NUMBER);
+        bin[o++] = 0x91;                    // International
+        o += put_semi_octets(bin + o, SENDER_NUMBER);
+    }
+
+    bin[o++] = 0x00;                        // PID
+    bin[o++] = ucs2 ? 0x08 : 0x00;          // DCS
+
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    bin[o++] = bcd(tm.tm_year % 100);
+    bin[o++] = bcd(tm.tm_mon + 1);
+    bin[o++] = bcd(tm.tm_mday);
+    bin[o++] = bcd(tm.tm_hour);
+    bin[o++] = bcd(tm.tm_min);
+    bin[o++] = bcd(tm.tm_sec);
+    bin[o++] = 0x00;                        // UTC
+
+    uint8_t udh[6] = { 0x05, 0x00, 0x03, ref & 0xFF, parts, part };
+    int udl_pos = o++;
+
+    if (ucs2) {
+        if (udhi) {
+            memcpy(bin + o, udh, sizeof(udh));
+            o += sizeof(udh);
+        }
+        memcpy(bin + o, text, text_len * 2);
+        o += text_len * 2;
+        bin[udl_pos] = (udhi ? sizeof(udh) : 0) + text_len * 2;
+    }
+    else if (udhi) {
+        // 6 octets of UDH are 48 bits, one fill bit aligns text to septet boundary
+        memcpy(bin + o, udh, sizeof(udh));
+        o += sizeof(udh);
+        o += pack_7bit(text, text_len, 1, bin + o);
+        bin[udl_pos] = 7 + text_len;
+    }
+    else {
+        o += pack_7bit(text, text_len, 0, bin + o);
+        bin[udl_pos] = text_len;
+    }
+
+    struct sim_net_msg *nm = &sim->net[(sim->net_head + sim->net_count) % SIM_NET_QUEUE];
+    strcpy(nm->pdu, SMSC_HEADER);
+    bin2hex(bin, o, nm->pdu + strlen(SMSC_HEADER));
+    nm->tpdu_len = o;
+    sim->net_count += 1;
+    return 0;
+}
+
+static int inject(struct sim_modem *sim, enum sim_msg_kind kind) {
+    char text[1024];
+    int seq = ++sim->seq;
+    int res = 0;
+
+    switch (kind) {
+    case SIM_MSG_7BIT:
+        snprintf(text, sizeof(text), "#%d Test message from simulator", seq);
+        res = queue_deliver(sim, 0, 0, 0, 1, 1, text, strlen(text));
+        break;
+    case SIM_MSG_ALNUM:
+        snprintf(text, sizeof(text), "#%d Your code is %04d", seq, sim_rand(sim) % 10000);
+        res = queue_deliver(sim, 1, 0, 0, 1, 1, text, strlen(text));
+        break;
+    case SIM_MSG_UCS2: {
+        uint8_t ucs2[140];
+        snprintf(text, sizeof(text), "#%d Проверка связи, симулятор модема", seq);
+        int chars = utf8_to_ucs2(text, ucs2, 70);
+        res = queue_deliver(sim, 0, 1, 0, 1, 1, (const char *) ucs2, chars);
+        break;
+    }
+    case SIM_MSG_MULTIPART: {
+        // 2 or 3 parts, parts are delivered in random order
+        int len = snprintf(text, sizeof(text), "#%d %s", seq, _lorem);
+        if (sim_rand(sim) % 2 == 0) {
+            len = MIN(len, PART_SEPTETS * 2 - 10);
+            text[len] = 0;
+        }
+        int parts = (len + PART_SEPTETS - 1) / PART_SEPTETS;
+        int order[3] = { 1, 2, 3 };
+        for (int i = parts - 1; i > 0; --i) {
+            int j = sim_rand(sim) % (i + 1);
+            int t = order[i]; order[i] = order[j]; order[j] = t;
+        }
+        for (int i = 0; i < parts && res == 0; ++i) {
+            int p = order[i];
+            int off = (p - 1) * PART_SEPTETS;
+            res = queue_deliver(sim, 0, 0, seq, p, parts, text + off, MIN(PART_SEPTETS, len - off));
+        }
+        break;
+    }
+    default:
+        return -1;
+    }
+
+    if (res == -1) {
+        return -1;
+    }
+    sim->stats.generated += 1;
+    log_debug("Generated message #%d kind %d", seq, kind);
+    return seq;
+}
+
+int sim_inject(struct sim_modem *sim, enum sim_msg_kind kind) {
+    pthread_mutex_lock(&sim->lock);
+    int res = inject(sim, kind);
+    pthread_mutex_unlock(&sim->lock);
+    return res;
+}
+
+static int find_free_slot(struct sim_modem *sim) {
+    for (int i = 0; i < sim->cfg.slots; ++i) {
+        if (!sim->slots[i].used) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int slots_used(struct sim_modem *sim) {
+    int used = 0;
+    for (int i = 0; i < sim->cfg.slots; ++i) {
+        used += sim->slots[i].used;
+    }
+    return used;
+}
+
+// Network side: deliver queued messages while there is space on SIM
+static int deliver_pending(struct sim_modem *sim) {
+    while (sim->net_count > 0) {
+        struct sim_net_msg *nm = &sim->net[sim->net_head];
+        if (sim->cnmi_mt == 2) {
+            CHECK(sim_printf(sim, CRLF "+CMT: ,%d" CRLF "%s" CRLF, nm->tpdu_len, nm->pdu));
+        }
+        else {
+            int idx = find_free_slot(sim);
+            if (idx == -1) {
+                return 0; // SIM is full, network retries later
+            }
+            struct sim_slot *slot = &sim->slots[idx];
+            slot->used = 1;
+            slot->status = 0;
+            slot->tpdu_len = nm->tpdu_len;
+            strcpy(slot->pdu, nm->pdu);
+            if (sim->cnmi_mt == 1) {
+                CHECK(sim_printf(sim, CRLF "+CMTI: \"SM\",%d" CRLF, idx + 1));
+            }
+        }
+        sim->net_head = (sim->net_head + 1) % SIM_NET_QUEUE;
+        sim->net_count -= 1;
+        sim->stats.delivered += 1;
+    }
+    return 0;
+}
+
+// Decode SMS-SUBMIT sent by TE, only text is of interest
+static int decode_submit(const char *hex, int hex_len, char *text, int text_size) {
+    uint8_t bin[SIM_PDU_SIZE / 2 + 2] = {0};
+    if (hex_len / 2 > (int) sizeof(bin) - 2) {
+        return -1;
+    }
+    hex2bin(hex, hex_len, bin);
+    int len = hex_len / 2;
+
+    int o = 1 + bin[0];                   // SMSC
+    if (o + 3 > len) {
+        return -1;
+    }
+    int udhi = bin[o] & 0x40;
+    int vpf = (bin[o] >> 3) & 0x03;
+    o += 2;                               // First octet, MR
+    o += 2 + (bin[o] + 1) / 2;            // DA length, type, digits
+    o += 1;                               // PID
+    int dcs = bin[o++];
+    o += (vpf == 2) ? 1 : (vpf == 0) ? 0 : 7;
+    if (o >= len) {
+        return -1;
+    }
+    int udl = bin[o++];
+    int hdr = udhi ? bin[o] + 1 : 0;
+
+    if ((dcs & 0x0C) == 0x08) {
+        return ucs2_to_utf8(bin + o + hdr, MIN((udl - hdr) / 2, (len - o - hdr) / 2), text, text_size);
+    }
+
+    int skip = (hdr * 8 + 6) / 7;         // Septets taken by UDH and fill bits
+    int count = MIN(udl - skip, text_size - 1);
+    if (count < 0 || (skip * 7 + count * 7 + 7) / 8 > len - o) {
+        return -1;
+    }
+    unpack_7bit(bin + o, skip * 7, count, text);
+    return count;
+}
+
+static struct sim_verb *find_verb(struct sim_modem *sim, const char *cmd) {
+    if (strncmp(cmd, "AT+", 3) != 0) {
+        return NULL;
+    }
+    for (int i = 0; i < sim->cfg.n_verbs; ++i) {
+        int len = strlen(sim->cfg.verbs[i].verb);
+        if (strncmp(cmd + 3, sim->cfg.verbs[i].verb, len) == 0 && !isalpha((unsigned char) cmd[3 + len])) {
+            return &sim->cfg.verbs[i];
+        }
+    }
+    return NULL;
+}
+
+static int is_sms_command(const char *cmd) {
+    return strncmp(cmd, "AT+CMG", 6) == 0 || strncmp(cmd, "AT+CPMS", 7) == 0 ||
+           strncmp(cmd, "AT+CNM", 6) == 0 || strncmp(cmd, "AT+CSMS", 7) == 0;
+}
+
+// Apply configured latency, return 1 if the error should be injected
+static int apply_verb_config(struct sim_modem *sim, const char *cmd) {
+    struct sim_verb *v = find_verb(sim, cmd);
+    int latency = (v != NULL && v->latency_ms >= 0) ? v->latency_ms : sim->cfg.latency_ms;
+    int error_rate = (v != NULL && v->error_rate >= 0) ? v->error_rate : sim->cfg.error_rate;
+    if (latency > 0) {
+        // Other ports are served while this one is busy
+        struct sim_port *port = sim->port;
+        pthread_mutex_unlock(&sim->lock);
+        usleep(latency * 1000);
+        pthread_mutex_lock(&sim->lock);
+        sim->port = port;
+    }
+    if (error_rate > 0 && sim_rand(sim) % 100 < error_rate) {
+        sim->stats.errors += 1;
+        return 1;
+    }
+    return 0;
+}
+
+static int reply_error(struct sim_modem *sim, const char *cmd) {
+    if (is_sms_command(cmd)) {
+        return sim_printf(sim, CRLF "+CMS ERROR: 500" CRLF);
+    }
+    return sim_printf(sim, CRLF "ERROR" CRLF);
+}
+
+static int reply_ok(struct sim_modem *sim) {
+    return sim_printf(sim, CRLF "OK" CRLF);
+}
+
+static int cmd_cmgr(struct sim_modem *sim, int idx) {
+    if (idx < 1 || idx > sim->cfg.slots) {
+        return sim_printf(sim, CRLF "+CMS ERROR: 321" CRLF);
+    }
+    struct sim_slot *slot = &sim->slots[idx - 1];
+    if (!slot->used) {
+        return sim_printf(sim, CRLF "+CMS ERROR: 321" CRLF);
+    }
+    CHECK(sim_printf(sim, CRLF "+CMGR: %d,,%d" CRLF "%s" CRLF, slot->status, slot->tpdu_len, slot->pdu));
+    slot->status = 1;
+    return reply_ok(sim);
+}
+
+static int cmd_cmgl(struct sim_modem *sim) {
+    for (int i = 0; i < sim->cfg.slots; ++i) {
+        struct sim_slot *slot = &sim->slots[i];
+        if (slot->used) {
+            CHECK(sim_printf(sim, CRLF "+CMGL: %d,%d,,%d" CRLF "%s", i + 1, slot->status, slot->tpdu_len, slot->pdu));
+            slot->status = 1;
+        }
+    }
+    CHECK(sim_write(sim, CRLF, 2));
+    return reply_ok(sim);
+}
+
+static int cmd_cmgd(struct sim_modem *sim, const char *args) {
+    int idx = atoi(args);
+    const char *flag = strchr(args, ',');
+    if (flag != NULL && atoi(flag + 1) > 0) {
+        // Delete flag 1 - read, 2 - read and sent, 3 - read, sent and unsent, 4 - all
+        int all = atoi(flag + 1) == 4;
+        for (int i = 0; i < sim->cfg.slots; ++i) {
+            if (sim->slots[i].used && (all || sim->slots[i].status == 1)) {
+                sim->slots[i].used = 0;
+                sim->stats.deleted += 1;
+            }
+        }
+        return reply_ok(sim);
+    }
+    if (idx < 1 || idx > sim->cfg.slots) {
+        return sim_printf(sim, CRLF "+CMS ERROR: 321" CRLF);
+    }
+    if (sim->slots[idx - 1].used) {
+        sim->slots[idx - 1].used = 0;
+        sim->stats.deleted += 1;
+    }
+    return reply_ok(sim);
+}
+
+static void hex_ucs2(const char *str, char *out, int out_size) {
+    uint8_t ucs2[64];
+    int chars = utf8_to_ucs2(str, ucs2, MIN(32, (out_size - 1) / 4));
+    bin2hex(ucs2, chars * 2, out);
+    out[chars * 4] = 0;
+}
+
+static int cmd_cpbr(struct sim_modem *sim, int idx) {
+    if (idx < 1 || idx > SIM_MAX_CONTACTS) {
+        return sim_printf(sim, CRLF "+CME ERROR: 21" CRLF);
+    }
+    const char *name = sim->contacts[idx - 1][0];
+    const char *phone = sim->contacts[idx - 1][1];
+    if (phone[0] != 0) {
+        char ucs2_name[132];
+        if (sim->cscs_ucs2) {
+            hex_ucs2(name, ucs2_name, sizeof(ucs2_name));
+            name = ucs2_name;
+        }
+        CHECK(sim_printf(sim, CRLF "+CPBR: %d,\"%s\",%d,\"%s\"" CRLF,
+                         idx, phone, phone[0] == '+' ? 145 : 129, name));
+    }
+    return reply_ok(sim);
+}
+
+// AT+CPBW=[<index>],"<number>",<type>,"<name>"
+static int cmd_cpbw(struct sim_modem *sim, const char *args) {
+    int idx = atoi(args);
+    if (idx == 0) {
+        for (idx = 1; idx <= SIM_MAX_CONTACTS && sim->contacts[idx - 1][1][0] != 0; ++idx);
+    }
+    if (idx < 1 || idx > SIM_MAX_CONTACTS) {
+        return sim_printf(sim, CRLF "+CME ERROR: 21" CRLF);
+    }
+    char fields[4][32] = {{0}};
+    int n = 0, pos = 0;
+    for (const char *s = args; *s && n < 4; ++s) {
+        if (*s == ',') {
+            fields[n][pos] = 0;
+            n += 1;
+            pos = 0;
+        }
+        else if (*s != '"' && pos < 31) {
+            fields[n][pos++] = *s;
+        }
+    }
+    snprintf(sim->contacts[idx - 1][1], 32, "%s", fields[1]);
+    snprintf(sim->contacts[idx - 1][0], 32, "%s", fields[3]);
+    return reply_ok(sim);
+}
+
+static int process_command(struct sim_modem *sim, const char *cmd) {
+    sim->stats.commands += 1;
+    log_debug("Command {%s}", cmd);
+
+    if (sim->port->echo) {
+        CHECK(sim_printf(sim, "%s\r", cmd));
+    }
+
+    if (apply_verb_config(sim, cmd)) {
+        log_noise("Injecting error for {%s}", cmd);
+        return reply_error(sim, cmd);
+    }
+
+    if (strcmp(cmd, "AT") == 0) {
+        return reply_ok(sim);
+    }
+    if (strncmp(cmd, "ATE", 3) == 0) {
+        sim->port->echo = atoi(cmd + 3);
+        return reply_ok(sim);
+    }
+    if (strncmp(cmd, "AT+", 3) != 0) {
+        return reply_error(sim, cmd);
+    }
+
+    const char *c = cmd + 3;
+    if (strcmp(c, "CPMS?") == 0) {
+        int used = slots_used(sim);
+        CHECK(sim_printf(sim, CRLF "+CPMS: \"SM\",%d,%d,\"SM\",%d,%d,\"SM\",%d,%d" CRLF,
+                         used, sim->cfg.slots, used, sim->cfg.slots, used, sim->cfg.slots));
+        return reply_ok(sim);
+    }
+    if (strncmp(c, "CMGR=", 5) == 0) {
+        return cmd_cmgr(sim, atoi(c + 5));
+    }
+    if (strncmp(c, "CMGL", 4) == 0) {
+        return cmd_cmgl(sim);
+    }
+    if (strncmp(c, "CMGD=", 5) == 0) {
+        return cmd_cmgd(sim, c + 5);
+    }
+    if (strncmp(c, "CMGS=", 5) == 0) {
+        sim->port->cmgs_pending = 1;
+        return sim_write(sim, CRLF "> ", 4);
+    }
+    if (strncmp(c, "CPBR=", 5) == 0) {
+        return cmd_cpbr(sim, atoi(c + 5));
+    }
+    if (strncmp(c, "CPBW=", 5) == 0) {
+        return cmd_cpbw(sim, c + 5);
+    }
+    if (strncmp(c, "CNMI=", 5) == 0) {
+        // AT+CNMI=<mode>,<mt>
+        const char *mt = strchr(c, ',');
+        sim->cnmi_mt = (mt != NULL) ? atoi(mt + 1) : 0;
+        return reply_ok(sim);
+    }
+    if (strcmp(c, "CNMA") == 0 || strncmp(c, "CNMA=", 5) == 0) {
+        return (sim->csms_service == 1) ? reply_ok(sim) : reply_error(sim, cmd);
+    }
+    if (strcmp(c, "CSMS?") == 0) {
+        CHECK(sim_printf(sim, CRLF "+CSMS: %d,1,1,1" CRLF, sim->csms_service));
+        return reply_ok(sim);
+    }
+    if (strncmp(c, "CSMS=", 5) == 0) {
+        sim->csms_service = atoi(c + 5);
+        return reply_ok(sim);
+    }
+    if (strncmp(c, "CSCS=", 5) == 0) {
+        sim->cscs_ucs2 = (strstr(c, "UCS2") != NULL);
+        return reply_ok(sim);
+    }
+    if (strcmp(c, "COPS?") == 0) {
+        CHECK(sim_printf(sim, CRLF "+COPS: 0,0,\"SIMULATOR\"" CRLF));
+        return reply_ok(sim);
+    }
+    if (strcmp(c, "COPS=?") == 0) {
+        CHECK(sim_printf(sim, CRLF "+COPS: (2,\"SIMULATOR\",\"SIM\",\"25099\"),,(0-4),(0-2)" CRLF));
+        return reply_ok(sim);
+    }
+    if (strcmp(c, "CREG?") == 0) {
+        CHECK(sim_printf(sim, CRLF "+CREG: 0,1" CRLF));
+        return reply_ok(sim);
+    }
+    if (strcmp(c, "CBC") == 0) {
+        CHECK(sim_printf(sim, CRLF "+CBC: 0,100,4200" CRLF));
+        return reply_ok(sim);
+    }
+    if (strcmp(c, "CCLK?") == 0) {
+        time_t now = time(NULL);
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        CHECK(sim_printf(sim, CRLF "+CCLK: \"%02d/%02d/%02d,%02d:%02d:%02d+00\"" CRLF,
+                         tm.tm_year % 100, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec));
+        return reply_ok(sim);
+    }
+    if (strncmp(c, "CMGF=", 5) == 0 || strncmp(c, "COPS=", 5) == 0 || strncmp(c, "CLTS=", 5) == 0 ||
+        strncmp(c, "CRSM=", 5) == 0 || strcmp(c, "CCALR?") == 0) {
+        return reply_ok(sim);
+    }
+
+    return reply_error(sim, cmd);
+}
+
+// PDU after > prompt, terminated with ^Z or cancelled with ESC
+static int process_submit(struct sim_modem *sim, const char *pdu, int len, int cancel) {
+    sim->port->cmgs_pending = 0;
+    if (cancel) {
+        return reply_ok(sim);
+    }
+    if (apply_verb_config(sim, "AT+CMGS")) {
+        return sim_printf(sim, CRLF "+CMS ERROR: 500" CRLF);
+    }
+
+    // Skip line ending left after AT+CMGS=<n>
+    while (len > 0 && (*pdu == '\r' || *pdu == '\n' || *pdu == ' ')) {
+        pdu += 1;
+        len -= 1;
+    }
+
+    char text[1024];
+    if (decode_submit(pdu, len, text, sizeof(text)) == -1) {
+        log_err("Invalid PDU received {%.*s}", len, pdu);
+        return sim_printf(sim, CRLF "+CMS ERROR: 304" CRLF);
+    }
+    sim->stats.sent += 1;
+    log_debug("Sent {%s}", text);
+    if (sim->on_sent != NULL) {
+        sim->on_sent(sim->on_sent_arg, text);
+    }
+    CHECK(sim_printf(sim, CRLF "+CMGS: %ld" CRLF, sim->stats.sent & 0xFF));
+    return reply_ok(sim);
+}
+
+static int process_input(struct sim_modem *sim) {
+    struct sim_port *p = sim->port;
+    int start = 0;
+    for (int i = 0; i < p->in_len; ++i) {
+        char ch = p->in[i];
+        if (p->cmgs_pending) {
+            if (ch == CTRL_Z || ch == ESC) {
+                CHECK(process_submit(sim, p->in + start, i - start, ch == ESC));
+                start = i + 1;
+            }
+            continue;
+        }
+        if (ch == '\r' || ch == '\n') {
+            if (i > start) {
+                p->in[i] = 0;
+                CHECK(process_command(sim, p->in + start));
+            }
+            start = i + 1;
+        }
+    }
+
+    memmove(p->in, p->in + start, p->in_len - start);
+    p->in_len -= start;
+    if (p->in_len == SIM_IN_SIZE - 1) {
+        log_err("Input overflow, dropping %d bytes", p->in_len);
+        p->in_len = 0;
+    }
+    return 0;
+}
+
+int sim_poll_port(struct sim_modem *sim, int port, int timeout) {
+    struct sim_port *p = &sim->ports[port];
+    int res = 0;
+
+    // Indications are sent to the first port, but not in the middle of a command
+    if (port == 0) {
+        pthread_mutex_lock(&sim->lock);
+        sim->port = p;
+        if (p->in_len == 0 && !p->cmgs_pending) {
+            res = deliver_pending(sim);
+        }
+        pthread_mutex_unlock(&sim->lock);
+        CHECK(res);
+    }
+
+    struct pollfd pfd = { .fd = p->master, .events = POLLIN };
+    res = poll(&pfd, 1, timeout);
+    if (res == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        log_errno("Simulator poll error");
+        return -1;
+    }
+    if (res == 0) {
+        return 0;
+    }
+
+    // Only the thread serving the port touches its input
+    int br = read(p->master, p->in + p->in_len, SIM_IN_SIZE - 1 - p->in_len);
+    if (br == -1) {
+        if (errno == EINTR || errno == EAGAIN || errno == EIO) {
+            return 0;
+        }
+        log_errno("Simulator read error");
+        return -1;
+    }
+    p->in_len += br;
+
+    pthread_mutex_lock(&sim->lock);
+    sim->port = p;
+    res = process_input(sim);
+    pthread_mutex_unlock(&sim->lock);
+    return res;
+}
+
+int sim_poll(struct sim_modem *sim, int timeout) {
+    return sim_poll_port(sim, 0, timeout);
+}
+
+// Create pseudo-terminal of the port
+static int open_port(struct sim_port *p, int echo) {
+    p->echo = echo;
+    p->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (p->master == -1 || grantpt(p->master) == -1 || unlockpt(p->master) == -1) {
+        log_errno("Can't create pseudo-terminal");
+        return -1;
+    }
+
+    const char *name = ptsname(p->master);
+    if (name == NULL) {
+        log_errno("Can't get pseudo-terminal name");
+        return -1;
+    }
+    snprintf(p->slave_name, sizeof(p->slave_name), "%s", name);
+
+    p->slave = open(p->slave_name, O_RDWR | O_NOCTTY);
+    if (p->slave == -1) {
+        log_errno("Can't open %s", p->slave_name);
+        return -1;
+    }
+
+    // No echo and line discipline on the modem side, client sets its own mode on open
+    struct termios tty;
+    if (tcgetattr(p->slave, &tty) == 0) {
+        cfmakeraw(&tty);
+        tcsetattr(p->slave, TCSANOW, &tty);
+    }
+    return 0;
+}
+
+int sim_open(struct sim_modem *sim, const struct sim_config *cfg) {
+    memset(sim, 0, sizeof(*sim));
+    sim->cfg = *cfg;
+    sim->cfg.slots = MIN(cfg->slots, SIM_MAX_SLOTS);
+    if (sim->cfg.slots < 1) {
+        sim->cfg.slots = 1;
+    }
+    sim->n_ports = MIN(cfg->ports, SIM_MAX_PORTS);
+    if (sim->n_ports < 1) {
+        sim->n_ports = 1;
+    }
+    sim->port = &sim->ports[0];
+    sim->rand_state = 1;
+    pthread_mutex_init(&sim->lock, NULL);
+    for (int i = 0; i < SIM_MAX_PORTS; ++i) {
+        sim->ports[i].master = -1;
+        sim->ports[i].slave = -1;
+    }
+
+    snprintf(sim->contacts[0][0], 32, "PRIMARY NUMBER");
+    snprintf(sim->contacts[0][1], 32, "%s", cfg->da);
+
+    for (int i = 0; i < sim->n_ports; ++i) {
+        if (open_port(&sim->ports[i], cfg->echo) != 0) {
+            sim_close(sim);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void sim_close(struct sim_modem *sim) {
+    for (int i = 0; i < SIM_MAX_PORTS; ++i) {
+        struct sim_port *p = &sim->ports[i];
+        if (p->slave != -1) {
+            close(p->slave);
+            p->slave = -1;
+        }
+        if (p->master != -1) {
+            close(p->master);
+            p->master = -1;
+        }
+    }
+}
+
+int sim_parse_verbs(struct sim_config *cfg, const char *list, int error_rate) {
+    const char *s = list;
+    while (*s) {
+        const char *eq = strchr(s, '=');
+        if (eq == NULL || eq == s || eq - s >= (int) sizeof(cfg->verbs[0].verb)) {
+            return -1;
+        }
+
+        struct sim_verb *v = NULL;
+        for (int i = 0; i < cfg->n_verbs; ++i) {
+            if (strncmp(cfg->verbs[i].verb, s, eq - s) == 0 && cfg->verbs[i].verb[eq - s] == 0) {
+                v = &cfg->verbs[i];
+            }
+        }
+        if (v == NULL) {
+            if (cfg->n_verbs == SIM_MAX_VERBS) {
+                return -1;
+            }
+            v = &cfg->verbs[cfg->n_verbs++];
+            memcpy(v->verb, s, eq - s);
+            v->verb[eq - s] = 0;
+            v->latency_ms = -1;
+            v->error_rate = -1;
+        }
+
+        if (error_rate) {
+            v->error_rate = atoi(eq + 1);
+        }
+        else {
+            v->latency_ms = atoi(eq + 1);
+        }
+
+        s = strchr(eq, ',');
+        if (s == NULL) {
+            break;
+        }
+        s += 1;
+    }
+    return 0;
+}
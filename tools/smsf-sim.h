@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SMSF_SIM_H
+#define _SMSF_SIM_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define SIM_MAX_SLOTS 255
+#define SIM_MAX_CONTACTS 10
+#define SIM_MAX_VERBS 16
+#define SIM_NET_QUEUE 1024
+#define SIM_PDU_SIZE 512
+#define SIM_IN_SIZE 8192
+#define SIM_MAX_PORTS 2
+
+/**
+ * @brief Kind of generated incoming message
+ */
+enum sim_msg_kind {
+    SIM_MSG_7BIT = 0,      //! Single GSM 7-bit message from international number
+    SIM_MSG_MULTIPART,     //! Concatenated GSM 7-bit message, 2-3 parts
+    SIM_MSG_UCS2,          //! Single UCS2 (Cyrillic) message
+    SIM_MSG_ALNUM,         //! Single GSM 7-bit message from alpha-numeric sender
+    SIM_MSG_KINDS
+};
+
+/**
+ * @brief Per-command latency and error injection, verb is the part after AT+, e.g. CMGS
+ */
+struct sim_verb {
+    char verb[8];
+    int latency_ms;
+    int error_rate;   //! Percent of commands answered with error
+};
+
+struct sim_config {
+    int slots;        //! SIM storage capacity
+    int latency_ms;   //! Default per-command latency
+    int error_rate;   //! Default percent of commands answered with error
+    int echo;         //! Initial echo mode, real modems start with echo on
+    int ports;        //! AT command ports, messages are indicated on the first one
+    char da[16];      //! Number stored as "PRIMARY NUMBER" contact
+    struct sim_verb verbs[SIM_MAX_VERBS];
+    int n_verbs;
+};
+
+struct sim_stats {
+    long commands;    //! AT commands processed
+    long errors;      //! Errors injected
+    long generated;   //! Messages generated (not parts)
+    long delivered;   //! Parts stored to SIM or routed to TE
+    long deleted;     //! Parts deleted from SIM
+    long sent;        //! Parts sent with AT+CMGS
+};
+
+struct sim_slot {
+    int used;
+    int status;       //! 0 - received unread, 1 - received read
+    int tpdu_len;     //! Length of PDU without SMSC, as reported by CMGR/CMGL
+    char pdu[SIM_PDU_SIZE];
+};
+
+struct sim_net_msg {
+    int tpdu_len;
+    char pdu[SIM_PDU_SIZE];
+};
+
+/**
+ * @brief Called for every part received with AT+CMGS
+ *
+ * @param arg - user argument
+ * @param text - decoded text of the part, UTF-8
+ */
+typedef void (sim_sent_func_t)(void *arg, const char *text);
+
+/**
+ * @brief AT command port, every port has its own pseudo-terminal and command state
+ */
+struct sim_port {
+    int master;
+    int slave;        //! Kept open, so the master doesn't get EIO between client sessions
+    char slave_name[64];
+
+    char in[SIM_IN_SIZE];
+    int in_len;
+    int echo;
+    int cmgs_pending; //! Prompt is sent, waiting for PDU terminated with ^Z
+};
+
+struct sim_modem {
+    struct sim_config cfg;
+    struct sim_port ports[SIM_MAX_PORTS];
+    int n_ports;
+    struct sim_port *port; //! Port the command is processed for
+    pthread_mutex_t lock;  //! Ports could be served by different threads
+
+    int cnmi_mt;      //! 0 - no indication, 1 - +CMTI, 2 - +CMT
+    int csms_service;
+    int cscs_ucs2;
+
+    struct sim_slot slots[SIM_MAX_SLOTS];
+    char contacts[SIM_MAX_CONTACTS][2][32]; //! name, phone
+
+    struct sim_net_msg net[SIM_NET_QUEUE]; //! Messages the network is trying to deliver
+    int net_head;
+    int net_count;
+
+    int seq;          //! Sequence number of generated messages
+    unsigned int rand_state;
+    struct sim_stats stats;
+
+    sim_sent_func_t *on_sent;
+    void *on_sent_arg;
+};
+
+/**
+ * @brief Create pseudo-terminal and initialize the simulator
+ *
+ * @param sim - simulator to initialize
+ * @param cfg - configuration, copied
+ * @return int - 0 - success, -1 - error
+ */
+int sim_open(struct sim_modem *sim, const struct sim_config *cfg);
+void sim_close(struct sim_modem *sim);
+
+/**
+ * @brief Generate incoming message, it's delivered to SIM by sim_poll
+ *
+ * @param sim - simulator
+ * @param kind - kind of message
+ * @return int - sequence number of the message, it's put to the text as #<seq>
+ */
+int sim_inject(struct sim_modem *sim, enum sim_msg_kind kind);
+
+/**
+ * @brief Deliver pending messages and process AT commands of the first port
+ *
+ * @param sim - simulator
+ * @param timeout - time to wait for commands, milliseconds
+ * @return int - 0 - success, -1 - error
+ */
+int sim_poll(struct sim_modem *sim, int timeout);
+
+/**
+ * @brief Process AT commands of the port, every port could be served by its own thread.
+ *        Command latency doesn't block other ports.
+ *
+ * @param sim - simulator
+ * @param port - port index, 0 also delivers pending messages
+ * @param timeout - time to wait for commands, milliseconds
+ * @return int - 0 - success, -1 - error
+ */
+int sim_poll_port(struct sim_modem *sim, int port, int timeout);
+
+/**
+ * @brief Parse VERB=<n>[,VERB=<n>...] list and set latency or error rate
+ *
+ * @param cfg - configuration to update
+ * @param list - list to parse
+ * @param error_rate - 1 to set error rate, 0 to set latency
+ * @return int - 0 - success, -1 - invalid list
+ */
+int sim_parse_verbs(struct sim_config *cfg, const char *list, int error_rate);
+
+#endif
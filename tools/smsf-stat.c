@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Metrics reader, prints counters published by running s3smsf without touching the modem
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "smsf-logging.h"
+#include "smsf-stats.h"
+#include "smsf-metrics.h"
+
+#define METRICS_FILE "/run/s3smsf.metrics"
+
+extern struct smsf_options _opts;
+
+static void usage() {
+    printf("Usage: s3smsf-stat [-f file] [-w seconds] [-p]\n"
+           "    -f metrics file, default " METRICS_FILE "\n"
+           "    -w print again every given number of seconds\n"
+           "    -p print in Prometheus text format\n");
+}
+
+static void print_at(const char *title, const struct at_stats *stats, int count) {
+    if (count == 0) {
+        return;
+    }
+    printf("  AT commands of %s, latency in us\n", title);
+    printf("    %-6s %8s %7s %8s %10s %10s %8s %8s %8s %8s %8s\n", "verb", "calls", "errors", "timeouts", "out", "in",
+           "avg", "p50", "p90", "p99", "max");
+    for (int i = 0; i < count; ++i) {
+        const struct at_stats *s = &stats[i];
+        const struct histogram *h = &s->latency_us;
+        printf("    %-6s %8u %7u %8u %10u %10u %8u %8u %8u %8u %8u\n", s->verb, s->calls, s->errors, s->timeouts,
+               s->bytes_out, s->bytes_in, (h->count > 0) ? (uint32_t) (h->sum / h->count) : 0,
+               hist_percentile(h, 50), hist_percentile(h, 90), hist_percentile(h, 99), h->max);
+    }
+}
+
+static void print_modem(const struct metrics_modem *mm, time_t now) {
+    // Sections are large, keep them off the stack
+    static struct metrics_read r;
+    static struct metrics_send s;
+
+    if (metrics_copy(&r, &mm->read, sizeof(r)) != 0 || metrics_copy(&s, &mm->send, sizeof(s)) != 0) {
+        printf("%s: busy, try again\n", mm->port);
+        return;
+    }
+
+    printf("%s%s%s: %s\n", mm->port, (mm->send_port[0] != 0) ? ", send " : "", mm->send_port,
+           (r.op_info[0] != 0) ? r.op_info : "not connected");
+    if (r.updated != 0) {
+        printf("  updated %lld s ago, cycles %u\n", (long long) (now - r.updated), r.cycles);
+    }
+    printf("  SIM %d of %d, outbox %u, reassembly %u, tracked %u\n", r.sim_messages, r.sim_capacity, r.outbox_depth,
+           r.reasm_groups, r.saved);
+    printf("  read %u, commands %u, deleted %u, sent %u, send errors %u\n", r.messages_read, r.commands,
+           r.messages_deleted, s.messages_sent, s.send_errors);
+
+    const struct histogram *h = &s.forward_ms;
+    if (h->count > 0) {
+        printf("  seen to sent, ms: avg %u p50 %u p90 %u p99 %u max %u\n", (uint32_t) (h->sum / h->count),
+               hist_percentile(h, 50), hist_percentile(h, 90), hist_percentile(h, 99), h->max);
+    }
+
+    print_at("read port", r.at, r.n_at);
+    print_at("send port", s.at, s.n_at);
+}
+
+static int print_region(const struct metrics_region *region) {
+    if (__atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC || region->version != METRICS_VERSION ||
+        region->size != sizeof(struct metrics_region)) {
+        return log_err("Metrics file is not written by this version of s3smsf");
+    }
+
+    time_t now = time(NULL);
+    int running = (kill(region->pid, 0) == 0 || errno == EPERM);
+    printf("s3smsf pid %d%s, up %lld s\n", region->pid, running ? "" : " (not running)", (long long) (now - region->started));
+    for (int i = 0; i < SMSF_MAX_MODEMS; ++i) {
+        if (__atomic_load_n(&region->modems[i].in_use, __ATOMIC_ACQUIRE) == 1) {
+            print_modem(&region->modems[i], now);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *name = METRICS_FILE;
+    int interval = 0;
+    int prom = 0;
+    int opt;
+
+    _opts.verbosity = LOG_ERR;
+
+    while ((opt = getopt(argc, argv, "f:w:ph")) != -1) {
+        switch (opt) {
+        case 'f': name = optarg; break;
+        case 'w': interval = atoi(optarg); break;
+        case 'p': prom = 1; break;
+        default:
+            usage();
+            exit(7);
+        }
+    }
+
+    int fd = open(name, O_RDONLY);
+    if (fd == -1) {
+        log_errno("Can't open %s, is s3smsf running?", name);
+        exit(2);
+    }
+    // Read only mapping, the daemon never notices readers
+    void *addr = mmap(NULL, sizeof(struct metrics_region), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        log_errno("Can't map %s", name);
+        exit(2);
+    }
+
+    const struct metrics_region *region = (const struct metrics_region *) addr;
+    int res;
+    while ((res = (prom) ? metrics_write_prom(stdout, region) : print_region(region)) == 0 && interval > 0) {
+        sleep(interval);
+        printf("\n");
+    }
+
+    munmap(addr, sizeof(struct metrics_region));
+    return (res == 0) ? 0 : 2;
+}
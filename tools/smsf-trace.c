@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2025 Dmitry Samersoff (dms@samersoff.net)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Trace report, reads trace files written by s3smsf and prints per-stage latency percentiles
+ * and the slowest messages
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "smsf-logging.h"
+#include "smsf-stats.h"
+#include "smsf-trace.h"
+
+extern struct smsf_options _opts;
+
+// Intervals reported, from stage to stage
+enum report_row { ROW_DECODE, ROW_REASSEMBLY, ROW_QUEUE, ROW_WAIT, ROW_SEND, ROW_DELETE, ROW_SEEN_SENT, ROW_SEEN_DELETED, ROWS };
+
+static const char *_row_names[ROWS] = {
+    "decode", "reassembly", "queue", "wait", "send", "delete", "seen-sent", "seen-deleted"
+};
+
+struct trace_set {
+    struct trace_record *recs;
+    int count;
+    int capacity;
+};
+
+static void usage() {
+    printf("Usage: s3smsf-trace [-n top] file [file ...]\n"
+           "    -n number of slowest messages to print, default 10\n"
+           "    Rotated file, <name>.1, could be passed along with the current one\n");
+}
+
+static int set_add(struct trace_set *set, const struct trace_record *rec) {
+    if (set->count == set->capacity) {
+        int capacity = (set->capacity == 0) ? 1024 : set->capacity * 2;
+        struct trace_record *recs = realloc(set->recs, capacity * sizeof(struct trace_record));
+        if (recs == NULL) {
+            return -1;
+        }
+        set->recs = recs;
+        set->capacity = capacity;
+    }
+    set->recs[set->count++] = *rec;
+    return 0;
+}
+
+static int by_fingerprint(const void *a, const void *b) {
+    uint64_t fa = ((const struct trace_record *) a)->fingerprint;
+    uint64_t fb = ((const struct trace_record *) b)->fingerprint;
+    return (fa > fb) - (fa < fb);
+}
+
+static int32_t seen_sent(const struct trace_record *rec) {
+    return rec->stage[TRACE_SENT];
+}
+
+static int by_latency(const void *a, const void *b) {
+    return seen_sent((const struct trace_record *) b) - seen_sent((const struct trace_record *) a);
+}
+
+// Interval between two stages, -1 if any of them is not reached
+static int32_t interval(const struct trace_record *rec, int from, int to) {
+    if (rec->stage[from] < 0 || rec->stage[to] < 0) {
+        return -1;
+    }
+    return rec->stage[to] - rec->stage[from];
+}
+
+// Sent to deleted, records are joined by fingerprint, seen of the long message may differ from seen of its first part
+static int32_t deleted_after(const struct trace_record *rec, const struct trace_record *del) {
+    if (del == NULL || rec->stage[TRACE_SENT] < 0 || del->stage[TRACE_DELETED] < 0) {
+        return -1;
+    }
+    return (int32_t) ((del->seen + del->stage[TRACE_DELETED]) - (rec->seen + rec->stage[TRACE_SENT]));
+}
+
+static void fill_rows(const struct trace_record *rec, const struct trace_record *del, int32_t rows[ROWS]) {
+    int decoded = (rec->stage[TRACE_REASSEMBLED] >= 0) ? TRACE_REASSEMBLED : TRACE_DECODED;
+    rows[ROW_DECODE] = rec->stage[TRACE_DECODED];
+    rows[ROW_REASSEMBLY] = interval(rec, TRACE_DECODED, TRACE_REASSEMBLED);
+    rows[ROW_QUEUE] = interval(rec, decoded, TRACE_QUEUED);
+    rows[ROW_WAIT] = interval(rec, TRACE_QUEUED, TRACE_SENDING);
+    rows[ROW_SEND] = interval(rec, TRACE_SENDING, TRACE_SENT);
+    rows[ROW_DELETE] = deleted_after(rec, del);
+    rows[ROW_SEEN_SENT] = rec->stage[TRACE_SENT];
+    rows[ROW_SEEN_DELETED] = (rows[ROW_DELETE] >= 0) ? rows[ROW_SEEN_SENT] + rows[ROW_DELETE] : -1;
+}
+
+static int read_trace(const char *name, struct trace_set *sent, struct trace_set *deleted) {
+    FILE *fp = fopen(name, "r");
+    if (fp == NULL) {
+        return log_errno("Can't open %s", name);
+    }
+
+    char line[256];
+    int lineno = 0;
+    struct trace_record rec;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno += 1;
+        if (trace_parse(line, &rec) != 0) {
+            log_err("%s:%d: not a trace record", name, lineno);
+            continue;
+        }
+        if (set_add((rec.kind == 'S') ? sent : deleted, &rec) != 0) {
+            fclose(fp);
+            return log_err("Out of memory, %d records", sent->count + deleted->count);
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int top = 10;
+    int opt;
+
+    _opts.verbosity = LOG_ERR;
+
+    while ((opt = getopt(argc, argv, "n:h")) != -1) {
+        switch (opt) {
+        case 'n': top = atoi(optarg); break;
+        default:
+            usage();
+            exit(7);
+        }
+    }
+
+    if (optind == argc || top < 0) {
+        usage();
+        exit(7);
+    }
+
+    struct trace_set sent = {0};
+    struct trace_set deleted = {0};
+    for (int i = optind; i < argc; ++i) {
+        if (read_trace(argv[i], &sent, &deleted) != 0) {
+            exit(2);
+        }
+    }
+
+    qsort(deleted.recs, deleted.count, sizeof(struct trace_record), by_fingerprint);
+
+    static struct histogram rows[ROWS];
+    int retried = 0;
+    int untimed = 0;
+    for (int i = 0; i < sent.count; ++i) {
+        const struct trace_record *rec = &sent.recs[i];
+        const struct trace_record *del = bsearch(rec, deleted.recs, deleted.count, sizeof(struct trace_record), by_fingerprint);
+        int32_t values[ROWS];
+        fill_rows(rec, del, values);
+        for (int j = 0; j < ROWS; ++j) {
+            if (values[j] >= 0) {
+                hist_add(&rows[j], values[j]);
+            }
+        }
+        retried += (rec->attempts > 1);
+        untimed += (rec->stage[TRACE_SENT] < 0);
+    }
+
+    printf("Messages sent %d, retried %d, sent after restart %d; deleted from SIM %d\n\n",
+           sent.count, retried, untimed, deleted.count);
+    printf("%-13s %8s %8s %8s %8s %8s %8s\n", "Stage, ms", "count", "avg", "p50", "p90", "p99", "max");
+    for (int j = 0; j < ROWS; ++j) {
+        const struct histogram *h = &rows[j];
+        printf("%-13s %8u %8u %8u %8u %8u %8u\n", _row_names[j], h->count, (h->count > 0) ? (uint32_t) (h->sum / h->count) : 0,
+               hist_percentile(h, 50), hist_percentile(h, 90), hist_percentile(h, 99), h->max);
+    }
+
+    // Slowest messages with stage breakdown
+    qsort(sent.recs, sent.count, sizeof(struct trace_record), by_latency);
+    top = (top < sent.count - untimed) ? top : sent.count - untimed;
+    if (top > 0) {
+        printf("\nSlowest %d messages, ms\n", top);
+        printf("%-19s %-16s %-15s %5s %5s", "Seen", "Fingerprint", "Sender", "parts", "tries");
+        for (int j = 0; j < ROWS; ++j) {
+            printf(" %12s", _row_names[j]);
+        }
+        printf("\n");
+    }
+    for (int i = 0; i < top; ++i) {
+        const struct trace_record *rec = &sent.recs[i];
+        const struct trace_record *del = bsearch(rec, deleted.recs, deleted.count, sizeof(struct trace_record), by_fingerprint);
+        int32_t values[ROWS];
+        fill_rows(rec, del, values);
+
+        char ts[24];
+        struct tm tm;
+        time_t seen = rec->seen / 1000;
+        strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", localtime_r(&seen, &tm));
+        printf("%-19s %016llx %-15s %5d %5d", ts, (unsigned long long) rec->fingerprint, rec->sender, rec->parts, rec->attempts);
+        for (int j = 0; j < ROWS; ++j) {
+            if (values[j] >= 0) {
+                printf(" %12d", values[j]);
+            }
+            else {
+                printf(" %12s", "-");
+            }
+        }
+        printf("\n");
+    }
+
+    free(sent.recs);
+    free(deleted.recs);
+    return 0;
+}